@@ -0,0 +1,83 @@
+// Copyright 2015-2016 Espressif Systems (Shanghai) PTE LTD
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include <stddef.h>
+#include <stdlib.h>
+#include "esp_heap_caps.h"
+#include "esp_jpg_decode.h"
+#include "jpgd.h"
+#include <new>
+
+#if defined(ARDUINO_ARCH_ESP32) && defined(CONFIG_ARDUHAL_ESP_LOG)
+#include "esp32-hal-log.h"
+#define TAG ""
+#else
+#include "esp_log.h"
+static const char* TAG = "esp_jpg_decode";
+#endif
+
+static void *_malloc(size_t size)
+{
+    void * res = malloc(size);
+    if(res) {
+        return res;
+    }
+    return heap_caps_malloc(size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+}
+
+bool esp_jpg_get_size(const uint8_t *src, size_t src_len, jpg_scale_t scale, uint16_t * width, uint16_t * height)
+{
+    int w, h;
+    if(!jpgd::jpeg_decoder::get_size(src, src_len, scale, &w, &h)) {
+        ESP_LOGE(TAG, "Unsupported JPG");
+        return false;
+    }
+    *width = w;
+    *height = h;
+    return true;
+}
+
+bool esp_jpg_decode(const uint8_t *src, size_t src_len, jpg_scale_t scale, jpg_lines_cb cb, void * arg)
+{
+    void *mem = _malloc(sizeof(jpgd::jpeg_decoder));
+    if(!mem) {
+        ESP_LOGE(TAG, "JPG decoder malloc failed");
+        return false;
+    }
+    jpgd::jpeg_decoder *dec = new (mem) jpgd::jpeg_decoder;
+
+    bool ret = false;
+    const uint8_t *data;
+    uint16_t y = 0;
+    int lines;
+    if(!dec->init(src, src_len, scale)) {
+        ESP_LOGE(TAG, "JPG decoder init failed");
+        goto done;
+    }
+    while((lines = dec->decode_mcu_row(&data)) > 0) {
+        if(!cb(arg, y, dec->get_width(), lines, data)) {
+            goto done;
+        }
+        y += lines;
+    }
+    if(lines < 0) {
+        ESP_LOGE(TAG, "Corrupt JPG data at line %u", y);
+        goto done;
+    }
+    ret = true;
+
+done:
+    dec->~jpeg_decoder();
+    free(mem);
+    return ret;
+}
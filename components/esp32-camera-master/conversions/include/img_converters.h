@@ -25,6 +25,17 @@ extern "C" {
 
     typedef size_t (* jpg_out_cb)(void * arg, size_t index, const void* data, size_t len);
 
+    /**
+     * @brief Size reduction applied while decoding a JPEG
+     */
+    typedef enum {
+        JPG_SCALE_NONE,     /*!< Full size */
+        JPG_SCALE_2X,       /*!< Half the width and height */
+        JPG_SCALE_4X,       /*!< A quarter of the width and height */
+        JPG_SCALE_8X,       /*!< An eighth of the width and height, only DC coefficients are decoded */
+        JPG_SCALE_MAX = JPG_SCALE_8X
+    } jpg_scale_t;
+
     /**
      * @brief Convert image buffer to JPEG
      *
@@ -62,7 +73,7 @@ extern "C" {
      * @param height    Height in pixels of the source image
      * @param format    Format of the source image
      * @param quality   JPEG quality of the resulting image
-     * @param out       Pointer to be populated with the address of the resulting buffer
+     * @param out       Pointer to be populated with the address of the resulting buffer, free() it when done
      * @param out_len   Pointer to be populated with the length of the output buffer
      *
      * @return true on success
@@ -81,10 +92,215 @@ extern "C" {
      */
     bool frame2jpg(camera_fb_t * fb, uint8_t quality, uint8_t ** out, size_t * out_len);
 
+    /**
+     * @brief Convert image buffer to a downscaled JPEG buffer, e.g. a preview
+     *
+     * The image is box filtered while it is encoded, there is no full size intermediate.
+     *
+     * @param src       Source buffer in RGB565, RGB888, YUYV or GRAYSCALE format
+     * @param src_len   Length in bytes of the source buffer
+     * @param width     Width in pixels of the source image
+     * @param height    Height in pixels of the source image
+     * @param format    Format of the source image
+     * @param quality   JPEG quality of the resulting image
+     * @param scale     Downscale factor: 1, 2 or 4. The JPEG is width / scale x height / scale, rounded up
+     * @param out       Pointer to be populated with the address of the resulting buffer, free() it when done
+     * @param out_len   Pointer to be populated with the length of the output buffer
+     *
+     * @return true on success
+     */
+    bool fmt2jpg_scaled(uint8_t *src, size_t src_len, uint16_t width, uint16_t height, pixformat_t format, uint8_t quality, uint8_t scale, uint8_t ** out, size_t * out_len);
+
+    /**
+     * @brief Convert camera frame buffer to a downscaled JPEG buffer, e.g. a preview
+     *
+     * @param fb        Source camera frame buffer
+     * @param quality   JPEG quality of the resulting image
+     * @param scale     Downscale factor: 1, 2 or 4. The JPEG is width / scale x height / scale, rounded up
+     * @param out       Pointer to be populated with the address of the resulting buffer, free() it when done
+     * @param out_len   Pointer to be populated with the length of the output buffer
+     *
+     * @return true on success
+     */
+    bool frame2jpg_scaled(camera_fb_t * fb, uint8_t quality, uint8_t scale, uint8_t ** out, size_t * out_len);
+
+    /**
+     * @brief Convert image buffer to JPEG into a caller supplied buffer
+     *
+     * @param src       Source buffer in RGB565, RGB888, YUYV or GRAYSCALE format
+     * @param src_len   Length in bytes of the source buffer
+     * @param width     Width in pixels of the source image
+     * @param height    Height in pixels of the source image
+     * @param format    Format of the source image
+     * @param quality   JPEG quality of the resulting image
+     * @param buf       Buffer the JPEG is written to
+     * @param buf_len   Size in bytes of buf
+     * @param out_len   Pointer to be populated with the length of the JPEG
+     *
+     * @return true on success, false also if the JPEG does not fit into buf
+     */
+    bool fmt2jpg_buf(uint8_t *src, size_t src_len, uint16_t width, uint16_t height, pixformat_t format, uint8_t quality, uint8_t * buf, size_t buf_len, size_t * out_len);
+
+    /**
+     * @brief Convert camera frame buffer to JPEG into a caller supplied buffer
+     *
+     * @param fb        Source camera frame buffer
+     * @param quality   JPEG quality of the resulting image
+     * @param buf       Buffer the JPEG is written to
+     * @param buf_len   Size in bytes of buf
+     * @param out_len   Pointer to be populated with the length of the JPEG
+     *
+     * @return true on success, false also if the JPEG does not fit into buf
+     */
+    bool frame2jpg_buf(camera_fb_t * fb, uint8_t quality, uint8_t * buf, size_t buf_len, size_t * out_len);
+
+    /**
+     * @brief Reusable JPEG encoder context, see jpg_encoder_ctx_create()
+     */
+    typedef struct jpg_encoder_ctx jpg_encoder_ctx_t;
+
+    /**
+     * @brief Create a JPEG encoder context for repeated conversions
+     *
+     * All memory the conversions need (encoder, its buffers and worker threads, scanline buffer,
+     * callback flush buffer and output buffer) is allocated here once, the *_ctx conversions
+     * don't allocate after the first frame.
+     *
+     * @param max_width     Largest width in pixels of the frames to convert
+     * @param max_height    Largest height in pixels of the frames to convert
+     * @param out_buf_len   Size in bytes of the output buffer for fmt2jpg_ctx(), 0 if only the callback variants are used
+     *
+     * @return the context, NULL if out of memory
+     */
+    jpg_encoder_ctx_t *jpg_encoder_ctx_create(uint16_t max_width, uint16_t max_height, size_t out_buf_len);
+
+    /**
+     * @brief Free a JPEG encoder context
+     *
+     * @param ctx       Context from jpg_encoder_ctx_create(), may be NULL
+     */
+    void jpg_encoder_ctx_free(jpg_encoder_ctx_t *ctx);
+
+    /**
+     * @brief Convert image buffer to JPEG in the output buffer of an encoder context
+     *
+     * @param ctx       Encoder context
+     * @param src       Source buffer in RGB565, RGB888, YUYV or GRAYSCALE format
+     * @param src_len   Length in bytes of the source buffer
+     * @param width     Width in pixels of the source image
+     * @param height    Height in pixels of the source image
+     * @param format    Format of the source image
+     * @param quality   JPEG quality of the resulting image
+     * @param out       Pointer to be populated with the address of the JPEG, valid until the next conversion with ctx
+     * @param out_len   Pointer to be populated with the length of the JPEG
+     *
+     * @return true on success, false also if the JPEG does not fit into the output buffer
+     */
+    bool fmt2jpg_ctx(jpg_encoder_ctx_t *ctx, uint8_t *src, size_t src_len, uint16_t width, uint16_t height, pixformat_t format, uint8_t quality, uint8_t ** out, size_t * out_len);
+
+    /**
+     * @brief Convert camera frame buffer to JPEG in the output buffer of an encoder context
+     *
+     * @param ctx       Encoder context
+     * @param fb        Source camera frame buffer
+     * @param quality   JPEG quality of the resulting image
+     * @param out       Pointer to be populated with the address of the JPEG, valid until the next conversion with ctx
+     * @param out_len   Pointer to be populated with the length of the JPEG
+     *
+     * @return true on success, false also if the JPEG does not fit into the output buffer
+     */
+    bool frame2jpg_ctx(jpg_encoder_ctx_t *ctx, camera_fb_t * fb, uint8_t quality, uint8_t ** out, size_t * out_len);
+
+    /**
+     * @brief Convert image buffer to JPEG with an encoder context
+     *
+     * @param ctx       Encoder context
+     * @param src       Source buffer in RGB565, RGB888, YUYV or GRAYSCALE format
+     * @param src_len   Length in bytes of the source buffer
+     * @param width     Width in pixels of the source image
+     * @param height    Height in pixels of the source image
+     * @param format    Format of the source image
+     * @param quality   JPEG quality of the resulting image
+     * @param cb        Callback to be called to write the bytes of the output JPEG
+     * @param arg       Pointer to be passed to the callback
+     *
+     * @return true on success
+     */
+    bool fmt2jpg_cb_ctx(jpg_encoder_ctx_t *ctx, uint8_t *src, size_t src_len, uint16_t width, uint16_t height, pixformat_t format, uint8_t quality, jpg_out_cb cb, void * arg);
+
+    /**
+     * @brief Convert camera frame buffer to JPEG with an encoder context
+     *
+     * @param ctx       Encoder context
+     * @param fb        Source camera frame buffer
+     * @param quality   JPEG quality of the resulting image
+     * @param cb        Callback to be called to write the bytes of the output JPEG
+     * @param arg       Pointer to be passed to the callback
+     *
+     * @return true on success
+     */
+    bool frame2jpg_cb_ctx(jpg_encoder_ctx_t *ctx, camera_fb_t * fb, uint8_t quality, jpg_out_cb cb, void * arg);
+
+    /**
+     * @brief State of the rate controlled JPEG conversion, keep one per stream of frames
+     */
+    typedef struct {
+        size_t target_len;      /*!< Byte budget per frame, e.g. bitrate / 8 / fps */
+        uint8_t quality;        /*!< Quality the last frame was encoded with, starting point for the first one */
+        uint8_t min_quality;    /*!< Lower limit of the quality chosen */
+        uint8_t max_quality;    /*!< Upper limit of the quality chosen */
+        float gamma;            /*!< Estimated exponent of size over quantizer scale, refined per frame */
+        float last_activity;    /*!< Activity measure of the last frame */
+        size_t last_len;        /*!< Length of the last frame, 0 before the first one */
+        size_t header_len;      /*!< Length of the markers of the last frame, ahead of its coded data */
+    } jpg_rate_ctrl_t;
+
+    /**
+     * @brief Initialize rate control state
+     *
+     * @param rc          Rate control state
+     * @param target_len  Byte budget per frame
+     */
+    void jpg_rate_ctrl_init(jpg_rate_ctrl_t *rc, size_t target_len);
+
+    /**
+     * @brief Convert image buffer to JPEG buffer, choosing the quality that meets the byte budget of rc
+     *
+     * The quality is predicted from the activity of the frame and the result of the previous one
+     * (for the first frame from a trial encode of its first rows), it settles within a frame or two.
+     *
+     * @param src       Source buffer in RGB565, RGB888, YUYV or GRAYSCALE format
+     * @param src_len   Length in bytes of the source buffer
+     * @param width     Width in pixels of the source image
+     * @param height    Height in pixels of the source image
+     * @param format    Format of the source image
+     * @param rc        Rate control state, updated with the result
+     * @param out       Pointer to be populated with the address of the resulting buffer, free() it when done
+     * @param out_len   Pointer to be populated with the length of the output buffer
+     *
+     * @return true on success
+     */
+    bool fmt2jpg_rc(uint8_t *src, size_t src_len, uint16_t width, uint16_t height, pixformat_t format, jpg_rate_ctrl_t *rc, uint8_t ** out, size_t * out_len);
+
+    /**
+     * @brief Convert camera frame buffer to JPEG buffer, choosing the quality that meets the byte budget of rc
+     *
+     * @param fb        Source camera frame buffer
+     * @param rc        Rate control state, updated with the result
+     * @param out       Pointer to be populated with the address of the resulting buffer, free() it when done
+     * @param out_len   Pointer to be populated with the length of the output buffer
+     *
+     * @return true on success
+     */
+    bool frame2jpg_rc(camera_fb_t * fb, jpg_rate_ctrl_t *rc, uint8_t ** out, size_t * out_len);
+
     /**
      * @brief Convert image buffer to BMP buffer
      *
-     * @param src       Source buffer in JPEG, RGB565, RGB888, YUYV or GRAYSCALE format
+     * Rows are converted straight into the result, top-down. GRAYSCALE gives an 8 bit gray palette BMP,
+     * the other formats 24 bit. JPEG sources are decoded, their size comes from the JPEG headers.
+     *
+     * @param src       Source buffer in JPEG, RGB565, RGB555, RGB444, RGB888, YUYV or GRAYSCALE format
      * @param src_len   Length in bytes of the source buffer
      * @param width     Width in pixels of the source image
      * @param height    Height in pixels of the source image
@@ -107,10 +323,41 @@ extern "C" {
      */
     bool frame2bmp(camera_fb_t * fb, uint8_t ** out, size_t * out_len);
 
+    /**
+     * @brief Convert image buffer to BMP, handing it to a callback while it is produced
+     *
+     * The callback gets the header and then blocks of whole rows, a few KB at a time,
+     * and is called with NULL data at the end.
+     *
+     * @param src       Source buffer in JPEG, RGB565, RGB555, RGB444, RGB888, YUYV or GRAYSCALE format
+     * @param src_len   Length in bytes of the source buffer
+     * @param width     Width in pixels of the source image
+     * @param height    Height in pixels of the source image
+     * @param format    Format of the source image
+     * @param cb        Callback to be called to write the bytes of the output BMP
+     * @param arg       Pointer to be passed to the callback
+     *
+     * @return true on success, false also if the callback accepted less than it was given
+     */
+    bool fmt2bmp_cb(uint8_t *src, size_t src_len, uint16_t width, uint16_t height, pixformat_t format, jpg_out_cb cb, void * arg);
+
+    /**
+     * @brief Convert camera frame buffer to BMP, handing it to a callback while it is produced
+     *
+     * @param fb        Source camera frame buffer
+     * @param cb        Callback to be called to write the bytes of the output BMP
+     * @param arg       Pointer to be passed to the callback
+     *
+     * @return true on success
+     */
+    bool frame2bmp_cb(camera_fb_t * fb, jpg_out_cb cb, void * arg);
+
     /**
      * @brief Convert image buffer to RGB888 buffer (used for face detection)
      *
-     * @param src       Source buffer in JPEG, RGB565, RGB888, YUYV or GRAYSCALE format
+     * Pixels are stored B, G, R like everywhere else in this library.
+     *
+     * @param src       Source buffer in JPEG, RGB565, RGB555, RGB444, RGB888, YUYV or GRAYSCALE format
      * @param src_len   Length in bytes of the source buffer
      * @param format    Format of the source image
      * @param rgb_buf   Pointer to the output buffer (width * height * 3)
@@ -119,6 +366,269 @@ extern "C" {
      */
     bool fmt2rgb888(const uint8_t *src_buf, size_t src_len, pixformat_t format, uint8_t * rgb_buf);
 
+    /**
+     * @brief Decode a baseline JPEG to RGB888, optionally scaled down
+     *
+     * The image is scaled in the IDCT, which makes the smaller sizes cheaper to decode.
+     * Progressive and 12-bit JPEGs are not supported.
+     *
+     * @param src       Source JPEG buffer
+     * @param src_len   Length in bytes of the source buffer
+     * @param out       Pointer to the output buffer, (width >> scale) * (height >> scale) * 3 bytes,
+     *                  where the shifts round up
+     * @param scale     Scale of the result
+     *
+     * @return true on success
+     */
+    bool jpg2rgb888(const uint8_t *src, size_t src_len, uint8_t * out, jpg_scale_t scale);
+
+    /**
+     * @brief Filter of the resize conversions
+     */
+    typedef enum {
+        IMG_RESIZE_BOX,         /*!< Area average, for shrinking: every source pixel counts with the part of it an output pixel covers */
+        IMG_RESIZE_BILINEAR,    /*!< Interpolation between the 2x2 nearest source pixels, for enlarging or small changes */
+    } img_resize_filter_t;
+
+    /**
+     * @brief Rectangle of an image in pixels
+     */
+    typedef struct {
+        uint16_t x;             /*!< Left edge */
+        uint16_t y;             /*!< Top edge */
+        uint16_t width;         /*!< Width */
+        uint16_t height;        /*!< Height */
+    } img_rect_t;
+
+    /**
+     * @brief Crop and resize image buffer, keeping its format
+     *
+     * Rows are processed as they come, the work memory is a few rows of the output width.
+     * For YUYV the source and output widths have to be even.
+     *
+     * @param src           Source buffer in RGB565, RGB888, YUYV or GRAYSCALE format
+     * @param src_len       Length in bytes of the source buffer
+     * @param width         Width in pixels of the source image
+     * @param height        Height in pixels of the source image
+     * @param format        Format of the source image
+     * @param crop          Part of the source to resize, NULL for all of it
+     * @param out_width     Width in pixels of the result
+     * @param out_height    Height in pixels of the result
+     * @param filter        Resize filter
+     * @param out           Output buffer of out_width * out_height pixels of the source format
+     *
+     * @return true on success
+     */
+    bool fmt2resized(const uint8_t *src, size_t src_len, uint16_t width, uint16_t height, pixformat_t format,
+                     const img_rect_t *crop, uint16_t out_width, uint16_t out_height, img_resize_filter_t filter, uint8_t * out);
+
+    /**
+     * @brief Crop and resize image buffer, handing the result to a callback row by row
+     *
+     * The callback gets every output row once and is called with NULL data at the end.
+     *
+     * @param src           Source buffer in RGB565, RGB888, YUYV or GRAYSCALE format
+     * @param src_len       Length in bytes of the source buffer
+     * @param width         Width in pixels of the source image
+     * @param height        Height in pixels of the source image
+     * @param format        Format of the source image
+     * @param crop          Part of the source to resize, NULL for all of it
+     * @param out_width     Width in pixels of the result
+     * @param out_height    Height in pixels of the result
+     * @param filter        Resize filter
+     * @param cb            Callback to be called with the output rows
+     * @param arg           Pointer to be passed to the callback
+     *
+     * @return true on success, false also if the callback accepted less than it was given
+     */
+    bool fmt2resized_cb(const uint8_t *src, size_t src_len, uint16_t width, uint16_t height, pixformat_t format,
+                        const img_rect_t *crop, uint16_t out_width, uint16_t out_height, img_resize_filter_t filter, jpg_out_cb cb, void * arg);
+
+    /**
+     * @brief Crop and resize camera frame buffer, keeping its format
+     *
+     * @param fb            Source camera frame buffer
+     * @param crop          Part of the frame to resize, NULL for all of it
+     * @param out_width     Width in pixels of the result
+     * @param out_height    Height in pixels of the result
+     * @param filter        Resize filter
+     * @param out           Pointer to be populated with the address of the resulting buffer, free() it when done
+     * @param out_len       Pointer to be populated with the length of the output buffer
+     *
+     * @return true on success
+     */
+    bool frame2resized(camera_fb_t * fb, const img_rect_t *crop, uint16_t out_width, uint16_t out_height, img_resize_filter_t filter, uint8_t ** out, size_t * out_len);
+
+    /**
+     * @brief Lossless transform of a JPEG
+     */
+    typedef enum {
+        JPG_TRANSFORM_NONE,         /*!< No change, for cropping only */
+        JPG_TRANSFORM_FLIP_H,       /*!< Mirror left to right */
+        JPG_TRANSFORM_FLIP_V,       /*!< Mirror top to bottom */
+        JPG_TRANSFORM_TRANSPOSE,    /*!< Mirror along the top left to bottom right diagonal */
+        JPG_TRANSFORM_TRANSVERSE,   /*!< Mirror along the top right to bottom left diagonal */
+        JPG_TRANSFORM_ROT_90,       /*!< Rotate 90 degrees clockwise */
+        JPG_TRANSFORM_ROT_180,      /*!< Rotate 180 degrees */
+        JPG_TRANSFORM_ROT_270,      /*!< Rotate 270 degrees clockwise */
+        JPG_TRANSFORM_MAX = JPG_TRANSFORM_ROT_270
+    } jpg_transform_t;
+
+    /**
+     * @brief Rotate, mirror and crop a JPEG without decoding it
+     *
+     * The quantized DCT coefficients are rearranged and coded again, so nothing is lost and it takes a fraction of
+     * a decode and encode. Works on whole MCUs (16x8 pixels for the 4:2:2 OV2640 frames): the crop is widened to
+     * the MCU grid at its top left, and a partial MCU at an edge that would end up at the top or left of the result
+     * is dropped. Rotations and transposes keep a separate position for every MCU of the crop, about 20 bytes each.
+     *
+     * @param src           Source baseline JPEG
+     * @param src_len       Length in bytes of the source JPEG
+     * @param transform     Transform to apply
+     * @param crop          Part of the source to keep, before the transform, NULL for all of it
+     * @param out           Pointer to be populated with the address of the resulting JPEG, free() it when done
+     * @param out_len       Pointer to be populated with the length of the resulting JPEG
+     *
+     * @return true on success
+     */
+    bool jpg_transform(const uint8_t *src, size_t src_len, jpg_transform_t transform, const img_rect_t *crop, uint8_t ** out, size_t * out_len);
+
+    /**
+     * @brief Rotate, mirror and crop a JPEG without decoding it, handing the result to a callback
+     *
+     * @param src           Source baseline JPEG
+     * @param src_len       Length in bytes of the source JPEG
+     * @param transform     Transform to apply
+     * @param crop          Part of the source to keep, before the transform, NULL for all of it
+     * @param cb            Callback to be called to write the bytes of the resulting JPEG
+     * @param arg           Pointer to be passed to the callback
+     *
+     * @return true on success
+     */
+    bool jpg_transform_cb(const uint8_t *src, size_t src_len, jpg_transform_t transform, const img_rect_t *crop, jpg_out_cb cb, void * arg);
+
+    /**
+     * @brief Rotate, mirror and crop a JPEG camera frame buffer without decoding it
+     *
+     * @param fb            Source camera frame buffer in JPEG format
+     * @param transform     Transform to apply
+     * @param crop          Part of the frame to keep, before the transform, NULL for all of it
+     * @param out           Pointer to be populated with the address of the resulting JPEG, free() it when done
+     * @param out_len       Pointer to be populated with the length of the resulting JPEG
+     *
+     * @return true on success
+     */
+    bool frame2jpg_transformed(camera_fb_t * fb, jpg_transform_t transform, const img_rect_t *crop, uint8_t ** out, size_t * out_len);
+
+    /**
+     * @brief Lower the quality of a JPEG without decoding it
+     *
+     * The quantized DCT coefficients are divided down to the quantization tables fmt2jpg() would use for the same
+     * quality and coded again, no IDCT or DCT involved. Tables of the source that are already coarser stay as they
+     * are, so the result never gets larger quantizers than needed nor finer ones than the source.
+     *
+     * @param src           Source baseline JPEG
+     * @param src_len       Length in bytes of the source JPEG
+     * @param quality       JPEG quality of the resulting image, 1..100
+     * @param out           Pointer to be populated with the address of the resulting JPEG, free() it when done
+     * @param out_len       Pointer to be populated with the length of the resulting JPEG
+     *
+     * @return true on success
+     */
+    bool jpg_requantize(const uint8_t *src, size_t src_len, uint8_t quality, uint8_t ** out, size_t * out_len);
+
+    /**
+     * @brief Lower the quality of a JPEG without decoding it, handing the result to a callback
+     *
+     * @param src           Source baseline JPEG
+     * @param src_len       Length in bytes of the source JPEG
+     * @param quality       JPEG quality of the resulting image, 1..100
+     * @param cb            Callback to be called to write the bytes of the resulting JPEG
+     * @param arg           Pointer to be passed to the callback
+     *
+     * @return true on success
+     */
+    bool jpg_requantize_cb(const uint8_t *src, size_t src_len, uint8_t quality, jpg_out_cb cb, void * arg);
+
+    /**
+     * @brief Lower the quality of a JPEG camera frame buffer without decoding it
+     *
+     * @param fb            Source camera frame buffer in JPEG format
+     * @param quality       JPEG quality of the resulting image, 1..100
+     * @param out           Pointer to be populated with the address of the resulting JPEG, free() it when done
+     * @param out_len       Pointer to be populated with the length of the resulting JPEG
+     *
+     * @return true on success
+     */
+    bool frame2jpg_requantized(camera_fb_t * fb, uint8_t quality, uint8_t ** out, size_t * out_len);
+
+    /**
+     * @brief Problems jpg_index() found, bits of jpg_index_t.flags
+     */
+    typedef enum {
+        JPG_INDEX_TRUNCATED = 1 << 0,   /*!< The data ends before EOI */
+        JPG_INDEX_CORRUPT   = 1 << 1,   /*!< No SOI, bad segment length, marker out of place or no SOF/SOS before EOI */
+    } jpg_index_flags_t;
+
+    /**
+     * @brief Structure of a JPEG as found by jpg_index(). Offsets are from the start of the buffer, 0 if not found.
+     */
+    typedef struct {
+        uint16_t width;                 /*!< Width in pixels from SOF */
+        uint16_t height;                /*!< Height in pixels from SOF */
+        uint8_t sof_marker;             /*!< SOF marker, 0xC0 for baseline, 0xC2 for progressive */
+        uint8_t components;             /*!< Number of components */
+        uint8_t sampling;               /*!< Sampling factors of the first component, horizontal << 4 | vertical */
+        uint8_t quality;                /*!< Quality 1..100 estimated from the first component's table, 0 if unknown */
+        uint16_t restart_interval;      /*!< MCUs between restart markers from DRI, 0 for none */
+        uint8_t flags;                  /*!< jpg_index_flags_t */
+        uint8_t quant_16bit;            /*!< Bit t set if quantization table t has 16 bit entries */
+        uint32_t quant_offset[4];       /*!< 64 entries of quantization table t in zigzag order */
+        uint32_t scan_offset;           /*!< First byte of entropy coded data of the first scan */
+        uint32_t eoi_offset;            /*!< The FF D9 of EOI */
+        uint32_t length;                /*!< Bytes up to and including EOI, or as far as the parser got */
+    } jpg_index_t;
+
+    /**
+     * @brief Validate a JPEG and index its structure in a single forward pass
+     *
+     * Walks the marker segments and skips entropy coded data with memchr() for 0xFF. Stops at the first EOI, so
+     * padding after it (DMA leftovers) does not matter. Does not allocate nor log, safe to use from the camera driver.
+     *
+     * @param buf           JPEG data
+     * @param len           Length in bytes of the data
+     * @param index         Structure to be populated, also on failure, as far as the parser got
+     *
+     * @return true if the JPEG is complete and well formed (flags is 0)
+     */
+    bool jpg_index(const uint8_t *buf, size_t len, jpg_index_t *index);
+
+    /**
+     * @brief State of jpg_eoi_scan() for one frame, zero it before the first chunk
+     */
+    typedef struct {
+        size_t pos;                     /*!< Bytes scanned so far */
+        size_t eoi;                     /*!< Bytes up to and including EOI once found, 0 before */
+        uint16_t skip;                  /*!< Bytes of the current marker segment still to skip */
+        uint8_t state;                  /*!< Where the scanner is in the JPEG structure */
+        uint8_t marker;                 /*!< Marker of the current segment */
+    } jpg_eoi_scan_t;
+
+    /**
+     * @brief Find the end of a JPEG that arrives in chunks
+     *
+     * Resumes where the previous chunk left off, so markers split over chunks are found. Marker segments are
+     * skipped by their length and entropy coded data with memchr(), so FF D9 inside headers or tables does not count.
+     * If the headers do not make sense it falls back to looking for the first FF D9.
+     *
+     * @param scan          Scanner state, zeroed for a new frame
+     * @param data          Next chunk of the frame
+     * @param len           Length in bytes of the chunk
+     *
+     * @return scan->eoi: the length of the JPEG up to and including EOI, 0 if not found yet
+     */
+    size_t jpg_eoi_scan(jpg_eoi_scan_t *scan, const uint8_t *data, size_t len);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,311 @@
+// Copyright 2015-2016 Espressif Systems (Shanghai) PTE LTD
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include <stddef.h>
+#include <string.h>
+#include "esp_attr.h"
+#include "img_converters.h"
+
+#define M_SOF0  0xC0
+#define M_DHT   0xC4
+#define M_JPG   0xC8
+#define M_DAC   0xCC
+#define M_SOF15 0xCF
+#define M_RST0  0xD0
+#define M_RST7  0xD7
+#define M_SOI   0xD8
+#define M_EOI   0xD9
+#define M_SOS   0xDA
+#define M_DQT   0xDB
+#define M_DRI   0xDD
+#define M_TEM   0x01
+
+#define BE16(p) (((p)[0] << 8) | (p)[1])
+
+// standard luma quantization table (ITU-T T.81 K.1) in zigzag order, the one quality scales
+static const uint8_t s_std_lum_quant[64] = { 16,11,12,14,12,10,16,14,13,14,18,17,16,19,24,40,26,24,22,22,24,49,35,37,29,40,58,51,61,60,57,51,56,55,64,72,92,78,64,68,87,69,55,56,80,109,81,87,95,98,103,104,103,62,77,113,121,112,100,120,92,101,103,99 };
+
+// Sums of a table and of the standard entries it scales, leaving out 8 bit entries clipped at 255
+typedef struct {
+    uint32_t sum, std_sum;
+} quant_sums_t;
+
+// Inverse of the quality scaling jpge (and libjpeg) apply to the standard tables
+static uint8_t estimate_quality(const quant_sums_t *sums)
+{
+    if (!sums->std_sum) {
+        return 1;
+    }
+    uint32_t scale = (sums->sum * 100 + sums->std_sum / 2) / sums->std_sum;
+    int quality;
+    if (scale <= 100) {
+        quality = (200 - (int)scale + 1) / 2;
+    } else {
+        quality = 5000 / scale;
+    }
+    return quality < 1 ? 1 : (quality > 100 ? 100 : quality);
+}
+
+static bool parse_sof(const uint8_t *seg, size_t seg_len, jpg_index_t *index, uint8_t *luma_table)
+{
+    if (seg_len < 6 || seg_len < 6 + 3 * (size_t)seg[5]) {
+        return false;
+    }
+    index->height = BE16(seg + 1);
+    index->width = BE16(seg + 3);
+    index->components = seg[5];
+    if (!index->width || !index->height || !index->components) {
+        return false;
+    }
+    index->sampling = seg[7];
+    *luma_table = seg[8] & 3;
+    return true;
+}
+
+static bool parse_dqt(const uint8_t *buf, size_t ofs, size_t seg_len, jpg_index_t *index, quant_sums_t *sums)
+{
+    const uint8_t *seg = buf + ofs;
+    size_t i = 0;
+    while (i < seg_len) {
+        const int t = seg[i] & 3, wide = seg[i] >> 4;
+        const size_t n = wide ? 128 : 64;
+        if ((seg[i] & 0x0C) || wide > 1 || i + 1 + n > seg_len) {
+            return false;
+        }
+        index->quant_offset[t] = ofs + i + 1;
+        index->quant_16bit = wide ? (index->quant_16bit | (1 << t)) : (index->quant_16bit & ~(1 << t));
+        sums[t].sum = sums[t].std_sum = 0;
+        for (size_t k = 0; k < 64; k++) {
+            const uint32_t q = wide ? BE16(seg + i + 1 + 2 * k) : seg[i + 1 + k];
+            if (wide || q < 255) {
+                sums[t].sum += q;
+                sums[t].std_sum += s_std_lum_quant[k];
+            }
+        }
+        i += 1 + n;
+    }
+    return true;
+}
+
+bool jpg_index(const uint8_t *buf, size_t len, jpg_index_t *index)
+{
+    quant_sums_t sums[4];
+    uint8_t luma_table = 0;
+    bool in_scan = false;
+    size_t p = 2;
+
+    memset(index, 0, sizeof(jpg_index_t));
+    if (len < 2 || buf[0] != 0xFF || buf[1] != M_SOI) {
+        index->flags = (len < 2) ? JPG_INDEX_TRUNCATED : JPG_INDEX_CORRUPT;
+        return false;
+    }
+
+    for (;;) {
+        if (in_scan) {
+            // entropy coded data: FF is only ever followed by a stuffed 00 or RSTn, anything else ends the scan
+            const uint8_t *ff = (const uint8_t *)memchr(buf + p, 0xFF, len - p);
+            if (!ff) {
+                p = len;
+                index->flags |= JPG_INDEX_TRUNCATED;
+                break;
+            }
+            p = ff - buf + 1;
+            while (p < len && buf[p] == 0xFF) {
+                p++;
+            }
+            if (p == len) {
+                index->flags |= JPG_INDEX_TRUNCATED;
+                break;
+            }
+            if (!buf[p] || (buf[p] >= M_RST0 && buf[p] <= M_RST7)) {
+                p++;
+                continue;
+            }
+            in_scan = false;
+            p--;
+        }
+
+        // marker, optionally preceded by fill bytes
+        if (p < len && buf[p] != 0xFF) {
+            index->flags |= JPG_INDEX_CORRUPT;
+            break;
+        }
+        while (p < len && buf[p] == 0xFF) {
+            p++;
+        }
+        if (p == len) {
+            index->flags |= JPG_INDEX_TRUNCATED;
+            break;
+        }
+        const uint8_t marker = buf[p++];
+        if (marker == M_EOI) {
+            index->eoi_offset = p - 2;
+            if (!index->sof_marker || !index->scan_offset) {
+                index->flags |= JPG_INDEX_CORRUPT;
+            }
+            break;
+        }
+        if (marker == M_TEM) {
+            continue;
+        }
+        if (!marker || marker == M_SOI || (marker >= M_RST0 && marker <= M_RST7)) {
+            index->flags |= JPG_INDEX_CORRUPT;
+            break;
+        }
+
+        // marker segment
+        if (p + 2 > len) {
+            index->flags |= JPG_INDEX_TRUNCATED;
+            break;
+        }
+        const size_t seg_len = BE16(buf + p);
+        if (seg_len < 2) {
+            index->flags |= JPG_INDEX_CORRUPT;
+            break;
+        }
+        if (p + seg_len > len) {
+            index->flags |= JPG_INDEX_TRUNCATED;
+            break;
+        }
+        const size_t ofs = p + 2, n = seg_len - 2;
+        bool ok = true;
+        if (marker >= M_SOF0 && marker <= M_SOF15 && marker != M_DHT && marker != M_JPG && marker != M_DAC) {
+            ok = !index->sof_marker && parse_sof(buf + ofs, n, index, &luma_table);
+            index->sof_marker = marker;
+        } else if (marker == M_DQT) {
+            ok = parse_dqt(buf, ofs, n, index, sums);
+        } else if (marker == M_DRI) {
+            ok = n >= 2;
+            if (ok) {
+                index->restart_interval = BE16(buf + ofs);
+            }
+        } else if (marker == M_SOS) {
+            ok = index->sof_marker && n >= 1 && n >= 4 + 2 * (size_t)buf[ofs];
+            if (!index->scan_offset) {
+                index->scan_offset = p + seg_len;
+            }
+            in_scan = true;
+        }
+        if (!ok) {
+            index->flags |= JPG_INDEX_CORRUPT;
+            break;
+        }
+        p += seg_len;
+    }
+
+    index->length = index->eoi_offset ? index->eoi_offset + 2 : p;
+    if (index->quant_offset[luma_table]) {
+        index->quality = estimate_quality(&sums[luma_table]);
+    }
+    return !index->flags;
+}
+
+// jpg_eoi_scan() states
+enum {
+    EOI_MARKER_FF,  // expecting the FF of a marker
+    EOI_MARKER,     // expecting a marker code, more FF are fill bytes
+    EOI_LEN_HI,     // segment length, high byte
+    EOI_LEN_LO,     // segment length, low byte
+    EOI_SKIP,       // inside a marker segment
+    EOI_SCAN,       // entropy coded data
+    EOI_SCAN_FF,    // entropy coded data after FF
+    EOI_RAW,        // lost track of the structure, looking for any FF D9
+    EOI_RAW_FF,     // same, after FF
+    EOI_DONE
+};
+
+// Runs in the camera driver's DMA filter task for every chunk of a JPEG frame
+size_t IRAM_ATTR jpg_eoi_scan(jpg_eoi_scan_t *scan, const uint8_t *data, size_t len)
+{
+    const uint8_t *p = data, *end = data + len;
+    uint8_t c;
+
+    while (p < end && scan->state != EOI_DONE) {
+        switch (scan->state) {
+        case EOI_SCAN:
+        case EOI_RAW: {
+            const uint8_t *ff = (const uint8_t *)memchr(p, 0xFF, end - p);
+            if (!ff) {
+                p = end;
+                break;
+            }
+            p = ff + 1;
+            scan->state = (scan->state == EOI_SCAN) ? EOI_SCAN_FF : EOI_RAW_FF;
+            break;
+        }
+        case EOI_SCAN_FF:
+            c = *p;
+            if (c == 0xFF) {
+                p++;
+            } else if (!c || (c >= M_RST0 && c <= M_RST7)) {
+                p++;
+                scan->state = EOI_SCAN;
+            } else {
+                scan->state = EOI_MARKER;    // end of the scan, c is the next marker
+            }
+            break;
+        case EOI_RAW_FF:
+            c = *p++;
+            if (c == M_EOI) {
+                scan->state = EOI_DONE;
+            } else if (c != 0xFF) {
+                scan->state = EOI_RAW;
+            }
+            break;
+        case EOI_MARKER_FF:
+            scan->state = (*p++ == 0xFF) ? EOI_MARKER : EOI_RAW;
+            break;
+        case EOI_MARKER:
+            c = *p++;
+            if (c == M_EOI) {
+                scan->state = EOI_DONE;
+            } else if (c == M_SOI || c == M_TEM || (c >= M_RST0 && c <= M_RST7)) {
+                scan->state = EOI_MARKER_FF;
+            } else if (!c) {
+                scan->state = EOI_RAW;
+            } else if (c != 0xFF) {
+                scan->marker = c;
+                scan->state = EOI_LEN_HI;
+            }
+            break;
+        case EOI_LEN_HI:
+            scan->skip = *p++ << 8;
+            scan->state = EOI_LEN_LO;
+            break;
+        case EOI_LEN_LO:
+            scan->skip |= *p++;
+            if (scan->skip < 2) {
+                scan->state = EOI_RAW;
+                break;
+            }
+            scan->skip -= 2;
+            scan->state = EOI_SKIP;
+            // fall through
+        case EOI_SKIP: {
+            const size_t n = ((size_t)(end - p) < scan->skip) ? (size_t)(end - p) : scan->skip;
+            p += n;
+            scan->skip -= n;
+            if (!scan->skip) {
+                scan->state = (scan->marker == M_SOS) ? EOI_SCAN : EOI_MARKER_FF;
+            }
+            break;
+        }
+        }
+    }
+
+    if (scan->state == EOI_DONE && !scan->eoi) {
+        scan->eoi = scan->pos + (p - data);
+    }
+    scan->pos += len;
+    return scan->eoi;
+}
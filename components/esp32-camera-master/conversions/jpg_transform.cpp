@@ -0,0 +1,367 @@
+// Copyright 2015-2016 Espressif Systems (Shanghai) PTE LTD
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include "esp_heap_caps.h"
+#include "jpg_transform.h"
+#include "jpgd.h"
+#include "jpge.h"
+#include <new>
+
+#if defined(ARDUINO_ARCH_ESP32) && defined(CONFIG_ARDUHAL_ESP_LOG)
+#include "esp32-hal-log.h"
+#define TAG ""
+#else
+#include "esp_log.h"
+static const char* TAG = "jpg_transform";
+#endif
+
+static const uint8_t s_zag[64] = { 0,1,8,16,9,2,3,10,17,24,32,25,18,11,4,5,12,19,26,33,40,48,41,34,27,20,13,6,7,14,21,28,35,42,49,56,57,50,43,36,29,22,15,23,30,37,44,51,58,59,52,45,38,31,39,46,53,60,61,54,47,55,62,63 };
+
+// Every transform is a mirror of the output columns and/or rows, followed by an optional transpose:
+// { transposed, columns mirrored, rows mirrored }, in terms of the output.
+static const uint8_t s_transforms[JPG_TRANSFORM_MAX + 1][3] = {
+    { 0, 0, 0 },    // JPG_TRANSFORM_NONE
+    { 0, 1, 0 },    // JPG_TRANSFORM_FLIP_H
+    { 0, 0, 1 },    // JPG_TRANSFORM_FLIP_V
+    { 1, 0, 0 },    // JPG_TRANSFORM_TRANSPOSE
+    { 1, 1, 1 },    // JPG_TRANSFORM_TRANSVERSE
+    { 1, 1, 0 },    // JPG_TRANSFORM_ROT_90
+    { 0, 1, 1 },    // JPG_TRANSFORM_ROT_180
+    { 1, 0, 1 },    // JPG_TRANSFORM_ROT_270
+};
+
+// Output coefficient k (zigzag order) of a block is source coefficient src[k], negated where neg[k] is set.
+// Mirroring negates the odd horizontal or vertical frequencies, transposing swaps u and v.
+typedef struct {
+    uint8_t src[64];
+    bool neg[64];
+} block_map_t;
+
+// Position of x in a grid of n, mirrored or not
+#define MIRROR(m, x, n) ((m) ? (n) - 1 - (x) : (x))
+
+static void *_malloc(size_t size)
+{
+    void * res = malloc(size);
+    if(res) {
+        return res;
+    }
+    return heap_caps_malloc(size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+}
+
+static void make_block_map(block_map_t *map, bool transposed, bool mirror_u, bool mirror_v)
+{
+    uint8_t unzag[64];
+    for(int k = 0; k < 64; k++) {
+        unzag[s_zag[k]] = k;
+    }
+    for(int k = 0; k < 64; k++) {
+        int u = s_zag[k] & 7, v = s_zag[k] >> 3;
+        map->src[k] = unzag[transposed ? (u * 8 + v) : (v * 8 + u)];
+        map->neg[k] = (mirror_u && (u & 1)) != (mirror_v && (v & 1));
+    }
+}
+
+// Hands out the source MCUs of the crop in whatever order the transform needs them. Rows that stay in order are
+// decoded as they come; mirrored rows seek to saved row positions and transposes to saved MCU positions, which
+// one pass over the scan collects up front.
+class mcu_source {
+public:
+    mcu_source(jpgd::jpeg_decoder *dec, int mx0, int my0, int mw, int mh, bool by_mcu, bool by_row)
+        : m_dec(dec), m_mx0(mx0), m_my0(my0), m_mw(mw), m_mh(mh), m_by_mcu(by_mcu), m_by_row(by_row),
+          m_blocks(dec->get_blocks_per_mcu()), m_cur(0), m_row(-1), m_pPos(NULL), m_pBuf(NULL) { }
+
+    ~mcu_source()
+    {
+        free(m_pPos);
+        free(m_pBuf);
+    }
+
+    bool init()
+    {
+        size_t num_pos = m_by_mcu ? (size_t)m_mw * m_mh : (m_by_row ? m_mh : 0);
+        size_t buf_len = (m_by_mcu ? 1 : m_mw) * m_blocks * 64 * sizeof(jpgd::int16);
+        m_pBuf = (jpgd::int16 *)_malloc(buf_len);
+        if (num_pos) {
+            m_pPos = (jpgd::jpeg_decoder::position *)_malloc(num_pos * sizeof(jpgd::jpeg_decoder::position));
+        }
+        if (!m_pBuf || (num_pos && !m_pPos)) {
+            ESP_LOGE(TAG, "Coefficient buffer malloc failed: %u bytes", (unsigned)(buf_len + num_pos * sizeof(jpgd::jpeg_decoder::position)));
+            return false;
+        }
+        for (size_t i = 0; i < num_pos; i++) {
+            int mx = m_mx0 + (m_by_mcu ? i % m_mw : 0);
+            int my = m_my0 + (m_by_mcu ? i / m_mw : i);
+            if (!skip_to(my * m_dec->get_mcus_per_row() + mx)) {
+                return false;
+            }
+            m_dec->get_position(&m_pPos[i]);
+        }
+        return true;
+    }
+
+    // Blocks of MCU (mx, my) of the crop, valid until the next call
+    const jpgd::int16 *get(int mx, int my)
+    {
+        if (m_by_mcu) {
+            m_dec->set_position(m_pPos[my * m_mw + mx]);
+            return decode(m_pBuf) ? m_pBuf : NULL;
+        }
+        if (my != m_row) {
+            if (m_by_row) {
+                m_dec->set_position(m_pPos[my]);
+            } else if (!skip_to((m_my0 + my) * m_dec->get_mcus_per_row() + m_mx0)) {
+                return NULL;
+            }
+            for (int i = 0; i < m_mw; i++) {
+                if (!decode(m_pBuf + i * m_blocks * 64)) {
+                    return NULL;
+                }
+            }
+            m_cur += m_mw;
+            m_row = my;
+        }
+        return m_pBuf + mx * m_blocks * 64;
+    }
+
+private:
+    jpgd::jpeg_decoder *m_dec;
+    int m_mx0, m_my0, m_mw, m_mh;
+    bool m_by_mcu, m_by_row;
+    int m_blocks;
+    int m_cur;                  // raster index of the next MCU of the scan while decoding in order
+    int m_row;                  // crop row in m_pBuf
+    jpgd::jpeg_decoder::position *m_pPos;
+    jpgd::int16 *m_pBuf;
+    jpgd::int16 m_skip[6 * 64];
+
+    bool decode(jpgd::int16 *pBlocks)
+    {
+        if (!m_dec->decode_mcu_coefficients(pBlocks)) {
+            ESP_LOGE(TAG, "Corrupt JPG data");
+            return false;
+        }
+        return true;
+    }
+
+    bool skip_to(int index)
+    {
+        for ( ; m_cur < index; m_cur++) {
+            if (!decode(m_skip)) {
+                return false;
+            }
+        }
+        return true;
+    }
+};
+
+static bool transform_scan(jpgd::jpeg_decoder *dec, jpg_transform_t transform, const img_rect_t *crop, jpge::output_stream *pStream)
+{
+    const bool transposed = s_transforms[transform][0], mirror_u = s_transforms[transform][1], mirror_v = s_transforms[transform][2];
+    // mirrored axes of the source, whose partial edge MCUs would move to the top or left
+    const bool mirror_x = transposed ? mirror_v : mirror_u, mirror_y = transposed ? mirror_u : mirror_v;
+    const int num_comps = dec->get_num_components();
+    const int mcu_w = 8 * dec->get_h_samp(0), mcu_h = 8 * dec->get_v_samp(0);
+    const int width = dec->get_image_width(), height = dec->get_image_height();
+
+    img_rect_t c = { 0, 0, (uint16_t)width, (uint16_t)height };
+    if (crop) {
+        c = *crop;
+    }
+    if (!c.width || !c.height || (c.x + c.width > width) || (c.y + c.height > height)) {
+        ESP_LOGE(TAG, "Crop %ux%u at %u,%u outside of %ux%u", c.width, c.height, c.x, c.y, width, height);
+        return false;
+    }
+    int w = c.x % mcu_w + c.width, h = c.y % mcu_h + c.height;
+    if (mirror_x) {
+        w -= w % mcu_w;
+    }
+    if (mirror_y) {
+        h -= h % mcu_h;
+    }
+    if (!w || !h) {
+        ESP_LOGE(TAG, "Nothing left of %ux%u after trimming to whole %ux%u MCUs", c.width, c.height, mcu_w, mcu_h);
+        return false;
+    }
+    const int mx0 = c.x / mcu_w, my0 = c.y / mcu_h;
+    const int mw = (w + mcu_w - 1) / mcu_w, mh = (h + mcu_h - 1) / mcu_h;
+    const int out_mw = transposed ? mh : mw, out_mh = transposed ? mw : mh;
+
+    block_map_t map;
+    make_block_map(&map, transposed, mirror_u, mirror_v);
+
+    // transposed images take transposed quantization tables and sampling factors
+    jpge::coef_encoder::component comps[3];
+    jpgd::uint16 quant[4][64];
+    const jpgd::uint16 *pQuant[4] = { NULL, NULL, NULL, NULL };
+    int block_ofs[3];
+    for (int i = 0, ofs = 0; i < num_comps; i++) {
+        const int t = dec->get_quant_index(i);
+        comps[i].m_id = dec->get_component_id(i);
+        comps[i].m_h_samp = transposed ? dec->get_v_samp(i) : dec->get_h_samp(i);
+        comps[i].m_v_samp = transposed ? dec->get_h_samp(i) : dec->get_v_samp(i);
+        comps[i].m_quant = t;
+        for (int k = 0; k < 64; k++) {
+            quant[t][k] = dec->get_quant_table(t)[map.src[k]];
+        }
+        pQuant[t] = quant[t];
+        block_ofs[i] = ofs;
+        ofs += dec->get_h_samp(i) * dec->get_v_samp(i) * 64;
+    }
+
+    jpge::coef_encoder enc;
+    if (!enc.init(pStream, transposed ? h : w, transposed ? w : h, num_comps, comps, pQuant)) {
+        return false;
+    }
+
+    mcu_source src(dec, mx0, my0, mw, mh, transposed, !transposed && mirror_y);
+    if (!src.init()) {
+        return false;
+    }
+
+    jpgd::int16 block[64];
+    for (int oy = 0; oy < out_mh; oy++) {
+        for (int ox = 0; ox < out_mw; ox++) {
+            const int x1 = MIRROR(mirror_u, ox, out_mw), y1 = MIRROR(mirror_v, oy, out_mh);
+            const jpgd::int16 *pMcu = transposed ? src.get(y1, x1) : src.get(x1, y1);
+            if (!pMcu) {
+                return false;
+            }
+            for (int i = 0; i < num_comps; i++) {
+                const int sh = dec->get_h_samp(i);
+                for (int by = 0; by < comps[i].m_v_samp; by++) {
+                    for (int bx = 0; bx < comps[i].m_h_samp; bx++) {
+                        const int bx1 = MIRROR(mirror_u, bx, comps[i].m_h_samp), by1 = MIRROR(mirror_v, by, comps[i].m_v_samp);
+                        const jpgd::int16 *pSrc = pMcu + block_ofs[i] + (transposed ? (bx1 * sh + by1) : (by1 * sh + bx1)) * 64;
+                        for (int k = 0; k < 64; k++) {
+                            block[k] = map.neg[k] ? -pSrc[map.src[k]] : pSrc[map.src[k]];
+                        }
+                        enc.code_block(i, block);
+                    }
+                }
+            }
+        }
+    }
+    return enc.finish();
+}
+
+// Source coefficient x quantized with q becomes round(x * q / q2) with the coarser q2. Only nonzero coefficients
+// take the divide, and with q2 >= q nothing grows out of the range the encoder accepts.
+static bool requantize_scan(jpgd::jpeg_decoder *dec, int quality, jpge::output_stream *pStream)
+{
+    const int num_comps = dec->get_num_components();
+    const int mcus = dec->get_mcus_per_row() * dec->get_mcu_rows();
+
+    // a table keeps its index and takes the luma target if it quantizes the luma, the chroma target otherwise
+    jpge::coef_encoder::component comps[3];
+    jpgd::uint16 quant[4][64];
+    const jpgd::uint16 *pQuant[4] = { NULL, NULL, NULL, NULL };
+    for (int i = num_comps - 1; i >= 0; i--) {
+        const int t = dec->get_quant_index(i);
+        comps[i].m_id = dec->get_component_id(i);
+        comps[i].m_h_samp = dec->get_h_samp(i);
+        comps[i].m_v_samp = dec->get_v_samp(i);
+        comps[i].m_quant = t;
+        jpge::coef_encoder::get_std_quant_table(quality, i > 0, quant[t]);
+        for (int k = 0; k < 64; k++) {
+            if (quant[t][k] < dec->get_quant_table(t)[k]) {
+                quant[t][k] = dec->get_quant_table(t)[k];
+            }
+        }
+        pQuant[t] = quant[t];
+    }
+
+    jpge::coef_encoder enc;
+    if (!enc.init(pStream, dec->get_image_width(), dec->get_image_height(), num_comps, comps, pQuant)) {
+        return false;
+    }
+
+    jpgd::int16 blocks[6 * 64];
+    for (int m = 0; m < mcus; m++) {
+        if (!dec->decode_mcu_coefficients(blocks)) {
+            ESP_LOGE(TAG, "Corrupt JPG data");
+            return false;
+        }
+        jpgd::int16 *pBlock = blocks;
+        for (int i = 0; i < num_comps; i++) {
+            const jpgd::uint16 *q = dec->get_quant_table(comps[i].m_quant), *q2 = quant[comps[i].m_quant];
+            for (int b = comps[i].m_h_samp * comps[i].m_v_samp; b > 0; b--, pBlock += 64) {
+                for (int k = 0; k < 64; k++) {
+                    const int x = pBlock[k];
+                    if (x && q[k] != q2[k]) {
+                        const int a = ((x < 0 ? -x : x) * q[k] + (q2[k] >> 1)) / q2[k];
+                        pBlock[k] = static_cast<jpgd::int16>(x < 0 ? -a : a);
+                    }
+                }
+                enc.code_block(i, pBlock);
+            }
+        }
+    }
+    return enc.finish();
+}
+
+static jpgd::jpeg_decoder *create_decoder(const uint8_t *src, size_t src_len)
+{
+    void *mem = _malloc(sizeof(jpgd::jpeg_decoder));
+    if (!mem) {
+        ESP_LOGE(TAG, "JPG decoder malloc failed");
+        return NULL;
+    }
+    jpgd::jpeg_decoder *dec = new (mem) jpgd::jpeg_decoder;
+    if (!dec->init_coefficients(src, src_len)) {
+        ESP_LOGE(TAG, "Unsupported JPG");
+        dec->~jpeg_decoder();
+        free(mem);
+        return NULL;
+    }
+    return dec;
+}
+
+static void delete_decoder(jpgd::jpeg_decoder *dec)
+{
+    dec->~jpeg_decoder();
+    free(dec);
+}
+
+bool jpg_transform_stream(const uint8_t *src, size_t src_len, jpg_transform_t transform, const img_rect_t *crop, jpge::output_stream *pStream)
+{
+    if ((unsigned)transform > JPG_TRANSFORM_MAX) {
+        ESP_LOGE(TAG, "Transform %u not supported", transform);
+        return false;
+    }
+    jpgd::jpeg_decoder *dec = create_decoder(src, src_len);
+    if (!dec) {
+        return false;
+    }
+    bool ret = transform_scan(dec, transform, crop, pStream);
+    delete_decoder(dec);
+    return ret;
+}
+
+bool jpg_requantize_stream(const uint8_t *src, size_t src_len, uint8_t quality, jpge::output_stream *pStream)
+{
+    if (quality < 1 || quality > 100) {
+        ESP_LOGE(TAG, "Quality %u outside of 1..100", quality);
+        return false;
+    }
+    jpgd::jpeg_decoder *dec = create_decoder(src, src_len);
+    if (!dec) {
+        return false;
+    }
+    bool ret = requantize_scan(dec, quality, pStream);
+    delete_decoder(dec);
+    return ret;
+}
@@ -0,0 +1,847 @@
+// jpgd.cpp - C++ class for baseline JPEG decompression.
+// Decodes 8-bit baseline (and extended Huffman) JPEGs with 1 or 3 components, H1V1, H2V1 or H2V2 sampling and
+// restart markers, which covers the OV2640 and jpge output. Huffman codes of up to JPGD_HUFF_LOOKAHEAD bits take a
+// single table lookup, the IDCT is the integer one of the IJG library. Scaled output comes straight out of the IDCT:
+// 1/2 and 1/4 use box filtered 4x4 and 2x2 transforms, 1/8 only the DC coefficient of each block.
+
+#include "jpgd.h"
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <new>
+#include "esp_heap_caps.h"
+
+#define JPGD_MIN(a,b) (((a)<(b))?(a):(b))
+
+namespace jpgd {
+
+    static inline void *jpgd_malloc(size_t nSize) {
+        void * b = malloc(nSize);
+        if(b){
+            return b;
+        }
+        return heap_caps_malloc(nSize, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    }
+    static inline void jpgd_free(void *p) { free(p); }
+
+    // Various JPEG enums and tables.
+    enum { M_SOF0 = 0xC0, M_SOF1 = 0xC1, M_DHT = 0xC4, M_JPG = 0xC8, M_DAC = 0xCC, M_SOF15 = 0xCF, M_RST0 = 0xD0, M_RST7 = 0xD7,
+           M_SOI = 0xD8, M_EOI = 0xD9, M_SOS = 0xDA, M_DQT = 0xDB, M_DRI = 0xDD, M_TEM = 0x01 };
+
+    static const uint8 s_zag[64] = { 0,1,8,16,9,2,3,10,17,24,32,25,18,11,4,5,12,19,26,33,40,48,41,34,27,20,13,6,7,14,21,28,35,42,49,56,57,50,43,36,29,22,15,23,30,37,44,51,58,59,52,45,38,31,39,46,53,60,61,54,47,55,62,63 };
+
+    // YCbCr to RGB, JFIF full range: R = Y + 1.402 Cr, G = Y - 0.344136 Cb - 0.714136 Cr, B = Y + 1.772 Cb.
+    // The green terms keep 16 fraction bits (the rounding half is in s_cb_g) and are added before the shift.
+    static constexpr int16 cr_r(int i) { return static_cast<int16>((91881 * (i - 128) + 32768) >> 16); }
+    static constexpr int16 cb_b(int i) { return static_cast<int16>((116130 * (i - 128) + 32768) >> 16); }
+    static constexpr int32 cr_g(int i) { return -46802 * (i - 128); }
+    static constexpr int32 cb_g(int i) { return -22554 * (i - 128) + 32768; }
+
+#define JPGD_REP4(f, i)     f(i), f((i) + 1), f((i) + 2), f((i) + 3)
+#define JPGD_REP16(f, i)    JPGD_REP4(f, (i)), JPGD_REP4(f, (i) + 4), JPGD_REP4(f, (i) + 8), JPGD_REP4(f, (i) + 12)
+#define JPGD_REP64(f, i)    JPGD_REP16(f, (i)), JPGD_REP16(f, (i) + 16), JPGD_REP16(f, (i) + 32), JPGD_REP16(f, (i) + 48)
+#define JPGD_REP256(f)      JPGD_REP64(f, 0), JPGD_REP64(f, 64), JPGD_REP64(f, 128), JPGD_REP64(f, 192)
+    static constexpr int16 s_cr_r[256] = { JPGD_REP256(cr_r) };
+    static constexpr int16 s_cb_b[256] = { JPGD_REP256(cb_b) };
+    static constexpr int32 s_cr_g[256] = { JPGD_REP256(cr_g) };
+    static constexpr int32 s_cb_g[256] = { JPGD_REP256(cb_g) };
+#undef JPGD_REP256
+#undef JPGD_REP64
+#undef JPGD_REP16
+#undef JPGD_REP4
+
+    static inline uint8 clamp(int i)
+    {
+        if (static_cast<uint>(i) > 255U)
+        {
+            i = ((~i) >> 31) & 0xFF;
+        }
+        return static_cast<uint8>(i);
+    }
+
+    static inline uint read_word(const uint8 *p)
+    {
+        return (p[0] << 8) | p[1];
+    }
+
+    // Value of a num_bits wide magnitude category, the codes with the top bit clear are the negative ones.
+    static inline int32 extend(uint v, int num_bits)
+    {
+        return (v < (1U << (num_bits - 1))) ? static_cast<int32>(v) - static_cast<int32>((1U << num_bits) - 1) : static_cast<int32>(v);
+    }
+
+    // Integer IDCT, the inverse of jpge's DCT2D(): 13 bit constants, the column pass keeps 2 extra bits.
+    enum { CONST_BITS = 13, PASS1_BITS = 2 };
+    enum { FIX_0_298631336 = 2446, FIX_0_390180644 = 3196, FIX_0_541196100 = 4433, FIX_0_765366865 = 6270,
+           FIX_0_899976223 = 7373, FIX_1_175875602 = 9633, FIX_1_501321110 = 12299, FIX_1_847759065 = 15137,
+           FIX_1_961570560 = 16069, FIX_2_053119869 = 16819, FIX_2_562915447 = 20995, FIX_3_072711026 = 25172 };
+#define JPGD_DESCALE(x, n) (((x) + (1 << ((n) - 1))) >> (n))
+
+    // One 8 point IDCT of s[0], s[step] .. s[7 * step], scaled by 2^CONST_BITS.
+    static inline void idct_1d(const int32 *s, int step, int32 *pOut)
+    {
+        const int32 s0 = s[0], s1 = s[step], s2 = s[2 * step], s3 = s[3 * step];
+        const int32 s4 = s[4 * step], s5 = s[5 * step], s6 = s[6 * step], s7 = s[7 * step];
+
+        const int32 z1 = (s2 + s6) * FIX_0_541196100;
+        const int32 t2 = z1 - s6 * FIX_1_847759065, t3 = z1 + s2 * FIX_0_765366865;
+        const int32 t0 = (s0 + s4) * (1 << CONST_BITS), t1 = (s0 - s4) * (1 << CONST_BITS);
+        const int32 t10 = t0 + t3, t13 = t0 - t3, t11 = t1 + t2, t12 = t1 - t2;
+
+        const int32 z5 = (s7 + s5 + s3 + s1) * FIX_1_175875602;
+        const int32 za = (s7 + s1) * -FIX_0_899976223, zb = (s5 + s3) * -FIX_2_562915447;
+        const int32 zc = (s7 + s3) * -FIX_1_961570560 + z5, zd = (s5 + s1) * -FIX_0_390180644 + z5;
+        const int32 o0 = s7 * FIX_0_298631336 + za + zc, o1 = s5 * FIX_2_053119869 + zb + zd;
+        const int32 o2 = s3 * FIX_3_072711026 + zb + zc, o3 = s1 * FIX_1_501321110 + za + zd;
+
+        pOut[0] = t10 + o3; pOut[7] = t10 - o3;
+        pOut[1] = t11 + o2; pOut[6] = t11 - o2;
+        pOut[2] = t12 + o1; pOut[5] = t12 - o1;
+        pOut[3] = t13 + o0; pOut[4] = t13 - o0;
+    }
+
+    static void idct_8x8(const int32 *pSrc, uint8 *pDst, uint stride)
+    {
+        int32 ws[64], t[8];
+        for (int c = 0; c < 8; c++)
+        {
+            const int32 *s = pSrc + c;
+            int32 *w = ws + c;
+            if (!(s[8] | s[16] | s[24] | s[32] | s[40] | s[48] | s[56]))
+            {
+                const int32 dc = s[0] * (1 << PASS1_BITS);
+                for (int i = 0; i < 8; i++)
+                    w[i * 8] = dc;
+                continue;
+            }
+            idct_1d(s, 8, t);
+            for (int i = 0; i < 8; i++)
+                w[i * 8] = JPGD_DESCALE(t[i], CONST_BITS - PASS1_BITS);
+        }
+        for (int r = 0; r < 8; r++, pDst += stride)
+        {
+            idct_1d(ws + r * 8, 1, t);
+            for (int i = 0; i < 8; i++)
+                pDst[i] = clamp(JPGD_DESCALE(t[i] + (128 << (CONST_BITS + PASS1_BITS + 3)), CONST_BITS + PASS1_BITS + 3));
+        }
+    }
+
+    // Box filtered IDCTs for the 1/2 and 1/4 scales: each output sample is the mean of a 2x2 (4x4) square of the full
+    // IDCT. The 1D transform rows are the averaged cos((2x + 1) u pi / 16), DC weighted 1 / sqrt(2), times 2^CONST_BITS;
+    // the second half of the outputs mirrors the first with the sign of the odd u flipped. u = 4 drops out of both,
+    // u = 2 and 6 out of the 1/4 one.
+    static inline void box4_1d(const int32 *s, int step, int32 *pOut)
+    {
+        const int32 s0 = s[0], s1 = s[step], s2 = s[2 * step], s3 = s[3 * step];
+        const int32 s5 = s[5 * step], s6 = s[6 * step], s7 = s[7 * step];
+        const int32 e0 = s0 * 5793 + s2 * 5352 - s6 * 2217, e1 = s0 * 5793 - s2 * 5352 + s6 * 2217;
+        const int32 o0 = s1 * 7423 + s3 * 2607 - s5 * 1742 - s7 * 1477;
+        const int32 o1 = s1 * 3075 - s3 * 6293 + s5 * 4205 - s7 * 612;
+        pOut[0] = e0 + o0; pOut[3] = e0 - o0;
+        pOut[1] = e1 + o1; pOut[2] = e1 - o1;
+    }
+
+    static inline void box2_1d(const int32 *s, int step, int32 *pOut)
+    {
+        const int32 e = s[0] * 5793;
+        const int32 o = s[step] * 5249 - s[3 * step] * 1843 + s[5 * step] * 1232 - s[7 * step] * 1044;
+        pOut[0] = e + o; pOut[1] = e - o;
+    }
+
+    // The 2D box transforms are 4 times the sample mean instead of 8 (two DC weights of 1 / sqrt(2) instead of 1).
+    static void idct_4x4(const int32 *pSrc, uint8 *pDst, uint stride)
+    {
+        int32 ws[32], t[4];
+        for (int c = 0; c < 8; c++)
+        {
+            box4_1d(pSrc + c, 8, t);
+            for (int i = 0; i < 4; i++)
+                ws[i * 8 + c] = JPGD_DESCALE(t[i], CONST_BITS - PASS1_BITS);
+        }
+        for (int r = 0; r < 4; r++, pDst += stride)
+        {
+            box4_1d(ws + r * 8, 1, t);
+            for (int i = 0; i < 4; i++)
+                pDst[i] = clamp(JPGD_DESCALE(t[i] + (128 << (CONST_BITS + PASS1_BITS + 2)), CONST_BITS + PASS1_BITS + 2));
+        }
+    }
+
+    static void idct_2x2(const int32 *pSrc, uint8 *pDst, uint stride)
+    {
+        int32 ws[16], t[2];
+        for (int c = 0; c < 8; c++)
+        {
+            box2_1d(pSrc + c, 8, t);
+            ws[c] = JPGD_DESCALE(t[0], CONST_BITS - PASS1_BITS);
+            ws[8 + c] = JPGD_DESCALE(t[1], CONST_BITS - PASS1_BITS);
+        }
+        for (int r = 0; r < 2; r++, pDst += stride)
+        {
+            box2_1d(ws + r * 8, 1, t);
+            pDst[0] = clamp(JPGD_DESCALE(t[0] + (128 << (CONST_BITS + PASS1_BITS + 2)), CONST_BITS + PASS1_BITS + 2));
+            pDst[1] = clamp(JPGD_DESCALE(t[1] + (128 << (CONST_BITS + PASS1_BITS + 2)), CONST_BITS + PASS1_BITS + 2));
+        }
+    }
+
+    void jpeg_decoder::store_block(const int32 *pCoef, int last, uint8 *pDst, uint stride)
+    {
+        const int size = 8 >> m_scale_shift;
+        if (!last)
+        {
+            // flat block, the mean is DC / 8
+            const uint8 v = clamp(JPGD_DESCALE(pCoef[0], 3) + 128);
+            for (int r = 0; r < size; r++, pDst += stride)
+                memset(pDst, v, size);
+            return;
+        }
+        switch (m_scale_shift)
+        {
+        case 0: idct_8x8(pCoef, pDst, stride); break;
+        case 1: idct_4x4(pCoef, pDst, stride); break;
+        default: idct_2x2(pCoef, pDst, stride); break;
+        }
+    }
+
+#undef JPGD_DESCALE
+
+    // Entropy decoding. Bytes are shifted in until the buffer holds more than 24 bits. Stuffed zero bytes after 0xFF
+    // are dropped; at a marker the reader stops and feeds zero bits, so corrupt data can't run past the segment.
+    inline void jpeg_decoder::fill_bit_buf()
+    {
+        while (m_bits_left <= 24)
+        {
+            uint c = 0;
+            if ((!m_marker_hit) && (m_pIn < m_pIn_end))
+            {
+                c = *m_pIn;
+                if (c != 0xFF)
+                {
+                    m_pIn++;
+                }
+                else if ((m_pIn + 1 < m_pIn_end) && (m_pIn[1] == 0))
+                {
+                    m_pIn += 2;
+                }
+                else
+                {
+                    m_marker_hit = true;
+                    c = 0;
+                }
+            }
+            m_bit_buf |= c << (24 - m_bits_left);
+            m_bits_left += 8;
+        }
+    }
+
+    // num_bits: 1..16
+    inline uint jpeg_decoder::get_bits(int num_bits)
+    {
+        if (m_bits_left < num_bits)
+            fill_bit_buf();
+        const uint v = m_bit_buf >> (32 - num_bits);
+        m_bit_buf <<= num_bits;
+        m_bits_left -= num_bits;
+        return v;
+    }
+
+    inline int jpeg_decoder::decode_symbol(const huff_table &h)
+    {
+        if (m_bits_left < 16)
+            fill_bit_buf();
+        const uint e = h.m_look[m_bit_buf >> (32 - JPGD_HUFF_LOOKAHEAD)];
+        if (e)
+        {
+            const int l = e >> 8;
+            m_bit_buf <<= l;
+            m_bits_left -= l;
+            return e & 0xFF;
+        }
+        for (int l = JPGD_HUFF_LOOKAHEAD + 1; l <= 16; l++)
+        {
+            const int32 code = m_bit_buf >> (32 - l);
+            if (code <= h.m_maxcode[l])
+            {
+                m_bit_buf <<= l;
+                m_bits_left -= l;
+                return h.m_vals[h.m_valoffset[l] + code];
+            }
+        }
+        return -1;
+    }
+
+    // Decodes one block into pCoef and returns the zigzag index of its last non zero coefficient in *pLast.
+    // At 1/8 scale the AC coefficients are only skipped.
+    bool jpeg_decoder::decode_block(component &c, int32 *pCoef, int *pLast)
+    {
+        const uint16 *q = m_quant[c.m_quant];
+        int s = decode_symbol(m_huff[0][c.m_dc_tab]);
+        if ((s < 0) || (s > 11))
+            return false;
+        if (s)
+            c.m_last_dc += extend(get_bits(s), s);
+        pCoef[0] = c.m_last_dc * q[0];
+
+        const huff_table &ac = m_huff[1][c.m_ac_tab];
+        const bool store = m_scale_shift < JPGD_MAX_SCALE_SHIFT;
+        int last = 0;
+        for (int k = 1; k < 64; k++)
+        {
+            if (m_bits_left < 16)
+                fill_bit_buf();
+            const int fast = ac.m_fast_ac[m_bit_buf >> (32 - JPGD_HUFF_LOOKAHEAD)];
+            if (fast)
+            {
+                const int l = fast & 15;
+                m_bit_buf <<= l;
+                m_bits_left -= l;
+                k += (fast >> 4) & 15;
+                if (k > 63)
+                    return false;
+                if (store)
+                {
+                    pCoef[s_zag[k]] = (fast >> 8) * q[k];
+                    last = k;
+                }
+                continue;
+            }
+
+            const int rs = decode_symbol(ac);
+            if (rs < 0)
+                return false;
+            s = rs & 15;
+            if (s)
+            {
+                k += rs >> 4;
+                if (k > 63)
+                    return false;
+                const int32 v = extend(get_bits(s), s);
+                if (store)
+                {
+                    pCoef[s_zag[k]] = v * q[k];
+                    last = k;
+                }
+            }
+            else
+            {
+                if (rs != 0xF0)
+                    break;
+                k += 15;
+            }
+        }
+        *pLast = last;
+        return true;
+    }
+
+    // The bits up to the marker are padding. Restart markers are taken in any order, only the position matters.
+    bool jpeg_decoder::process_restart()
+    {
+        m_bit_buf = 0;
+        m_bits_left = 0;
+        m_marker_hit = false;
+        for ( ; m_pIn + 1 < m_pIn_end; m_pIn++)
+        {
+            if ((m_pIn[0] == 0xFF) && (m_pIn[1] >= M_RST0) && (m_pIn[1] <= M_RST7))
+            {
+                m_pIn += 2;
+                for (int i = 0; i < m_comps_in_frame; i++)
+                    m_comp[i].m_last_dc = 0;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Takes the restart marker that is due before the next MCU, if any.
+    inline bool jpeg_decoder::start_mcu()
+    {
+        if (m_restart_interval)
+        {
+            if (!m_restarts_left)
+            {
+                if (!process_restart())
+                    return false;
+                m_restarts_left = m_restart_interval;
+            }
+            m_restarts_left--;
+        }
+        return true;
+    }
+
+    // decode_block() for the coefficient interface: quantized values in zigzag order, limited to baseline ranges
+    // so that they can be coded again.
+    bool jpeg_decoder::decode_block_coefficients(component &c, int16 *pZZ)
+    {
+        int s = decode_symbol(m_huff[0][c.m_dc_tab]);
+        if ((s < 0) || (s > 11))
+            return false;
+        if (s)
+            c.m_last_dc += extend(get_bits(s), s);
+        if ((c.m_last_dc < -1024) || (c.m_last_dc > 1023))
+            return false;
+        pZZ[0] = static_cast<int16>(c.m_last_dc);
+        memset(pZZ + 1, 0, 63 * sizeof(int16));
+
+        const huff_table &ac = m_huff[1][c.m_ac_tab];
+        for (int k = 1; k < 64; k++)
+        {
+            if (m_bits_left < 16)
+                fill_bit_buf();
+            const int fast = ac.m_fast_ac[m_bit_buf >> (32 - JPGD_HUFF_LOOKAHEAD)];
+            if (fast)
+            {
+                const int l = fast & 15;
+                m_bit_buf <<= l;
+                m_bits_left -= l;
+                k += (fast >> 4) & 15;
+                if (k > 63)
+                    return false;
+                pZZ[k] = static_cast<int16>(fast >> 8);
+                continue;
+            }
+
+            const int rs = decode_symbol(ac);
+            if (rs < 0)
+                return false;
+            s = rs & 15;
+            if (s)
+            {
+                k += rs >> 4;
+                if ((k > 63) || (s > 10))
+                    return false;
+                pZZ[k] = static_cast<int16>(extend(get_bits(s), s));
+            }
+            else
+            {
+                if (rs != 0xF0)
+                    break;
+                k += 15;
+            }
+        }
+        return true;
+    }
+
+    bool jpeg_decoder::decode_mcu_coefficients(int16 *pBlocks)
+    {
+        if ((!m_comps_in_frame) || (!m_pIn) || (!start_mcu()))
+            return false;
+        for (int ci = 0; ci < m_comps_in_frame; ci++)
+        {
+            component &c = m_comp[ci];
+            for (int n = c.m_h * c.m_v; n; n--, pBlocks += 64)
+            {
+                if (!decode_block_coefficients(c, pBlocks))
+                    return false;
+            }
+        }
+        return true;
+    }
+
+    void jpeg_decoder::get_position(position *pPos) const
+    {
+        pPos->m_pIn = m_pIn;
+        pPos->m_bit_buf = m_bit_buf;
+        for (int i = 0; i < JPGD_MAX_COMPONENTS; i++)
+            pPos->m_last_dc[i] = static_cast<int16>(m_comp[i].m_last_dc);
+        pPos->m_restarts_left = static_cast<uint16>(m_restarts_left);
+        pPos->m_bits_left = static_cast<int16>(m_bits_left);
+        pPos->m_marker_hit = m_marker_hit;
+    }
+
+    void jpeg_decoder::set_position(const position &pos)
+    {
+        m_pIn = pos.m_pIn;
+        m_bit_buf = pos.m_bit_buf;
+        for (int i = 0; i < JPGD_MAX_COMPONENTS; i++)
+            m_comp[i].m_last_dc = pos.m_last_dc[i];
+        m_restarts_left = pos.m_restarts_left;
+        m_bits_left = pos.m_bits_left;
+        m_marker_hit = pos.m_marker_hit;
+    }
+
+    // Chroma planes are upsampled by repeating samples.
+    void jpeg_decoder::convert_lines(int num_lines)
+    {
+        const uint out_stride = m_out_x * 3;
+        uint8 *pDst = m_pOut;
+        const component &y = m_comp[0];
+        if (m_comps_in_frame == 1)
+        {
+            for (int l = 0; l < num_lines; l++, pDst += out_stride)
+            {
+                const uint8 *pY = y.m_pPlane + l * y.m_plane_stride;
+                uint8 *d = pDst;
+                for (int x = 0; x < m_out_x; x++, d += 3)
+                    d[0] = d[1] = d[2] = pY[x];
+            }
+            return;
+        }
+
+        const int v_shift = m_max_v - 1, h_shift = m_max_h - 1;
+        for (int l = 0; l < num_lines; l++, pDst += out_stride)
+        {
+            const uint8 *pY = y.m_pPlane + l * y.m_plane_stride;
+            const uint8 *pCb = m_comp[1].m_pPlane + (l >> v_shift) * m_comp[1].m_plane_stride;
+            const uint8 *pCr = m_comp[2].m_pPlane + (l >> v_shift) * m_comp[2].m_plane_stride;
+            uint8 *d = pDst;
+            for (int x = 0; x < m_out_x; x++, d += 3)
+            {
+                const int yy = pY[x], cb = pCb[x >> h_shift], cr = pCr[x >> h_shift];
+                d[0] = clamp(yy + s_cb_b[cb]);
+                d[1] = clamp(yy + ((s_cb_g[cb] + s_cr_g[cr]) >> 16));
+                d[2] = clamp(yy + s_cr_r[cr]);
+            }
+        }
+    }
+
+    int jpeg_decoder::decode_mcu_row(const uint8 **pLines)
+    {
+        if (!m_pMem)
+            return -1;
+        if (m_mcu_row >= m_mcu_rows)
+            return 0;
+
+        const int size = 8 >> m_scale_shift;
+        for (int mx = 0; mx < m_mcus_per_row; mx++)
+        {
+            if (!start_mcu())
+                return -1;
+            for (int ci = 0; ci < m_comps_in_frame; ci++)
+            {
+                component &c = m_comp[ci];
+                uint8 *pDst = c.m_pPlane + mx * c.m_h * size;
+                for (int by = 0; by < c.m_v; by++, pDst += size * c.m_plane_stride)
+                {
+                    for (int bx = 0; bx < c.m_h; bx++)
+                    {
+                        int last;
+                        if (!decode_block(c, m_pCoef, &last))
+                            return -1;
+                        store_block(m_pCoef, last, pDst + bx * size, c.m_plane_stride);
+                        for (int k = 0; k <= last; k++)
+                            m_pCoef[s_zag[k]] = 0;
+                    }
+                }
+            }
+        }
+
+        const int mcu_lines = m_max_v * size;
+        const int num_lines = JPGD_MIN(mcu_lines, m_out_y - m_mcu_row * mcu_lines);
+        convert_lines(num_lines);
+        m_mcu_row++;
+        *pLines = m_pOut;
+        return num_lines;
+    }
+
+    // Headers.
+    bool jpeg_decoder::read_sof(const uint8 *p, uint len)
+    {
+        if ((len < 6) || (p[0] != 8))
+            return false;
+        m_image_y = read_word(p + 1);
+        m_image_x = read_word(p + 3);
+        m_comps_in_frame = p[5];
+        // a zero height would come later in a DNL marker
+        if ((!m_image_x) || (!m_image_y) || ((m_comps_in_frame != 1) && (m_comps_in_frame != 3)) || (len < 6U + m_comps_in_frame * 3U))
+            return false;
+        for (int i = 0; i < m_comps_in_frame; i++)
+        {
+            component &c = m_comp[i];
+            const uint8 *s = p + 6 + i * 3;
+            c.m_id = s[0];
+            c.m_h = s[1] >> 4;
+            c.m_v = s[1] & 15;
+            c.m_quant = s[2];
+            if (c.m_quant >= JPGD_MAX_QUANT_TABLES)
+                return false;
+        }
+        if (m_comps_in_frame == 1)
+        {
+            // a single component scan has one block per MCU, whatever the sampling factors say
+            m_comp[0].m_h = m_comp[0].m_v = 1;
+        }
+        else
+        {
+            if ((m_comp[0].m_h < 1) || (m_comp[0].m_h > 2) || (m_comp[0].m_v < 1) || (m_comp[0].m_v > 2))
+                return false;
+            for (int i = 1; i < 3; i++)
+                if ((m_comp[i].m_h != 1) || (m_comp[i].m_v != 1))
+                    return false;
+        }
+        m_max_h = m_comp[0].m_h;
+        m_max_v = m_comp[0].m_v;
+        return true;
+    }
+
+    bool jpeg_decoder::read_dht(const uint8 *p, uint len)
+    {
+        while (len)
+        {
+            if (len < 17)
+                return false;
+            const uint tc = p[0] >> 4, th = p[0] & 15;
+            if ((tc > 1) || (th >= JPGD_MAX_HUFF_TABLES))
+                return false;
+            uint count = 0;
+            for (int l = 1; l <= 16; l++)
+                count += p[l];
+            if ((count > 256) || (len < 17 + count))
+                return false;
+
+            huff_table &h = m_huff[tc][th];
+            const uint8 *pVals = p + 17;
+            memset(h.m_look, 0, sizeof(h.m_look));
+            uint code = 0, k = 0;
+            for (int l = 1; l <= 16; l++)
+            {
+                const uint n = p[l];
+                if (code + n > (1U << l))
+                    return false;
+                h.m_valoffset[l] = static_cast<int32>(k) - static_cast<int32>(code);
+                h.m_maxcode[l] = n ? static_cast<int32>(code + n - 1) : -1;
+                for (uint i = 0; i < n; i++, code++, k++)
+                {
+                    if (l > JPGD_HUFF_LOOKAHEAD)
+                        continue;
+                    const uint shift = JPGD_HUFF_LOOKAHEAD - l;
+                    const uint16 e = static_cast<uint16>((l << 8) | pVals[k]);
+                    for (uint j = 0; j < (1U << shift); j++)
+                        h.m_look[(code << shift) + j] = e;
+                }
+                code <<= 1;
+            }
+            memcpy(h.m_vals, pVals, count);
+
+            for (uint i = 0; i < (1U << JPGD_HUFF_LOOKAHEAD); i++)
+            {
+                const uint e = h.m_look[i], l = e >> 8, s = e & 15;
+                h.m_fast_ac[i] = 0;
+                if ((!s) || (l + s > JPGD_HUFF_LOOKAHEAD))
+                    continue;
+                const int32 v = extend((i >> (JPGD_HUFF_LOOKAHEAD - l - s)) & ((1U << s) - 1), s);
+                if ((v >= -128) && (v < 128))
+                    h.m_fast_ac[i] = static_cast<int16>((v * 256) | (e & 0xF0) | (l + s));
+            }
+            h.m_present = true;
+            p += 17 + count;
+            len -= 17 + count;
+        }
+        return true;
+    }
+
+    bool jpeg_decoder::read_dqt(const uint8 *p, uint len)
+    {
+        while (len)
+        {
+            const uint pq = p[0] >> 4, tq = p[0] & 15;
+            const uint n = pq ? 129 : 65;
+            if ((pq > 1) || (tq >= JPGD_MAX_QUANT_TABLES) || (len < n))
+                return false;
+            for (int k = 0; k < 64; k++)
+                m_quant[tq][k] = static_cast<uint16>(pq ? read_word(p + 1 + k * 2) : p[1 + k]);
+            m_quant_present[tq] = true;
+            p += n;
+            len -= n;
+        }
+        return true;
+    }
+
+    // Only a single scan with all components interleaved in frame order is supported.
+    bool jpeg_decoder::read_sos(const uint8 *p, uint len)
+    {
+        if ((len < 1) || (p[0] != m_comps_in_frame) || (len < 4U + m_comps_in_frame * 2U))
+            return false;
+        for (int i = 0; i < m_comps_in_frame; i++)
+        {
+            component &c = m_comp[i];
+            const uint8 *s = p + 1 + i * 2;
+            c.m_dc_tab = s[1] >> 4;
+            c.m_ac_tab = s[1] & 15;
+            if ((s[0] != c.m_id) || (c.m_dc_tab >= JPGD_MAX_HUFF_TABLES) || (c.m_ac_tab >= JPGD_MAX_HUFF_TABLES))
+                return false;
+            if ((!m_huff[0][c.m_dc_tab].m_present) || (!m_huff[1][c.m_ac_tab].m_present) || (!m_quant_present[c.m_quant]))
+                return false;
+            c.m_last_dc = 0;
+        }
+        const uint8 *s = p + 1 + m_comps_in_frame * 2;
+        return (s[0] == 0) && (s[1] == 63) && (s[2] == 0);
+    }
+
+    bool jpeg_decoder::read_headers(const uint8 *pData, uint len)
+    {
+        const uint8 *p = pData, *pEnd = pData + len;
+        if ((len < 4) || (p[0] != 0xFF) || (p[1] != M_SOI))
+            return false;
+        p += 2;
+        for ( ; ; )
+        {
+            while ((p < pEnd) && (*p != 0xFF))
+                p++;
+            while ((p < pEnd) && (*p == 0xFF))
+                p++;
+            if (p >= pEnd)
+                return false;
+            const uint m = *p++;
+            if ((m == M_TEM) || ((m >= M_RST0) && (m <= M_RST7)))
+                continue;
+            if ((m == M_EOI) || (pEnd - p < 2))
+                return false;
+            const uint seg_len = read_word(p);
+            if ((seg_len < 2) || (seg_len > static_cast<uint>(pEnd - p)))
+                return false;
+            const uint8 *s = p + 2;
+            const uint l = seg_len - 2;
+            p += seg_len;
+
+            bool ok = true;
+            if ((m == M_SOF0) || (m == M_SOF1))
+            {
+                ok = read_sof(s, l);
+            }
+            else if ((m > M_SOF1) && (m <= M_SOF15) && (m != M_DHT) && (m != M_JPG) && (m != M_DAC))
+            {
+                // progressive, lossless or arithmetic coded
+                ok = false;
+            }
+            else if (m == M_DHT)
+            {
+                ok = read_dht(s, l);
+            }
+            else if (m == M_DQT)
+            {
+                ok = read_dqt(s, l);
+            }
+            else if (m == M_DRI)
+            {
+                ok = l >= 2;
+                if (ok)
+                    m_restart_interval = read_word(s);
+            }
+            else if (m == M_SOS)
+            {
+                if ((!m_comps_in_frame) || (!read_sos(s, l)))
+                    return false;
+                m_pIn = p;
+                m_pIn_end = pEnd;
+                return true;
+            }
+            if (!ok)
+                return false;
+        }
+    }
+
+    void jpeg_decoder::clear()
+    {
+        m_pIn = m_pIn_end = NULL;
+        m_bit_buf = 0;
+        m_bits_left = 0;
+        m_marker_hit = false;
+        m_image_x = m_image_y = 0;
+        m_scale_shift = m_out_x = m_out_y = 0;
+        m_comps_in_frame = 0;
+        m_max_h = m_max_v = 1;
+        m_mcus_per_row = m_mcu_rows = m_mcu_row = 0;
+        m_restart_interval = m_restarts_left = 0;
+        memset(m_quant_present, 0, sizeof(m_quant_present));
+        for (int i = 0; i < JPGD_MAX_HUFF_TABLES; i++)
+            m_huff[0][i].m_present = m_huff[1][i].m_present = false;
+        m_pMem = NULL;
+        m_pCoef = NULL;
+        m_pOut = NULL;
+    }
+
+    jpeg_decoder::jpeg_decoder()
+    {
+        clear();
+    }
+
+    jpeg_decoder::~jpeg_decoder()
+    {
+        deinit();
+    }
+
+    bool jpeg_decoder::init_coefficients(const uint8 *pData, uint len)
+    {
+        deinit();
+        if ((!pData) || (!read_headers(pData, len)))
+        {
+            deinit();
+            return false;
+        }
+        m_out_x = m_image_x;
+        m_out_y = m_image_y;
+        m_mcus_per_row = (m_image_x + m_max_h * 8 - 1) / (m_max_h * 8);
+        m_mcu_rows = (m_image_y + m_max_v * 8 - 1) / (m_max_v * 8);
+        m_restarts_left = m_restart_interval;
+        return true;
+    }
+
+    bool jpeg_decoder::init(const uint8 *pData, uint len, int scale_shift)
+    {
+        if ((scale_shift < 0) || (scale_shift > JPGD_MAX_SCALE_SHIFT) || (!init_coefficients(pData, len)))
+        {
+            deinit();
+            return false;
+        }
+
+        m_scale_shift = scale_shift;
+        m_out_x = (m_image_x + (1 << scale_shift) - 1) >> scale_shift;
+        m_out_y = (m_image_y + (1 << scale_shift) - 1) >> scale_shift;
+
+        // coefficients first for their alignment, then the planes of one MCU row and its BGR lines
+        const uint size = 8 >> scale_shift;
+        uint mem_size = 64 * sizeof(int32);
+        for (int i = 0; i < m_comps_in_frame; i++)
+        {
+            m_comp[i].m_plane_stride = m_mcus_per_row * m_comp[i].m_h * size;
+            mem_size += m_comp[i].m_plane_stride * m_comp[i].m_v * size;
+        }
+        mem_size += m_out_x * 3 * m_max_v * size;
+        m_pMem = static_cast<uint8*>(jpgd_malloc(mem_size));
+        if (!m_pMem)
+        {
+            deinit();
+            return false;
+        }
+
+        uint8 *p = m_pMem;
+        m_pCoef = reinterpret_cast<int32*>(p);
+        memset(m_pCoef, 0, 64 * sizeof(int32));
+        p += 64 * sizeof(int32);
+        for (int i = 0; i < m_comps_in_frame; i++)
+        {
+            m_comp[i].m_pPlane = p;
+            p += m_comp[i].m_plane_stride * m_comp[i].m_v * size;
+        }
+        m_pOut = p;
+        return true;
+    }
+
+    // The decoder holds about 10 KB of tables, too much for the stack of most tasks.
+    bool jpeg_decoder::get_size(const uint8 *pData, uint len, int scale_shift, int *pWidth, int *pHeight)
+    {
+        if ((!pData) || (scale_shift < 0) || (scale_shift > JPGD_MAX_SCALE_SHIFT))
+            return false;
+        void *pMem = jpgd_malloc(sizeof(jpeg_decoder));
+        if (!pMem)
+            return false;
+        jpeg_decoder *d = new (pMem) jpeg_decoder;
+        const bool ok = d->read_headers(pData, len);
+        if (ok)
+        {
+            *pWidth = (d->m_image_x + (1 << scale_shift) - 1) >> scale_shift;
+            *pHeight = (d->m_image_y + (1 << scale_shift) - 1) >> scale_shift;
+        }
+        d->~jpeg_decoder();
+        jpgd_free(pMem);
+        return ok;
+    }
+
+    void jpeg_decoder::deinit()
+    {
+        jpgd_free(m_pMem);
+        clear();
+    }
+
+} // namespace jpgd
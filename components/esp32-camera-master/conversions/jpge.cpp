@@ -17,10 +17,27 @@
 #include <stdio.h>
 #include <string.h>
 #include <malloc.h>
+#include <new>
+#include <pthread.h>
 #include "esp_heap_caps.h"
 
+// SIMD kernels are only built for x86 hosts (SSE2 is baseline there, AVX2 is picked at runtime).
+// The Xtensa build always uses the scalar code. Define JPGE_NO_SIMD to force the scalar path.
+#if !defined(JPGE_NO_SIMD) && defined(__SSE2__)
+#include <emmintrin.h>
+#define JPGE_USE_SSE2 1
+#endif
+#if JPGE_USE_SSE2 && defined(__GNUC__)
+#include <immintrin.h>
+#define JPGE_USE_AVX2 1
+#endif
+
 #define JPGE_MAX(a,b) (((a)>(b))?(a):(b))
 #define JPGE_MIN(a,b) (((a)<(b))?(a):(b))
+// Magnitude category (number of significant bits) of a non negative value, and trailing zero count of a non zero
+// 64-bit mask. GCC maps these to NSAU on Xtensa and to LZCNT/TZCNT/BSR/BSF on x86.
+#define JPGE_NBITS(v) ((v) ? 32 - __builtin_clz(static_cast<uint32>(v)) : 0)
+#define JPGE_CTZ64(v) __builtin_ctzll(v)
 
 namespace jpge {
 
@@ -34,16 +51,16 @@ namespace jpge {
     static inline void jpge_free(void *p) { free(p); }
 
     // Various JPEG enums and tables.
-    enum { M_SOF0 = 0xC0, M_DHT = 0xC4, M_SOI = 0xD8, M_EOI = 0xD9, M_SOS = 0xDA, M_DQT = 0xDB, M_APP0 = 0xE0 };
+    enum { M_SOF0 = 0xC0, M_SOF1 = 0xC1, M_DHT = 0xC4, M_RST0 = 0xD0, M_SOI = 0xD8, M_EOI = 0xD9, M_SOS = 0xDA, M_DQT = 0xDB, M_DRI = 0xDD, M_APP0 = 0xE0 };
     enum { DC_LUM_CODES = 12, AC_LUM_CODES = 256, DC_CHROMA_CODES = 12, AC_CHROMA_CODES = 256, MAX_HUFF_SYMBOLS = 257, MAX_HUFF_CODESIZE = 32 };
 
     static const uint8 s_zag[64] = { 0,1,8,16,9,2,3,10,17,24,32,25,18,11,4,5,12,19,26,33,40,48,41,34,27,20,13,6,7,14,21,28,35,42,49,56,57,50,43,36,29,22,15,23,30,37,44,51,58,59,52,45,38,31,39,46,53,60,61,54,47,55,62,63 };
     static const int16 s_std_lum_quant[64] = { 16,11,12,14,12,10,16,14,13,14,18,17,16,19,24,40,26,24,22,22,24,49,35,37,29,40,58,51,61,60,57,51,56,55,64,72,92,78,64,68,87,69,55,56,80,109,81,87,95,98,103,104,103,62,77,113,121,112,100,120,92,101,103,99 };
     static const int16 s_std_croma_quant[64] = { 17,18,18,24,21,24,47,26,26,47,99,66,56,66,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99 };
-    static const uint8 s_dc_lum_bits[17] = { 0,0,1,5,1,1,1,1,1,1,0,0,0,0,0,0,0 };
-    static const uint8 s_dc_lum_val[DC_LUM_CODES] = { 0,1,2,3,4,5,6,7,8,9,10,11 };
-    static const uint8 s_ac_lum_bits[17] = { 0,0,2,1,3,3,2,4,3,5,5,4,4,0,0,1,0x7d };
-    static const uint8 s_ac_lum_val[AC_LUM_CODES]  = {
+    static constexpr uint8 s_dc_lum_bits[17] = { 0,0,1,5,1,1,1,1,1,1,0,0,0,0,0,0,0 };
+    static constexpr uint8 s_dc_lum_val[DC_LUM_CODES] = { 0,1,2,3,4,5,6,7,8,9,10,11 };
+    static constexpr uint8 s_ac_lum_bits[17] = { 0,0,2,1,3,3,2,4,3,5,5,4,4,0,0,1,0x7d };
+    static constexpr uint8 s_ac_lum_val[AC_LUM_CODES]  = {
         0x01,0x02,0x03,0x00,0x04,0x11,0x05,0x12,0x21,0x31,0x41,0x06,0x13,0x51,0x61,0x07,0x22,0x71,0x14,0x32,0x81,0x91,0xa1,0x08,0x23,0x42,0xb1,0xc1,0x15,0x52,0xd1,0xf0,
         0x24,0x33,0x62,0x72,0x82,0x09,0x0a,0x16,0x17,0x18,0x19,0x1a,0x25,0x26,0x27,0x28,0x29,0x2a,0x34,0x35,0x36,0x37,0x38,0x39,0x3a,0x43,0x44,0x45,0x46,0x47,0x48,0x49,
         0x4a,0x53,0x54,0x55,0x56,0x57,0x58,0x59,0x5a,0x63,0x64,0x65,0x66,0x67,0x68,0x69,0x6a,0x73,0x74,0x75,0x76,0x77,0x78,0x79,0x7a,0x83,0x84,0x85,0x86,0x87,0x88,0x89,
@@ -51,10 +68,10 @@ namespace jpge {
         0xc6,0xc7,0xc8,0xc9,0xca,0xd2,0xd3,0xd4,0xd5,0xd6,0xd7,0xd8,0xd9,0xda,0xe1,0xe2,0xe3,0xe4,0xe5,0xe6,0xe7,0xe8,0xe9,0xea,0xf1,0xf2,0xf3,0xf4,0xf5,0xf6,0xf7,0xf8,
         0xf9,0xfa
     };
-    static const uint8 s_dc_chroma_bits[17] = { 0,0,3,1,1,1,1,1,1,1,1,1,0,0,0,0,0 };
-    static const uint8 s_dc_chroma_val[DC_CHROMA_CODES]  = { 0,1,2,3,4,5,6,7,8,9,10,11 };
-    static const uint8 s_ac_chroma_bits[17] = { 0,0,2,1,2,4,4,3,4,7,5,4,4,0,1,2,0x77 };
-    static const uint8 s_ac_chroma_val[AC_CHROMA_CODES] = {
+    static constexpr uint8 s_dc_chroma_bits[17] = { 0,0,3,1,1,1,1,1,1,1,1,1,0,0,0,0,0 };
+    static constexpr uint8 s_dc_chroma_val[DC_CHROMA_CODES]  = { 0,1,2,3,4,5,6,7,8,9,10,11 };
+    static constexpr uint8 s_ac_chroma_bits[17] = { 0,0,2,1,2,4,4,3,4,7,5,4,4,0,1,2,0x77 };
+    static constexpr uint8 s_ac_chroma_val[AC_CHROMA_CODES] = {
         0x00,0x01,0x02,0x03,0x11,0x04,0x05,0x21,0x31,0x06,0x12,0x41,0x51,0x07,0x61,0x71,0x13,0x22,0x32,0x81,0x08,0x14,0x42,0x91,0xa1,0xb1,0xc1,0x09,0x23,0x33,0x52,0xf0,
         0x15,0x62,0x72,0xd1,0x0a,0x16,0x24,0x34,0xe1,0x25,0xf1,0x17,0x18,0x19,0x1a,0x26,0x27,0x28,0x29,0x2a,0x35,0x36,0x37,0x38,0x39,0x3a,0x43,0x44,0x45,0x46,0x47,0x48,
         0x49,0x4a,0x53,0x54,0x55,0x56,0x57,0x58,0x59,0x5a,0x63,0x64,0x65,0x66,0x67,0x68,0x69,0x6a,0x73,0x74,0x75,0x76,0x77,0x78,0x79,0x7a,0x82,0x83,0x84,0x85,0x86,0x87,
@@ -65,14 +82,57 @@ namespace jpge {
 
     const int YR = 19595, YG = 38470, YB = 7471, CB_R = -11059, CB_G = -21709, CB_B = 32768, CR_R = 32768, CR_G = -27439, CR_B = -5329;
 
-    static int32 m_last_quality = 0;
-    static int32 m_quantization_tables[2][64];
+    // Canonical Huffman codes/code sizes of the standard tables (JPEG spec Annex C), evaluated at compile time so
+    // they are read-only data shared by all encoder instances. Symbol k of val[] has the k-th code in order of size.
+    static constexpr int huff_num_codes(const uint8 *bits, int l = 1)
+    {
+        return (l > 16) ? 0 : bits[l] + huff_num_codes(bits, l + 1);
+    }
+
+    static constexpr int huff_index(const uint8 *val, int num_codes, int sym, int k = 0)
+    {
+        return (k >= num_codes) ? -1 : ((val[k] == sym) ? k : huff_index(val, num_codes, sym, k + 1));
+    }
+
+    static constexpr uint8 huff_size_of(const uint8 *bits, int k, int l = 1, int first_k = 0)
+    {
+        return (l > 16) ? 0 : ((k < first_k + bits[l]) ? l : huff_size_of(bits, k, l + 1, first_k + bits[l]));
+    }
+
+    static constexpr uint huff_code_of(const uint8 *bits, int k, int l = 1, int first_k = 0, uint first_code = 0)
+    {
+        return (l > 16) ? 0 : ((k < first_k + bits[l]) ? first_code + (k - first_k) : huff_code_of(bits, k, l + 1, first_k + bits[l], (first_code + bits[l]) << 1));
+    }
+
+    static constexpr uint huff_code(const uint8 *bits, const uint8 *val, int sym)
+    {
+        return (huff_index(val, huff_num_codes(bits), sym) < 0) ? 0 : huff_code_of(bits, huff_index(val, huff_num_codes(bits), sym));
+    }
+
+    static constexpr uint8 huff_code_size(const uint8 *bits, const uint8 *val, int sym)
+    {
+        return (huff_index(val, huff_num_codes(bits), sym) < 0) ? 0 : huff_size_of(bits, huff_index(val, huff_num_codes(bits), sym));
+    }
+
+#define JPGE_REP4(M, t, i)   M(t, (i)), M(t, (i) + 1), M(t, (i) + 2), M(t, (i) + 3)
+#define JPGE_REP16(M, t, i)  JPGE_REP4(M, t, (i)), JPGE_REP4(M, t, (i) + 4), JPGE_REP4(M, t, (i) + 8), JPGE_REP4(M, t, (i) + 12)
+#define JPGE_REP64(M, t, i)  JPGE_REP16(M, t, (i)), JPGE_REP16(M, t, (i) + 16), JPGE_REP16(M, t, (i) + 32), JPGE_REP16(M, t, (i) + 48)
+#define JPGE_REP256(M, t)    JPGE_REP64(M, t, 0), JPGE_REP64(M, t, 64), JPGE_REP64(M, t, 128), JPGE_REP64(M, t, 192)
+#define JPGE_HUFF_CODE(t, i) huff_code(s_##t##_bits, s_##t##_val, i)
+#define JPGE_HUFF_SIZE(t, i) huff_code_size(s_##t##_bits, s_##t##_val, i)
+
+    // Indexed by [table][symbol], tables are 0 = DC luma, 1 = DC chroma, 2 = AC luma, 3 = AC chroma.
+    static constexpr uint s_huff_codes[4][256] = {
+        { JPGE_REP256(JPGE_HUFF_CODE, dc_lum) }, { JPGE_REP256(JPGE_HUFF_CODE, dc_chroma) },
+        { JPGE_REP256(JPGE_HUFF_CODE, ac_lum) }, { JPGE_REP256(JPGE_HUFF_CODE, ac_chroma) }
+    };
+    static constexpr uint8 s_huff_code_sizes[4][256] = {
+        { JPGE_REP256(JPGE_HUFF_SIZE, dc_lum) }, { JPGE_REP256(JPGE_HUFF_SIZE, dc_chroma) },
+        { JPGE_REP256(JPGE_HUFF_SIZE, ac_lum) }, { JPGE_REP256(JPGE_HUFF_SIZE, ac_chroma) }
+    };
 
-    static bool m_huff_initialized = false;
-    static uint m_huff_codes[4][256];
-    static uint8 m_huff_code_sizes[4][256];
-    static uint8 m_huff_bits[4][17];
-    static uint8 m_huff_val[4][256];
+#undef JPGE_HUFF_SIZE
+#undef JPGE_HUFF_CODE
 
     static inline uint8 clamp(int i) {
         if (i < 0) {
@@ -106,6 +166,53 @@ namespace jpge {
         }
     }
 
+    // The camera delivers limited range YCbCr (Y 16-235, CbCr 16-240), JFIF wants full range.
+    static constexpr uint8 yuv_clamp(int i)
+    {
+        return (i < 0) ? 0 : ((i > 255) ? 255 : i);
+    }
+    static constexpr uint8 yuv_full_y(int y)
+    {
+        return yuv_clamp(((y - 16) * 255 * 2 + ((y < 16) ? -219 : 219)) / (219 * 2));
+    }
+    static constexpr uint8 yuv_full_c(int c)
+    {
+        return yuv_clamp(128 + ((c - 128) * 255 * 2 + ((c < 128) ? -224 : 224)) / (224 * 2));
+    }
+
+#define JPGE_LUT(f, i) f(i)
+    static constexpr uint8 s_yuv_full_y[256] = { JPGE_REP256(JPGE_LUT, yuv_full_y) };
+    static constexpr uint8 s_yuv_full_c[256] = { JPGE_REP256(JPGE_LUT, yuv_full_c) };
+#undef JPGE_LUT
+#undef JPGE_REP256
+#undef JPGE_REP64
+#undef JPGE_REP16
+#undef JPGE_REP4
+
+    // YUYV (Y0 U Y1 V per pixel pair) to one YCbCr triple per pixel, the chroma loaders do the subsampling.
+    static void YUYV_to_YCC(uint8* pDst, const uint8 *pSrc, int num_pixels) {
+        for( ; num_pixels > 1; pDst += 6, pSrc += 4, num_pixels -= 2) {
+            const uint8 cb = s_yuv_full_c[pSrc[1]], cr = s_yuv_full_c[pSrc[3]];
+            pDst[0] = s_yuv_full_y[pSrc[0]];
+            pDst[1] = cb;
+            pDst[2] = cr;
+            pDst[3] = s_yuv_full_y[pSrc[2]];
+            pDst[4] = cb;
+            pDst[5] = cr;
+        }
+        if (num_pixels) { // odd width, the last pixel has no V sample of its own
+            pDst[0] = s_yuv_full_y[pSrc[0]];
+            pDst[1] = s_yuv_full_c[pSrc[1]];
+            pDst[2] = s_yuv_full_c[pSrc[1]];
+        }
+    }
+
+    static void YUYV_to_Y(uint8* pDst, const uint8 *pSrc, int num_pixels) {
+        for( ; num_pixels; pDst++, pSrc += 2, num_pixels--) {
+            pDst[0] = s_yuv_full_y[pSrc[0]];
+        }
+    }
+
     // Forward DCT - DCT derived from jfdctint.
     enum { CONST_BITS = 13, ROW_BITS = 2 };
 #define DCT_DESCALE(x, n) (((x) + (((int32)1) << ((n) - 1))) >> (n))
@@ -142,74 +249,598 @@ namespace jpge {
         }
     }
 
+#if JPGE_USE_SSE2
+    // 16-bit lane version: one row (or column) of 8 samples per register. For 8-bit input none of the int16
+    // casts in DCT_MUL() ever truncate, so the multiplies can be regrouped into pmaddwd pairs, e.g.
+    // s2 = (t12 + t13) * 4433 + t13 * 6270 = t12 * 4433 + t13 * 10703, with identical 32-bit results.
+#define SSE2_PAIR(ca, cb) _mm_set1_epi32(static_cast<uint16>(ca) | (static_cast<uint32>(static_cast<uint16>(cb)) << 16))
+#define SSE2_DESCALE(v, n) _mm_srai_epi32(_mm_add_epi32(v, _mm_set1_epi32(1 << ((n) - 1))), n)
+
+    static inline void transpose_8x8_epi16(__m128i *r)
+    {
+        __m128i a0 = _mm_unpacklo_epi16(r[0], r[1]), a1 = _mm_unpackhi_epi16(r[0], r[1]);
+        __m128i a2 = _mm_unpacklo_epi16(r[2], r[3]), a3 = _mm_unpackhi_epi16(r[2], r[3]);
+        __m128i a4 = _mm_unpacklo_epi16(r[4], r[5]), a5 = _mm_unpackhi_epi16(r[4], r[5]);
+        __m128i a6 = _mm_unpacklo_epi16(r[6], r[7]), a7 = _mm_unpackhi_epi16(r[6], r[7]);
+        __m128i b0 = _mm_unpacklo_epi32(a0, a2), b1 = _mm_unpackhi_epi32(a0, a2);
+        __m128i b2 = _mm_unpacklo_epi32(a1, a3), b3 = _mm_unpackhi_epi32(a1, a3);
+        __m128i b4 = _mm_unpacklo_epi32(a4, a6), b5 = _mm_unpackhi_epi32(a4, a6);
+        __m128i b6 = _mm_unpacklo_epi32(a5, a7), b7 = _mm_unpackhi_epi32(a5, a7);
+        r[0] = _mm_unpacklo_epi64(b0, b4); r[1] = _mm_unpackhi_epi64(b0, b4);
+        r[2] = _mm_unpacklo_epi64(b1, b5); r[3] = _mm_unpackhi_epi64(b1, b5);
+        r[4] = _mm_unpacklo_epi64(b2, b6); r[5] = _mm_unpackhi_epi64(b2, b6);
+        r[6] = _mm_unpacklo_epi64(b3, b7); r[7] = _mm_unpackhi_epi64(b3, b7);
+    }
+
+    // One 1D pass over 8 registers. Outputs are left as 32-bit low/high halves (lanes 0-3 and 4-7) in lo[]/hi[],
+    // except s0/s4 of the row pass which are done in 16 bits by the caller.
+    static inline void dct1d_epi16(const __m128i *s, __m128i *lo, __m128i *hi)
+    {
+        __m128i t0 = _mm_add_epi16(s[0], s[7]), t7 = _mm_sub_epi16(s[0], s[7]), t1 = _mm_add_epi16(s[1], s[6]), t6 = _mm_sub_epi16(s[1], s[6]);
+        __m128i t2 = _mm_add_epi16(s[2], s[5]), t5 = _mm_sub_epi16(s[2], s[5]), t3 = _mm_add_epi16(s[3], s[4]), t4 = _mm_sub_epi16(s[3], s[4]);
+        __m128i t10 = _mm_add_epi16(t0, t3), t13 = _mm_sub_epi16(t0, t3), t11 = _mm_add_epi16(t1, t2), t12 = _mm_sub_epi16(t1, t2);
+
+        // s0 = t10 + t11, s4 = t10 - t11 can exceed 16 bits in the column pass.
+        __m128i p_lo = _mm_unpacklo_epi16(t10, t11), p_hi = _mm_unpackhi_epi16(t10, t11);
+        lo[0] = _mm_madd_epi16(p_lo, SSE2_PAIR(1, 1)); hi[0] = _mm_madd_epi16(p_hi, SSE2_PAIR(1, 1));
+        lo[4] = _mm_madd_epi16(p_lo, SSE2_PAIR(1, -1)); hi[4] = _mm_madd_epi16(p_hi, SSE2_PAIR(1, -1));
+
+        p_lo = _mm_unpacklo_epi16(t12, t13); p_hi = _mm_unpackhi_epi16(t12, t13);
+        lo[2] = _mm_madd_epi16(p_lo, SSE2_PAIR(4433, 4433 + 6270)); hi[2] = _mm_madd_epi16(p_hi, SSE2_PAIR(4433, 4433 + 6270));
+        lo[6] = _mm_madd_epi16(p_lo, SSE2_PAIR(4433 - 15137, 4433)); hi[6] = _mm_madd_epi16(p_hi, SSE2_PAIR(4433 - 15137, 4433));
+
+        __m128i q_lo = _mm_unpacklo_epi16(t4, t5), q_hi = _mm_unpackhi_epi16(t4, t5);
+        __m128i r_lo = _mm_unpacklo_epi16(t6, t7), r_hi = _mm_unpackhi_epi16(t6, t7);
+#define DCT_ODD(i, c4, c5, c6, c7) \
+        lo[i] = _mm_add_epi32(_mm_madd_epi16(q_lo, SSE2_PAIR(c4, c5)), _mm_madd_epi16(r_lo, SSE2_PAIR(c6, c7))); \
+        hi[i] = _mm_add_epi32(_mm_madd_epi16(q_hi, SSE2_PAIR(c4, c5)), _mm_madd_epi16(r_hi, SSE2_PAIR(c6, c7)));
+        DCT_ODD(1, 9633 - 7373, 9633 - 3196, 9633, 9633 + 12299 - 7373 - 3196);
+        DCT_ODD(3, 9633 - 16069, 9633 - 20995, 9633 + 25172 - 20995 - 16069, 9633);
+        DCT_ODD(5, 9633, 9633 + 16819 - 20995 - 3196, 9633 - 20995, 9633 - 3196);
+        DCT_ODD(7, 9633 + 2446 - 7373 - 16069, 9633, 9633 - 16069, 9633 - 7373);
+#undef DCT_ODD
+    }
+
+    static void DCT2D_sse2(int32 *p)
+    {
+        __m128i r[8], lo[8], hi[8];
+        for (int i = 0; i < 8; i++) {
+            r[i] = _mm_packs_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i * 8)), _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i * 8 + 4)));
+        }
+        // Rows: after the transpose r[k] holds sample k of every row.
+        transpose_8x8_epi16(r);
+        dct1d_epi16(r, lo, hi);
+        for (int i = 0; i < 8; i++) {
+            if (i & 3) {
+                r[i] = _mm_packs_epi32(SSE2_DESCALE(lo[i], CONST_BITS-ROW_BITS), SSE2_DESCALE(hi[i], CONST_BITS-ROW_BITS));
+            } else {
+                r[i] = _mm_slli_epi16(_mm_packs_epi32(lo[i], hi[i]), ROW_BITS);
+            }
+        }
+        // Columns: transpose back so r[k] holds row k, every lane is one column.
+        transpose_8x8_epi16(r);
+        dct1d_epi16(r, lo, hi);
+        for (int i = 0; i < 8; i++) {
+            if (i & 3) {
+                lo[i] = SSE2_DESCALE(lo[i], CONST_BITS+ROW_BITS+3); hi[i] = SSE2_DESCALE(hi[i], CONST_BITS+ROW_BITS+3);
+            } else {
+                lo[i] = SSE2_DESCALE(lo[i], ROW_BITS+3); hi[i] = SSE2_DESCALE(hi[i], ROW_BITS+3);
+            }
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(p + i * 8), lo[i]);
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(p + i * 8 + 4), hi[i]);
+        }
+    }
+#endif // JPGE_USE_SSE2
+
+#if JPGE_USE_AVX2
+    // AVX2 flavour of DCT2D_sse2(): the transposes stay 128-bit, but each pmaddwd covers a whole row of 8 products
+    // and the results are already in column order, so every output row is a single store.
+#define AVX2_PAIR(ca, cb) _mm256_set1_epi32(static_cast<uint16>(ca) | (static_cast<uint32>(static_cast<uint16>(cb)) << 16))
+#define AVX2_DESCALE(v, n) _mm256_srai_epi32(_mm256_add_epi32(v, _mm256_set1_epi32(1 << ((n) - 1))), n)
+
+    __attribute__((target("avx2"))) static inline __m256i interleave_epi16_avx2(__m128i a, __m128i b)
+    {
+        return _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_unpacklo_epi16(a, b)), _mm_unpackhi_epi16(a, b), 1);
+    }
+
+    __attribute__((target("avx2"))) static inline void dct1d_epi16_avx2(const __m128i *s, __m256i *d)
+    {
+        __m128i t0 = _mm_add_epi16(s[0], s[7]), t7 = _mm_sub_epi16(s[0], s[7]), t1 = _mm_add_epi16(s[1], s[6]), t6 = _mm_sub_epi16(s[1], s[6]);
+        __m128i t2 = _mm_add_epi16(s[2], s[5]), t5 = _mm_sub_epi16(s[2], s[5]), t3 = _mm_add_epi16(s[3], s[4]), t4 = _mm_sub_epi16(s[3], s[4]);
+        __m128i t10 = _mm_add_epi16(t0, t3), t13 = _mm_sub_epi16(t0, t3), t11 = _mm_add_epi16(t1, t2), t12 = _mm_sub_epi16(t1, t2);
+
+        __m256i p = interleave_epi16_avx2(t10, t11);
+        d[0] = _mm256_madd_epi16(p, AVX2_PAIR(1, 1));
+        d[4] = _mm256_madd_epi16(p, AVX2_PAIR(1, -1));
+        p = interleave_epi16_avx2(t12, t13);
+        d[2] = _mm256_madd_epi16(p, AVX2_PAIR(4433, 4433 + 6270));
+        d[6] = _mm256_madd_epi16(p, AVX2_PAIR(4433 - 15137, 4433));
+
+        __m256i q = interleave_epi16_avx2(t4, t5), r = interleave_epi16_avx2(t6, t7);
+        d[1] = _mm256_add_epi32(_mm256_madd_epi16(q, AVX2_PAIR(9633 - 7373, 9633 - 3196)), _mm256_madd_epi16(r, AVX2_PAIR(9633, 9633 + 12299 - 7373 - 3196)));
+        d[3] = _mm256_add_epi32(_mm256_madd_epi16(q, AVX2_PAIR(9633 - 16069, 9633 - 20995)), _mm256_madd_epi16(r, AVX2_PAIR(9633 + 25172 - 20995 - 16069, 9633)));
+        d[5] = _mm256_add_epi32(_mm256_madd_epi16(q, AVX2_PAIR(9633, 9633 + 16819 - 20995 - 3196)), _mm256_madd_epi16(r, AVX2_PAIR(9633 - 20995, 9633 - 3196)));
+        d[7] = _mm256_add_epi32(_mm256_madd_epi16(q, AVX2_PAIR(9633 + 2446 - 7373 - 16069, 9633)), _mm256_madd_epi16(r, AVX2_PAIR(9633 - 16069, 9633 - 7373)));
+    }
+
+    __attribute__((target("avx2"))) static void DCT2D_avx2(int32 *p)
+    {
+        __m128i r[8];
+        __m256i d[8];
+        for (int i = 0; i < 8; i++) {
+            __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + i * 8));
+            r[i] = _mm_packs_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+        }
+        transpose_8x8_epi16(r);
+        dct1d_epi16_avx2(r, d);
+        for (int i = 0; i < 8; i++) {
+            __m256i v = (i & 3) ? AVX2_DESCALE(d[i], CONST_BITS-ROW_BITS) : _mm256_slli_epi32(d[i], ROW_BITS);
+            r[i] = _mm_packs_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+        }
+        transpose_8x8_epi16(r);
+        dct1d_epi16_avx2(r, d);
+        for (int i = 0; i < 8; i++) {
+            __m256i v = (i & 3) ? AVX2_DESCALE(d[i], CONST_BITS+ROW_BITS+3) : AVX2_DESCALE(d[i], ROW_BITS+3);
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(p + i * 8), v);
+        }
+    }
+#endif // JPGE_USE_AVX2
+
+    // Quantization: coefficient i (zigzag order) is sign(x) * ((|x| + bias[i]) * recip[i] >> shift[i]), with
+    // bias = q / 2, shift = 15 + ceil(log2(q)) and recip = ceil(2^shift / q). recip fits 16 bits and for all
+    // |x| < 2^15 this is exactly the rounded division (|x| + q / 2) / q, no divides and no branches.
+    static void compute_quant_reciprocal(int32 q, uint16 *pRecip, uint16 *pBias, uint8 *pShift)
+    {
+        int c = 0;
+        while ((1 << c) < q) {
+            c++;
+        }
+        *pShift = static_cast<uint8>(15 + c);
+        *pRecip = static_cast<uint16>(((1U << *pShift) + q - 1) / q);
+        *pBias = static_cast<uint16>(q >> 1);
+    }
+
+    // Returns a mask with bit i set if coefficient i is not zero.
+    static uint64 quantize(const int32 *pSamples, const uint16 *pRecip, const uint16 *pBias, const uint8 *pShift, int16 *pDst)
+    {
+        uint64 nonzero = 0;
+        for (int i = 0; i < 64; i++) {
+            const int32 j = pSamples[s_zag[i]];
+            const int32 sign = j >> 31;
+            const uint32 a = static_cast<uint32>((j ^ sign) - sign) + pBias[i];
+            const int32 r = static_cast<int32>((a * pRecip[i]) >> pShift[i]);
+            pDst[i] = static_cast<int16>((r ^ sign) - sign);
+            nonzero |= static_cast<uint64>(r != 0) << i;
+        }
+        return nonzero;
+    }
+
+#if JPGE_USE_AVX2
+    // 8 coefficients at a time, gathered straight from the DCT output in zigzag order.
+    __attribute__((target("avx2"))) static uint64 quantize_avx2(const int32 *pSamples, const uint16 *pRecip, const uint16 *pBias, const uint8 *pShift, int16 *pDst)
+    {
+        uint64 zero = 0;
+        for (int i = 0; i < 64; i += 16) {
+            __m256i r[2];
+            for (int k = 0; k < 2; k++) {
+                const int o = i + k * 8;
+                __m256i idx = _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(s_zag + o)));
+                __m256i x = _mm256_i32gather_epi32(reinterpret_cast<const int*>(pSamples), idx, 4);
+                __m256i a = _mm256_add_epi32(_mm256_abs_epi32(x), _mm256_cvtepu16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(pBias + o))));
+                a = _mm256_mullo_epi32(a, _mm256_cvtepu16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(pRecip + o))));
+                a = _mm256_srlv_epi32(a, _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(pShift + o))));
+                r[k] = _mm256_sign_epi32(a, x);
+            }
+            // packs works within 128 bit lanes, put the quadwords back in order
+            __m256i p = _mm256_permute4x64_epi64(_mm256_packs_epi32(r[0], r[1]), 0xD8);
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(pDst + i), p);
+            // one byte per coefficient, packs puts coefficients 0-7 in bits 0-7 and 8-15 in bits 16-23
+            __m256i z = _mm256_cmpeq_epi16(p, _mm256_setzero_si256());
+            uint32 m = static_cast<uint32>(_mm256_movemask_epi8(_mm256_packs_epi16(z, z)));
+            zero |= static_cast<uint64>((m & 0xFF) | ((m >> 8) & 0xFF00)) << i;
+        }
+        return ~zero;
+    }
+#endif // JPGE_USE_AVX2
+
+    typedef uint64 (*quantize_func_t)(const int32 *pSamples, const uint16 *pRecip, const uint16 *pBias, const uint8 *pShift, int16 *pDst);
+
+    static quantize_func_t select_quantize()
+    {
+#if JPGE_USE_AVX2
+        if (__builtin_cpu_supports("avx2")) {
+            return quantize_avx2;
+        }
+#endif
+        return quantize;
+    }
+
+    struct sym_freq
+    {
+        uint m_key, m_sym_index;
+    };
+
+    // Radix sorts sym_freq[] array by 32-bit key m_key. Returns ptr to sorted values.
+    static sym_freq *radix_sort_syms(uint num_syms, sym_freq *pSyms0, sym_freq *pSyms1)
+    {
+        uint hist[256];
+        sym_freq *pCur_syms = pSyms0, *pNew_syms = pSyms1;
+        for (uint shift = 0; shift < 32; shift += 8) {
+            memset(hist, 0, sizeof(hist));
+            for (uint i = 0; i < num_syms; i++) {
+                hist[(pCur_syms[i].m_key >> shift) & 0xFF]++;
+            }
+            if (hist[0] == num_syms) {
+                continue; // all keys have this byte zero, order does not change
+            }
+            for (uint i = 0, cur_ofs = 0; i < 256; i++) { // turn counts into offsets
+                uint n = hist[i];
+                hist[i] = cur_ofs;
+                cur_ofs += n;
+            }
+            for (uint i = 0; i < num_syms; i++) {
+                pNew_syms[hist[(pCur_syms[i].m_key >> shift) & 0xFF]++] = pCur_syms[i];
+            }
+            sym_freq *t = pCur_syms; pCur_syms = pNew_syms; pNew_syms = t;
+        }
+        return pCur_syms;
+    }
+
+    // In-place minimum redundancy code lengths (Moffat & Katajainen). A[] must be sorted by ascending m_key,
+    // on return m_key holds the code length of each symbol.
+    static void calculate_minimum_redundancy(sym_freq *A, int n)
+    {
+        int root, leaf, next, avbl, used, dpth;
+        if (n == 0) {
+            return;
+        } else if (n == 1) {
+            A[0].m_key = 1;
+            return;
+        }
+        A[0].m_key += A[1].m_key; root = 0; leaf = 2;
+        for (next = 1; next < n - 1; next++) {
+            if ((leaf >= n) || (A[root].m_key < A[leaf].m_key)) {
+                A[next].m_key = A[root].m_key; A[root++].m_key = next;
+            } else {
+                A[next].m_key = A[leaf++].m_key;
+            }
+            if ((leaf >= n) || ((root < next) && (A[root].m_key < A[leaf].m_key))) {
+                A[next].m_key += A[root].m_key; A[root++].m_key = next;
+            } else {
+                A[next].m_key += A[leaf++].m_key;
+            }
+        }
+        A[n - 2].m_key = 0;
+        for (next = n - 3; next >= 0; next--) {
+            A[next].m_key = A[A[next].m_key].m_key + 1;
+        }
+        avbl = 1; used = dpth = 0; root = n - 2; next = n - 1;
+        while (avbl > 0) {
+            while ((root >= 0) && ((int)A[root].m_key == dpth)) {
+                used++; root--;
+            }
+            while (avbl > used) {
+                A[next--].m_key = dpth; avbl--;
+            }
+            avbl = 2 * used; dpth++; used = 0;
+        }
+    }
+
+    // Limit canonical Huffman code table's max code size to max_code_size.
+    static void huffman_enforce_max_code_size(int *pNum_codes, int code_list_len, int max_code_size)
+    {
+        if (code_list_len <= 1) {
+            return;
+        }
+        for (int i = max_code_size + 1; i <= MAX_HUFF_CODESIZE; i++) {
+            pNum_codes[max_code_size] += pNum_codes[i];
+        }
+        uint32 total = 0;
+        for (int i = max_code_size; i > 0; i--) {
+            total += (((uint32)pNum_codes[i]) << (max_code_size - i));
+        }
+        while (total != (1UL << max_code_size)) {
+            pNum_codes[max_code_size]--;
+            for (int i = max_code_size - 1; i > 0; i--) {
+                if (pNum_codes[i]) {
+                    pNum_codes[i]--;
+                    pNum_codes[i + 1] += 2;
+                    break;
+                }
+            }
+            total--;
+        }
+    }
+
     // Compute the actual canonical Huffman codes/code sizes given the JPEG huff bits and val arrays.
-    static void compute_huffman_table(uint *codes, uint8 *code_sizes, uint8 *bits, uint8 *val)
+    static void compute_huffman_table(uint *codes, uint8 *code_sizes, const uint8 *bits, const uint8 *val)
+    {
+        memset(codes, 0, sizeof(codes[0]) * 256);
+        memset(code_sizes, 0, sizeof(code_sizes[0]) * 256);
+        uint code = 0;
+        for (int l = 1, p = 0; l <= 16; l++, code <<= 1) {
+            for (int i = 0; i < bits[l]; i++, p++) {
+                codes[val[p]] = code++;
+                code_sizes[val[p]] = static_cast<uint8>(l);
+            }
+        }
+    }
+
+    typedef void (*dct2d_func_t)(int32 *p);
+
+    // Pick the fastest DCT the CPU we are running on supports.
+    static dct2d_func_t select_dct2d()
+    {
+#if JPGE_USE_AVX2
+        if (__builtin_cpu_supports("avx2")) {
+            return DCT2D_avx2;
+        }
+#endif
+#if JPGE_USE_SSE2
+        return DCT2D_sse2;
+#endif
+        return DCT2D;
+    }
+
+    // Output stream of a worker thread's segment: a chain of fixed size chunks that is kept for the whole image,
+    // so coding an MCU row never reallocs and copies, no matter how large it gets.
+    class chunk_stream : public output_stream
     {
-        int i, l, last_p, si;
-        static uint8 huff_size[257];
-        static uint huff_code[257];
-        uint code;
+    public:
+        chunk_stream() : m_pHead(NULL), m_pCur(NULL), m_size(0) { }
+
+        virtual ~chunk_stream()
+        {
+            while (m_pHead) {
+                chunk *pNext = m_pHead->m_pNext;
+                jpge_free(m_pHead);
+                m_pHead = pNext;
+            }
+        }
+
+        void rewind()
+        {
+            m_pCur = m_pHead;
+            if (m_pCur) {
+                m_pCur->m_used = 0;
+            }
+            m_size = 0;
+        }
+
+        virtual bool put_buf(const void* Pbuf, int len)
+        {
+            const uint8 *pSrc = static_cast<const uint8*>(Pbuf);
+            while (len > 0) {
+                if ((!m_pCur || m_pCur->m_used == CHUNK_SIZE) && !next_chunk()) {
+                    return false;
+                }
+                uint n = JPGE_MIN((uint)len, CHUNK_SIZE - m_pCur->m_used);
+                memcpy(m_pCur->m_data + m_pCur->m_used, pSrc, n);
+                m_pCur->m_used += n;
+                m_size += n;
+                pSrc += n;
+                len -= n;
+            }
+            return true;
+        }
 
-        int p = 0;
-        for (l = 1; l <= 16; l++) {
-            for (i = 1; i <= bits[l]; i++) {
-                huff_size[p++] = (char)l;
+        virtual uint get_size() const
+        {
+            return m_size;
+        }
+
+        // The encoder codes straight into the chunks.
+        virtual uint8 *get_write_buf(uint min_len, uint *pLen)
+        {
+            if ((!m_pCur || (CHUNK_SIZE - m_pCur->m_used < min_len)) && !next_chunk()) {
+                return NULL;
             }
+            *pLen = CHUNK_SIZE - m_pCur->m_used;
+            return m_pCur->m_data + m_pCur->m_used;
         }
 
-        huff_size[p] = 0;
-        last_p = p; // write sentinel
+        virtual bool commit_write_buf(uint len)
+        {
+            m_pCur->m_used += len;
+            m_size += len;
+            return true;
+        }
 
-        code = 0; si = huff_size[0]; p = 0;
+        bool write_to(output_stream *pStream) const
+        {
+            uint left = m_size;
+            for (const chunk *c = m_pHead; left; c = c->m_pNext) {
+                if (!pStream->put_buf(c->m_data, c->m_used)) {
+                    return false;
+                }
+                left -= c->m_used;
+            }
+            return true;
+        }
 
-        while (huff_size[p]) {
-            while (huff_size[p] == si) {
-                huff_code[p++] = code++;
+    private:
+        enum { CHUNK_SIZE = 4096 };
+        struct chunk
+        {
+            chunk *m_pNext;
+            uint m_used;
+            uint8 m_data[CHUNK_SIZE];
+        };
+        chunk *m_pHead, *m_pCur;
+        uint m_size;
+
+        // Move on to the next chunk, reusing the ones kept from earlier rows.
+        bool next_chunk()
+        {
+            chunk *pNext = m_pCur ? m_pCur->m_pNext : m_pHead;
+            if (!pNext) {
+                if ((pNext = static_cast<chunk*>(jpge_malloc(sizeof(chunk)))) == NULL) {
+                    return false;
+                }
+                pNext->m_pNext = NULL;
+                if (m_pCur) {
+                    m_pCur->m_pNext = pNext;
+                } else {
+                    m_pHead = pNext;
+                }
             }
-            code <<= 1;
-            si++;
+            pNext->m_used = 0;
+            m_pCur = pNext;
+            return true;
+        }
+    };
+
+    // Optimized Huffman tables of two pass mode, plus sort scratch for building them.
+    struct jpeg_encoder::huff_tables
+    {
+        uint m_codes[4][256];
+        uint8 m_code_sizes[4][256];
+        uint8 m_bits[4][17];
+        uint8 m_val[4][256];
+        sym_freq m_syms0[MAX_HUFF_SYMBOLS], m_syms1[MAX_HUFF_SYMBOLS];
+    };
+
+    // Worker threads for parallel MCU row coding. Worker i codes row i of every band (row 0 is coded by the
+    // thread calling process_scanline()), then waits for the next band.
+    struct jpeg_encoder::thread_pool
+    {
+        struct worker
+        {
+            jpeg_encoder *m_pEncoder;
+            int m_index;
+            pthread_t m_thread;
+            segment m_seg;
+            chunk_stream m_stream;
+        };
+
+        pthread_mutex_t m_mutex;
+        pthread_cond_t m_start_cond, m_done_cond;
+        uint m_band_seq;
+        int m_busy;
+        bool m_quit;
+        int m_num_workers;
+        worker *m_pWorkers;
+    };
+
+    // Code into memory of the stream if it offers some, else stage in m_out_buf.
+    void jpeg_encoder::open_output_buffer(segment &s)
+    {
+        uint len = 0;
+        s.m_pWindow = s.m_all_stream_writes_succeeded ? s.m_pStream->get_write_buf(JPGE_MIN_WRITE_BUF, &len) : NULL;
+        if (s.m_pWindow && (len >= JPGE_MIN_WRITE_BUF)) {
+            s.m_pOut_buf = s.m_pWindow;
+            s.m_out_buf_left = len;
+        } else {
+            s.m_pWindow = NULL;
+            s.m_pOut_buf = s.m_out_buf;
+            s.m_out_buf_left = JPGE_OUT_BUF_SIZE;
         }
+    }
 
-        memset(codes, 0, sizeof(codes[0])*256);
-        memset(code_sizes, 0, sizeof(code_sizes[0])*256);
-        for (p = 0; p < last_p; p++) {
-            codes[val[p]]      = huff_code[p];
-            code_sizes[val[p]] = huff_size[p];
+    // Hand everything coded so far to the stream. The buffer has to be opened again before more is emitted.
+    void jpeg_encoder::close_output_buffer(segment &s)
+    {
+        if (s.m_pWindow) {
+            s.m_all_stream_writes_succeeded = s.m_all_stream_writes_succeeded && s.m_pStream->commit_write_buf(static_cast<uint>(s.m_pOut_buf - s.m_pWindow));
+            s.m_pWindow = NULL;
+        } else if (s.m_out_buf_left != JPGE_OUT_BUF_SIZE) {
+            s.m_all_stream_writes_succeeded = s.m_all_stream_writes_succeeded && s.m_pStream->put_buf(s.m_out_buf, JPGE_OUT_BUF_SIZE - s.m_out_buf_left);
         }
+        s.m_pOut_buf = s.m_out_buf;
+        s.m_out_buf_left = JPGE_OUT_BUF_SIZE;
+    }
+
+    void jpeg_encoder::flush_output_buffer(segment &s)
+    {
+        close_output_buffer(s);
+        open_output_buffer(s);
+    }
+
+    // What the stream holds plus what is coded into the output buffer but not handed to it yet.
+    uint jpeg_encoder::output_size(const segment &s) const
+    {
+        return s.m_pStream->get_size() + static_cast<uint>(s.m_pOut_buf - (s.m_pWindow ? s.m_pWindow : s.m_out_buf));
     }
 
-    void jpeg_encoder::flush_output_buffer()
+    inline void jpeg_encoder::emit_byte(segment &s, uint8 i)
     {
-        if (m_out_buf_left != JPGE_OUT_BUF_SIZE) {
-            m_all_stream_writes_succeeded = m_all_stream_writes_succeeded && m_pStream->put_buf(m_out_buf, JPGE_OUT_BUF_SIZE - m_out_buf_left);
+        *s.m_pOut_buf++ = i;
+        if (--s.m_out_buf_left == 0) {
+            flush_output_buffer(s);
         }
-        m_pOut_buf = m_out_buf;
-        m_out_buf_left = JPGE_OUT_BUF_SIZE;
     }
 
-    void jpeg_encoder::emit_byte(uint8 i)
+    // Emit the byte, followed by a stuffed 0 if it is 0xFF.
+    inline void jpeg_encoder::emit_coded_byte(segment &s, uint8 c)
     {
-        *m_pOut_buf++ = i;
-        if (--m_out_buf_left == 0) {
-            flush_output_buffer();
+        emit_byte(s, c);
+        if (c == 0xFF) {
+            emit_byte(s, 0);
         }
     }
 
-    void jpeg_encoder::put_bits(uint bits, uint len)
+    // The bit buffer holds the m_bits_in most recent bits in its low end. len may be up to 32, so a Huffman code and
+    // its magnitude bits go in with one call. Whole 32-bit words are written out at once unless one of their
+    // bytes is 0xFF and needs stuffing.
+    inline void jpeg_encoder::put_bits(segment &s, uint bits, uint len)
     {
-        uint8 c = 0;
-        m_bit_buffer |= ((uint32)bits << (24 - (m_bits_in += len)));
-        while (m_bits_in >= 8) {
-            c = (uint8)((m_bit_buffer >> 16) & 0xFF);
-            emit_byte(c);
-            if (c == 0xFF) {
-                emit_byte(0);
+        s.m_bit_buffer = (s.m_bit_buffer << len) | bits;
+        if ((s.m_bits_in += len) >= 32) {
+            s.m_bits_in -= 32;
+            const uint32 w = static_cast<uint32>(s.m_bit_buffer >> s.m_bits_in);
+            const bool has_ff = ((~w - 0x01010101U) & w & 0x80808080U) != 0;
+            if (!has_ff && (s.m_out_buf_left > 4)) {
+                s.m_pOut_buf[0] = static_cast<uint8>(w >> 24);
+                s.m_pOut_buf[1] = static_cast<uint8>(w >> 16);
+                s.m_pOut_buf[2] = static_cast<uint8>(w >> 8);
+                s.m_pOut_buf[3] = static_cast<uint8>(w);
+                s.m_pOut_buf += 4;
+                s.m_out_buf_left -= 4;
+            } else {
+                emit_coded_byte(s, static_cast<uint8>(w >> 24));
+                emit_coded_byte(s, static_cast<uint8>(w >> 16));
+                emit_coded_byte(s, static_cast<uint8>(w >> 8));
+                emit_coded_byte(s, static_cast<uint8>(w));
             }
-            m_bit_buffer <<= 8;
-            m_bits_in -= 8;
         }
     }
 
+    // Pad to a byte boundary with 1 bits and write out all whole bytes of the bit buffer.
+    void jpeg_encoder::flush_bits(segment &s)
+    {
+        put_bits(s, 0x7F, 7);
+        while (s.m_bits_in >= 8) {
+            s.m_bits_in -= 8;
+            emit_coded_byte(s, static_cast<uint8>(s.m_bit_buffer >> s.m_bits_in));
+        }
+        s.m_bit_buffer = 0;
+        s.m_bits_in = 0;
+    }
+
+    void jpeg_encoder::reset_segment(segment &s, output_stream *pStream)
+    {
+        memset(s.m_last_dc_val, 0, sizeof(s.m_last_dc_val));
+        s.m_bit_buffer = 0;
+        s.m_bits_in = 0;
+        s.m_pStream = pStream;
+        s.m_all_stream_writes_succeeded = true;
+        if (m_pass_num == 2) {
+            open_output_buffer(s);
+        } else {
+            // pass 1 only counts symbols, don't claim any stream memory
+            s.m_pWindow = NULL;
+            s.m_pOut_buf = s.m_out_buf;
+            s.m_out_buf_left = JPGE_OUT_BUF_SIZE;
+        }
+    }
+
+    // Pad the segment to a byte boundary with 1 bits and push out its buffered bytes.
+    void jpeg_encoder::finish_segment(segment &s)
+    {
+        flush_bits(s);
+        flush_output_buffer(s);
+    }
+
     void jpeg_encoder::emit_word(uint i)
     {
         emit_byte(uint8(i >> 8)); emit_byte(uint8(i & 0xFF));
@@ -268,7 +899,7 @@ namespace jpge {
     }
 
     // Emit Huffman table.
-    void jpeg_encoder::emit_dht(uint8 *bits, uint8 *val, int index, bool ac_flag)
+    void jpeg_encoder::emit_dht(const uint8 *bits, const uint8 *val, int index, bool ac_flag)
     {
         emit_marker(M_DHT);
 
@@ -297,6 +928,14 @@ namespace jpge {
         }
     }
 
+    // Emit restart interval: one MCU row per interval.
+    void jpeg_encoder::emit_dri()
+    {
+        emit_marker(M_DRI);
+        emit_word(4);
+        emit_word(m_mcus_per_row);
+    }
+
     // emit start of scan
     void jpeg_encoder::emit_sos()
     {
@@ -316,43 +955,57 @@ namespace jpge {
         emit_byte(0);
     }
 
-    void jpeg_encoder::load_block_8_8_grey(int x)
+    // Emit all markers at beginning of image file.
+    void jpeg_encoder::emit_markers()
+    {
+        emit_marker(M_SOI);
+        emit_jfif_app0();
+        emit_dqt();
+        emit_sof();
+        emit_dhts();
+        if (m_params.m_num_threads > 1) {
+            emit_dri();
+        }
+        emit_sos();
+    }
+
+    void jpeg_encoder::load_block_8_8_grey(segment &s, int x)
     {
-        uint8 *pSrc;
-        sample_array_t *pDst = m_sample_array;
+        const uint8 *pSrc;
+        sample_array_t *pDst = s.m_sample_array;
         x <<= 3;
         for (int i = 0; i < 8; i++, pDst += 8)
         {
-            pSrc = m_mcu_lines[i] + x;
+            pSrc = s.m_mcu_lines[i] + x;
             pDst[0] = pSrc[0] - 128; pDst[1] = pSrc[1] - 128; pDst[2] = pSrc[2] - 128; pDst[3] = pSrc[3] - 128;
             pDst[4] = pSrc[4] - 128; pDst[5] = pSrc[5] - 128; pDst[6] = pSrc[6] - 128; pDst[7] = pSrc[7] - 128;
         }
     }
 
-    void jpeg_encoder::load_block_8_8(int x, int y, int c)
+    void jpeg_encoder::load_block_8_8(segment &s, int x, int y, int c)
     {
-        uint8 *pSrc;
-        sample_array_t *pDst = m_sample_array;
+        const uint8 *pSrc;
+        sample_array_t *pDst = s.m_sample_array;
         x = (x * (8 * 3)) + c;
         y <<= 3;
         for (int i = 0; i < 8; i++, pDst += 8)
         {
-            pSrc = m_mcu_lines[y + i] + x;
+            pSrc = s.m_mcu_lines[y + i] + x;
             pDst[0] = pSrc[0 * 3] - 128; pDst[1] = pSrc[1 * 3] - 128; pDst[2] = pSrc[2 * 3] - 128; pDst[3] = pSrc[3 * 3] - 128;
             pDst[4] = pSrc[4 * 3] - 128; pDst[5] = pSrc[5 * 3] - 128; pDst[6] = pSrc[6 * 3] - 128; pDst[7] = pSrc[7 * 3] - 128;
         }
     }
 
-    void jpeg_encoder::load_block_16_8(int x, int c)
+    void jpeg_encoder::load_block_16_8(segment &s, int x, int c)
     {
-        uint8 *pSrc1, *pSrc2;
-        sample_array_t *pDst = m_sample_array;
+        const uint8 *pSrc1, *pSrc2;
+        sample_array_t *pDst = s.m_sample_array;
         x = (x * (16 * 3)) + c;
         int a = 0, b = 2;
         for (int i = 0; i < 16; i += 2, pDst += 8)
         {
-            pSrc1 = m_mcu_lines[i + 0] + x;
-            pSrc2 = m_mcu_lines[i + 1] + x;
+            pSrc1 = s.m_mcu_lines[i + 0] + x;
+            pSrc2 = s.m_mcu_lines[i + 1] + x;
             pDst[0] = ((pSrc1[ 0 * 3] + pSrc1[ 1 * 3] + pSrc2[ 0 * 3] + pSrc2[ 1 * 3] + a) >> 2) - 128; pDst[1] = ((pSrc1[ 2 * 3] + pSrc1[ 3 * 3] + pSrc2[ 2 * 3] + pSrc2[ 3 * 3] + b) >> 2) - 128;
             pDst[2] = ((pSrc1[ 4 * 3] + pSrc1[ 5 * 3] + pSrc2[ 4 * 3] + pSrc2[ 5 * 3] + a) >> 2) - 128; pDst[3] = ((pSrc1[ 6 * 3] + pSrc1[ 7 * 3] + pSrc2[ 6 * 3] + pSrc2[ 7 * 3] + b) >> 2) - 128;
             pDst[4] = ((pSrc1[ 8 * 3] + pSrc1[ 9 * 3] + pSrc2[ 8 * 3] + pSrc2[ 9 * 3] + a) >> 2) - 128; pDst[5] = ((pSrc1[10 * 3] + pSrc1[11 * 3] + pSrc2[10 * 3] + pSrc2[11 * 3] + b) >> 2) - 128;
@@ -361,14 +1014,14 @@ namespace jpge {
         }
     }
 
-    void jpeg_encoder::load_block_16_8_8(int x, int c)
+    void jpeg_encoder::load_block_16_8_8(segment &s, int x, int c)
     {
-        uint8 *pSrc1;
-        sample_array_t *pDst = m_sample_array;
+        const uint8 *pSrc1;
+        sample_array_t *pDst = s.m_sample_array;
         x = (x * (16 * 3)) + c;
         for (int i = 0; i < 8; i++, pDst += 8)
         {
-            pSrc1 = m_mcu_lines[i + 0] + x;
+            pSrc1 = s.m_mcu_lines[i + 0] + x;
             pDst[0] = ((pSrc1[ 0 * 3] + pSrc1[ 1 * 3]) >> 1) - 128; pDst[1] = ((pSrc1[ 2 * 3] + pSrc1[ 3 * 3]) >> 1) - 128;
             pDst[2] = ((pSrc1[ 4 * 3] + pSrc1[ 5 * 3]) >> 1) - 128; pDst[3] = ((pSrc1[ 6 * 3] + pSrc1[ 7 * 3]) >> 1) - 128;
             pDst[4] = ((pSrc1[ 8 * 3] + pSrc1[ 9 * 3]) >> 1) - 128; pDst[5] = ((pSrc1[10 * 3] + pSrc1[11 * 3]) >> 1) - 128;
@@ -376,37 +1029,46 @@ namespace jpge {
         }
     }
 
-    void jpeg_encoder::load_quantized_coefficients(int component_num)
+    void jpeg_encoder::load_quantized_coefficients(segment &s, int component_num)
     {
-        int32 *q = m_quantization_tables[component_num > 0];
-        int16 *pDst = m_coefficient_array;
-        for (int i = 0; i < 64; i++)
+        const int t = component_num > 0;
+        s.m_nonzero = m_pQuantize(s.m_sample_array, m_quant_recip[t], m_quant_bias[t], m_quant_shift[t], s.m_coefficient_array);
+    }
+
+    void jpeg_encoder::code_coefficients_pass_one(segment &s, int component_num)
+    {
+        int16 *pSrc = s.m_coefficient_array;
+        uint32 *dc_count = s.m_pHuff_count + (component_num ? 1 : 0) * 256;
+        uint32 *ac_count = s.m_pHuff_count + (component_num ? 3 : 2) * 256;
+
+        int temp1 = pSrc[0] - s.m_last_dc_val[component_num];
+        s.m_last_dc_val[component_num] = pSrc[0];
+        dc_count[JPGE_NBITS(temp1 < 0 ? -temp1 : temp1)]++;
+
+        // Walk the nonzero AC coefficients, the zero runs between them are the bit distances.
+        uint64 ac = s.m_nonzero >> 1;
+        int i = 1;
+        while (ac)
         {
-            sample_array_t j = m_sample_array[s_zag[i]];
-            if (j < 0)
-            {
-                if ((j = -j + (*q >> 1)) < *q)
-                    *pDst++ = 0;
-                else
-                    *pDst++ = static_cast<int16>(-(j / *q));
-            }
-            else
-            {
-                if ((j = j + (*q >> 1)) < *q)
-                    *pDst++ = 0;
-                else
-                    *pDst++ = static_cast<int16>((j / *q));
-            }
-            q++;
+            int run_len = JPGE_CTZ64(ac);
+            i += run_len;
+            ac >>= run_len;
+            ac >>= 1;
+            for ( ; run_len >= 16; run_len -= 16)
+                ac_count[0xF0]++;
+            temp1 = pSrc[i++];
+            ac_count[(run_len << 4) + JPGE_NBITS(temp1 < 0 ? -temp1 : temp1)]++;
         }
+        if (i < 64)
+            ac_count[0]++;
     }
 
-    void jpeg_encoder::code_coefficients_pass_two(int component_num)
+    void jpeg_encoder::code_coefficients_pass_two(segment &s, int component_num)
     {
-        int i, j, run_len, nbits, temp1, temp2;
-        int16 *pSrc = m_coefficient_array;
-        uint *codes[2];
-        uint8 *code_sizes[2];
+        int nbits, temp1, temp2;
+        int16 *pSrc = s.m_coefficient_array;
+        const uint *codes[2];
+        const uint8 *code_sizes[2];
 
         if (component_num == 0)
         {
@@ -419,140 +1081,489 @@ namespace jpge {
             code_sizes[0] = m_huff_code_sizes[0 + 1]; code_sizes[1] = m_huff_code_sizes[2 + 1];
         }
 
-        temp1 = temp2 = pSrc[0] - m_last_dc_val[component_num];
-        m_last_dc_val[component_num] = pSrc[0];
+        temp1 = temp2 = pSrc[0] - s.m_last_dc_val[component_num];
+        s.m_last_dc_val[component_num] = pSrc[0];
 
         if (temp1 < 0)
         {
             temp1 = -temp1; temp2--;
         }
+        nbits = JPGE_NBITS(temp1);
+        put_bits(s, (codes[0][nbits] << nbits) | (temp2 & ((1 << nbits) - 1)), code_sizes[0][nbits] + nbits);
 
-        nbits = 0;
-        while (temp1)
+        // Walk the nonzero AC coefficients, the zero runs between them are the bit distances.
+        uint64 ac = s.m_nonzero >> 1;
+        int i = 1;
+        while (ac)
         {
-            nbits++; temp1 >>= 1;
-        }
-
-        put_bits(codes[0][nbits], code_sizes[0][nbits]);
-        if (nbits) put_bits(temp2 & ((1 << nbits) - 1), nbits);
-
-        for (run_len = 0, i = 1; i < 64; i++)
-        {
-            if ((temp1 = m_coefficient_array[i]) == 0)
-                run_len++;
-            else
+            int run_len = JPGE_CTZ64(ac);
+            i += run_len;
+            ac >>= run_len;
+            ac >>= 1;
+            for ( ; run_len >= 16; run_len -= 16)
+                put_bits(s, codes[1][0xF0], code_sizes[1][0xF0]);
+            if ((temp2 = temp1 = pSrc[i++]) < 0)
             {
-                while (run_len >= 16)
-                {
-                    put_bits(codes[1][0xF0], code_sizes[1][0xF0]);
-                    run_len -= 16;
-                }
-                if ((temp2 = temp1) < 0)
-                {
-                    temp1 = -temp1;
-                    temp2--;
-                }
-                nbits = 1;
-                while (temp1 >>= 1)
-                    nbits++;
-                j = (run_len << 4) + nbits;
-                put_bits(codes[1][j], code_sizes[1][j]);
-                put_bits(temp2 & ((1 << nbits) - 1), nbits);
-                run_len = 0;
+                temp1 = -temp1;
+                temp2--;
             }
+            nbits = JPGE_NBITS(temp1);
+            const int j = (run_len << 4) + nbits;
+            put_bits(s, (codes[1][j] << nbits) | (temp2 & ((1 << nbits) - 1)), code_sizes[1][j] + nbits);
         }
-        if (run_len)
-            put_bits(codes[1][0], code_sizes[1][0]);
+        if (i < 64)
+            put_bits(s, codes[1][0], code_sizes[1][0]);
     }
 
-    void jpeg_encoder::code_block(int component_num)
+    void jpeg_encoder::code_block(segment &s, int component_num)
     {
-        DCT2D(m_sample_array);
-        load_quantized_coefficients(component_num);
-        code_coefficients_pass_two(component_num);
+        m_pDCT2D(s.m_sample_array);
+        load_quantized_coefficients(s, component_num);
+        if (m_pass_num == 1)
+            code_coefficients_pass_one(s, component_num);
+        else
+            code_coefficients_pass_two(s, component_num);
     }
 
-    void jpeg_encoder::process_mcu_row()
+    void jpeg_encoder::code_mcu(segment &s, int i)
     {
         if (m_num_components == 1)
         {
-            for (int i = 0; i < m_mcus_per_row; i++)
-            {
-                load_block_8_8_grey(i); code_block(0);
-            }
+            load_block_8_8_grey(s, i); code_block(s, 0);
         }
         else if ((m_comp_h_samp[0] == 1) && (m_comp_v_samp[0] == 1))
         {
-            for (int i = 0; i < m_mcus_per_row; i++)
-            {
-                load_block_8_8(i, 0, 0); code_block(0); load_block_8_8(i, 0, 1); code_block(1); load_block_8_8(i, 0, 2); code_block(2);
-            }
+            load_block_8_8(s, i, 0, 0); code_block(s, 0); load_block_8_8(s, i, 0, 1); code_block(s, 1); load_block_8_8(s, i, 0, 2); code_block(s, 2);
         }
         else if ((m_comp_h_samp[0] == 2) && (m_comp_v_samp[0] == 1))
         {
-            for (int i = 0; i < m_mcus_per_row; i++)
-            {
-                load_block_8_8(i * 2 + 0, 0, 0); code_block(0); load_block_8_8(i * 2 + 1, 0, 0); code_block(0);
-                load_block_16_8_8(i, 1); code_block(1); load_block_16_8_8(i, 2); code_block(2);
-            }
+            load_block_8_8(s, i * 2 + 0, 0, 0); code_block(s, 0); load_block_8_8(s, i * 2 + 1, 0, 0); code_block(s, 0);
+            load_block_16_8_8(s, i, 1); code_block(s, 1); load_block_16_8_8(s, i, 2); code_block(s, 2);
         }
         else if ((m_comp_h_samp[0] == 2) && (m_comp_v_samp[0] == 2))
         {
-            for (int i = 0; i < m_mcus_per_row; i++)
-            {
-                load_block_8_8(i * 2 + 0, 0, 0); code_block(0); load_block_8_8(i * 2 + 1, 0, 0); code_block(0);
-                load_block_8_8(i * 2 + 0, 1, 0); code_block(0); load_block_8_8(i * 2 + 1, 1, 0); code_block(0);
-                load_block_16_8(i, 1); code_block(1); load_block_16_8(i, 2); code_block(2);
-            }
+            load_block_8_8(s, i * 2 + 0, 0, 0); code_block(s, 0); load_block_8_8(s, i * 2 + 1, 0, 0); code_block(s, 0);
+            load_block_8_8(s, i * 2 + 0, 1, 0); code_block(s, 0); load_block_8_8(s, i * 2 + 1, 1, 0); code_block(s, 0);
+            load_block_16_8(s, i, 1); code_block(s, 1); load_block_16_8(s, i, 2); code_block(s, 2);
         }
     }
 
-    void jpeg_encoder::load_mcu(const void *pSrc)
+    // Convert the source pixels of MCU mcu_x into the segment's tile, replicating the last column and row
+    // where the MCU sticks out of the image.
+    void jpeg_encoder::load_tile(segment &s, int mcu_x)
     {
-        const uint8* Psrc = reinterpret_cast<const uint8*>(pSrc);
-
-        uint8* pDst = m_mcu_lines[m_mcu_y_ofs]; // OK to write up to m_image_bpl_xlt bytes to pDst
-
-        if (m_num_components == 1) {
-            if (m_image_bpp == 3)
-                RGB_to_Y(pDst, Psrc, m_image_x);
-            else
-                memcpy(pDst, Psrc, m_image_x);
-        } else {
-            if (m_image_bpp == 3)
-                RGB_to_YCC(pDst, Psrc, m_image_x);
-            else
-                Y_to_YCC(pDst, Psrc, m_image_x);
+        const int shift = m_scale_shift;
+        const int x = mcu_x * m_mcu_x;
+        const int num_pixels = JPGE_MIN(m_mcu_x, m_image_x - x);
+        const int num_rows = (s.m_src_rows + (1 << shift) - 1) >> shift;
+        const int tile_bpl = m_mcu_x * m_num_components;
+        uint8 *pDst = s.m_tile;
+        for (int y = 0; y < m_mcu_y; y++, pDst += tile_bpl) {
+            if (y < num_rows) {
+                const uint8 *pSrc = s.m_pSrc + (y << shift) * s.m_src_stride + (x << shift) * m_image_bpp;
+                uint8 line[16 * 3];
+                if (shift) {
+                    uint16 acc[16 * 3];
+                    const int num_src_pixels = JPGE_MIN(m_mcu_x << shift, m_src_x - (x << shift));
+                    const int num_src_rows = JPGE_MIN(1 << shift, s.m_src_rows - (y << shift));
+                    memset(acc, 0, sizeof(acc));
+                    for (int i = 0; i < num_src_rows; i++)
+                        accumulate_pixels(acc, pSrc + i * s.m_src_stride, num_src_pixels);
+                    average_pixels(line, acc, num_src_pixels, num_src_rows);
+                    pSrc = line;
+                }
+                convert_pixels(pDst, pSrc, num_pixels);
+                pad_pixels(pDst, num_pixels, m_mcu_x);
+            } else {
+                memcpy(pDst, pDst - tile_bpl, tile_bpl);
+            }
         }
+    }
 
-        // Possibly duplicate pixels at end of scanline if not a multiple of 8 or 16
-        if (m_num_components == 1)
-            memset(m_mcu_lines[m_mcu_y_ofs] + m_image_bpl_xlt, pDst[m_image_bpl_xlt - 1], m_image_x_mcu - m_image_x);
-        else
+    void jpeg_encoder::process_mcu_row(segment &s)
+    {
+        // MCUs that can be loaded in place: all of them from the MCU line buffer, whole ones from a grayscale frame.
+        // The others go through the tile.
+        int num_direct = 0;
+        if (s.m_src_ycc)
+            num_direct = m_mcus_per_row;
+        else if ((m_image_bpp == 1) && (m_num_components == 1) && !m_scale_shift && (s.m_src_rows == m_mcu_y))
+            num_direct = m_image_x / m_mcu_x;
+
+        for (int i = 0; i < m_mcu_y; i++)
+            s.m_mcu_lines[i] = s.m_pSrc + i * s.m_src_stride;
+        for (int i = 0; i < num_direct; i++)
+            code_mcu(s, i);
+
+        if (num_direct < m_mcus_per_row)
         {
-            const uint8 y = pDst[m_image_bpl_xlt - 3 + 0], cb = pDst[m_image_bpl_xlt - 3 + 1], cr = pDst[m_image_bpl_xlt - 3 + 2];
-            uint8 *q = m_mcu_lines[m_mcu_y_ofs] + m_image_bpl_xlt;
-            for (int i = m_image_x; i < m_image_x_mcu; i++)
+            for (int i = 0; i < m_mcu_y; i++)
+                s.m_mcu_lines[i] = s.m_tile + i * m_mcu_x * m_num_components;
+            for (int i = num_direct; i < m_mcus_per_row; i++)
             {
-                *q++ = y; *q++ = cb; *q++ = cr;
+                load_tile(s, i); code_mcu(s, 0);
             }
         }
+    }
 
-        if (++m_mcu_y_ofs == m_mcu_y)
-        {
-            process_mcu_row();
-            m_mcu_y_ofs = 0;
+    // Code the MCU rows collected in the band. Row 0 goes straight to the output stream, the others are coded
+    // concurrently by the worker threads into their chunk streams and copied out behind it, separated by RSTn.
+    void jpeg_encoder::process_band()
+    {
+        const bool restarts = m_params.m_num_threads > 1;
+        const bool output = m_pass_num == 2;
+        const int rows = m_band_row;
+        const bool parallel = m_pPool && (rows > 1);
+
+        if (parallel) {
+            pthread_mutex_lock(&m_pPool->m_mutex);
+            m_pPool->m_busy = m_pPool->m_num_workers;
+            m_pPool->m_band_seq++;
+            pthread_cond_broadcast(&m_pPool->m_start_cond);
+            pthread_mutex_unlock(&m_pPool->m_mutex);
+        }
+
+        if (restarts) {
+            memset(m_seg.m_last_dc_val, 0, sizeof(m_seg.m_last_dc_val));
+        }
+        process_mcu_row(m_seg);
+        if (restarts && output) {
+            finish_segment(m_seg);
+        }
+
+        if (parallel) {
+            pthread_mutex_lock(&m_pPool->m_mutex);
+            while (m_pPool->m_busy) {
+                pthread_cond_wait(&m_pPool->m_done_cond, &m_pPool->m_mutex);
+            }
+            pthread_mutex_unlock(&m_pPool->m_mutex);
+
+            for (int i = 1; output && (i < rows); i++) {
+                thread_pool::worker &w = m_pPool->m_pWorkers[i - 1];
+                emit_marker(M_RST0 + m_next_restart_num);
+                m_next_restart_num = (m_next_restart_num + 1) & 7;
+                close_output_buffer(m_seg);
+                m_seg.m_all_stream_writes_succeeded = m_seg.m_all_stream_writes_succeeded && w.m_seg.m_all_stream_writes_succeeded && w.m_stream.write_to(m_pStream);
+                open_output_buffer(m_seg);
+            }
+        }
+
+        m_mcu_row += rows;
+        m_band_row = 0;
+        if (restarts && output && (m_mcu_row < m_mcu_rows)) {
+            emit_marker(M_RST0 + m_next_restart_num);
+            m_next_restart_num = (m_next_restart_num + 1) & 7;
+        }
+    }
+
+    void *jpeg_encoder::worker_thread(void *pArg)
+    {
+        thread_pool::worker *w = static_cast<thread_pool::worker*>(pArg);
+        jpeg_encoder *e = w->m_pEncoder;
+        thread_pool *pool = e->m_pPool;
+        uint band_seq = 0;
+
+        pthread_mutex_lock(&pool->m_mutex);
+        for ( ; ; ) {
+            while (!pool->m_quit && (pool->m_band_seq == band_seq)) {
+                pthread_cond_wait(&pool->m_start_cond, &pool->m_mutex);
+            }
+            if (pool->m_quit) {
+                break;
+            }
+            band_seq = pool->m_band_seq;
+            pthread_mutex_unlock(&pool->m_mutex);
+
+            if (w->m_index < e->m_band_row) {
+                w->m_stream.rewind();
+                e->reset_segment(w->m_seg, &w->m_stream);
+                e->process_mcu_row(w->m_seg);
+                if (e->m_pass_num == 2) {
+                    e->finish_segment(w->m_seg);
+                }
+            }
+
+            pthread_mutex_lock(&pool->m_mutex);
+            if (--pool->m_busy == 0) {
+                pthread_cond_signal(&pool->m_done_cond);
+            }
+        }
+        pthread_mutex_unlock(&pool->m_mutex);
+        return NULL;
+    }
+
+    // Start m_num_threads - 1 workers. Returns false if none could be started, the caller then codes
+    // every MCU row itself (still with restart markers).
+    bool jpeg_encoder::start_threads()
+    {
+        const int num_workers = m_params.m_num_threads - 1;
+        thread_pool *pool = static_cast<thread_pool*>(jpge_malloc(sizeof(thread_pool)));
+        if (!pool) {
+            return false;
+        }
+        pool->m_pWorkers = static_cast<thread_pool::worker*>(jpge_malloc(sizeof(thread_pool::worker) * num_workers));
+        if (!pool->m_pWorkers) {
+            jpge_free(pool);
+            return false;
+        }
+        pthread_mutex_init(&pool->m_mutex, NULL);
+        pthread_cond_init(&pool->m_start_cond, NULL);
+        pthread_cond_init(&pool->m_done_cond, NULL);
+        pool->m_band_seq = 0;
+        pool->m_busy = 0;
+        pool->m_quit = false;
+        pool->m_num_workers = 0;
+        m_pPool = pool;
+
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+#ifdef ESP_PLATFORM
+        pthread_attr_setstacksize(&attr, 4096);
+#endif
+        for (int i = 0; i < num_workers; i++) {
+            thread_pool::worker *w = new (&pool->m_pWorkers[i]) thread_pool::worker;
+            w->m_pEncoder = this;
+            w->m_index = i + 1;
+            if (pthread_create(&w->m_thread, &attr, worker_thread, w) != 0) {
+                w->~worker();
+                break;
+            }
+            pool->m_num_workers++;
+        }
+        pthread_attr_destroy(&attr);
+
+        if (!pool->m_num_workers) {
+            stop_threads();
+            return false;
+        }
+        return true;
+    }
+
+    void jpeg_encoder::stop_threads()
+    {
+        thread_pool *pool = m_pPool;
+        if (!pool) {
+            return;
+        }
+        pthread_mutex_lock(&pool->m_mutex);
+        pool->m_quit = true;
+        pthread_cond_broadcast(&pool->m_start_cond);
+        pthread_mutex_unlock(&pool->m_mutex);
+        for (int i = 0; i < pool->m_num_workers; i++) {
+            pthread_join(pool->m_pWorkers[i].m_thread, NULL);
+            pool->m_pWorkers[i].~worker();
+        }
+        pthread_cond_destroy(&pool->m_done_cond);
+        pthread_cond_destroy(&pool->m_start_cond);
+        pthread_mutex_destroy(&pool->m_mutex);
+        jpge_free(pool->m_pWorkers);
+        jpge_free(pool);
+        m_pPool = NULL;
+    }
+
+    void jpeg_encoder::convert_pixels(uint8 *pDst, const uint8 *pSrc, int num_pixels)
+    {
+        // A scaled YUYV line has the V sample of an odd last pixel, convert the whole pair. There is
+        // always room for the extra pixel, pad_pixels() overwrites it.
+        if (m_scale_shift && (m_image_bpp == 2))
+            num_pixels = (num_pixels + 1) & ~1;
+        if (m_num_components == 1) {
+            if (m_image_bpp == 3)
+                RGB_to_Y(pDst, pSrc, num_pixels);
+            else if (m_image_bpp == 2)
+                YUYV_to_Y(pDst, pSrc, num_pixels);
+            else
+                memcpy(pDst, pSrc, num_pixels);
+        } else {
+            if (m_image_bpp == 3)
+                RGB_to_YCC(pDst, pSrc, num_pixels);
+            else if (m_image_bpp == 2)
+                YUYV_to_YCC(pDst, pSrc, num_pixels);
+            else
+                Y_to_YCC(pDst, pSrc, num_pixels);
+        }
+    }
+
+    // Duplicate the last of num_pixels converted pixels up to total_pixels.
+    void jpeg_encoder::pad_pixels(uint8 *pDst, int num_pixels, int total_pixels)
+    {
+        if (m_num_components == 1)
+            memset(pDst + num_pixels, pDst[num_pixels - 1], total_pixels - num_pixels);
+        else
+        {
+            const uint8 y = pDst[num_pixels * 3 - 3 + 0], cb = pDst[num_pixels * 3 - 3 + 1], cr = pDst[num_pixels * 3 - 3 + 2];
+            uint8 *q = pDst + num_pixels * 3;
+            for (int i = num_pixels; i < total_pixels; i++)
+            {
+                *q++ = y; *q++ = cb; *q++ = cr;
+            }
+        }
+    }
+
+    // Box filter for m_scale > 1: add the sums over each run of m_scale source pixels to pAcc, which has one entry
+    // per byte of the scaled line. The scaled line keeps the source pixel format, so it converts like a source line.
+    void jpeg_encoder::accumulate_pixels(uint16 *pAcc, const uint8 *pSrc, int num_pixels)
+    {
+        const int shift = m_scale_shift;
+        if (m_image_bpp == 1)
+        {
+            for (int x = 0; x < num_pixels; x++)
+                pAcc[x >> shift] += pSrc[x];
+        }
+        else if (m_image_bpp == 3)
+        {
+            for (int x = 0; x < num_pixels; x++, pSrc += 3)
+            {
+                uint16 *p = pAcc + (x >> shift) * 3;
+                p[0] += pSrc[0]; p[1] += pSrc[1]; p[2] += pSrc[2];
+            }
+        }
+        else
+        {
+            // YUYV: both pixels of a source pair go to the same scaled pixel, its chroma to that pixel's pair.
+            // An odd last pixel has no V sample, its U stands in like in YUYV_to_YCC().
+            for (int x = 0; x < num_pixels; x += 2, pSrc += 4)
+            {
+                const int q = x >> shift;
+                uint16 *p = pAcc + (q >> 1) * 4;
+                if (x + 1 < num_pixels)
+                {
+                    p[(q & 1) * 2] += pSrc[0] + pSrc[2];
+                    p[1] += pSrc[1]; p[3] += pSrc[3];
+                }
+                else
+                {
+                    p[(q & 1) * 2] += pSrc[0];
+                    p[1] += pSrc[1]; p[3] += pSrc[1];
+                }
+            }
         }
     }
 
+    // Divide n box sums by the number of samples in them, and clear them for the next run.
+    static inline void box_average(uint8 *pDst, uint16 *pAcc, int n, int count)
+    {
+        if ((count & (count - 1)) == 0)
+        {
+            const int shift = JPGE_NBITS(count) - 1;
+            for (int i = 0; i < n; i++)
+            {
+                pDst[i] = static_cast<uint8>((pAcc[i] + (count >> 1)) >> shift);
+                pAcc[i] = 0;
+            }
+        }
+        else
+        {
+            for (int i = 0; i < n; i++)
+            {
+                pDst[i] = static_cast<uint8>((pAcc[i] + (count >> 1)) / count);
+                pAcc[i] = 0;
+            }
+        }
+    }
+
+    // Turn the sums of num_rows accumulated lines of num_pixels source pixels into the scaled line.
+    // Only the last scaled pixel (pair for YUYV) may have fewer source pixels than m_scale x num_rows.
+    void jpeg_encoder::average_pixels(uint8 *pDst, uint16 *pAcc, int num_pixels, int num_rows)
+    {
+        const int shift = m_scale_shift;
+        if (m_image_bpp != 2)
+        {
+            const int n = (num_pixels >> shift) * m_image_bpp;
+            const int rest = num_pixels & ((1 << shift) - 1);
+            box_average(pDst, pAcc, n, num_rows << shift);
+            if (rest)
+                box_average(pDst + n, pAcc + n, m_image_bpp, num_rows * rest);
+        }
+        else
+        {
+            const int n = (num_pixels >> (shift + 1)) * 4;
+            const int rest = num_pixels - (n << shift) / 2;
+            box_average(pDst, pAcc, n, num_rows << shift);
+            if (rest)
+            {
+                uint8 *q = pDst + n;
+                uint16 *p = pAcc + n;
+                box_average(q + 0, p + 0, 1, num_rows * JPGE_MIN(rest, 1 << shift));
+                if (rest > (1 << shift))
+                    box_average(q + 2, p + 2, 1, num_rows * (rest - (1 << shift)));
+                else
+                    q[2] = q[0];
+                box_average(q + 1, p + 1, 1, num_rows * ((rest + 1) >> 1));
+                box_average(q + 3, p + 3, 1, num_rows * ((rest + 1) >> 1));
+            }
+        }
+    }
+
+    // Hand the MCU row collected at m_band_row of the MCU line buffer to its segment.
+    void jpeg_encoder::end_mcu_row()
+    {
+        segment *s = m_band_segs[m_band_row];
+        s->m_pSrc = m_mcu_buf + m_band_row * m_mcu_y * m_image_bpl_mcu;
+        s->m_src_stride = m_image_bpl_mcu;
+        s->m_src_rows = m_mcu_y;
+        s->m_src_ycc = true;
+        m_mcu_y_ofs = 0;
+        if (++m_band_row == m_band_size)
+        {
+            process_band();
+        }
+    }
+
+    void jpeg_encoder::load_line(const uint8 *pSrc)
+    {
+        uint8* pDst = m_mcu_buf + (m_band_row * m_mcu_y + m_mcu_y_ofs) * m_image_bpl_mcu;
+        convert_pixels(pDst, pSrc, m_image_x);
+
+        // Possibly duplicate pixels at end of scanline if not a multiple of 8 or 16
+        pad_pixels(pDst, m_image_x, m_image_x_mcu);
+
+        if (++m_mcu_y_ofs == m_mcu_y)
+            end_mcu_row();
+    }
+
+    bool jpeg_encoder::load_mcu(const void *pSrc)
+    {
+        // The MCU line buffer is only needed when the image comes in scanline by scanline.
+        if (!m_mcu_buf)
+        {
+            if ((m_mcu_buf = static_cast<uint8*>(alloc(m_image_bpl_mcu * m_mcu_y * m_band_size))) == NULL)
+                return false;
+        }
+        if (!m_scale_shift)
+        {
+            load_line(static_cast<const uint8*>(pSrc));
+            return true;
+        }
+
+        // Scaled: sum up m_scale scanlines, one scaled line wide.
+        if (!m_scale_acc)
+        {
+            const int len = (m_image_bpp == 2) ? ((m_image_x + 1) & ~1) * 2 : m_image_x * m_image_bpp;
+            if ((m_scale_acc = static_cast<uint16*>(alloc(len * (sizeof(uint16) + 1)))) == NULL)
+                return false;
+            memset(m_scale_acc, 0, len * sizeof(uint16));
+            m_scale_line = reinterpret_cast<uint8*>(m_scale_acc + len);
+        }
+        accumulate_pixels(m_scale_acc, static_cast<const uint8*>(pSrc), m_src_x);
+        if (++m_scale_rows == (1 << m_scale_shift))
+        {
+            average_pixels(m_scale_line, m_scale_acc, m_src_x, m_scale_rows);
+            m_scale_rows = 0;
+            load_line(m_scale_line);
+        }
+        return true;
+    }
+
     // Quantization table generation.
+    static int32 quality_scale(int quality)
+    {
+        return (quality < 50) ? 5000 / quality : 200 - quality * 2;
+    }
+
     void jpeg_encoder::compute_quant_table(int32 *pDst, const int16 *pSrc)
     {
-        int32 q;
-        if (m_params.m_quality < 50)
-            q = 5000 / m_params.m_quality;
-        else
-            q = 200 - m_params.m_quality * 2;
+        int32 q = quality_scale(m_params.m_quality);
         for (int i = 0; i < 64; i++)
         {
             int32 j = *pSrc++; j = (j * q + 50L) / 100L;
@@ -560,6 +1571,12 @@ namespace jpge {
         }
     }
 
+    void jpeg_encoder::compute_quant_reciprocals(int table)
+    {
+        for (int i = 0; i < 64; i++)
+            compute_quant_reciprocal(m_quantization_tables[table][i], &m_quant_recip[table][i], &m_quant_bias[table][i], &m_quant_shift[table][i]);
+    }
+
     // Higher-level methods.
     bool jpeg_encoder::jpg_open(int p_x_res, int p_y_res, int src_channels)
     {
@@ -598,7 +1615,10 @@ namespace jpge {
             }
         }
 
-        m_image_x        = p_x_res; m_image_y = p_y_res;
+        m_src_x          = p_x_res; m_src_y = p_y_res;
+        m_scale_shift    = (m_params.m_scale == 4) ? 2 : (m_params.m_scale == 2) ? 1 : 0;
+        m_image_x        = (p_x_res + m_params.m_scale - 1) >> m_scale_shift;
+        m_image_y        = (p_y_res + m_params.m_scale - 1) >> m_scale_shift;
         m_image_bpp      = src_channels;
         m_image_bpl      = m_image_x * src_channels;
         m_image_x_mcu    = (m_image_x + m_mcu_x - 1) & (~(m_mcu_x - 1));
@@ -607,79 +1627,193 @@ namespace jpge {
         m_image_bpl_mcu  = m_image_x_mcu * m_num_components;
         m_mcus_per_row   = m_image_x_mcu / m_mcu_x;
 
-        if ((m_mcu_lines[0] = static_cast<uint8*>(jpge_malloc(m_image_bpl_mcu * m_mcu_y))) == NULL) {
-            return false;
-        }
-        for (int i = 1; i < m_mcu_y; i++)
-            m_mcu_lines[i] = m_mcu_lines[i-1] + m_image_bpl_mcu;
+        m_mcu_rows       = m_image_y_mcu / m_mcu_y;
 
-        if(m_last_quality != m_params.m_quality){
-            m_last_quality = m_params.m_quality;
-            compute_quant_table(m_quantization_tables[0], s_std_lum_quant);
-            compute_quant_table(m_quantization_tables[1], s_std_croma_quant);
+        // In parallel mode a band of one MCU row per thread is coded at once.
+        m_band_size = 1;
+        m_band_segs[0] = &m_seg;
+        if ((m_params.m_num_threads > 1) && (m_pPool || start_threads())) {
+            m_band_size += m_pPool->m_num_workers;
+            for (int i = 1; i < m_band_size; i++) {
+                m_band_segs[i] = &m_pPool->m_pWorkers[i - 1].m_seg;
+            }
         }
 
-        if(!m_huff_initialized){
-            m_huff_initialized = true;
 
-            memcpy(m_huff_bits[0+0], s_dc_lum_bits, 17);    memcpy(m_huff_val[0+0], s_dc_lum_val, DC_LUM_CODES);
-            memcpy(m_huff_bits[2+0], s_ac_lum_bits, 17);    memcpy(m_huff_val[2+0], s_ac_lum_val, AC_LUM_CODES);
-            memcpy(m_huff_bits[0+1], s_dc_chroma_bits, 17); memcpy(m_huff_val[0+1], s_dc_chroma_val, DC_CHROMA_CODES);
-            memcpy(m_huff_bits[2+1], s_ac_chroma_bits, 17); memcpy(m_huff_val[2+1], s_ac_chroma_val, AC_CHROMA_CODES);
+        compute_quant_table(m_quantization_tables[0], s_std_lum_quant);
+        compute_quant_table(m_quantization_tables[1], s_std_croma_quant);
+        compute_quant_reciprocals(0);
+        compute_quant_reciprocals(1);
 
-            compute_huffman_table(&m_huff_codes[0+0][0], &m_huff_code_sizes[0+0][0], m_huff_bits[0+0], m_huff_val[0+0]);
-            compute_huffman_table(&m_huff_codes[2+0][0], &m_huff_code_sizes[2+0][0], m_huff_bits[2+0], m_huff_val[2+0]);
-            compute_huffman_table(&m_huff_codes[0+1][0], &m_huff_code_sizes[0+1][0], m_huff_bits[0+1], m_huff_val[0+1]);
-            compute_huffman_table(&m_huff_codes[2+1][0], &m_huff_code_sizes[2+1][0], m_huff_bits[2+1], m_huff_val[2+1]);
+        for (int i = 0; i < 4; i++) {
+            m_huff_codes[i] = s_huff_codes[i];
+            m_huff_code_sizes[i] = s_huff_code_sizes[i];
+        }
+        m_huff_bits[0+0] = s_dc_lum_bits;    m_huff_val[0+0] = s_dc_lum_val;
+        m_huff_bits[2+0] = s_ac_lum_bits;    m_huff_val[2+0] = s_ac_lum_val;
+        m_huff_bits[0+1] = s_dc_chroma_bits; m_huff_val[0+1] = s_dc_chroma_val;
+        m_huff_bits[2+1] = s_ac_chroma_bits; m_huff_val[2+1] = s_ac_chroma_val;
+
+        // Two pass mode: every segment of the band counts its symbols separately, they are summed up after pass 1.
+        if (m_params.m_two_pass_flag) {
+            m_pHuff = static_cast<huff_tables*>(alloc(sizeof(huff_tables)));
+            m_huff_count = static_cast<uint32*>(alloc(m_band_size * 4 * 256 * sizeof(uint32)));
+            if (!m_pHuff || !m_huff_count) {
+                return false;
+            }
+            memset(m_huff_count, 0, m_band_size * 4 * 256 * sizeof(uint32));
+            for (int i = 0; i < m_band_size; i++) {
+                m_band_segs[i]->m_pHuff_count = m_huff_count + i * 4 * 256;
+            }
         }
 
-        m_out_buf_left = JPGE_OUT_BUF_SIZE;
-        m_pOut_buf = m_out_buf;
-        m_bit_buffer = 0;
-        m_bits_in = 0;
+        m_pDCT2D = select_dct2d();
+        m_pQuantize = select_quantize();
+        return start_pass(m_params.m_two_pass_flag ? 1 : 2);
+    }
+
+    // Pass 1 only gathers Huffman statistics, pass 2 writes the JPEG file.
+    bool jpeg_encoder::start_pass(int pass_num)
+    {
+        m_pass_num = pass_num;
+        reset_segment(m_seg, m_pStream);
         m_mcu_y_ofs = 0;
-        m_pass_num = 2;
-        memset(m_last_dc_val, 0, 3 * sizeof(m_last_dc_val[0]));
+        m_scale_rows = 0;
+        m_band_row = 0;
+        m_mcu_row = 0;
+        m_next_restart_num = 0;
+        if (m_pass_num == 2) {
+            const uint start = output_size(m_seg);
+            emit_markers();
+            m_header_size = output_size(m_seg) - start;
+        }
+        return m_seg.m_all_stream_writes_succeeded;
+    }
 
-        // Emit all markers at beginning of image file.
-        emit_marker(M_SOI);
-        emit_jfif_app0();
-        emit_dqt();
-        emit_sof();
-        emit_dhts();
-        emit_sos();
+    // Build a length limited (16 bits) canonical Huffman table from the symbol counts of pass 1.
+    void jpeg_encoder::optimize_huffman_table(int table_num, int table_len)
+    {
+        sym_freq *syms0 = m_pHuff->m_syms0;
+        syms0[0].m_key = 1; syms0[0].m_sym_index = 0;  // dummy symbol, assures that no valid code contains all 1's
+        int num_used_syms = 1;
+        const uint32 *pSym_count = m_huff_count + table_num * 256;
+        for (int i = 0; i < table_len; i++) {
+            if (pSym_count[i]) {
+                syms0[num_used_syms].m_key = pSym_count[i];
+                syms0[num_used_syms++].m_sym_index = i + 1;
+            }
+        }
+        sym_freq *pSyms = radix_sort_syms(num_used_syms, syms0, m_pHuff->m_syms1);
+        calculate_minimum_redundancy(pSyms, num_used_syms);
+
+        // Count the # of symbols of each code size.
+        int num_codes[1 + MAX_HUFF_CODESIZE];
+        memset(num_codes, 0, sizeof(num_codes));
+        for (int i = 0; i < num_used_syms; i++) {
+            num_codes[JPGE_MIN(pSyms[i].m_key, (uint)MAX_HUFF_CODESIZE)]++;
+        }
 
-        return m_all_stream_writes_succeeded;
+        const int JPGE_CODE_SIZE_LIMIT = 16;
+        huffman_enforce_max_code_size(num_codes, num_used_syms, JPGE_CODE_SIZE_LIMIT);
+
+        // Compute m_huff_bits array, which contains the # of symbols per code size.
+        uint8 *bits = m_pHuff->m_bits[table_num];
+        memset(bits, 0, 17);
+        for (int i = 1; i <= JPGE_CODE_SIZE_LIMIT; i++) {
+            bits[i] = static_cast<uint8>(num_codes[i]);
+        }
+
+        // Remove the dummy symbol added above, which must be in largest bucket.
+        for (int i = JPGE_CODE_SIZE_LIMIT; i >= 1; i--) {
+            if (bits[i]) {
+                bits[i]--;
+                break;
+            }
+        }
+
+        // Compute the m_huff_val array, which contains the symbol indices sorted by code size (smallest to largest).
+        uint8 *val = m_pHuff->m_val[table_num];
+        for (int i = num_used_syms - 1; i >= 1; i--) {
+            val[num_used_syms - 1 - i] = static_cast<uint8>(pSyms[i].m_sym_index - 1);
+        }
+
+        compute_huffman_table(m_pHuff->m_codes[table_num], m_pHuff->m_code_sizes[table_num], bits, val);
+        m_huff_codes[table_num] = m_pHuff->m_codes[table_num];
+        m_huff_code_sizes[table_num] = m_pHuff->m_code_sizes[table_num];
+        m_huff_bits[table_num] = bits;
+        m_huff_val[table_num] = val;
+    }
+
+    bool jpeg_encoder::terminate_pass_one()
+    {
+        uint32 *pTotal = m_huff_count;
+        for (int i = 1; i < m_band_size; i++) {
+            const uint32 *pCount = m_huff_count + i * 4 * 256;
+            for (int j = 0; j < 4 * 256; j++) {
+                pTotal[j] += pCount[j];
+            }
+        }
+        optimize_huffman_table(0+0, DC_LUM_CODES);
+        optimize_huffman_table(2+0, AC_LUM_CODES);
+        if (m_num_components > 1) {
+            optimize_huffman_table(0+1, DC_CHROMA_CODES);
+            optimize_huffman_table(2+1, AC_CHROMA_CODES);
+        }
+        return start_pass(2);
     }
 
     bool jpeg_encoder::process_end_of_image()
     {
+        if (m_scale_rows) {
+            average_pixels(m_scale_line, m_scale_acc, m_src_x, m_scale_rows);
+            m_scale_rows = 0;
+            load_line(m_scale_line);
+        }
         if (m_mcu_y_ofs) {
+            uint8 *pLines = m_mcu_buf + m_band_row * m_mcu_y * m_image_bpl_mcu;
             if (m_mcu_y_ofs < 16) { // check here just to shut up static analysis
                 for (int i = m_mcu_y_ofs; i < m_mcu_y; i++) {
-                    memcpy(m_mcu_lines[i], m_mcu_lines[m_mcu_y_ofs - 1], m_image_bpl_mcu);
+                    memcpy(pLines + i * m_image_bpl_mcu, pLines + (m_mcu_y_ofs - 1) * m_image_bpl_mcu, m_image_bpl_mcu);
                 }
             }
-            process_mcu_row();
+            end_mcu_row();
+        }
+        if (m_band_row) {
+            process_band();
         }
 
-        put_bits(0x7F, 7);
+        if (m_pass_num == 1) {
+            return terminate_pass_one();
+        }
+
+        flush_bits(m_seg);
         emit_marker(M_EOI);
-        flush_output_buffer();
-        m_all_stream_writes_succeeded = m_all_stream_writes_succeeded && m_pStream->put_buf(NULL, 0);
+        close_output_buffer(m_seg);
+        m_seg.m_all_stream_writes_succeeded = m_seg.m_all_stream_writes_succeeded && m_pStream->put_buf(NULL, 0);
         m_pass_num++; // purposely bump up m_pass_num, for debugging
         return true;
     }
 
     void jpeg_encoder::clear()
     {
-        m_mcu_lines[0] = NULL;
+        m_mcu_buf = NULL;
+        m_scale_acc = NULL;
+        m_scale_rows = 0;
+        m_pHuff = NULL;
+        m_huff_count = NULL;
+        m_seg.m_pHuff_count = NULL;
+        m_seg.m_pWindow = NULL;
         m_pass_num = 0;
-        m_all_stream_writes_succeeded = true;
+        m_header_size = 0;
+        m_seg.m_all_stream_writes_succeeded = true;
+        m_arena_used = 0;
     }
 
     jpeg_encoder::jpeg_encoder()
     {
+        m_pPool = NULL;
+        m_pArena = NULL;
+        m_arena_size = 0;
         clear();
     }
 
@@ -690,33 +1824,331 @@ namespace jpge {
 
     bool jpeg_encoder::init(output_stream *pStream, int width, int height, int src_channels, const params &comp_params)
     {
-        deinit();
-        if (((!pStream) || (width < 1) || (height < 1)) || ((src_channels != 1) && (src_channels != 3) && (src_channels != 4)) || (!comp_params.check())) return false;
+        if (m_pPool && (m_params.m_num_threads != comp_params.m_num_threads))
+            stop_threads();
+        free_buffers();
+        clear();
+        if (((!pStream) || (width < 1) || (height < 1)) || ((src_channels < 1) || (src_channels > 3)) || (!comp_params.check())) return false;
         m_pStream = pStream;
         m_params = comp_params;
         return jpg_open(width, height, src_channels);
     }
 
+    void jpeg_encoder::free_buffers()
+    {
+        release(m_mcu_buf);
+        release(m_scale_acc);
+        release(m_pHuff);
+        release(m_huff_count);
+    }
+
     void jpeg_encoder::deinit()
     {
-        jpge_free(m_mcu_lines[0]);
+        stop_threads();
+        free_buffers();
         clear();
     }
 
+    void jpeg_encoder::set_arena(void *pArena, uint size)
+    {
+        deinit();
+        m_pArena = static_cast<uint8*>(pArena);
+        m_arena_size = pArena ? size : 0;
+    }
+
+    // Arena blocks are 16 byte aligned, enough for anything the encoder keeps in them.
+    static inline uint arena_align(uint size)
+    {
+        return (size + 15) & ~15U;
+    }
+
+    void *jpeg_encoder::alloc(uint size)
+    {
+        if (!m_pArena)
+            return jpge_malloc(size);
+        size = arena_align(size);
+        if (size > m_arena_size - m_arena_used)
+            return NULL;
+        void *p = m_pArena + m_arena_used;
+        m_arena_used += size;
+        return p;
+    }
+
+    // Arena blocks go away all at once, with the next init().
+    void jpeg_encoder::release(void *p)
+    {
+        if (!m_pArena)
+            jpge_free(p);
+    }
+
+    // Has to follow the buffer sizes in load_mcu() and jpg_open(), for the largest band (one MCU row per thread).
+    uint jpeg_encoder::get_arena_size(int width, int height, int src_channels, const params &comp_params)
+    {
+        (void)height;
+        const int shift = (comp_params.m_scale == 4) ? 2 : (comp_params.m_scale == 2) ? 1 : 0;
+        const int image_x = (width + comp_params.m_scale - 1) >> shift;
+        const int num_components = (comp_params.m_subsampling == Y_ONLY) ? 1 : 3;
+        const int mcu_x = (comp_params.m_subsampling >= H2V1) ? 16 : 8;
+        const int mcu_y = (comp_params.m_subsampling == H2V2) ? 16 : 8;
+        const int band_size = comp_params.m_num_threads;
+        uint size = arena_align(((image_x + mcu_x - 1) & ~(mcu_x - 1)) * num_components * mcu_y * band_size);
+        if (shift) {
+            const int len = (src_channels == 2) ? ((image_x + 1) & ~1) * 2 : image_x * src_channels;
+            size += arena_align(len * (sizeof(uint16) + 1));
+        }
+        if (comp_params.m_two_pass_flag) {
+            size += arena_align(sizeof(huff_tables)) + arena_align(band_size * 4 * 256 * sizeof(uint32));
+        }
+        return size;
+    }
+
     bool jpeg_encoder::process_scanline(const void* pScanline)
     {
         if ((m_pass_num < 1) || (m_pass_num > 2)) {
             return false;
         }
-        if (m_all_stream_writes_succeeded) {
+        if (m_seg.m_all_stream_writes_succeeded) {
             if (!pScanline) {
                 if (!process_end_of_image()) {
                     return false;
                 }
-            } else {
-                load_mcu(pScanline);
+            } else if (!load_mcu(pScanline)) {
+                return false;
+            }
+        }
+        return m_seg.m_all_stream_writes_succeeded;
+    }
+
+    bool jpeg_encoder::process_lines(const void *pLines, int stride, int num_rows)
+    {
+        if ((m_pass_num < 1) || (m_pass_num > 2) || m_mcu_y_ofs || m_scale_rows || (num_rows < 0)) {
+            return false;
+        }
+        const uint8 *pSrc = static_cast<const uint8*>(pLines);
+        while ((num_rows > 0) && m_seg.m_all_stream_writes_succeeded) {
+            // Only the last MCU row of the image may be cut short, and nothing may follow it.
+            const int mcu_src_rows = m_mcu_y << m_scale_shift;
+            int rows = JPGE_MIN(m_src_y - (m_mcu_row + m_band_row) * mcu_src_rows, mcu_src_rows);
+            if ((rows <= 0) || (num_rows < rows)) {
+                return false;
+            }
+            segment *s = m_band_segs[m_band_row];
+            s->m_pSrc = pSrc;
+            s->m_src_stride = stride;
+            s->m_src_rows = rows;
+            s->m_src_ycc = false;
+            if (++m_band_row == m_band_size) {
+                process_band();
+            }
+            pSrc += rows * stride;
+            num_rows -= rows;
+        }
+        // Don't keep pointers into the caller's buffer past this call.
+        if (m_band_row) {
+            process_band();
+        }
+        return m_seg.m_all_stream_writes_succeeded;
+    }
+
+    bool jpeg_encoder::process_frame(const void *pFrame, int stride)
+    {
+        if (!process_lines(pFrame, stride, m_src_y)) {
+            return false;
+        }
+        return process_scanline(NULL);
+    }
+
+    coef_encoder::coef_encoder() : m_pStream(NULL), m_num_components(0), m_bit_buffer(0), m_bits_in(0), m_out_len(0), m_all_stream_writes_succeeded(false)
+    {
+        memset(m_comp_table, 0, sizeof(m_comp_table));
+        memset(m_last_dc_val, 0, sizeof(m_last_dc_val));
+    }
+
+    void coef_encoder::flush_output_buffer()
+    {
+        if (m_out_len) {
+            m_all_stream_writes_succeeded = m_all_stream_writes_succeeded && m_pStream->put_buf(m_out_buf, m_out_len);
+            m_out_len = 0;
+        }
+    }
+
+    inline void coef_encoder::emit_byte(uint8 i)
+    {
+        m_out_buf[m_out_len++] = i;
+        if (m_out_len == OUT_BUF_SIZE) {
+            flush_output_buffer();
+        }
+    }
+
+    inline void coef_encoder::emit_coded_byte(uint8 c)
+    {
+        emit_byte(c);
+        if (c == 0xFF) {
+            emit_byte(0);
+        }
+    }
+
+    void coef_encoder::emit_word(uint i)
+    {
+        emit_byte(uint8(i >> 8)); emit_byte(uint8(i & 0xFF));
+    }
+
+    void coef_encoder::emit_marker(int marker)
+    {
+        emit_byte(uint8(0xFF)); emit_byte(uint8(marker));
+    }
+
+    void coef_encoder::emit_dht(const uint8 *bits, const uint8 *val, int index, bool ac_flag)
+    {
+        const int length = huff_num_codes(bits);
+        emit_marker(M_DHT);
+        emit_word(length + 2 + 1 + 16);
+        emit_byte(static_cast<uint8>(index + (ac_flag << 4)));
+        for (int i = 1; i <= 16; i++)
+            emit_byte(bits[i]);
+        for (int i = 0; i < length; i++)
+            emit_byte(val[i]);
+    }
+
+    // Same bit buffer as jpeg_encoder::put_bits(), without the word-at-a-time shortcut.
+    inline void coef_encoder::put_bits(uint bits, uint len)
+    {
+        m_bit_buffer = (m_bit_buffer << len) | bits;
+        m_bits_in += len;
+        while (m_bits_in >= 8) {
+            m_bits_in -= 8;
+            emit_coded_byte(static_cast<uint8>(m_bit_buffer >> m_bits_in));
+        }
+    }
+
+    bool coef_encoder::init(output_stream *pStream, int width, int height, int num_components, const component *pComps, const uint16 *const *pQuant)
+    {
+        if ((!pStream) || (width < 1) || (height < 1) || (width > 65535) || (height > 65535) || ((num_components != 1) && (num_components != 3))) {
+            return false;
+        }
+        bool extended = false, wide[4] = { false, false, false, false };
+        for (int i = 0; i < num_components; i++) {
+            const component &c = pComps[i];
+            if ((c.m_quant > 3) || (!pQuant[c.m_quant]) || (c.m_h_samp < 1) || (c.m_h_samp > 4) || (c.m_v_samp < 1) || (c.m_v_samp > 4)) {
+                return false;
+            }
+            for (int k = 0; k < 64; k++) {
+                wide[c.m_quant] = wide[c.m_quant] || (pQuant[c.m_quant][k] > 255);
             }
+            extended = extended || wide[c.m_quant];
+            m_comp_table[i] = (i > 0);
         }
+        m_pStream = pStream;
+        m_num_components = num_components;
+        memset(m_last_dc_val, 0, sizeof(m_last_dc_val));
+        m_bit_buffer = 0;
+        m_bits_in = 0;
+        m_out_len = 0;
+        m_all_stream_writes_succeeded = true;
+
+        emit_marker(M_SOI);
+        for (int t = 0; t < 4; t++) {
+            if (!pQuant[t]) {
+                continue;
+            }
+            emit_marker(M_DQT);
+            emit_word(2 + 1 + 64 * (wide[t] ? 2 : 1));
+            emit_byte(static_cast<uint8>((wide[t] << 4) | t));
+            for (int k = 0; k < 64; k++) {
+                if (wide[t]) {
+                    emit_byte(static_cast<uint8>(pQuant[t][k] >> 8));
+                }
+                emit_byte(static_cast<uint8>(pQuant[t][k]));
+            }
+        }
+        emit_marker(extended ? M_SOF1 : M_SOF0);
+        emit_word(3 * num_components + 2 + 5 + 1);
+        emit_byte(8);
+        emit_word(height);
+        emit_word(width);
+        emit_byte(static_cast<uint8>(num_components));
+        for (int i = 0; i < num_components; i++) {
+            emit_byte(pComps[i].m_id);
+            emit_byte(static_cast<uint8>((pComps[i].m_h_samp << 4) + pComps[i].m_v_samp));
+            emit_byte(pComps[i].m_quant);
+        }
+        emit_dht(s_dc_lum_bits, s_dc_lum_val, 0, false);
+        emit_dht(s_ac_lum_bits, s_ac_lum_val, 0, true);
+        if (num_components == 3) {
+            emit_dht(s_dc_chroma_bits, s_dc_chroma_val, 1, false);
+            emit_dht(s_ac_chroma_bits, s_ac_chroma_val, 1, true);
+        }
+        emit_marker(M_SOS);
+        emit_word(2 * num_components + 2 + 1 + 3);
+        emit_byte(static_cast<uint8>(num_components));
+        for (int i = 0; i < num_components; i++) {
+            emit_byte(pComps[i].m_id);
+            emit_byte(static_cast<uint8>((m_comp_table[i] << 4) + m_comp_table[i]));
+        }
+        emit_byte(0);     /* spectral selection */
+        emit_byte(63);
+        emit_byte(0);
+        return m_all_stream_writes_succeeded;
+    }
+
+    void coef_encoder::get_std_quant_table(int quality, bool chroma, uint16 *pDst)
+    {
+        const int16 *pSrc = chroma ? s_std_croma_quant : s_std_lum_quant;
+        int32 q = quality_scale(JPGE_MIN(JPGE_MAX(quality, 1), 100));
+        for (int i = 0; i < 64; i++)
+        {
+            int32 j = (pSrc[i] * q + 50L) / 100L;
+            pDst[i] = static_cast<uint16>(JPGE_MIN(JPGE_MAX(j, 1), 255));
+        }
+    }
+
+    void coef_encoder::code_block(int c, const int16 *pCoefs)
+    {
+        const int t = m_comp_table[c];
+        const uint *dc_codes = s_huff_codes[0 + t], *ac_codes = s_huff_codes[2 + t];
+        const uint8 *dc_sizes = s_huff_code_sizes[0 + t], *ac_sizes = s_huff_code_sizes[2 + t];
+
+        int temp1, temp2, nbits;
+        temp1 = temp2 = pCoefs[0] - m_last_dc_val[c];
+        m_last_dc_val[c] = pCoefs[0];
+        if (temp1 < 0) {
+            temp1 = -temp1; temp2--;
+        }
+        nbits = JPGE_NBITS(temp1);
+        put_bits((dc_codes[nbits] << nbits) | (temp2 & ((1 << nbits) - 1)), dc_sizes[nbits] + nbits);
+
+        int run_len = 0;
+        for (int i = 1; i < 64; i++) {
+            if (!(temp1 = temp2 = pCoefs[i])) {
+                run_len++;
+                continue;
+            }
+            for ( ; run_len >= 16; run_len -= 16)
+                put_bits(ac_codes[0xF0], ac_sizes[0xF0]);
+            if (temp1 < 0) {
+                temp1 = -temp1; temp2--;
+            }
+            nbits = JPGE_NBITS(temp1);
+            const int j = (run_len << 4) + nbits;
+            put_bits((ac_codes[j] << nbits) | (temp2 & ((1 << nbits) - 1)), ac_sizes[j] + nbits);
+            run_len = 0;
+        }
+        if (run_len)
+            put_bits(ac_codes[0], ac_sizes[0]);
+    }
+
+    bool coef_encoder::finish()
+    {
+        if (!m_pStream) {
+            return false;
+        }
+        put_bits(0x7F, 7);
+        m_bit_buffer = 0;
+        m_bits_in = 0;
+        emit_marker(M_EOI);
+        flush_output_buffer();
+        m_all_stream_writes_succeeded = m_all_stream_writes_succeeded && m_pStream->put_buf(NULL, 0);
+        m_pStream = NULL;
         return m_all_stream_writes_succeeded;
     }
 
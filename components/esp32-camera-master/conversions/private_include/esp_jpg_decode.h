@@ -0,0 +1,57 @@
+// Copyright 2015-2016 Espressif Systems (Shanghai) PTE LTD
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#ifndef _ESP_JPG_DECODE_H_
+#define _ESP_JPG_DECODE_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "img_converters.h"
+
+    /**
+     * @brief Receives decoded lines
+     *
+     * @param arg       Pointer passed to esp_jpg_decode()
+     * @param y         Index of the first line
+     * @param width     Width in pixels of the lines
+     * @param lines     Number of lines, one MCU row (at most 16 >> scale)
+     * @param data      Lines of width * 3 bytes in B, G, R order
+     *
+     * @return true to continue decoding
+     */
+    typedef bool (* jpg_lines_cb)(void * arg, uint16_t y, uint16_t width, uint16_t lines, const uint8_t * data);
+
+    /**
+     * @brief Read the size the JPEG decodes to at scale from its headers
+     *
+     * @return false if the JPEG is not one the decoder supports
+     */
+    bool esp_jpg_get_size(const uint8_t *src, size_t src_len, jpg_scale_t scale, uint16_t * width, uint16_t * height);
+
+    /**
+     * @brief Decode a baseline JPEG, handing the lines to cb as each MCU row is done
+     *
+     * @return true if all lines were decoded and accepted by cb
+     */
+    bool esp_jpg_decode(const uint8_t *src, size_t src_len, jpg_scale_t scale, jpg_lines_cb cb, void * arg);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _ESP_JPG_DECODE_H_ */
@@ -0,0 +1,40 @@
+// Copyright 2015-2016 Espressif Systems (Shanghai) PTE LTD
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#ifndef _JPG_TRANSFORM_H_
+#define _JPG_TRANSFORM_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include "img_converters.h"
+#include "jpge.h"
+
+/**
+ * @brief Transform a baseline JPEG in the DCT domain, writing the result to pStream
+ *
+ * Backs jpg_transform() and jpg_transform_cb(), see there.
+ *
+ * @return true on success
+ */
+bool jpg_transform_stream(const uint8_t *src, size_t src_len, jpg_transform_t transform, const img_rect_t *crop, jpge::output_stream *pStream);
+
+/**
+ * @brief Requantize a baseline JPEG to a coarser quality, writing the result to pStream
+ *
+ * Backs jpg_requantize() and jpg_requantize_cb(), see there.
+ *
+ * @return true on success
+ */
+bool jpg_requantize_stream(const uint8_t *src, size_t src_len, uint8_t quality, jpge::output_stream *pStream);
+
+#endif /* _JPG_TRANSFORM_H_ */
@@ -0,0 +1,151 @@
+// jpgd.h - C++ class for baseline JPEG decompression.
+// Companion of jpge: decodes the baseline, Huffman coded JPEGs the OV2640 and jpge produce, optionally scaled down.
+#ifndef JPEG_DECODER_H
+#define JPEG_DECODER_H
+
+namespace jpgd
+{
+typedef unsigned char  uint8;
+typedef signed short   int16;
+typedef signed int     int32;
+typedef unsigned short uint16;
+typedef unsigned int   uint32;
+typedef unsigned int   uint;
+
+// Baseline JPEGs have at most 2 DC and 2 AC Huffman tables and 4 quantization tables.
+enum { JPGD_MAX_COMPONENTS = 3, JPGD_MAX_HUFF_TABLES = 2, JPGD_MAX_QUANT_TABLES = 4 };
+
+// Number of code bits resolved by a single table lookup, longer codes take the canonical code search.
+enum { JPGD_HUFF_LOOKAHEAD = 9 };
+
+// Scale shift 0..3: the output is 1, 2, 4 or 8 times smaller in both directions. At 1/8 only DC coefficients are used.
+enum { JPGD_MAX_SCALE_SHIFT = 3 };
+
+// Lossy JPEG decompression class. Output lines are 3 bytes per pixel in B, G, R order (grayscale images too).
+// The Huffman lookup tables make it about 10 KB, better not placed on a task stack.
+class jpeg_decoder
+{
+public:
+    // Entropy decoder state at the start of an MCU, see get_position().
+    struct position
+    {
+        const uint8 *m_pIn;
+        uint32 m_bit_buf;
+        int16 m_last_dc[JPGD_MAX_COMPONENTS];
+        uint16 m_restarts_left;
+        int16 m_bits_left;
+        bool m_marker_hit;
+    };
+
+    jpeg_decoder();
+    ~jpeg_decoder();
+
+    // Parses the headers of the JPEG in pData[0..len) up to the first scan and allocates the MCU row buffers.
+    // pData has to stay valid until the image is decoded. Fails on progressive, lossless or 12-bit images.
+    bool init(const uint8 *pData, uint len, int scale_shift = 0);
+
+    // Only parses the headers and returns the output size at scale_shift.
+    static bool get_size(const uint8 *pData, uint len, int scale_shift, int *pWidth, int *pHeight);
+
+    // Output size: the image size divided by the scale, rounded up.
+    inline int get_width() const { return m_out_x; }
+    inline int get_height() const { return m_out_y; }
+    inline int get_num_components() const { return m_comps_in_frame; }
+
+    // Decodes the next MCU row. Returns the number of output lines placed at *pLines (get_width() * 3 bytes each),
+    // 0 once all lines are out and -1 on corrupt data.
+    int decode_mcu_row(const uint8 **pLines);
+
+    void deinit();
+
+    // Lossless access to the quantized coefficients, for transforms and requantization without the pixels.
+    // init_coefficients() only parses the headers, nothing is allocated, and decode_mcu_row() is not available.
+    bool init_coefficients(const uint8 *pData, uint len);
+
+    // Decodes the next MCU (in raster order) into get_blocks_per_mcu() blocks of 64 quantized coefficients in
+    // zigzag order: the component 0 blocks row by row, then those of components 1 and 2. Fails on corrupt data,
+    // also on values a baseline JPEG can't hold (DC outside -1024..1023, AC outside -1023..1023).
+    bool decode_mcu_coefficients(int16 *pBlocks);
+
+    // The state before the next MCU. After set_position() decoding continues from there, so MCUs can be
+    // visited in any order once their positions are known.
+    void get_position(position *pPos) const;
+    void set_position(const position &pos);
+
+    inline int get_image_width() const { return m_image_x; }
+    inline int get_image_height() const { return m_image_y; }
+    inline int get_mcus_per_row() const { return m_mcus_per_row; }
+    inline int get_mcu_rows() const { return m_mcu_rows; }
+    inline int get_blocks_per_mcu() const { return (m_comps_in_frame == 1) ? 1 : m_max_h * m_max_v + 2; }
+    inline int get_component_id(int c) const { return m_comp[c].m_id; }
+    inline int get_h_samp(int c) const { return m_comp[c].m_h; }
+    inline int get_v_samp(int c) const { return m_comp[c].m_v; }
+    inline int get_quant_index(int c) const { return m_comp[c].m_quant; }
+    // Quantization table t in zigzag order, NULL if the image has none.
+    inline const uint16 *get_quant_table(int t) const { return m_quant_present[t] ? m_quant[t] : 0; }
+
+private:
+    jpeg_decoder(const jpeg_decoder &);
+    jpeg_decoder &operator =(const jpeg_decoder &);
+
+    struct huff_table
+    {
+        // (code length << 8) | symbol for every JPGD_HUFF_LOOKAHEAD bit prefix of a short code, 0 for longer codes
+        uint16 m_look[1 << JPGD_HUFF_LOOKAHEAD];
+        // AC tables: (value << 8) | (run << 4) | total bits when the code and the value bits both fit the prefix, else 0
+        int16 m_fast_ac[1 << JPGD_HUFF_LOOKAHEAD];
+        // largest code of each length (-1 if there is none) and index of its symbols in m_vals minus the first code
+        int32 m_maxcode[17];
+        int32 m_valoffset[17];
+        uint8 m_vals[256];
+        bool m_present;
+    };
+
+    struct component
+    {
+        uint8 m_id, m_h, m_v, m_quant;
+        uint8 m_dc_tab, m_ac_tab;
+        int32 m_last_dc;
+        uint8 *m_pPlane;        // MCU row of samples, m_plane_stride wide
+        uint m_plane_stride;
+    };
+
+    const uint8 *m_pIn, *m_pIn_end;
+    uint32 m_bit_buf;           // next bits of the entropy coded data, MSB first
+    int m_bits_left;
+    bool m_marker_hit;
+
+    int m_image_x, m_image_y;
+    int m_scale_shift, m_out_x, m_out_y;
+    int m_comps_in_frame;
+    component m_comp[JPGD_MAX_COMPONENTS];
+    int m_max_h, m_max_v;
+    int m_mcus_per_row, m_mcu_rows, m_mcu_row;
+    int m_restart_interval, m_restarts_left;
+    bool m_quant_present[JPGD_MAX_QUANT_TABLES];
+    uint16 m_quant[JPGD_MAX_QUANT_TABLES][64];
+    huff_table m_huff[2][JPGD_MAX_HUFF_TABLES];   // [0] DC, [1] AC
+    uint8 *m_pMem;              // one allocation for m_pCoef, the sample planes and m_pOut
+    int32 *m_pCoef;             // dequantized coefficients of the current block, natural order, zero between blocks
+    uint8 *m_pOut;              // the BGR lines of one MCU row
+
+    void clear();
+    bool read_headers(const uint8 *pData, uint len);
+    bool read_sof(const uint8 *p, uint len);
+    bool read_dht(const uint8 *p, uint len);
+    bool read_dqt(const uint8 *p, uint len);
+    bool read_sos(const uint8 *p, uint len);
+    void fill_bit_buf();
+    uint get_bits(int num_bits);
+    int decode_symbol(const huff_table &h);
+    bool process_restart();
+    bool decode_block(component &c, int32 *pCoef, int *pLast);
+    bool decode_block_coefficients(component &c, int16 *pZZ);
+    bool start_mcu();
+    void store_block(const int32 *pCoef, int last, uint8 *pDst, uint stride);
+    void convert_lines(int num_lines);
+};
+
+} // namespace jpgd
+
+#endif // JPEG_DECODER_H
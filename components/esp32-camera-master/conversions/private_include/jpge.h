@@ -11,15 +11,19 @@ typedef signed short   int16;
 typedef signed int     int32;
 typedef unsigned short uint16;
 typedef unsigned int   uint32;
+typedef unsigned long long uint64;
 typedef unsigned int   uint;
 
 // JPEG chroma subsampling factors. Y_ONLY (grayscale images) and H2V2 (color images) are the most common.
 enum subsampling_t { Y_ONLY = 0, H1V1 = 1, H2V1 = 2, H2V2 = 3 };
 
+// Maximum number of MCU rows encoded concurrently (params::m_num_threads).
+enum { JPGE_MAX_THREADS = 8 };
+
 // JPEG compression parameters structure.
 struct params
 {
-    inline params() : m_quality(85), m_subsampling(H2V2) { }
+    inline params() : m_quality(85), m_subsampling(H2V2), m_num_threads(1), m_two_pass_flag(false), m_scale(1) { }
 
     inline bool check() const
     {
@@ -31,6 +35,14 @@ struct params
         {
             return false;
         }
+        if ((m_num_threads < 1) || (m_num_threads > JPGE_MAX_THREADS))
+        {
+            return false;
+        }
+        if ((m_scale != 1) && (m_scale != 2) && (m_scale != 4))
+        {
+            return false;
+        }
         return true;
     }
 
@@ -43,6 +55,21 @@ struct params
     // 2 = H2V1 subsampling (YCbCr 2x1x1, 4 blocks per MCU)
     // 3 = H2V2 subsampling (YCbCr 4x1x1, 6 blocks per MCU-- very common)
     subsampling_t m_subsampling;
+
+    // m_num_threads:
+    // 1 = one entropy coded segment, no restart markers (default)
+    // >1 = a restart interval (DRI/RSTn) at every MCU row, and up to this many MCU rows are
+    //      DCT'd and entropy coded at the same time, each on its own thread.
+    int m_num_threads;
+
+    // m_two_pass_flag: If true, the image is fed to the encoder twice. Pass 1 gathers symbol statistics,
+    // pass 2 codes with Huffman tables optimized for this image (typically 5-10% smaller at the same quality).
+    // Use get_total_passes() to loop over the passes.
+    bool m_two_pass_flag;
+
+    // m_scale: 1, 2 or 4. The image is box filtered down by this factor while it is loaded, the JPEG is
+    // ceil(width / m_scale) x ceil(height / m_scale). init() and the process_*() functions still take the source image.
+    int m_scale;
 };
 
 // Output stream abstract class - used by the jpeg_encoder class to write to the output stream.
@@ -53,6 +80,13 @@ public:
     virtual ~output_stream() { };
     virtual bool put_buf(const void* Pbuf, int len) = 0;
     virtual uint get_size() const = 0;
+
+    // Optional zero-copy interface. get_write_buf() returns memory owned by the stream, at least min_len bytes
+    // (the actual size goes to *pLen), which the encoder then codes into directly. commit_write_buf() hands the
+    // first len bytes of it back. Return NULL if not supported or out of space, the encoder then stages the data
+    // in its own buffer and calls put_buf() as usual.
+    virtual uint8 *get_write_buf(uint /*min_len*/, uint * /*pLen*/) { return 0; }
+    virtual bool commit_write_buf(uint /*len*/) { return false; }
 };
 
 // Lower level jpeg_encoder class - useful if more control is needed than the above helper functions.
@@ -66,25 +100,90 @@ public:
     // pStream: The stream object to use for writing compressed data.
     // params - Compression parameters structure, defined above.
     // width, height  - Image dimensions.
-    // channels - May be 1, or 3. 1 indicates grayscale, 3 indicates RGB source data.
+    // channels - May be 1, 2 or 3. 1 indicates grayscale, 2 YUYV (YCbCr 4:2:2 as the camera outputs it, encoded
+    // without a trip through RGB), 3 indicates RGB source data.
     // Returns false on out of memory or if a stream write fails.
     bool init(output_stream *pStream, int width, int height, int src_channels, const params &comp_params = params());
 
     // Call this method with each source scanline.
-    // width * src_channels bytes per scanline is expected (RGB or Y format).
+    // width * src_channels bytes per scanline is expected (RGB, YUYV or Y format).
     // You must call with NULL after all scanlines are processed to finish compression.
     // Returns false on out of memory or if a stream write fails.
     bool process_scanline(const void* pScanline);
 
+    // Alternative to process_scanline(): compresses num_rows scanlines stored stride bytes apart. Blocks are read
+    // straight from the caller's buffer (converted an MCU at a time where needed), without the MCU line buffer.
+    // num_rows must be a multiple of the MCU height (8, or 16 for H2V2) except for the last rows of the image, and
+    // no more than the image has left; returns false otherwise.
+    // The buffer may be reused as soon as the call returns. Don't mix with process_scanline() within a pass.
+    bool process_lines(const void *pLines, int stride, int num_rows);
+
+    // Compresses a whole frame with process_lines() and finishes the pass, as process_scanline(NULL) does.
+    bool process_frame(const void *pFrame, int stride);
+
     // Deinitializes the compressor, freeing any allocated memory. May be called at any time.
     void deinit();
 
+    // Optional: take the per image buffers from pArena instead of the heap, for an encoder that is init()'ed
+    // over and over. The arena must stay valid while the encoder is in use and is reused by every init().
+    // The worker threads, if any, are also kept from one init() to the next as long as m_num_threads stays
+    // the same, so that encoding repeated frames does not touch the heap at all.
+    // get_arena_size() returns the arena size an image needs, init() or the process_*() calls fail if it is too small.
+    void set_arena(void *pArena, uint size);
+    static uint get_arena_size(int width, int height, int src_channels, const params &comp_params = params());
+
+    // Number of times all scanlines (each time followed by NULL) have to be passed to process_scanline().
+    inline uint get_total_passes() const
+    {
+        return m_params.m_two_pass_flag ? 2 : 1;
+    }
+    inline uint get_cur_pass()
+    {
+        return m_pass_num;
+    }
+
+    // Bytes of markers, SOI up to and including SOS, that pass 2 wrote ahead of the entropy coded data.
+    inline uint get_header_size() const
+    {
+        return m_header_size;
+    }
+
 private:
     jpeg_encoder(const jpeg_encoder &);
     jpeg_encoder &operator =(const jpeg_encoder &);
 
     typedef int32 sample_array_t;
-    enum { JPGE_OUT_BUF_SIZE = 512 };
+    enum { JPGE_OUT_BUF_SIZE = 512, JPGE_MIN_WRITE_BUF = 64 };
+
+    // State of one entropy coded segment: the MCU row it codes, DC predictors, bit buffer and output buffer.
+    // The MCU row is read from m_pSrc, which either is in the MCU line buffer (already YCbCr and padded to whole
+    // MCUs) or is the caller's image; MCUs that need converting, scaling or padding are then gathered into m_tile
+    // first. m_src_rows counts source rows, m_scale of them per MCU line when scaling.
+    // The encoder codes into m_seg itself. In parallel mode every worker thread has its own segment, whose
+    // output goes to a memory stream and is copied to m_pStream in MCU row order.
+    struct segment
+    {
+        const uint8 *m_pSrc;
+        int m_src_stride, m_src_rows;
+        bool m_src_ycc;
+        const uint8 *m_mcu_lines[16];
+        sample_array_t m_sample_array[64];
+        int16 m_coefficient_array[64];
+        int m_last_dc_val[3];
+        uint64 m_nonzero;
+        uint64 m_bit_buffer;
+        uint m_bits_in;
+        output_stream *m_pStream;
+        uint8 *m_pWindow;
+        uint8 *m_pOut_buf;
+        uint m_out_buf_left;
+        bool m_all_stream_writes_succeeded;
+        uint32 *m_pHuff_count;
+        uint8 m_out_buf[JPGE_OUT_BUF_SIZE];
+        uint8 m_tile[16 * 16 * 3];
+    };
+    struct thread_pool;
+    struct huff_tables;
 
     output_stream *m_pStream;
     params m_params;
@@ -95,54 +194,156 @@ private:
     int m_image_bpl_xlt, m_image_bpl_mcu;
     int m_mcus_per_row;
     int m_mcu_x, m_mcu_y;
-    uint8 *m_mcu_lines[16];
+    uint8 *m_mcu_buf;
     uint8 m_mcu_y_ofs;
-    sample_array_t m_sample_array[64];
-    int16 m_coefficient_array[64];
+    int m_src_x, m_src_y;
+    int m_scale_shift, m_scale_rows;
+    uint16 *m_scale_acc;
+    uint8 *m_scale_line;
+    void (*m_pDCT2D)(sample_array_t *pSamples);
+    int32 m_quantization_tables[2][64];
+    uint16 m_quant_recip[2][64], m_quant_bias[2][64];
+    uint8 m_quant_shift[2][64];
+    uint64 (*m_pQuantize)(const int32 *pSamples, const uint16 *pRecip, const uint16 *pBias, const uint8 *pShift, int16 *pDst);
 
-    int m_last_dc_val[3];
-    uint8 m_out_buf[JPGE_OUT_BUF_SIZE];
-    uint8 *m_pOut_buf;
-    uint m_out_buf_left;
-    uint32 m_bit_buffer;
-    uint m_bits_in;
+    // Huffman tables in use, indexed 0 = DC luma, 1 = DC chroma, 2 = AC luma, 3 = AC chroma. They point to the
+    // standard tables, or to m_pHuff after pass 1 in two pass mode.
+    const uint *m_huff_codes[4];
+    const uint8 *m_huff_code_sizes[4];
+    const uint8 *m_huff_bits[4];
+    const uint8 *m_huff_val[4];
+    huff_tables *m_pHuff;
+    uint32 *m_huff_count;
+
+    segment m_seg;
+    segment *m_band_segs[JPGE_MAX_THREADS];
+    int m_band_size, m_band_row;
+    int m_mcu_row, m_mcu_rows;
+    uint8 m_next_restart_num;
+    thread_pool *m_pPool;
     uint8 m_pass_num;
-    bool m_all_stream_writes_succeeded;
+    uint m_header_size;
+    uint8 *m_pArena;
+    uint m_arena_size, m_arena_used;
 
     bool jpg_open(int p_x_res, int p_y_res, int src_channels);
+    void *alloc(uint size);
+    void release(void *p);
+    void free_buffers();
 
-    void flush_output_buffer();
-    void put_bits(uint bits, uint len);
+    void open_output_buffer(segment &s);
+    void close_output_buffer(segment &s);
+    void flush_output_buffer(segment &s);
+    uint output_size(const segment &s) const;
+    void put_bits(segment &s, uint bits, uint len);
+    void emit_byte(segment &s, uint8 i);
+    void emit_coded_byte(segment &s, uint8 c);
+    void flush_bits(segment &s);
+    void reset_segment(segment &s, output_stream *pStream);
+    void finish_segment(segment &s);
 
-    void emit_byte(uint8 i);
+    void flush_output_buffer() { flush_output_buffer(m_seg); }
+    void emit_byte(uint8 i) { emit_byte(m_seg, i); }
     void emit_word(uint i);
     void emit_marker(int marker);
 
     void emit_jfif_app0();
     void emit_dqt();
     void emit_sof();
-    void emit_dht(uint8 *bits, uint8 *val, int index, bool ac_flag);
+    void emit_dht(const uint8 *bits, const uint8 *val, int index, bool ac_flag);
     void emit_dhts();
+    void emit_dri();
     void emit_sos();
+    void emit_markers();
 
     void compute_quant_table(int32 *dst, const int16 *src);
-    void load_quantized_coefficients(int component_num);
+    void compute_quant_reciprocals(int table);
+    void load_quantized_coefficients(segment &s, int component_num);
 
-    void load_block_8_8_grey(int x);
-    void load_block_8_8(int x, int y, int c);
-    void load_block_16_8(int x, int c);
-    void load_block_16_8_8(int x, int c);
+    void load_block_8_8_grey(segment &s, int x);
+    void load_block_8_8(segment &s, int x, int y, int c);
+    void load_block_16_8(segment &s, int x, int c);
+    void load_block_16_8_8(segment &s, int x, int c);
 
-    void code_coefficients_pass_two(int component_num);
-    void code_block(int component_num);
+    void code_coefficients_pass_one(segment &s, int component_num);
+    void code_coefficients_pass_two(segment &s, int component_num);
+    void optimize_huffman_table(int table_num, int table_len);
+    void code_block(segment &s, int component_num);
 
-    void process_mcu_row();
+    void code_mcu(segment &s, int i);
+    void load_tile(segment &s, int mcu_x);
+    void process_mcu_row(segment &s);
+    void process_band();
+    bool start_threads();
+    void stop_threads();
+    static void *worker_thread(void *pArg);
+    bool start_pass(int pass_num);
+    bool terminate_pass_one();
     bool process_end_of_image();
-    void load_mcu(const void* src);
+    void convert_pixels(uint8 *pDst, const uint8 *pSrc, int num_pixels);
+    void pad_pixels(uint8 *pDst, int num_pixels, int total_pixels);
+    void end_mcu_row();
+    void accumulate_pixels(uint16 *pAcc, const uint8 *pSrc, int num_pixels);
+    void average_pixels(uint8 *pDst, uint16 *pAcc, int num_pixels, int num_rows);
+    void load_line(const uint8 *pSrc);
+    bool load_mcu(const void* src);
     void clear();
     void init();
 };
 
+// Baseline JPEG writer for DCT coefficients that are already quantized, to transform or requantize a JPEG without
+// going through the pixels. One scan without restart markers, coded with the standard Huffman tables.
+class coef_encoder
+{
+public:
+    struct component
+    {
+        uint8 m_id, m_h_samp, m_v_samp, m_quant;
+    };
+
+    coef_encoder();
+
+    // Writes the headers for num_components (1 or 3) components. pQuant[t] are the 64 entries of quantization
+    // table t in zigzag order, NULL for tables no component uses. Entries above 255 make it an extended (SOF1) JPEG.
+    // Returns false on invalid parameters or if a stream write fails.
+    bool init(output_stream *pStream, int width, int height, int num_components, const component *pComps, const uint16 *const *pQuant);
+
+    // Codes the next block of component c: 64 quantized coefficients in zigzag order. Blocks have to come in the
+    // order of the scan, MCU by MCU. DC values must be within -1024..1023, AC values within -1023..1023.
+    void code_block(int c, const int16 *pCoefs);
+
+    // Pads the last byte and writes EOI. Returns false if any stream write failed.
+    bool finish();
+
+    // The standard luma or chroma quantization table in zigzag order, scaled for quality 1..100 the same way
+    // jpeg_encoder does it.
+    static void get_std_quant_table(int quality, bool chroma, uint16 *pDst);
+
+private:
+    coef_encoder(const coef_encoder &);
+    coef_encoder &operator =(const coef_encoder &);
+
+    enum { OUT_BUF_SIZE = 512 };
+
+    output_stream *m_pStream;
+    int m_num_components;
+    uint8 m_comp_table[3];      // Huffman table set of each component, 0 = luma, 1 = chroma
+    int m_last_dc_val[3];
+    uint64 m_bit_buffer;
+    uint m_bits_in;
+    uint m_out_len;
+    bool m_all_stream_writes_succeeded;
+    uint8 m_out_buf[OUT_BUF_SIZE];
+
+    void flush_output_buffer();
+    void emit_byte(uint8 i);
+    void emit_coded_byte(uint8 c);
+    void emit_word(uint i);
+    void emit_marker(int marker);
+    void emit_dht(const uint8 *bits, const uint8 *val, int index, bool ac_flag);
+    void put_bits(uint bits, uint len);
+};
+
 } // namespace jpge
 
 #endif // JPEG_ENCODER
@@ -18,10 +18,20 @@
 extern "C" {
 #endif
 
+#include <stddef.h>
 #include <stdint.h>
 
     void yuv2rgb(uint8_t y, uint8_t u, uint8_t v, uint8_t *r, uint8_t *g, uint8_t *b);
 
+    /*
+     * Whole row conversions of width YUYV pixels, identical to yuv2rgb() per pixel. An odd last pixel
+     * has no V sample and takes 128. RGB888 is written B, G, R, RGB565 high byte first, and gray is
+     * the R = G = B value of the pixel without its color.
+     */
+    void yuv422_to_rgb888_row(const uint8_t *src, uint8_t *dst, size_t width);
+    void yuv422_to_rgb565_row(const uint8_t *src, uint8_t *dst, size_t width);
+    void yuv422_to_gray_row(const uint8_t *src, uint8_t *dst, size_t width);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,443 @@
+// Copyright 2015-2016 Espressif Systems (Shanghai) PTE LTD
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include "esp_attr.h"
+#include "esp_heap_caps.h"
+#include "esp_camera.h"
+#include "img_converters.h"
+
+#if defined(ARDUINO_ARCH_ESP32) && defined(CONFIG_ARDUHAL_ESP_LOG)
+#include "esp32-hal-log.h"
+#define TAG ""
+#else
+#include "esp_log.h"
+static const char* TAG = "resize";
+#endif
+
+// The taps of every output sample have weights summing to 1 << RESIZE_WBITS.
+// Horizontally filtered samples keep 8 fraction bits in 16 bits, the vertical sum of those fits 32 bits.
+#define RESIZE_WBITS        12
+#define RESIZE_HSHIFT       (RESIZE_WBITS - 8)
+#define RESIZE_VSHIFT       (RESIZE_WBITS + 8)
+
+// Filter taps along one axis: count[j] (index, weight) pairs per output sample j, consecutive.
+// Indexes are relative to the first source sample the axis may read.
+typedef struct {
+    uint16_t * count;
+    uint16_t * index;
+    uint16_t * weight;
+} resize_taps_t;
+
+// State of one conversion. Source rows are filtered horizontally once into one of two row slots,
+// output rows are the weighted sum of the slots, so only a few rows are ever held.
+typedef struct {
+    const uint8_t * src;
+    size_t src_stride;          // bytes per source row
+    pixformat_t format;
+    uint16_t x, width, out_width;  // crop start and width, output width
+    resize_taps_t h, hc, v;     // horizontal (luma or all channels), horizontal chroma of YUYV, vertical
+    size_t samples;             // 16 bit samples per filtered row
+    uint16_t * rows[2];
+    int32_t row_y[2];
+    uint32_t * acc;
+    uint8_t * vals;             // output samples before packing, NULL if they are the output row
+    uint8_t * rgb;              // RGB565 source row unpacked to 3 bytes per pixel
+} resizer_t;
+
+static void *_malloc(size_t size)
+{
+    void * res = malloc(size);
+    if(res) {
+        return res;
+    }
+    return heap_caps_malloc(size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+}
+
+static size_t source_bpp(pixformat_t format)
+{
+    switch(format) {
+    case PIXFORMAT_GRAYSCALE:
+        return 1;
+    case PIXFORMAT_RGB565:
+    case PIXFORMAT_YUV422:
+        return 2;
+    case PIXFORMAT_RGB888:
+        return 3;
+    default:
+        return 0;
+    }
+}
+
+// Filtered samples per pixel: RGB565 is filtered as 8 bit R, G, B, YUYV as Y plus every other U, V.
+static size_t samples_per_pixel(pixformat_t format)
+{
+    switch(format) {
+    case PIXFORMAT_GRAYSCALE:
+        return 1;
+    case PIXFORMAT_YUV422:
+        return 2;
+    default:
+        return 3;
+    }
+}
+
+// Upper bound of the taps for out samples from a source span of len_h half samples.
+// A box covers at most len_h / (2 * out) + 2 source samples.
+static size_t max_taps(img_resize_filter_t filter, uint32_t len_h, uint16_t out)
+{
+    if(filter == IMG_RESIZE_BILINEAR) {
+        return (size_t)out * 2;
+    }
+    return (size_t)out * (len_h / (2 * (uint32_t)out) + 2);
+}
+
+/*
+ * Taps for out samples covering the source span [start_h / 2, (start_h + len_h) / 2), reading samples lo..hi only.
+ * Positions are kept in units of 1 / (2 * out) source samples, which makes every boundary an integer:
+ * identity and integer ratios come out as exact single taps, and nothing drifts across the row.
+ */
+static void resize_axis(resize_taps_t *t, img_resize_filter_t filter, uint32_t start_h, uint32_t len_h, uint16_t out, int lo, int hi)
+{
+    const int64_t unit = 2 * (int64_t)out;
+    const uint32_t one = 1 << RESIZE_WBITS;
+    uint16_t *idx = t->index, *w = t->weight;
+
+    for(int j = 0; j < out; j++) {
+        int64_t a = (int64_t)start_h * out + (int64_t)j * len_h;
+        int64_t b = a + len_h;
+        int n = 0;
+
+        if(filter == IMG_RESIZE_BILINEAR) {
+            // center of the output sample minus half a source sample, in units of 1 / (4 * out)
+            int64_t c = a + b - unit;
+            int64_t k = lo;
+            uint32_t f = 0;
+            if(c > 2 * unit * lo) {
+                k = c / (2 * unit);
+                f = ((c % (2 * unit)) * one + unit) / (2 * unit);
+                if(f == one) {
+                    k++;
+                    f = 0;
+                }
+            }
+            if(k >= hi) {
+                k = hi;
+                f = 0;
+            }
+            idx[n] = k - lo;
+            w[n++] = one - f;
+            if(f) {
+                idx[n] = k + 1 - lo;
+                w[n++] = f;
+            }
+        } else {
+            // area average: every source sample weighs with the part of it the output sample covers
+            uint32_t sum = 0;
+            int largest = 0;
+            for(int64_t k = a / unit; k * unit < b; k++) {
+                int64_t s0 = (k * unit > a) ? k * unit : a;
+                int64_t s1 = ((k + 1) * unit < b) ? (k + 1) * unit : b;
+                uint32_t wt = ((s1 - s0) * one + len_h / 2) / len_h;
+                if(!wt) {
+                    continue;
+                }
+                idx[n] = ((k < lo) ? lo : (k > hi) ? hi : k) - lo;
+                w[n] = wt;
+                if(!n || wt > w[largest]) {
+                    largest = n;
+                }
+                sum += wt;
+                n++;
+            }
+            w[largest] += one - sum;
+        }
+        t->count[j] = n;
+        idx += n;
+        w += n;
+    }
+}
+
+// Horizontal pass of ch interleaved channels, ch_stride bytes apart, of samples step bytes apart.
+static inline void resize_row(const uint8_t *src, const resize_taps_t *t, uint16_t out, int step, int ch, int ch_stride, uint16_t *dst)
+{
+    const uint16_t *idx = t->index, *w = t->weight;
+    for(int j = 0; j < out; j++) {
+        uint32_t acc0 = 0, acc1 = 0, acc2 = 0;
+        for(int n = t->count[j]; n; n--, idx++, w++) {
+            const uint8_t *p = src + *idx * step;
+            acc0 += *w * p[0];
+            if(ch > 1) {
+                acc1 += *w * p[ch_stride];
+            }
+            if(ch > 2) {
+                acc2 += *w * p[2 * ch_stride];
+            }
+        }
+        *dst++ = (acc0 + (1 << (RESIZE_HSHIFT - 1))) >> RESIZE_HSHIFT;
+        if(ch > 1) {
+            *dst++ = (acc1 + (1 << (RESIZE_HSHIFT - 1))) >> RESIZE_HSHIFT;
+        }
+        if(ch > 2) {
+            *dst++ = (acc2 + (1 << (RESIZE_HSHIFT - 1))) >> RESIZE_HSHIFT;
+        }
+    }
+}
+
+// Horizontally filtered source row y of the crop, computed once while it is in use
+static const uint16_t *get_row(resizer_t *r, int32_t y)
+{
+    if(r->row_y[0] == y) {
+        return r->rows[0];
+    }
+    if(r->row_y[1] == y) {
+        return r->rows[1];
+    }
+    // rows are requested in ascending order, replace the older one
+    int s = (r->row_y[0] < r->row_y[1]) ? 0 : 1;
+    uint16_t *dst = r->rows[s];
+    const uint8_t *src = r->src + y * r->src_stride;
+
+    switch(r->format) {
+    case PIXFORMAT_GRAYSCALE:
+        resize_row(src + r->x, &r->h, r->out_width, 1, 1, 1, dst);
+        break;
+    case PIXFORMAT_RGB888:
+        resize_row(src + r->x * 3, &r->h, r->out_width, 3, 3, 1, dst);
+        break;
+    case PIXFORMAT_RGB565: {
+        const uint8_t *p = src + r->x * 2;
+        uint8_t *d = r->rgb;
+        for(int i = 0; i < r->width; i++, p += 2, d += 3) {
+            uint8_t cr = p[0] & 0xF8;
+            uint8_t cg = (p[0] & 0x07) << 5 | (p[1] & 0xE0) >> 3;
+            uint8_t cb = (p[1] & 0x1F) << 3;
+            d[0] = cr | cr >> 5;
+            d[1] = cg | cg >> 6;
+            d[2] = cb | cb >> 5;
+        }
+        resize_row(r->rgb, &r->h, r->out_width, 3, 3, 1, dst);
+        break;
+    }
+    case PIXFORMAT_YUV422:
+        // Y of every pixel, then U, V of every pixel pair
+        resize_row(src + r->x * 2, &r->h, r->out_width, 2, 1, 1, dst);
+        resize_row(src + (r->x / 2) * 4 + 1, &r->hc, r->out_width / 2, 4, 2, 2, dst + r->out_width);
+        break;
+    default:
+        break;
+    }
+    r->row_y[s] = y;
+    return dst;
+}
+
+// Vertical pass of one output row from n taps, then packing to the output format.
+static void resize_out_row(resizer_t *r, const uint16_t *idx, const uint16_t *w, int n, uint8_t *dst)
+{
+    uint8_t *v = r->vals ? r->vals : dst;
+    const uint16_t *row = get_row(r, idx[0]);
+    size_t i, samples = r->samples;
+
+    if(n == 1) {
+        for(i = 0; i < samples; i++) {
+            v[i] = (row[i] + 0x80) >> 8;
+        }
+    } else {
+        uint32_t *acc = r->acc;
+        for(i = 0; i < samples; i++) {
+            acc[i] = (uint32_t)w[0] * row[i];
+        }
+        for(int k = 1; k < n; k++) {
+            row = get_row(r, idx[k]);
+            for(i = 0; i < samples; i++) {
+                acc[i] += (uint32_t)w[k] * row[i];
+            }
+        }
+        for(i = 0; i < samples; i++) {
+            v[i] = (acc[i] + (1 << (RESIZE_VSHIFT - 1))) >> RESIZE_VSHIFT;
+        }
+    }
+
+    if(r->format == PIXFORMAT_RGB565) {
+        for(i = 0; i < r->out_width; i++, v += 3, dst += 2) {
+            // rounded to 5 and 6 bits, the exact inverse of the expansion in get_row()
+            uint8_t cr = (v[0] * 249 + 1014) >> 11;
+            uint8_t cg = (v[1] * 253 + 505) >> 10;
+            uint8_t cb = (v[2] * 249 + 1014) >> 11;
+            dst[0] = cr << 3 | cg >> 3;
+            dst[1] = cg << 5 | cb;
+        }
+    } else if(r->format == PIXFORMAT_YUV422) {
+        const uint8_t *uv = v + r->out_width;
+        for(i = 0; i < r->out_width; i += 2, v += 2, uv += 2, dst += 4) {
+            dst[0] = v[0];
+            dst[1] = uv[0];
+            dst[2] = v[1];
+            dst[3] = uv[1];
+        }
+    }
+}
+
+static bool check_params(size_t src_len, uint16_t width, uint16_t height, pixformat_t format,
+                         const img_rect_t *crop, uint16_t out_width, uint16_t out_height, img_resize_filter_t filter)
+{
+    size_t bpp = source_bpp(format);
+    if(!bpp) {
+        ESP_LOGE(TAG, "Format %u not supported", format);
+        return false;
+    }
+    if(!width || !height || src_len < (size_t)width * height * bpp) {
+        ESP_LOGE(TAG, "Source buffer too short: %u < %ux%ux%u", (unsigned)src_len, width, height, (unsigned)bpp);
+        return false;
+    }
+    img_rect_t c = { 0, 0, width, height };
+    if(crop) {
+        c = *crop;
+    }
+    if(!c.width || !c.height || (uint32_t)c.x + c.width > width || (uint32_t)c.y + c.height > height) {
+        ESP_LOGE(TAG, "Crop %ux%u at %u,%u outside of %ux%u", c.width, c.height, c.x, c.y, width, height);
+        return false;
+    }
+    if(!out_width || !out_height || filter > IMG_RESIZE_BILINEAR) {
+        ESP_LOGE(TAG, "Output %ux%u with filter %u not supported", out_width, out_height, filter);
+        return false;
+    }
+    if(format == PIXFORMAT_YUV422 && ((width | out_width) & 1)) {
+        ESP_LOGE(TAG, "YUV422 needs even widths: %u, %u", width, out_width);
+        return false;
+    }
+    return true;
+}
+
+static bool resize(const uint8_t *src, size_t src_len, uint16_t width, uint16_t height, pixformat_t format,
+                   const img_rect_t *crop, uint16_t out_width, uint16_t out_height, img_resize_filter_t filter,
+                   uint8_t *out, jpg_out_cb cb, void *arg)
+{
+    if(!check_params(src_len, width, height, format, crop, out_width, out_height, filter)) {
+        return false;
+    }
+    size_t bpp = source_bpp(format);
+    img_rect_t c = { 0, 0, width, height };
+    if(crop) {
+        c = *crop;
+    }
+
+    resizer_t r = { 0 };
+    r.src = src + c.y * (size_t)width * bpp;
+    r.src_stride = (size_t)width * bpp;
+    r.format = format;
+    r.x = c.x;
+    r.width = c.width;
+    r.out_width = out_width;
+    r.samples = out_width * samples_per_pixel(format);
+    r.row_y[0] = r.row_y[1] = -1;
+
+    size_t out_row = (size_t)out_width * bpp;
+    size_t nh = max_taps(filter, 2 * (uint32_t)c.width, out_width);
+    size_t nhc = (format == PIXFORMAT_YUV422) ? max_taps(filter, c.width, out_width / 2) : 0;
+    size_t nv = max_taps(filter, 2 * (uint32_t)c.height, out_height);
+    size_t n16 = 2 * r.samples + out_width + out_width / 2 + out_height + 2 * (nh + nhc + nv);
+    size_t n8 = ((format == PIXFORMAT_RGB565 || format == PIXFORMAT_YUV422) ? r.samples : 0)
+                + ((format == PIXFORMAT_RGB565) ? (size_t)c.width * 3 : 0)
+                + (cb ? out_row : 0);
+    size_t len = r.samples * sizeof(uint32_t) + n16 * sizeof(uint16_t) + n8;
+    uint8_t *mem = (uint8_t *)_malloc(len);
+    if(!mem) {
+        ESP_LOGE(TAG, "Resize buffer malloc failed: %u bytes", (unsigned)len);
+        return false;
+    }
+
+    r.acc = (uint32_t *)mem;
+    uint16_t *p16 = (uint16_t *)(r.acc + r.samples);
+    r.rows[0] = p16;
+    r.rows[1] = p16 + r.samples;
+    p16 += 2 * r.samples;
+    resize_taps_t *taps[3] = { &r.h, &r.hc, &r.v };
+    size_t counts[3] = { out_width, out_width / 2, out_height };
+    size_t sizes[3] = { nh, nhc, nv };
+    for(int i = 0; i < 3; i++) {
+        taps[i]->count = p16;
+        taps[i]->index = p16 + counts[i];
+        taps[i]->weight = p16 + counts[i] + sizes[i];
+        p16 += counts[i] + 2 * sizes[i];
+    }
+    uint8_t *p8 = (uint8_t *)p16;
+    if(format == PIXFORMAT_RGB565 || format == PIXFORMAT_YUV422) {
+        r.vals = p8;
+        p8 += r.samples;
+    }
+    if(format == PIXFORMAT_RGB565) {
+        r.rgb = p8;
+        p8 += (size_t)c.width * 3;
+    }
+
+    resize_axis(&r.h, filter, 2 * (uint32_t)c.x, 2 * (uint32_t)c.width, out_width, c.x, c.x + c.width - 1);
+    if(format == PIXFORMAT_YUV422) {
+        // chroma samples sit at half the luma resolution, an odd crop start falls between two of them
+        resize_axis(&r.hc, filter, c.x, c.width, out_width / 2, c.x / 2, (c.x + c.width - 1) / 2);
+    }
+    resize_axis(&r.v, filter, 2 * (uint32_t)c.y, 2 * (uint32_t)c.height, out_height, c.y, c.y + c.height - 1);
+
+    bool ret = true;
+    const uint16_t *idx = r.v.index, *w = r.v.weight;
+    for(int y = 0; y < out_height; y++) {
+        int n = r.v.count[y];
+        uint8_t *dst = cb ? p8 : out + y * out_row;
+        resize_out_row(&r, idx, w, n, dst);
+        idx += n;
+        w += n;
+        if(cb && cb(arg, (size_t)y * out_row, dst, out_row) != out_row) {
+            ret = false;
+            break;
+        }
+    }
+    if(ret && cb) {
+        cb(arg, (size_t)out_height * out_row, NULL, 0);
+    }
+    free(mem);
+    return ret;
+}
+
+bool fmt2resized(const uint8_t *src, size_t src_len, uint16_t width, uint16_t height, pixformat_t format,
+                 const img_rect_t *crop, uint16_t out_width, uint16_t out_height, img_resize_filter_t filter, uint8_t * out)
+{
+    return resize(src, src_len, width, height, format, crop, out_width, out_height, filter, out, NULL, NULL);
+}
+
+bool fmt2resized_cb(const uint8_t *src, size_t src_len, uint16_t width, uint16_t height, pixformat_t format,
+                    const img_rect_t *crop, uint16_t out_width, uint16_t out_height, img_resize_filter_t filter, jpg_out_cb cb, void * arg)
+{
+    return resize(src, src_len, width, height, format, crop, out_width, out_height, filter, NULL, cb, arg);
+}
+
+bool frame2resized(camera_fb_t * fb, const img_rect_t *crop, uint16_t out_width, uint16_t out_height, img_resize_filter_t filter, uint8_t ** out, size_t * out_len)
+{
+    if(!check_params(fb->len, fb->width, fb->height, fb->format, crop, out_width, out_height, filter)) {
+        return false;
+    }
+    size_t len = (size_t)out_width * out_height * source_bpp(fb->format);
+    uint8_t *buf = (uint8_t *)_malloc(len);
+    if(!buf) {
+        ESP_LOGE(TAG, "Resize output malloc failed: %u bytes", (unsigned)len);
+        return false;
+    }
+    if(!resize(fb->buf, fb->len, fb->width, fb->height, fb->format, crop, out_width, out_height, filter, buf, NULL, NULL)) {
+        free(buf);
+        return false;
+    }
+    *out = buf;
+    *out_len = len;
+    return true;
+}
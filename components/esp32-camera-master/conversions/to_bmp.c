@@ -0,0 +1,437 @@
+// Copyright 2015-2016 Espressif Systems (Shanghai) PTE LTD
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include "esp_attr.h"
+#include "esp_heap_caps.h"
+#include "esp_camera.h"
+#include "img_converters.h"
+#include "esp_jpg_decode.h"
+#include "yuv.h"
+
+#if defined(ARDUINO_ARCH_ESP32) && defined(CONFIG_ARDUHAL_ESP_LOG)
+#include "esp32-hal-log.h"
+#define TAG ""
+#else
+#include "esp_log.h"
+static const char* TAG = "to_bmp";
+#endif
+
+// BITMAPFILEHEADER + BITMAPINFOHEADER, followed by the gray palette for 8 bit images
+#define BMP_HEADER_LEN      54
+#define BMP_PALETTE_LEN     (256 * 4)
+
+// amount of BMP data handed to the callback at once
+#define BMP_CB_CHUNK_LEN    4096
+
+// pixels fmt2rgb888() converts per convert_row() call, even for YUYV
+#define RGB_BLOCK_PIXELS    1024
+
+// Destination of decoded JPEG lines: rows of row_len bytes (0: as decoded), padding zeroed
+typedef struct {
+    uint8_t * out;
+    size_t row_len;
+} rgb_writer_t;
+
+// Collects decoded JPEG rows for the BMP callback, handing them on in chunks of buf_len bytes
+typedef struct {
+    jpg_out_cb cb;
+    void * arg;
+    size_t index;
+    uint8_t * buf;
+    size_t buf_len;
+    size_t len;
+    size_t row_len;
+} bmp_cb_writer_t;
+
+static void *_malloc(size_t size)
+{
+    void * res = malloc(size);
+    if(res) {
+        return res;
+    }
+    return heap_caps_malloc(size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+}
+
+// Bytes per source pixel, 0 if the format can't be converted line by line
+static size_t source_bpp(pixformat_t format)
+{
+    switch(format) {
+    case PIXFORMAT_GRAYSCALE:
+        return 1;
+    case PIXFORMAT_RGB565:
+    case PIXFORMAT_RGB555:
+    case PIXFORMAT_RGB444:
+    case PIXFORMAT_YUV422:
+        return 2;
+    case PIXFORMAT_RGB888:
+        return 3;
+    default:
+        return 0;
+    }
+}
+
+// Grayscale becomes an 8 bit palette image, everything else 24 bit BGR. Rows are padded to 4 bytes.
+static size_t bmp_row_len(uint16_t width, pixformat_t format)
+{
+    return ((size_t)width * ((format == PIXFORMAT_GRAYSCALE) ? 1 : 3) + 3) & ~(size_t)3;
+}
+
+static size_t bmp_header_len(pixformat_t format)
+{
+    return BMP_HEADER_LEN + ((format == PIXFORMAT_GRAYSCALE) ? BMP_PALETTE_LEN : 0);
+}
+
+static void put_le16(uint8_t *p, uint16_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+}
+
+static void put_le32(uint8_t *p, uint32_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+// The height is stored negative, which makes the BMP top-down: rows go out in the order the camera delivers them.
+static void write_header(uint8_t *dst, uint16_t width, uint16_t height, pixformat_t format)
+{
+    size_t header_len = bmp_header_len(format);
+    size_t image_len = bmp_row_len(width, format) * height;
+
+    memset(dst, 0, BMP_HEADER_LEN);
+    dst[0] = 'B';
+    dst[1] = 'M';
+    put_le32(dst + 2, header_len + image_len);  // file size
+    put_le32(dst + 10, header_len);             // offset of the pixel data
+    put_le32(dst + 14, 40);                     // info header size
+    put_le32(dst + 18, width);
+    put_le32(dst + 22, -(int32_t)height);
+    put_le16(dst + 26, 1);                      // planes
+    put_le16(dst + 28, (format == PIXFORMAT_GRAYSCALE) ? 8 : 24);
+    put_le32(dst + 34, image_len);
+    put_le32(dst + 38, 2835);                   // 72 dpi
+    put_le32(dst + 42, 2835);
+    if(format == PIXFORMAT_GRAYSCALE) {
+        put_le32(dst + 46, 256);                // palette entries
+        uint8_t *p = dst + BMP_HEADER_LEN;
+        for(int i = 0; i < 256; i++, p += 4) {
+            p[0] = p[1] = p[2] = i;
+            p[3] = 0;
+        }
+    }
+}
+
+// Convert one row of width pixels to BMP order (B, G, R) and zero the row padding.
+static void IRAM_ATTR convert_row(const uint8_t *src, pixformat_t format, uint8_t *dst, uint16_t width, size_t row_len)
+{
+    uint8_t *d = dst;
+    size_t i;
+    uint8_t r, g, b;
+
+    switch(format) {
+    case PIXFORMAT_GRAYSCALE:
+        memcpy(d, src, width);
+        d += width;
+        break;
+    case PIXFORMAT_RGB888:
+        // already stored B, G, R
+        memcpy(d, src, width * 3);
+        d += width * 3;
+        break;
+    case PIXFORMAT_RGB565:
+        for(i = 0; i < width; i++, src += 2) {
+            r = src[0] & 0xF8;
+            g = (src[0] & 0x07) << 5 | (src[1] & 0xE0) >> 3;
+            b = (src[1] & 0x1F) << 3;
+            *d++ = b | b >> 5;
+            *d++ = g | g >> 6;
+            *d++ = r | r >> 5;
+        }
+        break;
+    case PIXFORMAT_RGB555:
+        for(i = 0; i < width; i++, src += 2) {
+            r = (src[0] & 0x7C) << 1;
+            g = (src[0] & 0x03) << 6 | (src[1] & 0xE0) >> 2;
+            b = (src[1] & 0x1F) << 3;
+            *d++ = b | b >> 5;
+            *d++ = g | g >> 5;
+            *d++ = r | r >> 5;
+        }
+        break;
+    case PIXFORMAT_RGB444:
+        for(i = 0; i < width; i++, src += 2) {
+            *d++ = (src[1] & 0x0F) * 0x11;
+            *d++ = (src[1] >> 4) * 0x11;
+            *d++ = (src[0] & 0x0F) * 0x11;
+        }
+        break;
+    case PIXFORMAT_YUV422:
+        yuv422_to_rgb888_row(src, d, width);
+        d += width * 3;
+        break;
+    default:
+        break;
+    }
+    memset(d, 0, dst + row_len - d);
+}
+
+static bool check_source(size_t src_len, uint16_t width, uint16_t height, pixformat_t format)
+{
+    size_t bpp = source_bpp(format);
+    if(!bpp) {
+        ESP_LOGE(TAG, "Format %u not supported", format);
+        return false;
+    }
+    if(!width || !height || src_len < (size_t)width * height * bpp) {
+        ESP_LOGE(TAG, "Source buffer too short: %u < %ux%ux%u", (unsigned)src_len, width, height, (unsigned)bpp);
+        return false;
+    }
+    return true;
+}
+
+static bool _rgb_write(void * arg, uint16_t y, uint16_t width, uint16_t lines, const uint8_t * data)
+{
+    rgb_writer_t * w = (rgb_writer_t *)arg;
+    size_t len = (size_t)width * 3;
+    if(!w->row_len) {
+        memcpy(w->out + y * len, data, len * lines);
+        return true;
+    }
+    uint8_t * dst = w->out + y * w->row_len;
+    for(uint16_t i = 0; i < lines; i++, data += len, dst += w->row_len) {
+        memcpy(dst, data, len);
+        memset(dst + len, 0, w->row_len - len);
+    }
+    return true;
+}
+
+static bool bmp_cb_flush(bmp_cb_writer_t * w)
+{
+    if(w->len) {
+        if(w->cb(w->arg, w->index, w->buf, w->len) != w->len) {
+            return false;
+        }
+        w->index += w->len;
+        w->len = 0;
+    }
+    return true;
+}
+
+static bool _bmp_cb_write(void * arg, uint16_t y, uint16_t width, uint16_t lines, const uint8_t * data)
+{
+    bmp_cb_writer_t * w = (bmp_cb_writer_t *)arg;
+    size_t len = (size_t)width * 3;
+    (void)y; // lines arrive top to bottom, they are appended where the previous ones ended
+    for(uint16_t i = 0; i < lines; i++, data += len) {
+        if(w->len + w->row_len > w->buf_len && !bmp_cb_flush(w)) {
+            return false;
+        }
+        memcpy(w->buf + w->len, data, len);
+        memset(w->buf + w->len + len, 0, w->row_len - len);
+        w->len += w->row_len;
+    }
+    return true;
+}
+
+bool jpg2rgb888(const uint8_t *src, size_t src_len, uint8_t * out, jpg_scale_t scale)
+{
+    if(scale > JPG_SCALE_MAX) {
+        ESP_LOGE(TAG, "Scale %u not supported", scale);
+        return false;
+    }
+    rgb_writer_t w = { out, 0 };
+    return esp_jpg_decode(src, src_len, scale, _rgb_write, &w);
+}
+
+bool fmt2rgb888(const uint8_t *src_buf, size_t src_len, pixformat_t format, uint8_t * rgb_buf)
+{
+    if(format == PIXFORMAT_JPEG) {
+        return jpg2rgb888(src_buf, src_len, rgb_buf, JPG_SCALE_NONE);
+    }
+    size_t bpp = source_bpp(format);
+    if(!bpp) {
+        ESP_LOGE(TAG, "Format %u not supported", format);
+        return false;
+    }
+
+    // There is no image size, but none of the conversions depends on the position of a pixel
+    size_t pixels = src_len / bpp;
+    while(pixels) {
+        uint16_t n = (pixels < RGB_BLOCK_PIXELS) ? pixels : RGB_BLOCK_PIXELS;
+        if(format == PIXFORMAT_GRAYSCALE) {
+            for(uint16_t i = 0; i < n; i++, rgb_buf += 3) {
+                rgb_buf[0] = rgb_buf[1] = rgb_buf[2] = src_buf[i];
+            }
+        } else {
+            convert_row(src_buf, format, rgb_buf, n, (size_t)n * 3);
+            rgb_buf += (size_t)n * 3;
+        }
+        src_buf += n * bpp;
+        pixels -= n;
+    }
+    return true;
+}
+
+// JPEG sources take their size from the JPEG and always give 24 bit BMPs
+static bool jpg2bmp(const uint8_t *src, size_t src_len, uint8_t ** out, size_t * out_len)
+{
+    uint16_t width, height;
+    if(!esp_jpg_get_size(src, src_len, JPG_SCALE_NONE, &width, &height)) {
+        return false;
+    }
+
+    size_t row_len = bmp_row_len(width, PIXFORMAT_JPEG);
+    size_t len = BMP_HEADER_LEN + row_len * height;
+    uint8_t * bmp = (uint8_t *)_malloc(len);
+    if(!bmp) {
+        ESP_LOGE(TAG, "BMP buffer malloc failed: %u bytes", (unsigned)len);
+        return false;
+    }
+
+    write_header(bmp, width, height, PIXFORMAT_JPEG);
+    rgb_writer_t w = { bmp + BMP_HEADER_LEN, row_len };
+    if(!esp_jpg_decode(src, src_len, JPG_SCALE_NONE, _rgb_write, &w)) {
+        free(bmp);
+        return false;
+    }
+
+    *out = bmp;
+    *out_len = len;
+    return true;
+}
+
+static bool jpg2bmp_cb(const uint8_t *src, size_t src_len, jpg_out_cb cb, void * arg)
+{
+    uint16_t width, height;
+    if(!esp_jpg_get_size(src, src_len, JPG_SCALE_NONE, &width, &height)) {
+        return false;
+    }
+
+    bmp_cb_writer_t w = { cb, arg, 0, NULL, 0, 0, bmp_row_len(width, PIXFORMAT_JPEG) };
+    w.buf_len = (w.row_len < BMP_CB_CHUNK_LEN) ? (BMP_CB_CHUNK_LEN / w.row_len) * w.row_len : w.row_len;
+    w.buf = (uint8_t *)_malloc(w.buf_len);
+    if(!w.buf) {
+        ESP_LOGE(TAG, "BMP buffer malloc failed: %u bytes", (unsigned)w.buf_len);
+        return false;
+    }
+
+    bool ret = false;
+    write_header(w.buf, width, height, PIXFORMAT_JPEG);
+    w.len = BMP_HEADER_LEN;
+    if(!bmp_cb_flush(&w) || !esp_jpg_decode(src, src_len, JPG_SCALE_NONE, _bmp_cb_write, &w) || !bmp_cb_flush(&w)) {
+        goto done;
+    }
+    cb(arg, w.index, NULL, 0);
+    ret = true;
+
+done:
+    free(w.buf);
+    return ret;
+}
+
+bool fmt2bmp(uint8_t *src, size_t src_len, uint16_t width, uint16_t height, pixformat_t format, uint8_t ** out, size_t * out_len)
+{
+    if(format == PIXFORMAT_JPEG) {
+        return jpg2bmp(src, src_len, out, out_len);
+    }
+    if(!check_source(src_len, width, height, format)) {
+        return false;
+    }
+
+    size_t src_row_len = (size_t)width * source_bpp(format);
+    size_t row_len = bmp_row_len(width, format);
+    size_t header_len = bmp_header_len(format);
+    size_t len = header_len + row_len * height;
+    uint8_t * bmp = (uint8_t *)_malloc(len);
+    if(!bmp) {
+        ESP_LOGE(TAG, "BMP buffer malloc failed: %u bytes", (unsigned)len);
+        return false;
+    }
+
+    write_header(bmp, width, height, format);
+    uint8_t * dst = bmp + header_len;
+    for(int y = 0; y < height; y++, src += src_row_len, dst += row_len) {
+        convert_row(src, format, dst, width, row_len);
+    }
+
+    *out = bmp;
+    *out_len = len;
+    return true;
+}
+
+bool frame2bmp(camera_fb_t * fb, uint8_t ** out, size_t * out_len)
+{
+    return fmt2bmp(fb->buf, fb->len, fb->width, fb->height, fb->format, out, out_len);
+}
+
+// Rows are converted into a buffer of about BMP_CB_CHUNK_LEN bytes, which goes to the callback when full.
+// The callback is called with NULL data at the end, like fmt2jpg_cb() does.
+bool fmt2bmp_cb(uint8_t *src, size_t src_len, uint16_t width, uint16_t height, pixformat_t format, jpg_out_cb cb, void * arg)
+{
+    if(format == PIXFORMAT_JPEG) {
+        return jpg2bmp_cb(src, src_len, cb, arg);
+    }
+    if(!check_source(src_len, width, height, format)) {
+        return false;
+    }
+
+    size_t src_row_len = (size_t)width * source_bpp(format);
+    size_t row_len = bmp_row_len(width, format);
+    size_t header_len = bmp_header_len(format);
+    size_t chunk_rows = (row_len < BMP_CB_CHUNK_LEN) ? BMP_CB_CHUNK_LEN / row_len : 1;
+    size_t buf_len = row_len * chunk_rows;
+    if(buf_len < header_len) {
+        buf_len = header_len;
+    }
+    uint8_t * buf = (uint8_t *)_malloc(buf_len);
+    if(!buf) {
+        ESP_LOGE(TAG, "BMP buffer malloc failed: %u bytes", (unsigned)buf_len);
+        return false;
+    }
+
+    bool ret = false;
+    size_t index = 0;
+    write_header(buf, width, height, format);
+    if(cb(arg, index, buf, header_len) != header_len) {
+        goto done;
+    }
+    index += header_len;
+
+    for(int y = 0; y < height; ) {
+        size_t len = 0;
+        for(size_t i = 0; i < chunk_rows && y < height; i++, y++, src += src_row_len, len += row_len) {
+            convert_row(src, format, buf + len, width, row_len);
+        }
+        if(cb(arg, index, buf, len) != len) {
+            goto done;
+        }
+        index += len;
+    }
+    cb(arg, index, NULL, 0);
+    ret = true;
+
+done:
+    free(buf);
+    return ret;
+}
+
+bool frame2bmp_cb(camera_fb_t * fb, jpg_out_cb cb, void * arg)
+{
+    return fmt2bmp_cb(fb->buf, fb->len, fb->width, fb->height, fb->format, cb, arg);
+}
@@ -12,14 +12,23 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 #include <stddef.h>
+#include <stdlib.h>
 #include <string.h>
+#include <math.h>
 #include "esp_attr.h"
 #include "soc/efuse_reg.h"
 #include "esp_heap_caps.h"
 #include "esp_camera.h"
 #include "img_converters.h"
 #include "jpge.h"
-#include "yuv.h"
+#include "jpg_transform.h"
+#include <new>
+
+// The SSE2 kernels are only built for x86 hosts, like the ones in jpge.cpp. Define JPGE_NO_SIMD for the scalar code.
+#if !defined(JPGE_NO_SIMD) && defined(__SSE2__)
+#include <emmintrin.h>
+#define TO_JPG_USE_SSE2 1
+#endif
 
 #include "esp_system.h"
 #if ESP_IDF_VERSION_MAJOR >= 4 // IDF 4+
@@ -49,52 +58,89 @@ static void *_malloc(size_t size)
     return heap_caps_malloc(size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
 }
 
-static IRAM_ATTR void convert_line_format(uint8_t * src, pixformat_t format, uint8_t * dst, size_t width, size_t in_channels, size_t line)
+#if TO_JPG_USE_SSE2
+// Four R, G, B, 0 pixels to 12 bytes R, G, B: each 64 bit half drops its zero bytes, then the halves are joined.
+static inline __m128i pack_rgb0(__m128i v)
 {
-    int i=0, o=0, l=0;
-    if(format == PIXFORMAT_GRAYSCALE) {
-        memcpy(dst, src + line * width, width);
-    } else if(format == PIXFORMAT_RGB888) {
-        l = width * 3;
-        src += l * line;
-        for(i=0; i<l; i+=3) {
-            dst[o++] = src[i+2];
-            dst[o++] = src[i+1];
-            dst[o++] = src[i];
-        }
-    } else if(format == PIXFORMAT_RGB565) {
-        l = width * 2;
-        src += l * line;
-        for(i=0; i<l; i+=2) {
-            dst[o++] = src[i] & 0xF8;
-            dst[o++] = (src[i] & 0x07) << 5 | (src[i+1] & 0xE0) >> 3;
-            dst[o++] = (src[i+1] & 0x1F) << 3;
-        }
-    } else if(format == PIXFORMAT_YUV422) {
-        uint8_t y0, y1, u, v;
-        uint8_t r, g, b;
-        l = width * 2;
-        src += l * line;
-        for(i=0; i<l; i+=4) {
-            y0 = src[i];
-            u = src[i+1];
-            y1 = src[i+2];
-            v = src[i+3];
+    const __m128i lo24 = _mm_set_epi32(0, 0x00FFFFFF, 0, 0x00FFFFFF);
+    const __m128i hi24 = _mm_set_epi32(0x0000FFFF, (int)0xFF000000, 0x0000FFFF, (int)0xFF000000);
+    const __m128i first6 = _mm_set_epi32(0, 0, 0x0000FFFF, -1);
+    const __m128i next6 = _mm_set_epi32(0, -1, (int)0xFFFF0000, 0);
+    __m128i w = _mm_or_si128(_mm_and_si128(v, lo24), _mm_and_si128(_mm_srli_epi64(v, 8), hi24));
+    return _mm_or_si128(_mm_and_si128(w, first6), _mm_and_si128(_mm_srli_si128(w, 2), next6));
+}
+#endif
 
-            yuv2rgb(y0, u, v, &r, &g, &b);
-            dst[o++] = r;
-            dst[o++] = g;
-            dst[o++] = b;
+// RGB888 is stored B, G, R, the encoder takes R, G, B
+static IRAM_ATTR void convert_line_bgr(const uint8_t * src, uint8_t * dst, size_t width)
+{
+    size_t i = 0;
+#if TO_JPG_USE_SSE2
+    // 5 pixels per 16 bytes: G stays, B and R trade places by shifting the vector 2 bytes either way.
+    // The 16th byte lands on the next pixel, which the next round writes again.
+    const __m128i keep = _mm_setr_epi8(0, -1, 0, 0, -1, 0, 0, -1, 0, 0, -1, 0, 0, -1, 0, 0);
+    const __m128i from_right = _mm_setr_epi8(-1, 0, 0, -1, 0, 0, -1, 0, 0, -1, 0, 0, -1, 0, 0, 0);
+    const __m128i from_left = _mm_setr_epi8(0, 0, -1, 0, 0, -1, 0, 0, -1, 0, 0, -1, 0, 0, -1, 0);
+    for( ; i + 6 <= width; i += 5, src += 15, dst += 15) {
+        __m128i v = _mm_loadu_si128((const __m128i *)src);
+        __m128i swapped = _mm_or_si128(_mm_and_si128(_mm_srli_si128(v, 2), from_right), _mm_and_si128(_mm_slli_si128(v, 2), from_left));
+        _mm_storeu_si128((__m128i *)dst, _mm_or_si128(_mm_and_si128(v, keep), swapped));
+    }
+#endif
+    for( ; i + 2 <= width; i += 2, src += 6, dst += 6) {
+        dst[0] = src[2];
+        dst[1] = src[1];
+        dst[2] = src[0];
+        dst[3] = src[5];
+        dst[4] = src[4];
+        dst[5] = src[3];
+    }
+    if(i < width) {
+        dst[0] = src[2];
+        dst[1] = src[1];
+        dst[2] = src[0];
+    }
+}
 
-            yuv2rgb(y1, u, v, &r, &g, &b);
-            dst[o++] = r;
-            dst[o++] = g;
-            dst[o++] = b;
-        }
+// RGB565, high byte first, to R, G, B. The low bits are left zero.
+static IRAM_ATTR void convert_line_rgb565(const uint8_t * src, uint8_t * dst, size_t width)
+{
+    size_t i = 0;
+#if TO_JPG_USE_SSE2
+    // 8 pixels per round, unpacked in 16 bit lanes and interleaved to R, G, B, 0 before packing.
+    // Each 12 byte half is stored 16 bytes wide, the next store overwrites the extra bytes.
+    const __m128i m_ff = _mm_set1_epi16(0xFF), m_f8 = _mm_set1_epi16(0xF8), m_e0 = _mm_set1_epi16(0xE0);
+    const __m128i m_07 = _mm_set1_epi16(0x07), m_1f = _mm_set1_epi16(0x1F);
+    for( ; i + 10 <= width; i += 8, src += 16, dst += 24) {
+        __m128i v = _mm_loadu_si128((const __m128i *)src);
+        __m128i hi = _mm_and_si128(v, m_ff);
+        __m128i lo = _mm_srli_epi16(v, 8);
+        __m128i r = _mm_and_si128(hi, m_f8);
+        __m128i g = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(hi, m_07), 5), _mm_srli_epi16(_mm_and_si128(lo, m_e0), 3));
+        __m128i b = _mm_slli_epi16(_mm_and_si128(lo, m_1f), 3);
+        __m128i rg = _mm_or_si128(r, _mm_slli_epi16(g, 8));
+        _mm_storeu_si128((__m128i *)dst, pack_rgb0(_mm_unpacklo_epi16(rg, b)));
+        _mm_storeu_si128((__m128i *)(dst + 12), pack_rgb0(_mm_unpackhi_epi16(rg, b)));
+    }
+#endif
+    for( ; i < width; i++, src += 2, dst += 3) {
+        dst[0] = src[0] & 0xF8;
+        dst[1] = (src[0] & 0x07) << 5 | (src[1] & 0xE0) >> 3;
+        dst[2] = (src[1] & 0x1F) << 3;
     }
 }
 
-bool convert_image(uint8_t *src, uint16_t width, uint16_t height, pixformat_t format, uint8_t quality, jpge::output_stream *dst_stream)
+static IRAM_ATTR void convert_line_format(uint8_t * src, pixformat_t format, uint8_t * dst, size_t width, size_t line)
+{
+    if(format == PIXFORMAT_RGB888) {
+        convert_line_bgr(src + width * 3 * line, dst, width);
+    } else if(format == PIXFORMAT_RGB565) {
+        convert_line_rgb565(src + width * 2 * line, dst, width);
+    }
+}
+
+// Encoder parameters for a source format, returns the number of source channels.
+static int image_params(pixformat_t format, uint8_t quality, uint8_t scale, jpge::params *comp_params)
 {
     int num_channels = 3;
     jpge::subsampling_t subsampling = jpge::H2V2;
@@ -102,6 +148,10 @@ bool convert_image(uint8_t *src, uint16_t width, uint16_t height, pixformat_t fo
     if(format == PIXFORMAT_GRAYSCALE) {
         num_channels = 1;
         subsampling = jpge::Y_ONLY;
+    } else if(format == PIXFORMAT_YUV422) {
+        // keep the horizontal-only chroma subsampling the sensor delivers
+        num_channels = 2;
+        subsampling = jpge::H2V1;
     }
 
     if(!quality) {
@@ -110,58 +160,152 @@ bool convert_image(uint8_t *src, uint16_t width, uint16_t height, pixformat_t fo
         quality = 100;
     }
 
-    jpge::params comp_params = jpge::params();
-    comp_params.m_subsampling = subsampling;
-    comp_params.m_quality = quality;
+    *comp_params = jpge::params();
+    comp_params->m_subsampling = subsampling;
+    comp_params->m_quality = quality;
+    comp_params->m_scale = scale;
+#ifdef CONFIG_JPEG_ENCODER_THREADS
+    comp_params->m_num_threads = CONFIG_JPEG_ENCODER_THREADS;
+#endif
+#ifdef CONFIG_JPEG_ENCODER_OPTIMIZE_HUFFMAN
+    comp_params->m_two_pass_flag = true;
+#endif
+    return num_channels;
+}
 
-    jpge::jpeg_encoder dst_image;
+// Grayscale and YUYV frames are read by the encoder in place, the others are converted line by line into line,
+// which has to hold width * 3 bytes.
+static bool encode_image(jpge::jpeg_encoder &dst_image, uint8_t *line, uint8_t *src, uint16_t width, uint16_t height, pixformat_t format, uint8_t quality, jpge::output_stream *dst_stream, uint8_t scale)
+{
+    jpge::params comp_params;
+    int num_channels = image_params(format, quality, scale, &comp_params);
 
     if (!dst_image.init(dst_stream, width, height, num_channels, comp_params)) {
         ESP_LOGE(TAG, "JPG encoder init failed");
         return false;
     }
 
-    uint8_t* line = (uint8_t*)_malloc(width * num_channels);
-    if(!line) {
-        ESP_LOGE(TAG, "Scan line malloc failed");
-        return false;
+    if(format == PIXFORMAT_GRAYSCALE || format == PIXFORMAT_YUV422) {
+        for (uint32_t pass = 0; pass < dst_image.get_total_passes(); pass++) {
+            if (!dst_image.process_frame(src, width * num_channels)) {
+                ESP_LOGE(TAG, "JPG process frame failed");
+                return false;
+            }
+        }
+        return true;
     }
 
-    for (int i = 0; i < height; i++) {
-        convert_line_format(src, format, line, width, num_channels, i);
-        if (!dst_image.process_scanline(line)) {
-            ESP_LOGE(TAG, "JPG process line %u failed", i);
-            free(line);
+    for (uint32_t pass = 0; pass < dst_image.get_total_passes(); pass++) {
+        for (int i = 0; i < height; i++) {
+            convert_line_format(src, format, line, width, i);
+            if (!dst_image.process_scanline(line)) {
+                ESP_LOGE(TAG, "JPG process line %u failed", i);
+                return false;
+            }
+        }
+        if (!dst_image.process_scanline(NULL)) {
+            ESP_LOGE(TAG, "JPG image finish failed");
             return false;
         }
     }
-    free(line);
+    return true;
+}
 
-    if (!dst_image.process_scanline(NULL)) {
-        ESP_LOGE(TAG, "JPG image finish failed");
+// Sub-blocks of an encoder allocation are 16 byte aligned.
+static inline size_t ctx_align(size_t size)
+{
+    return (size + 15) & ~(size_t)15;
+}
+
+// The encoder object is several KB, too much for the stack of the task calling in: it is allocated on the heap,
+// together with the scan line if the format needs one, like jpg_encoder_ctx_create() does.
+// header_len, if not NULL, gets the size of the markers ahead of the entropy coded data.
+bool convert_image(uint8_t *src, uint16_t width, uint16_t height, pixformat_t format, uint8_t quality, jpge::output_stream *dst_stream, uint8_t scale = 1, size_t *header_len = NULL)
+{
+    size_t line_len = (format != PIXFORMAT_GRAYSCALE && format != PIXFORMAT_YUV422) ? (size_t)width * 3 : 0;
+    size_t total = ctx_align(sizeof(jpge::jpeg_encoder)) + line_len;
+    uint8_t *mem = (uint8_t *)_malloc(total);
+    if(!mem) {
+        ESP_LOGE(TAG, "JPG encoder malloc failed: %u bytes", (unsigned)total);
         return false;
     }
-    dst_image.deinit();
-    return true;
+
+    jpge::jpeg_encoder *dst_image = new (mem) jpge::jpeg_encoder;
+    uint8_t *line = line_len ? mem + ctx_align(sizeof(jpge::jpeg_encoder)) : NULL;
+    bool ret = encode_image(*dst_image, line, src, width, height, format, quality, dst_stream, scale);
+    if(header_len) {
+        *header_len = dst_image->get_header_size();
+    }
+    dst_image->~jpeg_encoder();
+    free(mem);
+    return ret;
 }
 
+#ifndef CONFIG_JPEG_ENCODER_CB_FLUSH_SIZE
+#define CONFIG_JPEG_ENCODER_CB_FLUSH_SIZE 4096
+#endif
+
+// Collects the encoder output in a buffer of CONFIG_JPEG_ENCODER_CB_FLUSH_SIZE bytes, which the encoder
+// writes into directly, and hands it to the callback whenever it is full.
+// A callback that consumes less than it was given fails the conversion.
 class callback_stream : public jpge::output_stream {
 protected:
     jpg_out_cb ocb;
     void * oarg;
     size_t index;
+    uint8_t *buf, *own_buf;
+    size_t buf_len, buf_used;
+    bool failed;
+
+    bool flush()
+    {
+        if (buf_used && !failed) {
+            size_t len = ocb(oarg, index, buf, buf_used);
+            index += len;
+            failed = len != buf_used;
+        }
+        buf_used = 0;
+        return !failed;
+    }
 
 public:
-    callback_stream(jpg_out_cb cb, void * arg) : ocb(cb), oarg(arg), index(0) { }
-    virtual ~callback_stream() { }
+    // flush_buf: CONFIG_JPEG_ENCODER_CB_FLUSH_SIZE bytes to use, or NULL to allocate them
+    callback_stream(jpg_out_cb cb, void * arg, uint8_t *flush_buf = NULL) : ocb(cb), oarg(arg), index(0), buf(flush_buf), own_buf(NULL), buf_len(CONFIG_JPEG_ENCODER_CB_FLUSH_SIZE), buf_used(0), failed(false)
+    {
+        if (buf_len && !buf) {
+            buf = own_buf = (uint8_t *)_malloc(buf_len);
+        }
+    }
+    virtual ~callback_stream()
+    {
+        free(own_buf);
+    }
     virtual bool put_buf(const void* data, int len)
     {
-        index += ocb(oarg, index, data, len);
-        return true;
+        if (!flush()) {
+            return false;
+        }
+        size_t written = ocb(oarg, index, data, len);
+        index += written;
+        failed = data && written != (size_t)len;
+        return !failed;
     }
-    virtual size_t get_size() const
+    virtual jpge::uint8 *get_write_buf(jpge::uint min_len, jpge::uint *pLen)
     {
-        return index;
+        if (!buf || (buf_len - buf_used < min_len && (!flush() || buf_len < min_len))) {
+            return NULL;
+        }
+        *pLen = buf_len - buf_used;
+        return buf + buf_used;
+    }
+    virtual bool commit_write_buf(jpge::uint len)
+    {
+        buf_used += len;
+        return buf_used < buf_len || flush();
+    }
+    virtual jpge::uint get_size() const
+    {
+        return index + buf_used;
     }
 };
 
@@ -178,13 +322,14 @@ bool frame2jpg_cb(camera_fb_t * fb, uint8_t quality, jpg_out_cb cb, void * arg)
 
 
 
+// Writes into a caller supplied buffer. The encoder codes straight into it, overflow fails the conversion.
 class memory_stream : public jpge::output_stream {
 protected:
     uint8_t *out_buf;
     size_t max_len, index;
 
 public:
-    memory_stream(void *pBuf, uint buf_size) : out_buf(static_cast<uint8_t*>(pBuf)), max_len(buf_size), index(0) { }
+    memory_stream(void *pBuf, size_t buf_size) : out_buf(static_cast<uint8_t*>(pBuf)), max_len(buf_size), index(0) { }
 
     virtual ~memory_stream() { }
 
@@ -195,47 +340,529 @@ public:
             return true;
         }
         if ((size_t)len > (max_len - index)) {
-            ESP_LOGW(TAG, "JPG output overflow: %d bytes", len - (max_len - index));
-            len = max_len - index;
+            ESP_LOGE(TAG, "JPG output overflow: %u bytes", (unsigned)(len - (max_len - index)));
+            return false;
         }
-        if (len) {
-            memcpy(out_buf + index, pBuf, len);
-            index += len;
+        memcpy(out_buf + index, pBuf, len);
+        index += len;
+        return true;
+    }
+
+    virtual jpge::uint8 *get_write_buf(jpge::uint min_len, jpge::uint *pLen)
+    {
+        // too little room left: let the encoder stage the rest, so that put_buf() sees the exact overflow
+        if (max_len - index < min_len) {
+            return NULL;
+        }
+        *pLen = max_len - index;
+        return out_buf + index;
+    }
+
+    virtual bool commit_write_buf(jpge::uint len)
+    {
+        index += len;
+        return true;
+    }
+
+    virtual jpge::uint get_size() const
+    {
+        return index;
+    }
+};
+
+bool fmt2jpg_buf(uint8_t *src, size_t src_len, uint16_t width, uint16_t height, pixformat_t format, uint8_t quality, uint8_t * buf, size_t buf_len, size_t * out_len)
+{
+    memory_stream dst_stream(buf, buf_len);
+
+    if(!convert_image(src, width, height, format, quality, &dst_stream)) {
+        return false;
+    }
+    *out_len = dst_stream.get_size();
+    return true;
+}
+
+bool frame2jpg_buf(camera_fb_t * fb, uint8_t quality, uint8_t * buf, size_t buf_len, size_t * out_len)
+{
+    return fmt2jpg_buf(fb->buf, fb->len, fb->width, fb->height, fb->format, quality, buf, buf_len, out_len);
+}
+
+// Grows by chaining further buffers instead of reallocating, nothing written is ever copied while encoding.
+// detach() hands out the result in one piece: the first buffer shrunk in place if it held everything,
+// else the chain copied once into a buffer of exactly the right size.
+class chain_stream : public jpge::output_stream {
+protected:
+    struct chunk {
+        chunk *next;
+        uint8_t *data;
+        size_t len, used;
+    };
+    chunk *head, *tail;
+    size_t next_len, index;
+
+    bool add_chunk(size_t min_len)
+    {
+        chunk *c = (chunk *)malloc(sizeof(chunk));
+        if (!c) {
+            return false;
+        }
+        c->len = next_len > min_len ? next_len : min_len;
+        c->data = (uint8_t *)_malloc(c->len);
+        if (!c->data) {
+            free(c);
+            ESP_LOGE(TAG, "JPG buffer malloc failed");
+            return false;
+        }
+        c->next = NULL;
+        c->used = 0;
+        if (tail) {
+            tail->next = c;
+        } else {
+            head = c;
+        }
+        tail = c;
+        // later chunks only hold what the estimate missed, keep them smaller
+        next_len = (next_len / 2 > 4096) ? next_len / 2 : 4096;
+        return true;
+    }
+
+public:
+    chain_stream(size_t first_len) : head(NULL), tail(NULL), next_len(first_len), index(0) { }
+
+    virtual ~chain_stream()
+    {
+        while (head) {
+            chunk *c = head;
+            head = c->next;
+            free(c->data);
+            free(c);
+        }
+    }
+
+    virtual bool put_buf(const void* pBuf, int len)
+    {
+        if (!pBuf) {
+            //end of image
+            return true;
+        }
+        if ((!tail || tail->len - tail->used < (size_t)len) && !add_chunk(len)) {
+            return false;
+        }
+        memcpy(tail->data + tail->used, pBuf, len);
+        tail->used += len;
+        index += len;
+        return true;
+    }
+
+    virtual jpge::uint8 *get_write_buf(jpge::uint min_len, jpge::uint *pLen)
+    {
+        if ((!tail || tail->len - tail->used < min_len) && !add_chunk(min_len)) {
+            return NULL;
         }
+        *pLen = tail->len - tail->used;
+        return tail->data + tail->used;
+    }
+
+    virtual bool commit_write_buf(jpge::uint len)
+    {
+        tail->used += len;
+        index += len;
         return true;
     }
 
-    virtual size_t get_size() const
+    virtual jpge::uint get_size() const
     {
         return index;
     }
+
+    uint8_t *detach()
+    {
+        uint8_t *out;
+        if (!head) {
+            return NULL;
+        }
+        if (!head->next) {
+            out = (uint8_t *)realloc(head->data, index);
+            if (!out) {
+                out = head->data;
+            }
+            free(head);
+        } else {
+            out = (uint8_t *)_malloc(index);
+            if (!out) {
+                ESP_LOGE(TAG, "JPG buffer malloc failed");
+                return NULL;
+            }
+            size_t o = 0;
+            while (head) {
+                chunk *c = head;
+                head = c->next;
+                memcpy(out + o, c->data, c->used);
+                o += c->used;
+                free(c->data);
+                free(c);
+            }
+        }
+        head = tail = NULL;
+        index = 0;
+        return out;
+    }
 };
 
+// convert_image() into a buffer of its own, for fmt2jpg_scaled() and fmt2jpg_rc()
+static bool convert_image_alloc(uint8_t *src, uint16_t width, uint16_t height, pixformat_t format, uint8_t quality, uint8_t scale, uint8_t ** out, size_t * out_len, size_t *header_len)
+{
+    // about 2 bits per pixel, enough for most frames up to high quality
+    chain_stream dst_stream((size_t)width * height / 4 / (scale * scale) + 1024);
+
+    if(!convert_image(src, width, height, format, quality, &dst_stream, scale, header_len)) {
+        return false;
+    }
+
+    size_t len = dst_stream.get_size();
+    uint8_t * jpg_buf = dst_stream.detach();
+    if(jpg_buf == NULL) {
+        return false;
+    }
+    *out = jpg_buf;
+    *out_len = len;
+    return true;
+}
+
+bool fmt2jpg_scaled(uint8_t *src, size_t src_len, uint16_t width, uint16_t height, pixformat_t format, uint8_t quality, uint8_t scale, uint8_t ** out, size_t * out_len)
+{
+    return convert_image_alloc(src, width, height, format, quality, scale, out, out_len, NULL);
+}
+
+bool frame2jpg_scaled(camera_fb_t * fb, uint8_t quality, uint8_t scale, uint8_t ** out, size_t * out_len)
+{
+    return fmt2jpg_scaled(fb->buf, fb->len, fb->width, fb->height, fb->format, quality, scale, out, out_len);
+}
+
 bool fmt2jpg(uint8_t *src, size_t src_len, uint16_t width, uint16_t height, pixformat_t format, uint8_t quality, uint8_t ** out, size_t * out_len)
 {
-    //todo: allocate proper buffer for holding JPEG data
-    //this should be enough for CIF frame size
-    int jpg_buf_len = 64*1024;
+    return fmt2jpg_scaled(src, src_len, width, height, format, quality, 1, out, out_len);
+}
+
+bool frame2jpg(camera_fb_t * fb, uint8_t quality, uint8_t ** out, size_t * out_len)
+{
+    return fmt2jpg(fb->buf, fb->len, fb->width, fb->height, fb->format, quality, out, out_len);
+}
+
+bool jpg_transform(const uint8_t *src, size_t src_len, jpg_transform_t transform, const img_rect_t *crop, uint8_t ** out, size_t * out_len)
+{
+    // the coefficients stay the same, only the Huffman tables may differ
+    chain_stream dst_stream(src_len + 1024);
 
+    if(!jpg_transform_stream(src, src_len, transform, crop, &dst_stream)) {
+        return false;
+    }
 
-    uint8_t * jpg_buf = (uint8_t *)_malloc(jpg_buf_len);
+    size_t len = dst_stream.get_size();
+    uint8_t * jpg_buf = dst_stream.detach();
     if(jpg_buf == NULL) {
-        ESP_LOGE(TAG, "JPG buffer malloc failed");
         return false;
     }
-    memory_stream dst_stream(jpg_buf, jpg_buf_len);
+    *out = jpg_buf;
+    *out_len = len;
+    return true;
+}
 
-    if(!convert_image(src, width, height, format, quality, &dst_stream)) {
-        free(jpg_buf);
+bool jpg_transform_cb(const uint8_t *src, size_t src_len, jpg_transform_t transform, const img_rect_t *crop, jpg_out_cb cb, void * arg)
+{
+    callback_stream dst_stream(cb, arg);
+    return jpg_transform_stream(src, src_len, transform, crop, &dst_stream);
+}
+
+bool frame2jpg_transformed(camera_fb_t * fb, jpg_transform_t transform, const img_rect_t *crop, uint8_t ** out, size_t * out_len)
+{
+    if(fb->format != PIXFORMAT_JPEG) {
+        ESP_LOGE(TAG, "Format %u is not JPEG", fb->format);
+        return false;
+    }
+    return jpg_transform(fb->buf, fb->len, transform, crop, out, out_len);
+}
+
+bool jpg_requantize(const uint8_t *src, size_t src_len, uint8_t quality, uint8_t ** out, size_t * out_len)
+{
+    // coarser tables only shrink the coefficients, the result stays around the source size or below
+    chain_stream dst_stream(src_len + 1024);
+
+    if(!jpg_requantize_stream(src, src_len, quality, &dst_stream)) {
         return false;
     }
 
+    size_t len = dst_stream.get_size();
+    uint8_t * jpg_buf = dst_stream.detach();
+    if(jpg_buf == NULL) {
+        return false;
+    }
     *out = jpg_buf;
+    *out_len = len;
+    return true;
+}
+
+bool jpg_requantize_cb(const uint8_t *src, size_t src_len, uint8_t quality, jpg_out_cb cb, void * arg)
+{
+    callback_stream dst_stream(cb, arg);
+    return jpg_requantize_stream(src, src_len, quality, &dst_stream);
+}
+
+bool frame2jpg_requantized(camera_fb_t * fb, uint8_t quality, uint8_t ** out, size_t * out_len)
+{
+    if(fb->format != PIXFORMAT_JPEG) {
+        ESP_LOGE(TAG, "Format %u is not JPEG", fb->format);
+        return false;
+    }
+    return jpg_requantize(fb->buf, fb->len, quality, out, out_len);
+}
+
+// Reusable encoder context: the encoder, its worker threads and every buffer a conversion needs live in one
+// allocation made by jpg_encoder_ctx_create(), so that encoding frame after frame does not touch the heap.
+struct jpg_encoder_ctx {
+    jpge::jpeg_encoder encoder;
+    uint16_t max_width, max_height;
+    uint8_t *line;          // width * 3 bytes, RGB565/RGB888 scanline
+    uint8_t *flush_buf;     // CONFIG_JPEG_ENCODER_CB_FLUSH_SIZE bytes for the callback stream
+    uint8_t *out_buf;       // JPEG output of fmt2jpg_ctx()
+    size_t out_buf_len;
+};
+
+jpg_encoder_ctx_t *jpg_encoder_ctx_create(uint16_t max_width, uint16_t max_height, size_t out_buf_len)
+{
+    // largest encoder arena over the source formats, at full scale
+    static const pixformat_t formats[] = { PIXFORMAT_GRAYSCALE, PIXFORMAT_YUV422, PIXFORMAT_RGB888 };
+    size_t arena_len = 0;
+    for (size_t i = 0; i < sizeof(formats) / sizeof(formats[0]); i++) {
+        jpge::params comp_params;
+        int num_channels = image_params(formats[i], 100, 1, &comp_params);
+        size_t len = jpge::jpeg_encoder::get_arena_size(max_width, max_height, num_channels, comp_params);
+        if (len > arena_len) {
+            arena_len = len;
+        }
+    }
+
+    size_t line_len = ctx_align((size_t)max_width * 3);
+    size_t flush_len = ctx_align(CONFIG_JPEG_ENCODER_CB_FLUSH_SIZE);
+    size_t total = ctx_align(sizeof(jpg_encoder_ctx)) + ctx_align(arena_len) + line_len + flush_len + out_buf_len;
+    uint8_t *mem = (uint8_t *)_malloc(total);
+    if (!mem) {
+        ESP_LOGE(TAG, "JPG encoder context malloc failed: %u bytes", (unsigned)total);
+        return NULL;
+    }
+
+    jpg_encoder_ctx_t *ctx = new (mem) jpg_encoder_ctx;
+    mem += ctx_align(sizeof(jpg_encoder_ctx));
+    ctx->encoder.set_arena(mem, arena_len);
+    mem += ctx_align(arena_len);
+    ctx->line = mem;
+    mem += line_len;
+    ctx->flush_buf = mem;
+    mem += flush_len;
+    ctx->out_buf = out_buf_len ? mem : NULL;
+    ctx->out_buf_len = out_buf_len;
+    ctx->max_width = max_width;
+    ctx->max_height = max_height;
+    return ctx;
+}
+
+void jpg_encoder_ctx_free(jpg_encoder_ctx_t *ctx)
+{
+    if (ctx) {
+        ctx->~jpg_encoder_ctx();
+        free(ctx);
+    }
+}
+
+static bool ctx_convert_image(jpg_encoder_ctx_t *ctx, uint8_t *src, uint16_t width, uint16_t height, pixformat_t format, uint8_t quality, jpge::output_stream *dst_stream)
+{
+    if (width > ctx->max_width || height > ctx->max_height) {
+        ESP_LOGE(TAG, "Frame %ux%u larger than the encoder context", width, height);
+        return false;
+    }
+    return encode_image(ctx->encoder, ctx->line, src, width, height, format, quality, dst_stream, 1);
+}
+
+bool fmt2jpg_ctx(jpg_encoder_ctx_t *ctx, uint8_t *src, size_t src_len, uint16_t width, uint16_t height, pixformat_t format, uint8_t quality, uint8_t ** out, size_t * out_len)
+{
+    memory_stream dst_stream(ctx->out_buf, ctx->out_buf_len);
+
+    if(!ctx_convert_image(ctx, src, width, height, format, quality, &dst_stream)) {
+        return false;
+    }
+    *out = ctx->out_buf;
     *out_len = dst_stream.get_size();
     return true;
 }
 
-bool frame2jpg(camera_fb_t * fb, uint8_t quality, uint8_t ** out, size_t * out_len)
+bool frame2jpg_ctx(jpg_encoder_ctx_t *ctx, camera_fb_t * fb, uint8_t quality, uint8_t ** out, size_t * out_len)
 {
-    return fmt2jpg(fb->buf, fb->len, fb->width, fb->height, fb->format, quality, out, out_len);
+    return fmt2jpg_ctx(ctx, fb->buf, fb->len, fb->width, fb->height, fb->format, quality, out, out_len);
+}
+
+bool fmt2jpg_cb_ctx(jpg_encoder_ctx_t *ctx, uint8_t *src, size_t src_len, uint16_t width, uint16_t height, pixformat_t format, uint8_t quality, jpg_out_cb cb, void * arg)
+{
+    callback_stream dst_stream(cb, arg, ctx->flush_buf);
+    return ctx_convert_image(ctx, src, width, height, format, quality, &dst_stream);
+}
+
+bool frame2jpg_cb_ctx(jpg_encoder_ctx_t *ctx, camera_fb_t * fb, uint8_t quality, jpg_out_cb cb, void * arg)
+{
+    return fmt2jpg_cb_ctx(ctx, fb->buf, fb->len, fb->width, fb->height, fb->format, quality, cb, arg);
+}
+
+// Rate control.
+// The encoded size is modelled as the header the encoder reports plus entropy coded data that grows linearly
+// with the activity (mean luma gradient) of the frame and falls with the quantizer scale s as s^-gamma.
+// The data size of the previous frame, or of a trial encode of a band of MCU rows for the first frame,
+// is rescaled to the activity of the new frame, and the scale that brings it onto the budget is solved for.
+// gamma is refined from every frame that was coded at a different scale than its reference.
+// The activity is taken from a few bands of rows spread over the frame, not from all of it, so that the
+// estimate reads about as much of a PSRAM frame as the trial encode does.
+#define RC_TRIAL_ROWS       32
+#define RC_ACTIVITY_BANDS   4
+#define RC_ACTIVITY_ROWS    16
+
+static float quality_to_scale(int quality)
+{
+    return (quality < 50) ? 5000.0f / quality : 200.0f - 2 * quality;
+}
+
+static int scale_to_quality(float scale)
+{
+    int quality = (scale <= 100.0f) ? (int)((200.0f - scale) / 2 + 0.5f) : (int)(5000.0f / scale + 0.5f);
+    return (quality < 1) ? 1 : (quality > 100) ? 100 : quality;
+}
+
+static inline int luma_at(const uint8_t *src, pixformat_t format, int x)
+{
+    const uint8_t *p;
+    switch(format) {
+    case PIXFORMAT_GRAYSCALE:
+        return src[x];
+    case PIXFORMAT_YUV422:
+        return src[x * 2];
+    case PIXFORMAT_RGB888:
+        p = src + x * 3;
+        return (p[0] + 2 * p[1] + p[2]) >> 2;
+    case PIXFORMAT_RGB565:
+        p = src + x * 2;
+        return ((p[0] & 0xF8) + (((p[0] & 0x07) << 5 | (p[1] & 0xE0) >> 3) << 1) + ((p[1] & 0x1F) << 3)) >> 2;
+    default:
+        return 0;
+    }
+}
+
+// Mean absolute luma gradient of rows [y0, y1), sampled on every 4th row and every 2nd column.
+static float frame_activity(const uint8_t *src, uint16_t width, int y0, int y1, pixformat_t format)
+{
+    size_t bpl = (size_t)width * ((format == PIXFORMAT_GRAYSCALE) ? 1 : (format == PIXFORMAT_RGB888) ? 3 : 2);
+    uint32_t sum = 0, num = 0;
+    for (int y = y0; y + 1 < y1; y += 4) {
+        const uint8_t *row = src + y * bpl;
+        for (int x = 0; x + 2 < width; x += 2) {
+            int l = luma_at(row, format, x);
+            sum += abs(luma_at(row, format, x + 2) - l) + abs(luma_at(row + bpl, format, x) - l);
+            num++;
+        }
+    }
+    // flat frames still cost something per block
+    return 1.0f + (num ? (float)sum / num : 0.0f);
+}
+
+// frame_activity() of RC_ACTIVITY_BANDS bands of RC_ACTIVITY_ROWS rows, evenly spread over the frame
+static float sampled_activity(const uint8_t *src, uint16_t width, uint16_t height, pixformat_t format)
+{
+    if(height <= RC_ACTIVITY_BANDS * RC_ACTIVITY_ROWS) {
+        return frame_activity(src, width, 0, height, format);
+    }
+    float sum = 0;
+    for(int i = 0; i < RC_ACTIVITY_BANDS; i++) {
+        int y0 = (int)height * (2 * i + 1) / (2 * RC_ACTIVITY_BANDS) - RC_ACTIVITY_ROWS / 2;
+        sum += frame_activity(src, width, y0, y0 + RC_ACTIVITY_ROWS, format);
+    }
+    return sum / RC_ACTIVITY_BANDS;
+}
+
+class count_stream : public jpge::output_stream {
+protected:
+    size_t index;
+
+public:
+    count_stream() : index(0) { }
+    virtual ~count_stream() { }
+    virtual bool put_buf(const void* pBuf, int len)
+    {
+        index += len;
+        return true;
+    }
+    virtual jpge::uint get_size() const
+    {
+        return index;
+    }
+};
+
+void jpg_rate_ctrl_init(jpg_rate_ctrl_t *rc, size_t target_len)
+{
+    rc->target_len = target_len;
+    rc->quality = 60;
+    rc->min_quality = 5;
+    rc->max_quality = 95;
+    rc->gamma = 0.8f;
+    rc->last_activity = 0;
+    rc->last_len = 0;
+    rc->header_len = 0;
+}
+
+bool fmt2jpg_rc(uint8_t *src, size_t src_len, uint16_t width, uint16_t height, pixformat_t format, jpg_rate_ctrl_t *rc, uint8_t ** out, size_t * out_len)
+{
+    float activity = sampled_activity(src, width, height, format);
+    float ref_scale = quality_to_scale(rc->quality);
+    float ref_data;
+    size_t header_len = rc->header_len;
+
+    if(rc->last_len) {
+        ref_data = (float)((rc->last_len > header_len) ? rc->last_len - header_len : 1) * activity / rc->last_activity;
+    } else {
+        // nothing to go by yet, code a band of MCU rows from the middle of the frame at the current quality and extrapolate
+        int rows = (height < RC_TRIAL_ROWS) ? height : RC_TRIAL_ROWS;
+        int y0 = ((height - rows) / 2) & ~15;
+        size_t bpl = (size_t)width * ((format == PIXFORMAT_GRAYSCALE) ? 1 : (format == PIXFORMAT_RGB888) ? 3 : 2);
+        count_stream trial;
+        if(!convert_image(src + y0 * bpl, width, rows, format, rc->quality, &trial, 1, &header_len)) {
+            return false;
+        }
+        size_t trial_len = trial.get_size();
+        ref_data = (float)((trial_len > header_len) ? trial_len - header_len : 1) * activity / frame_activity(src, width, y0, y0 + rows, format) * height / rows;
+    }
+
+    float budget = (float)((rc->target_len > 2 * header_len) ? rc->target_len - header_len : header_len);
+    float scale = ref_scale * powf(ref_data / budget, 1.0f / rc->gamma);
+    int quality = scale_to_quality(scale);
+    if(quality < rc->min_quality) {
+        quality = rc->min_quality;
+    } else if(quality > rc->max_quality) {
+        quality = rc->max_quality;
+    }
+
+    if(!convert_image_alloc(src, width, height, format, quality, 1, out, out_len, &header_len)) {
+        return false;
+    }
+
+    // refine the exponent from what the change of scale actually did
+    scale = quality_to_scale(quality);
+    if(rc->last_len && (fabsf(logf(scale / ref_scale)) > 0.05f) && (*out_len > header_len)) {
+        float gamma = logf(ref_data / (*out_len - header_len)) / logf(scale / ref_scale);
+        gamma = (gamma < 0.5f) ? 0.5f : (gamma > 1.5f) ? 1.5f : gamma;
+        rc->gamma = 0.7f * rc->gamma + 0.3f * gamma;
+    }
+    rc->quality = quality;
+    rc->last_activity = activity;
+    rc->last_len = *out_len;
+    rc->header_len = header_len;
+    return true;
+}
+
+bool frame2jpg_rc(camera_fb_t * fb, jpg_rate_ctrl_t *rc, uint8_t ** out, size_t * out_len)
+{
+    return fmt2jpg_rc(fb->buf, fb->len, fb->width, fb->height, fb->format, rc, out, out_len);
 }
@@ -19,6 +19,7 @@
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "freertos/semphr.h"
+#include "freertos/event_groups.h"
 #include "soc/soc.h"
 #include "soc/gpio_sig_map.h"
 #include "soc/i2s_reg.h"
@@ -35,6 +36,8 @@
 #include "sccb.h"
 #include "esp_camera.h"
 #include "camera_common.h"
+#include "dma_filter.h"
+#include "img_converters.h"
 #include "xclk.h"
 #if CONFIG_OV2640_SUPPORT
 #include "ov2640.h"
@@ -80,8 +83,6 @@ static const char* CAMERA_PIXFORMAT_NVS_KEY = "pixformat";
 extern int HwFrameCnt, I2sFrameCnt,DMAerrors,JPGerrors;
 
 
-typedef void (*dma_filter_t)(const dma_elem_t* src, lldesc_t* dma_desc, uint8_t* dst);
-
 typedef struct camera_fb_s
 {
     uint8_t * buf;
@@ -91,8 +92,9 @@ typedef struct camera_fb_s
     pixformat_t format;
     struct timeval timestamp;
     size_t size;
-    uint8_t ref;
+    uint8_t ref;        // holders: the latest frame slot and each consumer, 0 when the buffer may be filled
     uint8_t bad;
+    uint32_t seq;       // number of the frame, counting the frames the driver has completed
     struct camera_fb_s * next;
 } camera_fb_int_t;
 
@@ -119,6 +121,7 @@ typedef struct
 
     size_t dma_received_count;
     size_t dma_filtered_count;
+    jpg_eoi_scan_t jpeg_scan;
     size_t dma_per_line;
     size_t dma_buf_width;
     size_t dma_sample_count;
@@ -132,8 +135,12 @@ typedef struct
     dma_filter_t dma_filter;
     intr_handle_t i2s_intr_handle;
     QueueHandle_t data_ready;
-    QueueHandle_t fb_in;
-    QueueHandle_t fb_out;
+
+    SemaphoreHandle_t fb_lock;          // guards ref of the frame buffers and the fields below
+    EventGroupHandle_t fb_event;
+    camera_fb_int_t *fb_latest;         // newest complete frame
+    uint32_t fb_seq;                    // its number
+    uint32_t fb_get_seq;                // number of the frame esp_camera_fb_get() handed out last
 
     SemaphoreHandle_t frame_ready;
     TaskHandle_t dma_filter_task;
@@ -148,13 +155,14 @@ static void IRAM_ATTR i2s_isr(void* arg);
 static esp_err_t dma_desc_init();
 static void dma_desc_deinit();
 static void dma_filter_task(void *pvParameters);
-static void dma_filter_grayscale(const dma_elem_t* src, lldesc_t* dma_desc, uint8_t* dst);
-static void dma_filter_grayscale_highspeed(const dma_elem_t* src, lldesc_t* dma_desc, uint8_t* dst);
-static void dma_filter_yuyv(const dma_elem_t* src, lldesc_t* dma_desc, uint8_t* dst);
-static void dma_filter_yuyv_highspeed(const dma_elem_t* src, lldesc_t* dma_desc, uint8_t* dst);
-static void dma_filter_jpeg(const dma_elem_t* src, lldesc_t* dma_desc, uint8_t* dst);
 static void i2s_stop(bool* need_yield);
 
+//event bit of a frame number. Publishing frame n sets its bit and clears the one of n + 1, so a task that saw
+//frame n waits for the bit of n + 1. That bit is lost if frames n + 1 and n + 2 both complete between the check
+//and the wait, as n + 2 clears it again: waits are cut into FB_WAIT_SLICE and the frame number checked after each
+#define FB_EVENT_SEQ(seq)   (((seq) & 1) ? 0x02 : 0x01)
+#define FB_WAIT_SLICE       ((10 / portTICK_PERIOD_MS) ? (10 / portTICK_PERIOD_MS) : 1)
+
 static bool is_hs_mode()
 {
     return s_state->config.xclk_freq_hz > 10000000;
@@ -258,7 +266,7 @@ static esp_err_t camera_fb_init(size_t count)
 
     camera_fb_deinit();
 
-    ESP_LOGI(TAG, "Allocating %u frame buffers (%d KB total)", count, (s_state->fb_size * count) / 1024);
+    ESP_LOGI(TAG, "Allocating %u frame buffers (%d KB total)", (unsigned)count, (int)(s_state->fb_size * count / 1024));
 
     camera_fb_int_t * _fb = NULL, * _fb1 = NULL, * _fb2 = NULL;
     for(size_t i = 0; i < count; i++)
@@ -273,17 +281,17 @@ static esp_err_t camera_fb_init(size_t count)
         _fb2->buf = (uint8_t*) calloc(_fb2->size, 1);
         if(!_fb2->buf)
         {
-            ESP_LOGI(TAG, "Allocating %d KB frame buffer in PSRAM", s_state->fb_size/1024);
+            ESP_LOGI(TAG, "Allocating %d KB frame buffer in PSRAM", (int)(s_state->fb_size/1024));
             _fb2->buf = (uint8_t*) heap_caps_calloc(_fb2->size, 1, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
         }
         else
         {
-            ESP_LOGI(TAG, "Allocating %d KB frame buffer in OnBoard RAM", s_state->fb_size/1024);
+            ESP_LOGI(TAG, "Allocating %d KB frame buffer in OnBoard RAM", (int)(s_state->fb_size/1024));
         }
         if(!_fb2->buf)
         {
             free(_fb2);
-            ESP_LOGE(TAG, "Allocating %d KB frame buffer Failed", s_state->fb_size/1024);
+            ESP_LOGE(TAG, "Allocating %d KB frame buffer Failed", (int)(s_state->fb_size/1024));
             goto fail;
         }
         memset(_fb2->buf, 0, _fb2->size);
@@ -319,7 +327,7 @@ static esp_err_t dma_desc_init()
     assert(s_state->width % 4 == 0);
     size_t line_size = s_state->width * s_state->in_bytes_per_pixel *
                        i2s_bytes_per_sample(s_state->sampling_mode);
-    ESP_LOGD(TAG, "Line width (for DMA): %d bytes", line_size);
+    ESP_LOGD(TAG, "Line width (for DMA): %d bytes", (int)line_size);
     size_t dma_per_line = 1;
     size_t buf_size = line_size;
     while (buf_size >= 4096)
@@ -331,9 +339,9 @@ static esp_err_t dma_desc_init()
     s_state->dma_buf_width = line_size;
     s_state->dma_per_line = dma_per_line;
     s_state->dma_desc_count = dma_desc_count;
-    ESP_LOGD(TAG, "DMA buffer size: %d, DMA buffers per line: %d", buf_size, dma_per_line);
-    ESP_LOGD(TAG, "DMA buffer count: %d", dma_desc_count);
-    ESP_LOGD(TAG, "DMA buffer total: %d bytes", buf_size * dma_desc_count);
+    ESP_LOGD(TAG, "DMA buffer size: %d, DMA buffers per line: %d", (int)buf_size, (int)dma_per_line);
+    ESP_LOGD(TAG, "DMA buffer count: %d", (int)dma_desc_count);
+    ESP_LOGD(TAG, "DMA buffer total: %d bytes", (int)(buf_size * dma_desc_count));
 
     s_state->dma_buf = (dma_elem_t**) malloc(sizeof(dma_elem_t*) * dma_desc_count);
     if (s_state->dma_buf == NULL)
@@ -348,7 +356,7 @@ static esp_err_t dma_desc_init()
     size_t dma_sample_count = 0;
     for (int i = 0; i < dma_desc_count; ++i)
     {
-        ESP_LOGD(TAG, "Allocating DMA buffer #%d, size=%d", i, buf_size);
+        ESP_LOGD(TAG, "Allocating DMA buffer #%d, size=%d", (int)i, (int)buf_size);
         dma_elem_t* buf = (dma_elem_t*) malloc(buf_size);
         if (buf == NULL)
         {
@@ -504,7 +512,7 @@ static void IRAM_ATTR i2s_start_bus()
     i2s_conf_reset();
 
     I2S0.rx_eof_num = s_state->dma_sample_count;
-    I2S0.in_link.addr = (uint32_t) &s_state->dma_desc[0];
+    I2S0.in_link.addr = (uint32_t)(uintptr_t) &s_state->dma_desc[0];
     I2S0.in_link.start = 1;
     I2S0.int_clr.val = I2S0.int_raw.val;
     I2S0.int_ena.val = 0;
@@ -659,7 +667,7 @@ static void IRAM_ATTR vsync_isr(void* arg)
             i2s_conf_reset();
             s_state->dma_desc_cur = (s_state->dma_desc_cur + 1) % s_state->dma_desc_count;
             //I2S0.rx_eof_num = s_state->dma_sample_count;
-            I2S0.in_link.addr = (uint32_t) &s_state->dma_desc[s_state->dma_desc_cur];
+            I2S0.in_link.addr = (uint32_t)(uintptr_t) &s_state->dma_desc[s_state->dma_desc_cur];
             I2S0.in_link.start = 1;
             I2S0.conf.rx_start = 1;
             s_state->dma_received_count = 0;
@@ -671,10 +679,23 @@ static void IRAM_ATTR vsync_isr(void* arg)
     }
 }
 
+//drop a reference, with fb_lock held. The last one frees the buffer to be filled again
+static void camera_fb_unref(camera_fb_int_t * fb)
+{
+    if(fb->ref && --fb->ref == 0)
+    {
+        fb->len = 0;
+        if(fb == s_state->fb)
+        {
+            //DMA waits on this buffer and may be in the middle of a frame, drop that frame
+            fb->bad = 1;
+        }
+    }
+}
+
 static void IRAM_ATTR camera_fb_done()
 {
-    camera_fb_int_t * fb = NULL, * fb2 = NULL;
-    BaseType_t taskAwoken = 0;
+    camera_fb_int_t * fb = NULL;
 
     if(s_state->config.fb_count == 1)
     {
@@ -682,47 +703,27 @@ static void IRAM_ATTR camera_fb_done()
         return;
     }
 
+    xSemaphoreTake(s_state->fb_lock, portMAX_DELAY);
     fb = s_state->fb;
     if(!fb->ref && fb->len)
     {
-        //add reference
+        //the latest frame slot holds it until a newer frame replaces it, consumers add their own references
         fb->ref = 1;
-
-        //check if the queue is full
-        if(xQueueIsQueueFullFromISR(s_state->fb_out) == pdTRUE)
-        {
-            //pop frame buffer from the queue
-            if(xQueueReceiveFromISR(s_state->fb_out, &fb2, &taskAwoken) == pdTRUE)
-            {
-                //free the popped buffer
-                fb2->ref = 0;
-                fb2->len = 0;
-                //push the new frame to the end of the queue
-                xQueueSendFromISR(s_state->fb_out, &fb, &taskAwoken);
-            }
-            else
-            {
-                //queue is full and we could not pop a frame from it
-            }
-        }
-        else
+        fb->seq = ++s_state->fb_seq;
+        if(s_state->fb_latest)
         {
-            //push the new frame to the end of the queue
-            xQueueSendFromISR(s_state->fb_out, &fb, &taskAwoken);
+            camera_fb_unref(s_state->fb_latest);
         }
+        s_state->fb_latest = fb;
+        //wakes every task waiting for a frame
+        xEventGroupClearBits(s_state->fb_event, FB_EVENT_SEQ(fb->seq + 1));
+        xEventGroupSetBits(s_state->fb_event, FB_EVENT_SEQ(fb->seq));
     }
     else
     {
         //frame was referenced or empty
     }
 
-    //return buffers to be filled
-    while(xQueueReceiveFromISR(s_state->fb_in, &fb2, &taskAwoken) == pdTRUE)
-    {
-        fb2->ref = 0;
-        fb2->len = 0;
-    }
-
     //advance frame buffer only if the current one has data
     if(s_state->fb->len)
     {
@@ -745,11 +746,11 @@ static void IRAM_ATTR camera_fb_done()
         //stay at the previous buffer
         s_state->fb = fb;
     }
+    xSemaphoreGive(s_state->fb_lock);
 }
 
 static void IRAM_ATTR dma_finish_frame()
 {
-	int flag=0;
     size_t buf_len = s_state->width * s_state->fb_bytes_per_pixel / s_state->dma_per_line;
 
     if(!s_state->fb->ref)
@@ -771,33 +772,25 @@ static void IRAM_ATTR dma_finish_frame()
             s_state->fb->len = s_state->dma_filtered_count * buf_len;
             if(s_state->fb->len)
             {
-                //find the end marker for JPEG. Data after that can be discarded. tomk
+                //cut the JPEG after its end marker, dma_filter_buffer() found it on the way. Data after that can be discarded. tomk
                 if(s_state->fb->format == PIXFORMAT_JPEG)
                 {
-                    uint8_t * dptr = &s_state->fb->buf[s_state->fb->len - 1]; // goto last byte
-                    while(dptr > s_state->fb->buf) // go backwards
+                    if(s_state->jpeg_scan.eoi)
                     {
-                        if(dptr[0] == 0xFF && dptr[1] == 0xD9 && dptr[2] == 0x00 && dptr[3] == 0x00)
-                        { // if found endmarker
-                            dptr += 2; //goto after 0xD9
-                            s_state->fb->len = dptr - s_state->fb->buf;  //adjust length
-                            if((s_state->fb->len & 0x1FF) == 0) // if last 9bits are 0, 512 boundary, tomk
-                            {
-                                s_state->fb->len += 1; //add 1
-                            }
-                            if((s_state->fb->len % 100) == 0) // if bytecount is divby 100, add 1
-                            {
-                                s_state->fb->len += 1;
-                            }
-							flag=1;
-                            break;
+                        s_state->fb->len = s_state->jpeg_scan.eoi;  //adjust length
+                        if((s_state->fb->len & 0x1FF) == 0) // if last 9bits are 0, 512 boundary, tomk
+                        {
+                            s_state->fb->len += 1; //add 1
                         }
-                        dptr--;
+                        if((s_state->fb->len % 100) == 0) // if bytecount is divby 100, add 1
+                        {
+                            s_state->fb->len += 1;
+                        }
+                    }
+                    else
+                    {
+                        JPGerrors++; // bad, jpg endmarker not found
                     }
-					if (!flag)
-					{
-						JPGerrors++; // bad, jpg endmarker not found
-					}
                 }
                 //send out the frame
 				I2sFrameCnt++;
@@ -829,6 +822,12 @@ static void IRAM_ATTR dma_filter_buffer(size_t buf_idx)
         return;
     }
 
+    //the JPEG ended in an earlier buffer, the rest of the frame is padding
+    if(s_state->sensor.pixformat == PIXFORMAT_JPEG && s_state->dma_filtered_count && s_state->jpeg_scan.eoi)
+    {
+        return;
+    }
+
     //check if there is enough space in the frame buffer for the new data
     size_t buf_len = s_state->width * s_state->fb_bytes_per_pixel / s_state->dma_per_line;
     size_t fb_pos = s_state->dma_filtered_count * buf_len;
@@ -856,6 +855,7 @@ static void IRAM_ATTR dma_filter_buffer(size_t buf_idx)
                 JPGerrors++;
                 return;
             }
+            memset(&s_state->jpeg_scan, 0, sizeof(jpg_eoi_scan_t));
         }
         //set the frame properties
         s_state->fb->width = resolution[s_state->sensor.status.framesize].width;
@@ -866,6 +866,11 @@ static void IRAM_ATTR dma_filter_buffer(size_t buf_idx)
         s_state->fb->timestamp.tv_sec = us / 1000000UL;
         s_state->fb->timestamp.tv_usec = us % 1000000UL;
     }
+    if(s_state->sensor.pixformat == PIXFORMAT_JPEG)
+    {
+        //look for the end marker while the new data is still in the cache
+        jpg_eoi_scan(&s_state->jpeg_scan, s_state->fb->buf + fb_pos, buf_len);
+    }
     s_state->dma_filtered_count++;
 }
 
@@ -890,185 +895,6 @@ static void IRAM_ATTR dma_filter_task(void *pvParameters)
     }
 }
 
-static void IRAM_ATTR dma_filter_jpeg(const dma_elem_t* src, lldesc_t* dma_desc, uint8_t* dst)
-{
-    size_t end = dma_desc->length / sizeof(dma_elem_t) / 4;
-    // manually unrolling 4 iterations of the loop here
-    for (size_t i = 0; i < end; ++i)
-    {
-        dst[0] = src[0].sample1;
-        dst[1] = src[1].sample1;
-        dst[2] = src[2].sample1;
-        dst[3] = src[3].sample1;
-        src += 4;
-        dst += 4;
-    }
-}
-
-static void IRAM_ATTR dma_filter_grayscale(const dma_elem_t* src, lldesc_t* dma_desc, uint8_t* dst)
-{
-    size_t end = dma_desc->length / sizeof(dma_elem_t) / 4;
-    for (size_t i = 0; i < end; ++i)
-    {
-        // manually unrolling 4 iterations of the loop here
-        dst[0] = src[0].sample1;
-        dst[1] = src[1].sample1;
-        dst[2] = src[2].sample1;
-        dst[3] = src[3].sample1;
-        src += 4;
-        dst += 4;
-    }
-}
-
-static void IRAM_ATTR dma_filter_grayscale_highspeed(const dma_elem_t* src, lldesc_t* dma_desc, uint8_t* dst)
-{
-    size_t end = dma_desc->length / sizeof(dma_elem_t) / 8;
-    for (size_t i = 0; i < end; ++i)
-    {
-        // manually unrolling 4 iterations of the loop here
-        dst[0] = src[0].sample1;
-        dst[1] = src[2].sample1;
-        dst[2] = src[4].sample1;
-        dst[3] = src[6].sample1;
-        src += 8;
-        dst += 4;
-    }
-    // the final sample of a line in SM_0A0B_0B0C sampling mode needs special handling
-    if ((dma_desc->length & 0x7) != 0)
-    {
-        dst[0] = src[0].sample1;
-        dst[1] = src[2].sample1;
-    }
-}
-
-static void IRAM_ATTR dma_filter_yuyv(const dma_elem_t* src, lldesc_t* dma_desc, uint8_t* dst)
-{
-    size_t end = dma_desc->length / sizeof(dma_elem_t) / 4;
-    for (size_t i = 0; i < end; ++i)
-    {
-        dst[0] = src[0].sample1;//y0
-        dst[1] = src[0].sample2;//u
-        dst[2] = src[1].sample1;//y1
-        dst[3] = src[1].sample2;//v
-
-        dst[4] = src[2].sample1;//y0
-        dst[5] = src[2].sample2;//u
-        dst[6] = src[3].sample1;//y1
-        dst[7] = src[3].sample2;//v
-        src += 4;
-        dst += 8;
-    }
-}
-
-static void IRAM_ATTR dma_filter_yuyv_highspeed(const dma_elem_t* src, lldesc_t* dma_desc, uint8_t* dst)
-{
-    size_t end = dma_desc->length / sizeof(dma_elem_t) / 8;
-    for (size_t i = 0; i < end; ++i)
-    {
-        dst[0] = src[0].sample1;//y0
-        dst[1] = src[1].sample1;//u
-        dst[2] = src[2].sample1;//y1
-        dst[3] = src[3].sample1;//v
-
-        dst[4] = src[4].sample1;//y0
-        dst[5] = src[5].sample1;//u
-        dst[6] = src[6].sample1;//y1
-        dst[7] = src[7].sample1;//v
-        src += 8;
-        dst += 8;
-    }
-    if ((dma_desc->length & 0x7) != 0)
-    {
-        dst[0] = src[0].sample1;//y0
-        dst[1] = src[1].sample1;//u
-        dst[2] = src[2].sample1;//y1
-        dst[3] = src[2].sample2;//v
-    }
-}
-
-static void IRAM_ATTR dma_filter_rgb888(const dma_elem_t* src, lldesc_t* dma_desc, uint8_t* dst)
-{
-    size_t end = dma_desc->length / sizeof(dma_elem_t) / 4;
-    uint8_t lb, hb;
-    for (size_t i = 0; i < end; ++i)
-    {
-        hb = src[0].sample1;
-        lb = src[0].sample2;
-        dst[0] = (lb & 0x1F) << 3;
-        dst[1] = (hb & 0x07) << 5 | (lb & 0xE0) >> 3;
-        dst[2] = hb & 0xF8;
-
-        hb = src[1].sample1;
-        lb = src[1].sample2;
-        dst[3] = (lb & 0x1F) << 3;
-        dst[4] = (hb & 0x07) << 5 | (lb & 0xE0) >> 3;
-        dst[5] = hb & 0xF8;
-
-        hb = src[2].sample1;
-        lb = src[2].sample2;
-        dst[6] = (lb & 0x1F) << 3;
-        dst[7] = (hb & 0x07) << 5 | (lb & 0xE0) >> 3;
-        dst[8] = hb & 0xF8;
-
-        hb = src[3].sample1;
-        lb = src[3].sample2;
-        dst[9] = (lb & 0x1F) << 3;
-        dst[10] = (hb & 0x07) << 5 | (lb & 0xE0) >> 3;
-        dst[11] = hb & 0xF8;
-        src += 4;
-        dst += 12;
-    }
-}
-
-static void IRAM_ATTR dma_filter_rgb888_highspeed(const dma_elem_t* src, lldesc_t* dma_desc, uint8_t* dst)
-{
-    size_t end = dma_desc->length / sizeof(dma_elem_t) / 8;
-    uint8_t lb, hb;
-    for (size_t i = 0; i < end; ++i)
-    {
-        hb = src[0].sample1;
-        lb = src[1].sample1;
-        dst[0] = (lb & 0x1F) << 3;
-        dst[1] = (hb & 0x07) << 5 | (lb & 0xE0) >> 3;
-        dst[2] = hb & 0xF8;
-
-        hb = src[2].sample1;
-        lb = src[3].sample1;
-        dst[3] = (lb & 0x1F) << 3;
-        dst[4] = (hb & 0x07) << 5 | (lb & 0xE0) >> 3;
-        dst[5] = hb & 0xF8;
-
-        hb = src[4].sample1;
-        lb = src[5].sample1;
-        dst[6] = (lb & 0x1F) << 3;
-        dst[7] = (hb & 0x07) << 5 | (lb & 0xE0) >> 3;
-        dst[8] = hb & 0xF8;
-
-        hb = src[6].sample1;
-        lb = src[7].sample1;
-        dst[9] = (lb & 0x1F) << 3;
-        dst[10] = (hb & 0x07) << 5 | (lb & 0xE0) >> 3;
-        dst[11] = hb & 0xF8;
-
-        src += 8;
-        dst += 12;
-    }
-    if ((dma_desc->length & 0x7) != 0)
-    {
-        hb = src[0].sample1;
-        lb = src[1].sample1;
-        dst[0] = (lb & 0x1F) << 3;
-        dst[1] = (hb & 0x07) << 5 | (lb & 0xE0) >> 3;
-        dst[2] = hb & 0xF8;
-
-        hb = src[2].sample1;
-        lb = src[2].sample2;
-        dst[3] = (lb & 0x1F) << 3;
-        dst[4] = (hb & 0x07) << 5 | (lb & 0xE0) >> 3;
-        dst[5] = hb & 0xF8;
-    }
-}
-
 /*
  * Public Methods
  * */
@@ -1276,12 +1102,10 @@ esp_err_t camera_init(const camera_config_t* config)
             if (is_hs_mode())
             {
                 s_state->sampling_mode = SM_0A00_0B00;
-                s_state->dma_filter = &dma_filter_yuyv_highspeed;
             }
             else
             {
                 s_state->sampling_mode = SM_0A0B_0C0D;
-                s_state->dma_filter = &dma_filter_yuyv;
             }
             s_state->in_bytes_per_pixel = 1;       // camera sends Y8
         }
@@ -1290,12 +1114,10 @@ esp_err_t camera_init(const camera_config_t* config)
             if (is_hs_mode() && s_state->sensor.id.PID != OV7725_PID)
             {
                 s_state->sampling_mode = SM_0A00_0B00;
-                s_state->dma_filter = &dma_filter_grayscale_highspeed;
             }
             else
             {
                 s_state->sampling_mode = SM_0A0B_0C0D;
-                s_state->dma_filter = &dma_filter_grayscale;
             }
             s_state->in_bytes_per_pixel = 2;       // camera sends YU/YV
         }
@@ -1307,12 +1129,10 @@ esp_err_t camera_init(const camera_config_t* config)
         if (is_hs_mode() && s_state->sensor.id.PID != OV7725_PID)
         {
             s_state->sampling_mode = SM_0A00_0B00;
-            s_state->dma_filter = &dma_filter_yuyv_highspeed;
         }
         else
         {
             s_state->sampling_mode = SM_0A0B_0C0D;
-            s_state->dma_filter = &dma_filter_yuyv;
         }
         s_state->in_bytes_per_pixel = 2;       // camera sends YU/YV
         s_state->fb_bytes_per_pixel = 2;       // frame buffer stores YU/YV/RGB565
@@ -1323,12 +1143,10 @@ esp_err_t camera_init(const camera_config_t* config)
         if (is_hs_mode())
         {
             s_state->sampling_mode = SM_0A00_0B00;
-            s_state->dma_filter = &dma_filter_rgb888_highspeed;
         }
         else
         {
             s_state->sampling_mode = SM_0A0B_0C0D;
-            s_state->dma_filter = &dma_filter_rgb888;
         }
         s_state->in_bytes_per_pixel = 2;       // camera sends RGB565
         s_state->fb_bytes_per_pixel = 3;       // frame buffer stores RGB888
@@ -1359,7 +1177,6 @@ esp_err_t camera_init(const camera_config_t* config)
         s_state->in_bytes_per_pixel = 2;
         s_state->fb_bytes_per_pixel = 2;
         s_state->fb_size = (s_state->width * s_state->height * s_state->fb_bytes_per_pixel) / compression_ratio_bound;
-        s_state->dma_filter = &dma_filter_jpeg;
         s_state->sampling_mode = SM_0A00_0B00;
     }
     else
@@ -1368,6 +1185,7 @@ esp_err_t camera_init(const camera_config_t* config)
         err = ESP_ERR_NOT_SUPPORTED;
         goto fail;
     }
+    s_state->dma_filter = dma_filter_get(pix_format, s_state->in_bytes_per_pixel, s_state->sampling_mode);
 
     /*ESP_LOGD(TAG, "in_bpp: %d, fb_bpp: %d, fb_size: %d, mode: %d, width: %d height: %d",
              s_state->in_bytes_per_pixel, s_state->fb_bytes_per_pixel,
@@ -1375,7 +1193,7 @@ esp_err_t camera_init(const camera_config_t* config)
              s_state->width, s_state->height);
 			 */
 			 
-	ESP_LOGI(TAG, "size: %d %d %d",s_state->width, s_state->height,s_state->fb_size);
+	ESP_LOGI(TAG, "size: %d %d %d",(int)s_state->width, (int)s_state->height,(int)s_state->fb_size);
 
     i2s_init();
 
@@ -1394,7 +1212,8 @@ esp_err_t camera_init(const camera_config_t* config)
         goto fail;
     }
 
-    s_state->data_ready = xQueueCreate(16, sizeof(size_t));
+    //a queued buffer must not be refilled before it is filtered: one is being filled, one filtered, the rest may wait
+    s_state->data_ready = xQueueCreate(s_state->dma_desc_count - 2, sizeof(size_t));
     if (s_state->data_ready == NULL)
     {
         ESP_LOGE(TAG, "Failed to dma queue");
@@ -1414,11 +1233,11 @@ esp_err_t camera_init(const camera_config_t* config)
     }
     else
     {
-        s_state->fb_in = xQueueCreate(s_state->config.fb_count, sizeof(camera_fb_t *));
-        s_state->fb_out = xQueueCreate(1, sizeof(camera_fb_t *));
-        if (s_state->fb_in == NULL || s_state->fb_out == NULL)
+        s_state->fb_lock = xSemaphoreCreateMutex();
+        s_state->fb_event = xEventGroupCreate();
+        if (s_state->fb_lock == NULL || s_state->fb_event == NULL)
         {
-            ESP_LOGE(TAG, "Failed to fb queues");
+            ESP_LOGE(TAG, "Failed to create fb lock");
             err = ESP_ERR_NO_MEM;
             goto fail;
         }
@@ -1454,7 +1273,7 @@ esp_err_t camera_init(const camera_config_t* config)
 
     s_state->sensor.status.framesize = frame_size;
     s_state->sensor.pixformat = pix_format;
-    ESP_LOGD(TAG, "Setting frame size to %dx%d", s_state->width, s_state->height);
+    ESP_LOGD(TAG, "Setting frame size to %dx%d", (int)s_state->width, (int)s_state->height);
     if (s_state->sensor.set_framesize(&s_state->sensor, frame_size) != 0)
     {
         ESP_LOGE(TAG, "Failed to set frame size");
@@ -1555,13 +1374,13 @@ esp_err_t esp_camera_deinit()
     {
         vQueueDelete(s_state->data_ready);
     }
-    if (s_state->fb_in)
+    if (s_state->fb_lock)
     {
-        vQueueDelete(s_state->fb_in);
+        vSemaphoreDelete(s_state->fb_lock);
     }
-    if (s_state->fb_out)
+    if (s_state->fb_event)
     {
-        vQueueDelete(s_state->fb_out);
+        vEventGroupDelete(s_state->fb_event);
     }
     if (s_state->frame_ready)
     {
@@ -1584,12 +1403,50 @@ esp_err_t esp_camera_deinit()
 
 #define FB_GET_TIMEOUT (4000 / portTICK_PERIOD_MS)
 
-camera_fb_t* esp_camera_fb_get()
+//take a reference to the newest frame, with fb_lock held. *seq is the number of the frame the caller had
+//before, 0 for none, it gets the new one. *missed counts the frames completed in between
+static camera_fb_int_t * camera_fb_ref_latest(uint32_t * seq, uint32_t * missed)
 {
-    if (s_state == NULL)
+    camera_fb_int_t * fb = s_state->fb_latest;
+    fb->ref++;
+    if(missed)
     {
-        return NULL;
+        *missed = (*seq && (int32_t)(fb->seq - *seq) > 0) ? fb->seq - *seq - 1 : 0;
     }
+    *seq = fb->seq;
+    return fb;
+}
+
+//wait up to timeout for a frame newer than *seq and take a reference to it. *seq is read and updated under fb_lock
+static camera_fb_int_t * camera_fb_take_newer(uint32_t * seq, uint32_t * missed, TickType_t timeout)
+{
+    camera_fb_int_t * fb = NULL;
+    TickType_t start = xTaskGetTickCount();
+    xSemaphoreTake(s_state->fb_lock, portMAX_DELAY);
+    while(!s_state->fb_latest || (int32_t)(s_state->fb_latest->seq - *seq) <= 0)
+    {
+        EventBits_t next = FB_EVENT_SEQ(s_state->fb_seq + 1);
+        xSemaphoreGive(s_state->fb_lock);
+        TickType_t waited = xTaskGetTickCount() - start;
+        if(waited >= timeout)
+        {
+            return NULL;
+        }
+        TickType_t slice = timeout - waited;
+        if(slice > FB_WAIT_SLICE)
+        {
+            slice = FB_WAIT_SLICE;
+        }
+        xEventGroupWaitBits(s_state->fb_event, next, pdFALSE, pdFALSE, slice);
+        xSemaphoreTake(s_state->fb_lock, portMAX_DELAY);
+    }
+    fb = camera_fb_ref_latest(seq, missed);
+    xSemaphoreGive(s_state->fb_lock);
+    return fb;
+}
+
+static bool camera_fb_start()
+{
     if(!I2S0.conf.rx_start)
     {
         if(s_state->config.fb_count > 1)
@@ -1598,9 +1455,22 @@ camera_fb_t* esp_camera_fb_get()
         }
         if (i2s_run() != 0)
         {
-            return NULL;
+            return false;
         }
     }
+    return true;
+}
+
+camera_fb_t* esp_camera_fb_get()
+{
+    if (s_state == NULL)
+    {
+        return NULL;
+    }
+    if (!camera_fb_start())
+    {
+        return NULL;
+    }
     bool need_yield = false;
     if (s_state->config.fb_count == 1)
     {
@@ -1612,26 +1482,99 @@ camera_fb_t* esp_camera_fb_get()
         }
         return (camera_fb_t*)s_state->fb;
     }
-    camera_fb_int_t * fb = NULL;
-    if(s_state->fb_out)
+    //the newest frame no other esp_camera_fb_get() caller had
+    camera_fb_int_t * fb = camera_fb_take_newer(&s_state->fb_get_seq, NULL, FB_GET_TIMEOUT);
+    if (fb == NULL)
     {
-        if (xQueueReceive(s_state->fb_out, &fb, FB_GET_TIMEOUT) != pdTRUE)
-        {
-            i2s_stop(&need_yield);
-            ESP_LOGE(TAG, "Failed to get the frame on time!");
-            return NULL;
-        }
+        i2s_stop(&need_yield);
+        ESP_LOGE(TAG, "Failed to get the frame on time!");
     }
     return (camera_fb_t*)fb;
 }
 
 void esp_camera_fb_return(camera_fb_t * fb)
 {
-    if(fb == NULL || s_state == NULL || s_state->config.fb_count == 1 || s_state->fb_in == NULL)
+    esp_camera_fb_release(fb);
+}
+
+camera_fb_t* esp_camera_fb_acquire()
+{
+    if (s_state == NULL)
+    {
+        return NULL;
+    }
+    if (s_state->config.fb_count == 1)
+    {
+        ESP_LOGE(TAG, "Sharing frames needs fb_count > 1");
+        return NULL;
+    }
+    if (!camera_fb_start())
+    {
+        return NULL;
+    }
+    xSemaphoreTake(s_state->fb_lock, portMAX_DELAY);
+    uint32_t seq = s_state->fb_seq;
+    xSemaphoreGive(s_state->fb_lock);
+    camera_fb_int_t * fb = camera_fb_take_newer(&seq, NULL, FB_GET_TIMEOUT);
+    if (fb == NULL)
+    {
+        ESP_LOGE(TAG, "Failed to get the frame on time!");
+    }
+    return (camera_fb_t*)fb;
+}
+
+camera_fb_t* esp_camera_fb_get_latest(uint32_t * seq, uint32_t * missed)
+{
+    if (s_state == NULL || seq == NULL)
+    {
+        return NULL;
+    }
+    if (s_state->config.fb_count == 1)
+    {
+        ESP_LOGE(TAG, "Latest frame needs fb_count > 1");
+        return NULL;
+    }
+    if (!camera_fb_start())
+    {
+        return NULL;
+    }
+    camera_fb_int_t * fb = NULL;
+    xSemaphoreTake(s_state->fb_lock, portMAX_DELAY);
+    if (s_state->fb_latest)
+    {
+        fb = camera_fb_ref_latest(seq, missed);
+    }
+    xSemaphoreGive(s_state->fb_lock);
+    return (camera_fb_t*)fb;
+}
+
+camera_fb_t* esp_camera_fb_get_newer(uint32_t * seq, uint32_t * missed, uint32_t timeout_ms)
+{
+    if (s_state == NULL || seq == NULL)
+    {
+        return NULL;
+    }
+    if (s_state->config.fb_count == 1)
+    {
+        ESP_LOGE(TAG, "Latest frame needs fb_count > 1");
+        return NULL;
+    }
+    if (!camera_fb_start())
+    {
+        return NULL;
+    }
+    return (camera_fb_t*)camera_fb_take_newer(seq, missed, timeout_ms / portTICK_PERIOD_MS);
+}
+
+void esp_camera_fb_release(camera_fb_t * fb)
+{
+    if(fb == NULL || s_state == NULL || s_state->config.fb_count == 1 || s_state->fb_lock == NULL)
     {
         return;
     }
-    xQueueSend(s_state->fb_in, &fb, portMAX_DELAY);
+    xSemaphoreTake(s_state->fb_lock, portMAX_DELAY);
+    camera_fb_unref((camera_fb_int_t *)fb);
+    xSemaphoreGive(s_state->fb_lock);
 }
 
 sensor_t * esp_camera_sensor_get()
@@ -0,0 +1,282 @@
+// Copyright 2015-2016 Espressif Systems (Shanghai) PTE LTD
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include <stdint.h>
+#include "esp_attr.h"
+#include "dma_filter.h"
+
+// the host build (host/) has SSE2 on x86, the ESP32 gets the 32 bit loops
+#if defined(__SSE2__) && !defined(DMA_FILTER_NO_SIMD)
+#include <emmintrin.h>
+#define DMA_FILTER_SSE2 1
+#endif
+
+#define S1(w) (((w) >> 16) & 0xFF)
+#define S2(w) ((w) & 0xFF)
+
+#define ALIGNED(p) ((((uintptr_t)(p)) & 3) == 0)
+
+// sample1 of four words step apart, as the little endian word of four frame buffer bytes
+FORCE_INLINE_ATTR uint32_t pack_s1(const uint32_t* s, size_t step)
+{
+    return S1(s[0]) | (S1(s[step]) << 8) | (S1(s[2 * step]) << 16) | (S1(s[3 * step]) << 24);
+}
+
+// sample1 and sample2 of two words
+FORCE_INLINE_ATTR uint32_t pack_s1s2(const uint32_t* s)
+{
+    return S1(s[0]) | (S2(s[0]) << 8) | (S1(s[1]) << 16) | (S2(s[1]) << 24);
+}
+
+// RGB565 with hb in bits 16..23 and lb in bits 0..7, like a SM_0A0B_0C0D word, to the three frame buffer bytes in bits 0..23
+FORCE_INLINE_ATTR uint32_t rgb888(uint32_t w)
+{
+    return ((w & 0x1F) << 3) | ((w & 0xE0) << 5) | ((w & 0x70000) >> 3) | (w & 0xF80000);
+}
+
+// pixel i of a buffer: both bytes in one word, or in sample1 of two words in highspeed mode
+FORCE_INLINE_ATTR uint32_t rgb888_pixel(const uint32_t* s, size_t i, bool hs)
+{
+    return rgb888(hs ? (s[2 * i] & 0xFF0000) | S1(s[2 * i + 1]) : s[i]);
+}
+
+#if DMA_FILTER_SSE2
+// sample1 of four words step apart, in the low byte of each 32 bit lane
+FORCE_INLINE_ATTR __m128i s1_x4(const uint32_t* s, size_t step)
+{
+    if (step == 1)
+    {
+        return _mm_and_si128(_mm_srli_epi32(_mm_loadu_si128((const __m128i*) s), 16), _mm_set1_epi32(0xFF));
+    }
+    // the even word of each 64 bit lane, the odd word's bits drop out
+    __m128i a = _mm_and_si128(_mm_srli_epi64(_mm_loadu_si128((const __m128i*) s), 16), _mm_set1_epi64x(0xFF));
+    __m128i b = _mm_and_si128(_mm_srli_epi64(_mm_loadu_si128((const __m128i*) s + 1), 16), _mm_set1_epi64x(0xFF));
+    return _mm_packs_epi32(a, b);
+}
+#endif
+
+// dst[i] = sample1 of s[i * step] for i < n, n a multiple of 4
+FORCE_INLINE_ATTR void filter_s1(const uint32_t* s, uint8_t* dst, size_t n, size_t step)
+{
+    if (!ALIGNED(dst))
+    {
+        for (size_t i = 0; i < n; ++i)
+        {
+            dst[i] = S1(s[i * step]);
+        }
+        return;
+    }
+    uint32_t* d = (uint32_t*) dst;
+#if DMA_FILTER_SSE2
+    for (; n >= 16; n -= 16)
+    {
+        __m128i v0 = s1_x4(s, step), v1 = s1_x4(s + 4 * step, step);
+        __m128i v2 = s1_x4(s + 8 * step, step), v3 = s1_x4(s + 12 * step, step);
+        _mm_storeu_si128((__m128i*) d, _mm_packus_epi16(_mm_packs_epi32(v0, v1), _mm_packs_epi32(v2, v3)));
+        s += 16 * step;
+        d += 4;
+    }
+#endif
+    for (; n; n -= 4)
+    {
+        *d++ = pack_s1(s, step);
+        s += 4 * step;
+    }
+}
+
+// sample1 and sample2 of n words, n even
+FORCE_INLINE_ATTR void filter_s1s2(const uint32_t* s, uint8_t* dst, size_t n)
+{
+    if (!ALIGNED(dst))
+    {
+        for (size_t i = 0; i < n; ++i)
+        {
+            dst[2 * i] = S1(s[i]);
+            dst[2 * i + 1] = S2(s[i]);
+        }
+        return;
+    }
+    uint32_t* d = (uint32_t*) dst;
+#if DMA_FILTER_SSE2
+    const __m128i mask = _mm_set1_epi32(0x00FF00FF);
+    for (; n >= 8; n -= 8)
+    {
+        // sample2 in byte 0 and sample1 in byte 2, swap the 16 bit halves and pack
+        __m128i a = _mm_and_si128(_mm_loadu_si128((const __m128i*) s), mask);
+        __m128i b = _mm_and_si128(_mm_loadu_si128((const __m128i*) s + 1), mask);
+        a = _mm_or_si128(_mm_slli_epi32(a, 16), _mm_srli_epi32(a, 16));
+        b = _mm_or_si128(_mm_slli_epi32(b, 16), _mm_srli_epi32(b, 16));
+        _mm_storeu_si128((__m128i*) d, _mm_packus_epi16(a, b));
+        s += 8;
+        d += 4;
+    }
+#endif
+    for (; n; n -= 2)
+    {
+        *d++ = pack_s1s2(s);
+        s += 2;
+    }
+}
+
+// n RGB565 pixels to RGB888, n a multiple of 4
+FORCE_INLINE_ATTR void filter_rgb888(const uint32_t* s, uint8_t* dst, size_t n, bool hs)
+{
+    if (!ALIGNED(dst))
+    {
+        for (size_t i = 0; i < n; ++i)
+        {
+            uint32_t p = rgb888_pixel(s, i, hs);
+            dst[3 * i] = p;
+            dst[3 * i + 1] = p >> 8;
+            dst[3 * i + 2] = p >> 16;
+        }
+        return;
+    }
+    uint32_t* d = (uint32_t*) dst;
+#if DMA_FILTER_SSE2
+    for (; n >= 4; n -= 4)
+    {
+        __m128i w, p;
+        if (hs)
+        {
+            // sample1 of eight words packed to hb in bits 0..7 and lb in bits 16..23 of each pixel
+            w = _mm_packs_epi32(s1_x4(s, 1), s1_x4(s + 4, 1));
+            p = _mm_or_si128(_mm_or_si128(_mm_srli_epi32(_mm_and_si128(w, _mm_set1_epi32(0x1F0000)), 13),
+                                          _mm_srli_epi32(_mm_and_si128(w, _mm_set1_epi32(0xE00000)), 11)),
+                             _mm_or_si128(_mm_slli_epi32(_mm_and_si128(w, _mm_set1_epi32(0x07)), 13),
+                                          _mm_slli_epi32(_mm_and_si128(w, _mm_set1_epi32(0xF8)), 16)));
+            s += 8;
+        }
+        else
+        {
+            w = _mm_loadu_si128((const __m128i*) s);
+            p = _mm_or_si128(_mm_or_si128(_mm_slli_epi32(_mm_and_si128(w, _mm_set1_epi32(0x1F)), 3),
+                                          _mm_slli_epi32(_mm_and_si128(w, _mm_set1_epi32(0xE0)), 5)),
+                             _mm_or_si128(_mm_srli_epi32(_mm_and_si128(w, _mm_set1_epi32(0x70000)), 3),
+                                          _mm_and_si128(w, _mm_set1_epi32(0xF80000))));
+            s += 4;
+        }
+        // close the gaps between the 3 byte pixels, first within each 64 bit lane, then between the lanes
+        p = _mm_or_si128(_mm_and_si128(p, _mm_set1_epi64x(0xFFFFFF)), _mm_and_si128(_mm_srli_epi64(p, 8), _mm_set1_epi64x(0xFFFFFF000000)));
+        p = _mm_or_si128(_mm_and_si128(p, _mm_set_epi32(0, 0, 0xFFFF, 0xFFFFFFFF)), _mm_and_si128(_mm_srli_si128(p, 2), _mm_set_epi32(0, 0xFFFFFFFF, 0xFFFF0000, 0)));
+        _mm_storel_epi64((__m128i*) d, p);
+        d[2] = _mm_cvtsi128_si32(_mm_srli_si128(p, 8));
+        d += 3;
+    }
+#endif
+    for (; n; n -= 4)
+    {
+        uint32_t p0 = rgb888_pixel(s, 0, hs);
+        uint32_t p1 = rgb888_pixel(s, 1, hs);
+        uint32_t p2 = rgb888_pixel(s, 2, hs);
+        uint32_t p3 = rgb888_pixel(s, 3, hs);
+        d[0] = p0 | (p1 << 24);
+        d[1] = (p1 >> 8) | (p2 << 16);
+        d[2] = (p2 >> 16) | (p3 << 8);
+        s += hs ? 8 : 4;
+        d += 3;
+    }
+}
+
+void IRAM_ATTR dma_filter_jpeg(const dma_elem_t* src, lldesc_t* dma_desc, uint8_t* dst)
+{
+    filter_s1(&src->val, dst, dma_desc->length / sizeof(dma_elem_t) / 4 * 4, 1);
+}
+
+void IRAM_ATTR dma_filter_grayscale(const dma_elem_t* src, lldesc_t* dma_desc, uint8_t* dst)
+{
+    filter_s1(&src->val, dst, dma_desc->length / sizeof(dma_elem_t) / 4 * 4, 1);
+}
+
+void IRAM_ATTR dma_filter_grayscale_highspeed(const dma_elem_t* src, lldesc_t* dma_desc, uint8_t* dst)
+{
+    size_t end = dma_desc->length / sizeof(dma_elem_t) / 8;
+    filter_s1(&src->val, dst, end * 4, 2);
+    // the final sample of a line in SM_0A0B_0B0C sampling mode needs special handling
+    if ((dma_desc->length & 0x7) != 0)
+    {
+        src += end * 8;
+        dst += end * 4;
+        dst[0] = src[0].sample1;
+        dst[1] = src[2].sample1;
+    }
+}
+
+void IRAM_ATTR dma_filter_yuyv(const dma_elem_t* src, lldesc_t* dma_desc, uint8_t* dst)
+{
+    filter_s1s2(&src->val, dst, dma_desc->length / sizeof(dma_elem_t) / 4 * 4);
+}
+
+void IRAM_ATTR dma_filter_yuyv_highspeed(const dma_elem_t* src, lldesc_t* dma_desc, uint8_t* dst)
+{
+    size_t end = dma_desc->length / sizeof(dma_elem_t) / 8;
+    filter_s1(&src->val, dst, end * 8, 1);
+    if ((dma_desc->length & 0x7) != 0)
+    {
+        src += end * 8;
+        dst += end * 8;
+        dst[0] = src[0].sample1;//y0
+        dst[1] = src[1].sample1;//u
+        dst[2] = src[2].sample1;//y1
+        dst[3] = src[2].sample2;//v
+    }
+}
+
+void IRAM_ATTR dma_filter_rgb888(const dma_elem_t* src, lldesc_t* dma_desc, uint8_t* dst)
+{
+    filter_rgb888(&src->val, dst, dma_desc->length / sizeof(dma_elem_t) / 4 * 4, false);
+}
+
+void IRAM_ATTR dma_filter_rgb888_highspeed(const dma_elem_t* src, lldesc_t* dma_desc, uint8_t* dst)
+{
+    size_t end = dma_desc->length / sizeof(dma_elem_t) / 8;
+    filter_rgb888(&src->val, dst, end * 4, true);
+    if ((dma_desc->length & 0x7) != 0)
+    {
+        src += end * 8;
+        dst += end * 12;
+        uint32_t p0 = rgb888(src[0].sample1 << 16 | src[1].sample1);
+        uint32_t p1 = rgb888(src[2].val);
+        dst[0] = p0;
+        dst[1] = p0 >> 8;
+        dst[2] = p0 >> 16;
+        dst[3] = p1;
+        dst[4] = p1 >> 8;
+        dst[5] = p1 >> 16;
+    }
+}
+
+dma_filter_t dma_filter_get(pixformat_t format, size_t in_bytes_per_pixel, i2s_sampling_mode_t mode)
+{
+    // SM_0A0B_0C0D carries two camera bytes per sample, the other modes one
+    bool hs = mode != SM_0A0B_0C0D;
+    switch (format)
+    {
+    case PIXFORMAT_JPEG:
+        return hs ? &dma_filter_jpeg : &dma_filter_yuyv;
+    case PIXFORMAT_GRAYSCALE:
+        if (in_bytes_per_pixel == 1)
+        {
+            // camera sends Y8, every byte goes to the frame buffer
+            return hs ? &dma_filter_yuyv_highspeed : &dma_filter_yuyv;
+        }
+        return hs ? &dma_filter_grayscale_highspeed : &dma_filter_grayscale;
+    case PIXFORMAT_YUV422:
+    case PIXFORMAT_RGB565:
+        return hs ? &dma_filter_yuyv_highspeed : &dma_filter_yuyv;
+    case PIXFORMAT_RGB888:
+        return hs ? &dma_filter_rgb888_highspeed : &dma_filter_rgb888;
+    default:
+        return NULL;
+    }
+}
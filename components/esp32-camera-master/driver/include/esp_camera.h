@@ -168,6 +168,51 @@ extern "C" {
      */
     void esp_camera_fb_return(camera_fb_t * fb);
 
+    /**
+     * @brief Obtain a shared reference to the next frame.
+     *
+     * Waits for the next frame the driver completes. Tasks calling this at the same time
+     * get the same frame buffer, which is not reused until every one of them has released it.
+     * Needs fb_count > 1, each concurrent holder keeps a buffer from being refilled.
+     *
+     * @return pointer to the frame buffer, NULL on timeout or when fb_count is 1
+     */
+    camera_fb_t* esp_camera_fb_acquire();
+
+    /**
+     * @brief Obtain a reference to the most recent complete frame without waiting.
+     *
+     * Needs fb_count > 1. Release the frame with esp_camera_fb_release().
+     *
+     * @param seq       in: number of the frame the caller had before, 0 for none.
+     *                  out: number of the returned frame. Numbers count up by one per completed frame.
+     * @param missed    if not NULL, receives how many frames completed between the two, 0 if none or the same frame
+     *
+     * @return pointer to the frame buffer, NULL if no frame has completed yet or fb_count is 1
+     */
+    camera_fb_t* esp_camera_fb_get_latest(uint32_t * seq, uint32_t * missed);
+
+    /**
+     * @brief Wait for a frame newer than *seq and obtain a reference to the most recent one.
+     *
+     * Returns at once if a newer frame is already there. Needs fb_count > 1. Release the frame with esp_camera_fb_release().
+     *
+     * @param seq           in: number of the frame the caller had before, 0 for none. out: number of the returned frame.
+     * @param missed        if not NULL, receives how many frames completed between the two
+     * @param timeout_ms    time to wait at most, 0 to only check
+     *
+     * @return pointer to the frame buffer, NULL on timeout or when fb_count is 1
+     */
+    camera_fb_t* esp_camera_fb_get_newer(uint32_t * seq, uint32_t * missed, uint32_t timeout_ms);
+
+    /**
+     * @brief Release a frame buffer obtained with esp_camera_fb_acquire(), esp_camera_fb_get_latest(),
+     *        esp_camera_fb_get_newer() or esp_camera_fb_get().
+     *
+     * @param fb    Pointer to the frame buffer
+     */
+    void esp_camera_fb_release(camera_fb_t * fb);
+
     /**
      * @brief Get a pointer to the image sensor control structure
      *
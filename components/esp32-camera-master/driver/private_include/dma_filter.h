@@ -0,0 +1,30 @@
+#pragma once
+
+#include "camera_common.h"
+
+/*
+ * Filters copy the camera bytes out of a received DMA buffer into the frame buffer.
+ * Each I2S sample is a 32 bit word holding sample1 in bits 16..23 and sample2 in bits 0..7,
+ * which bytes are real depends on the i2s_sampling_mode_t. The filters read whole words
+ * and write whole words when dst is 4 byte aligned, and byte by byte when it is not.
+ */
+typedef void (*dma_filter_t)(const dma_elem_t* src, lldesc_t* dma_desc, uint8_t* dst);
+
+void dma_filter_jpeg(const dma_elem_t* src, lldesc_t* dma_desc, uint8_t* dst);
+void dma_filter_grayscale(const dma_elem_t* src, lldesc_t* dma_desc, uint8_t* dst);
+void dma_filter_grayscale_highspeed(const dma_elem_t* src, lldesc_t* dma_desc, uint8_t* dst);
+void dma_filter_yuyv(const dma_elem_t* src, lldesc_t* dma_desc, uint8_t* dst);
+void dma_filter_yuyv_highspeed(const dma_elem_t* src, lldesc_t* dma_desc, uint8_t* dst);
+void dma_filter_rgb888(const dma_elem_t* src, lldesc_t* dma_desc, uint8_t* dst);
+void dma_filter_rgb888_highspeed(const dma_elem_t* src, lldesc_t* dma_desc, uint8_t* dst);
+
+/**
+ * @brief Pick the filter for a frame buffer format and the sampling mode I2S runs in
+ *
+ * @param format                Frame buffer format
+ * @param in_bytes_per_pixel    Bytes the camera sends per pixel, 1 for Y8 and 2 for YU/YV in grayscale
+ * @param mode                  Sampling mode
+ *
+ * @return the filter, NULL if the format is not supported
+ */
+dma_filter_t dma_filter_get(pixformat_t format, size_t in_bytes_per_pixel, i2s_sampling_mode_t mode);
@@ -0,0 +1,255 @@
+// bmptest: checks fmt2bmp() and fmt2bmp_cb() for every source format they take.
+//
+// Random GRAYSCALE, RGB565, RGB555, RGB444, YUV422 and RGB888 images of sizes that need 0 to 3 bytes of row
+// padding, and rows longer than the callback chunk, are converted both ways. The header fields have to describe
+// a top-down BMP of the right size and depth (8 bit with a gray palette for GRAYSCALE, else 24 bit), every pixel
+// has to be the source pixel as B, G, R and every padding byte zero. The JPEGs in docu/ have to come out as
+// jpg2rgb888() decodes them. The callback has to get the same bytes as the buffer, in order, then one call with
+// NULL data; a callback that takes less than it is given fails the conversion.
+#include <string.h>
+#include "esp_log.h"
+#include "img_converters.h"
+#include "yuv.h"
+#include "test.h"
+
+#define LE16(p)         ((p)[0] | (p)[1] << 8)
+#define LE32(p)         ((uint32_t)((p)[0] | (p)[1] << 8 | (p)[2] << 16 | (uint32_t)(p)[3] << 24))
+
+static const pixformat_t s_formats[] = { PIXFORMAT_GRAYSCALE, PIXFORMAT_RGB565, PIXFORMAT_RGB555, PIXFORMAT_RGB444, PIXFORMAT_YUV422, PIXFORMAT_RGB888 };
+static const char *const s_format_names[] = { "GRAYSCALE", "RGB565", "RGB555", "RGB444", "YUV422", "RGB888" };
+static const int s_bpp[] = { 1, 2, 2, 2, 2, 3 };
+#define FORMAT_COUNT    (int)(sizeof(s_formats) / sizeof(s_formats[0]))
+
+static const int s_sizes[][2] = { { 1, 1 }, { 2, 3 }, { 3, 5 }, { 4, 2 }, { 5, 7 }, { 33, 17 }, { 320, 240 }, { 1500, 3 } };
+#define SIZE_COUNT      (int)(sizeof(s_sizes) / sizeof(s_sizes[0]))
+
+// Output of the callback, which also checks that it is called in order
+typedef struct {
+    uint8_t *data;
+    size_t len, size;
+    size_t limit;       // take only this many bytes in total, to fail the conversion
+    int end_calls;
+    bool out_of_order;
+} cb_out_t;
+
+static size_t collect_cb(void *arg, size_t index, const void *data, size_t len)
+{
+    cb_out_t *out = (cb_out_t *)arg;
+    if (index != out->len || out->end_calls) {
+        out->out_of_order = true;
+    }
+    if (!data) {
+        out->end_calls++;
+        return 0;
+    }
+    if (out->len + len > out->limit) {
+        len = out->limit - out->len;
+    }
+    if (out->len + len > out->size) {
+        out->size = (out->len + len) * 2;
+        out->data = (uint8_t *)realloc(out->data, out->size);
+    }
+    memcpy(out->data + out->len, data, len);
+    out->len += len;
+    return len;
+}
+
+// What the BMP holds for pixel i of the source, as B, G, R
+static void expect_pixel(pixformat_t format, const uint8_t *src, int width, int i, uint8_t *bgr)
+{
+    const uint8_t *p;
+    unsigned v;
+    switch (format) {
+    case PIXFORMAT_RGB565:
+        v = src[i * 2] << 8 | src[i * 2 + 1];
+        bgr[0] = (v & 31) << 3 | (v & 31) >> 2;
+        bgr[1] = ((v >> 5) & 63) << 2 | ((v >> 5) & 63) >> 4;
+        bgr[2] = (v >> 11) << 3 | (v >> 11) >> 2;
+        break;
+    case PIXFORMAT_RGB555:
+        v = src[i * 2] << 8 | src[i * 2 + 1];
+        bgr[0] = (v & 31) << 3 | (v & 31) >> 2;
+        bgr[1] = ((v >> 5) & 31) << 3 | ((v >> 5) & 31) >> 2;
+        bgr[2] = ((v >> 10) & 31) << 3 | ((v >> 10) & 31) >> 2;
+        break;
+    case PIXFORMAT_RGB444:
+        v = src[i * 2] << 8 | src[i * 2 + 1];
+        bgr[0] = (v & 15) * 17;
+        bgr[1] = ((v >> 4) & 15) * 17;
+        bgr[2] = ((v >> 8) & 15) * 17;
+        break;
+    case PIXFORMAT_YUV422: {
+        // pairs share U and V, an odd last pixel of a row has no V
+        int x = i % width, pair = i - (x & 1);
+        uint8_t vv = (x | 1) < width ? src[pair * 2 + 3] : 128;
+        yuv2rgb(src[i * 2], src[pair * 2 + 1], vv, &bgr[2], &bgr[1], &bgr[0]);
+        break;
+    }
+    default:
+        p = src + i * 3;
+        memcpy(bgr, p, 3);
+        break;
+    }
+}
+
+// Header fields of a top-down BMP, returns the offset of the pixel data
+static size_t check_header(const char *what, const uint8_t *bmp, size_t len, int width, int height, int bits)
+{
+    size_t row_len = ((size_t)width * bits / 8 + 3) & ~(size_t)3;
+    size_t offset = 54 + (bits == 8 ? 1024 : 0);
+    CHECK(len == offset + row_len * height, "%s: %u bytes, expected %u", what, (unsigned)len, (unsigned)(offset + row_len * height));
+    if (len < 54) {
+        return 0;
+    }
+    CHECK(bmp[0] == 'B' && bmp[1] == 'M', "%s: no BM signature", what);
+    CHECK(LE32(bmp + 2) == len, "%s: file size %u, length %u", what, LE32(bmp + 2), (unsigned)len);
+    CHECK(LE32(bmp + 10) == offset, "%s: pixel data at %u, expected %u", what, LE32(bmp + 10), (unsigned)offset);
+    CHECK(LE32(bmp + 14) == 40, "%s: info header size %u", what, LE32(bmp + 14));
+    CHECK((int32_t)LE32(bmp + 18) == width, "%s: width %d", what, (int32_t)LE32(bmp + 18));
+    CHECK((int32_t)LE32(bmp + 22) == -height, "%s: height %d, expected %d (top-down)", what, (int32_t)LE32(bmp + 22), -height);
+    CHECK(LE16(bmp + 26) == 1, "%s: %u planes", what, LE16(bmp + 26));
+    CHECK(LE16(bmp + 28) == bits, "%s: %u bits per pixel, expected %d", what, LE16(bmp + 28), bits);
+    CHECK(LE32(bmp + 30) == 0, "%s: compression %u", what, LE32(bmp + 30));
+    CHECK(LE32(bmp + 34) == row_len * height, "%s: image size %u", what, LE32(bmp + 34));
+    if (bits == 8) {
+        CHECK(LE32(bmp + 46) == 256, "%s: %u palette entries", what, LE32(bmp + 46));
+        bool gray = len >= offset;
+        for (int i = 0; gray && i < 256; i++) {
+            const uint8_t *e = bmp + 54 + i * 4;
+            gray = e[0] == i && e[1] == i && e[2] == i && e[3] == 0;
+        }
+        CHECK(gray, "%s: palette is not the gray ramp", what);
+    }
+    return len >= offset ? offset : 0;
+}
+
+// Rows, top first, each padded with zeros to 4 bytes: expect holds the unpadded rows
+static void check_rows(const char *what, const uint8_t *pixels, const uint8_t *expect, int width, int height, int bytes)
+{
+    size_t row_len = ((size_t)width * bytes + 3) & ~(size_t)3;
+    for (int y = 0; y < height; y++) {
+        const uint8_t *row = pixels + y * row_len;
+        if (memcmp(row, expect + (size_t)y * width * bytes, (size_t)width * bytes)) {
+            CHECK(0, "%s: row %d differs", what, y);
+            return;
+        }
+        for (size_t i = (size_t)width * bytes; i < row_len; i++) {
+            if (row[i]) {
+                CHECK(0, "%s: padding byte %u of row %d is 0x%02x", what, (unsigned)i, y, row[i]);
+                return;
+            }
+        }
+    }
+}
+
+// Both conversions of one image, compared with each other and with expect
+static void check_bmp(const char *what, uint8_t *src, size_t src_len, int width, int height, pixformat_t format, const uint8_t *expect, int bits)
+{
+    uint8_t *bmp = NULL;
+    size_t len = 0;
+    CHECK(fmt2bmp(src, src_len, width, height, format, &bmp, &len), "%s: fmt2bmp() failed", what);
+    if (!bmp) {
+        return;
+    }
+    size_t offset = check_header(what, bmp, len, width, height, bits);
+    if (offset) {
+        check_rows(what, bmp + offset, expect, width, height, bits / 8);
+    }
+
+    cb_out_t out = { NULL, 0, 0, (size_t)-1, 0, false };
+    CHECK(fmt2bmp_cb(src, src_len, width, height, format, collect_cb, &out), "%s: fmt2bmp_cb() failed", what);
+    CHECK(out.len == len && !memcmp(out.data, bmp, len), "%s: fmt2bmp_cb() output differs from fmt2bmp()", what);
+    CHECK(!out.out_of_order && out.end_calls == 1, "%s: callback out of order or %d end calls", what, out.end_calls);
+    free(out.data);
+
+    // a callback that stops taking data partway fails the conversion
+    cb_out_t short_out = { NULL, 0, 0, len / 2, 0, false };
+    CHECK(!fmt2bmp_cb(src, src_len, width, height, format, collect_cb, &short_out), "%s: fmt2bmp_cb() ignores a short write", what);
+    CHECK(!short_out.end_calls, "%s: end of data after a short write", what);
+    free(short_out.data);
+    free(bmp);
+}
+
+static void check_formats(uint32_t *seed)
+{
+    char what[96];
+    for (int s = 0; s < SIZE_COUNT; s++) {
+        int width = s_sizes[s][0], height = s_sizes[s][1];
+        for (int f = 0; f < FORMAT_COUNT; f++) {
+            size_t src_len = (size_t)width * height * s_bpp[f];
+            uint8_t *src = (uint8_t *)malloc(src_len);
+            uint8_t *expect = (uint8_t *)malloc((size_t)width * height * 3);
+            for (size_t i = 0; i < src_len; i++) {
+                src[i] = test_rand(seed);
+            }
+            if (s_formats[f] == PIXFORMAT_GRAYSCALE) {
+                memcpy(expect, src, src_len);
+            } else {
+                for (int y = 0; y < height; y++) {
+                    const uint8_t *row = src + (size_t)y * width * s_bpp[f];
+                    for (int x = 0; x < width; x++) {
+                        expect_pixel(s_formats[f], row, width, x, expect + ((size_t)y * width + x) * 3);
+                    }
+                }
+            }
+            snprintf(what, sizeof(what), "%s %dx%d", s_format_names[f], width, height);
+            check_bmp(what, src, src_len, width, height, s_formats[f], expect, s_formats[f] == PIXFORMAT_GRAYSCALE ? 8 : 24);
+
+            // a source shorter than the image is refused
+            uint8_t *bmp = NULL;
+            size_t len;
+            esp_log_level_t level = sim_log_level;
+            sim_log_level = ESP_LOG_NONE;
+            CHECK(!fmt2bmp(src, src_len - 1, width, height, s_formats[f], &bmp, &len), "%s: short source accepted", what);
+            sim_log_level = level;
+            free(src);
+            free(expect);
+        }
+    }
+}
+
+static void check_jpeg_frame(const char *what, uint8_t *jpg, size_t len)
+{
+    jpg_index_t index;
+    CHECK(jpg_index(jpg, len, &index), "%s: not a complete JPEG", what);
+    uint8_t *rgb = (uint8_t *)malloc((size_t)index.width * index.height * 3);
+    CHECK(jpg2rgb888(jpg, len, rgb, JPG_SCALE_NONE), "%s: jpg2rgb888() failed", what);
+    check_bmp(what, jpg, len, index.width, index.height, PIXFORMAT_JPEG, rgb, 24);
+    free(rgb);
+}
+
+// JPEGs come out as jpg2rgb888() decodes them: the ones in docu/, and encoded ones with widths that need padding
+static void check_jpeg(uint32_t *seed)
+{
+    const char *paths[] = TEST_FRAMES;
+    char what[96];
+    for (int f = 0; f < TEST_FRAME_COUNT; f++) {
+        size_t len;
+        uint8_t *jpg = test_load(paths[f], &len);
+        check_jpeg_frame(paths[f], jpg, len);
+        free(jpg);
+    }
+    for (int s = 0; s < SIZE_COUNT; s++) {
+        int width = s_sizes[s][0], height = s_sizes[s][1];
+        size_t src_len = (size_t)width * height * 3, len;
+        uint8_t *src = (uint8_t *)malloc(src_len), *jpg = NULL;
+        for (size_t i = 0; i < src_len; i++) {
+            src[i] = test_rand(seed);
+        }
+        snprintf(what, sizeof(what), "JPEG %dx%d", width, height);
+        CHECK(fmt2jpg(src, src_len, width, height, PIXFORMAT_RGB888, 90, &jpg, &len), "%s: fmt2jpg() failed", what);
+        if (jpg) {
+            check_jpeg_frame(what, jpg, len);
+        }
+        free(jpg);
+        free(src);
+    }
+}
+
+int main(void)
+{
+    uint32_t seed = 1;
+    check_formats(&seed);
+    check_jpeg(&seed);
+    return test_done("bmptest");
+}
@@ -0,0 +1,495 @@
+// camsim: runs the camera driver on the host against the emulated OV2640 and reports how frames get through.
+//
+// The sensor thread replays JPEG frames at a chosen frame rate and pixel clock, consumer threads take them
+// with esp_camera_fb_get() like the app's server does, share them with esp_camera_fb_acquire(), or follow the
+// newest one with esp_camera_fb_get_latest() / esp_camera_fb_get_newer(). At the end it prints one line per result, and
+// --expect turns results into pass/fail checks for regression runs.
+#include <getopt.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "esp_camera.h"
+#include "esp_log.h"
+#include "esp_system.h"
+#include "img_converters.h"
+#include "sim.h"
+
+#define MAX_FRAMES      256
+#define MAX_CONSUMERS   8
+#define MAX_EXPECT      16
+
+// counters the driver updates, the app defines them in tcpserver.c
+int HwFrameCnt, I2sFrameCnt, DMAerrors, JPGerrors;
+
+typedef struct {
+    const char *key;
+    char op[3];
+    double value;
+} expect_t;
+
+typedef enum {
+    API_GET,        // esp_camera_fb_get()
+    API_ACQUIRE,    // esp_camera_fb_acquire()
+    API_LATEST,     // esp_camera_fb_get_latest(), polled every millisecond
+    API_NEWER,      // esp_camera_fb_get_newer()
+} api_t;
+
+typedef struct {
+    uint32_t frames;
+    double fps;
+    uint32_t pclk_hz;
+    uint32_t pad;
+    size_t fb_count;
+    int consumers;
+    api_t api;
+    uint32_t consumer_ms[MAX_CONSUMERS];
+    uint32_t filter_us;
+    expect_t expect[MAX_EXPECT];
+    int expect_count;
+} options_t;
+
+typedef struct {
+    const char *key;
+    double value;
+} result_t;
+
+static options_t s_opt = {
+    .frames = 60,
+    .fps = 25,
+    .pclk_hz = 10000000,
+    .fb_count = 2,
+    .consumers = 1,
+};
+
+// what the consumers saw, under s_lock
+static pthread_mutex_t s_lock = PTHREAD_MUTEX_INITIALIZER;
+static volatile bool s_stop;
+static uint8_t *s_seen;
+static int64_t *s_latency;
+static int64_t *s_age;
+static size_t s_samples, s_max_samples;
+static uint32_t s_got, s_corrupt, s_overwritten, s_dup, s_timeouts;
+static uint32_t s_missed, s_skipped, s_missed_error;
+static uint32_t s_first_seq = UINT32_MAX, s_last_seq;
+static int64_t s_first_us, s_last_us;
+
+static camera_config_t camera_config = {
+    .pin_pwdn = 32,
+    .pin_reset = -1,
+    .pin_xclk = 0,
+    .pin_sscb_sda = 26,
+    .pin_sscb_scl = 27,
+    .pin_d7 = 35,
+    .pin_d6 = 34,
+    .pin_d5 = 39,
+    .pin_d4 = 36,
+    .pin_d3 = 21,
+    .pin_d2 = 19,
+    .pin_d1 = 18,
+    .pin_d0 = 5,
+    .pin_vsync = 25,
+    .pin_href = 23,
+    .pin_pclk = 22,
+    .xclk_freq_hz = 20000000,
+    .pixel_format = PIXFORMAT_JPEG,
+    .frame_size = FRAMESIZE_UXGA,
+    .jpeg_quality = 10,
+    .fb_count = 2
+};
+
+static void usage(void)
+{
+    fprintf(stderr,
+            "usage: camsim [options] frame.jpg|stream.mjpeg ...\n"
+            "  --frames N        frames to measure (%u)\n"
+            "  --fps F           sensor frame rate (%g)\n"
+            "  --pclk HZ         bytes per second while the sensor sends (%u)\n"
+            "  --pad N           zero bytes after each EOI (%u)\n"
+            "  --fb-count N      frame buffers of the driver (%u)\n"
+            "  --consumers N     threads calling esp_camera_fb_get() (%d)\n"
+            "  --acquire         consumers share frames with esp_camera_fb_acquire()\n"
+            "  --latest          consumers poll esp_camera_fb_get_latest()\n"
+            "  --newer           consumers wait in esp_camera_fb_get_newer()\n"
+            "  --consumer-ms MS  time a consumer keeps each frame, a comma list gives one per consumer (%u)\n"
+            "  --filter-us US    extra time the DMA filter task takes per buffer (%u)\n"
+            "  --expect KEY<OP>N fail unless result KEY compares to N, OP one of < <= = >= >\n"
+            "  -v                driver log at info, -vv debug\n",
+            s_opt.frames, s_opt.fps, s_opt.pclk_hz, s_opt.pad, (unsigned)s_opt.fb_count,
+            s_opt.consumers, s_opt.consumer_ms[0], s_opt.filter_us);
+}
+
+// "10,40,100": one hold time per consumer, the last one repeats for the rest
+static bool parse_hold(const char *arg, uint32_t *ms)
+{
+    char *end;
+    int n = 0;
+    do {
+        ms[n++] = strtoul(arg, &end, 0);
+        arg = end + 1;
+    } while (*end == ',' && n < MAX_CONSUMERS);
+    for (int i = n; i < MAX_CONSUMERS; i++) {
+        ms[i] = ms[n - 1];
+    }
+    return *end == 0;
+}
+
+static bool parse_expect(const char *arg, expect_t *e)
+{
+    static const char *ops[] = { "<=", ">=", "<", ">", "=" };
+    for (int i = 0; i < 5; i++) {
+        const char *p = strstr(arg, ops[i]);
+        if (p && p != arg) {
+            char *end;
+            e->key = strndup(arg, p - arg);
+            strcpy(e->op, ops[i]);
+            e->value = strtod(p + strlen(ops[i]), &end);
+            return *end == 0;
+        }
+    }
+    return false;
+}
+
+// Split files into JPEGs: a file may hold one frame or a stream of them back to back
+static size_t load_frames(char **files, int count, const uint8_t **frames, size_t *lens)
+{
+    size_t n = 0;
+    for (int i = 0; i < count; i++) {
+        FILE *f = fopen(files[i], "rb");
+        if (!f) {
+            perror(files[i]);
+            return 0;
+        }
+        fseek(f, 0, SEEK_END);
+        long len = ftell(f);
+        fseek(f, 0, SEEK_SET);
+        uint8_t *buf = (uint8_t *)malloc(len);
+        if (!buf || fread(buf, 1, len, f) != (size_t)len) {
+            fclose(f);
+            fprintf(stderr, "%s: read failed\n", files[i]);
+            return 0;
+        }
+        fclose(f);
+
+        size_t pos = 0;
+        while (pos + 1 < (size_t)len && n < MAX_FRAMES) {
+            if (buf[pos] != 0xFF || buf[pos + 1] != 0xD8) {
+                pos++;
+                continue;
+            }
+            jpg_index_t index;
+            if (!jpg_index(buf + pos, len - pos, &index)) {
+                fprintf(stderr, "%s: bad JPEG at %u, flags 0x%x\n", files[i], (unsigned)pos, index.flags);
+                return 0;
+            }
+            frames[n] = buf + pos;
+            lens[n++] = index.length;
+            pos += index.length;
+        }
+    }
+    return n;
+}
+
+// the next frame for the chosen API, NULL on timeout. fb_seq and missed are the driver's numbers
+static camera_fb_t *consumer_take(uint32_t *fb_seq, uint32_t *missed)
+{
+    camera_fb_t *fb;
+    *missed = 0;
+    switch (s_opt.api) {
+    case API_ACQUIRE:
+        return esp_camera_fb_acquire();
+    case API_LATEST:
+        // a poller sees the same frame until a newer one completes
+        for (int64_t end = esp_timer_get_time() + 4000000; esp_timer_get_time() < end && !s_stop;) {
+            uint32_t seq = *fb_seq;
+            fb = esp_camera_fb_get_latest(&seq, missed);
+            if (fb && seq != *fb_seq) {
+                *fb_seq = seq;
+                return fb;
+            }
+            esp_camera_fb_release(fb);
+            sim_sleep_until(esp_timer_get_time() + 1000);
+        }
+        return NULL;
+    case API_NEWER:
+        return esp_camera_fb_get_newer(fb_seq, missed, 4000);
+    default:
+        return esp_camera_fb_get();
+    }
+}
+
+static void *consumer_main(void *arg)
+{
+    int id = (int)(intptr_t)arg;
+    uint32_t prev_seq = UINT32_MAX, fb_seq = 0;
+    while (!s_stop) {
+        int64_t t0 = esp_timer_get_time();
+        uint32_t missed;
+        camera_fb_t *fb = consumer_take(&fb_seq, &missed);
+        int64_t t1 = esp_timer_get_time();
+        if (!fb) {
+            if (!s_stop) {
+                pthread_mutex_lock(&s_lock);
+                s_timeouts++;
+                pthread_mutex_unlock(&s_lock);
+            }
+            continue;
+        }
+        uint32_t seq;
+        bool ok = sim_sensor_check(fb->buf, fb->len, &seq);
+        int64_t age = t1 - ((int64_t)fb->timestamp.tv_sec * 1000000 + fb->timestamp.tv_usec);
+
+        pthread_mutex_lock(&s_lock);
+        if (!ok) {
+            s_corrupt++;
+        }
+        if (ok && seq < s_opt.frames) {
+            // sharing hands a frame to every consumer, each one must still only move forward
+            if (s_seen[seq]++ && s_opt.api == API_GET) {
+                s_dup++;
+            }
+            if (prev_seq != UINT32_MAX && seq <= prev_seq) {
+                s_dup++;
+            }
+            // the driver can only miss frames the sensor sent; it may see fewer when DMA waited for a buffer
+            if (prev_seq != UINT32_MAX && seq > prev_seq) {
+                s_skipped += seq - prev_seq - 1;
+                s_missed_error += missed > seq - prev_seq - 1;
+            }
+            s_missed += missed;
+            prev_seq = seq;
+            if (s_first_seq == UINT32_MAX) {
+                s_first_seq = seq;
+                s_first_us = t1;
+            }
+            if (seq > s_last_seq) {
+                s_last_seq = seq;
+                s_last_us = t1;
+            }
+        }
+        if (s_samples < s_max_samples) {
+            s_latency[s_samples] = t1 - t0;
+            s_age[s_samples++] = age;
+        }
+        s_got++;
+        pthread_mutex_unlock(&s_lock);
+
+        if (s_opt.consumer_ms[id]) {
+            sim_sleep_until(t1 + s_opt.consumer_ms[id] * 1000);
+        }
+        // the driver must not have refilled the buffer while it was held
+        uint32_t seq_after;
+        if (ok && (!sim_sensor_check(fb->buf, fb->len, &seq_after) || seq_after != seq)) {
+            pthread_mutex_lock(&s_lock);
+            s_overwritten++;
+            pthread_mutex_unlock(&s_lock);
+        }
+        if (s_opt.api == API_GET) {
+            esp_camera_fb_return(fb);
+        } else {
+            esp_camera_fb_release(fb);
+        }
+    }
+    return NULL;
+}
+
+static int cmp_i64(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile(int64_t *v, size_t n, int p)
+{
+    return n ? (double)v[(n - 1) * p / 100] : 0;
+}
+
+static double mean(const int64_t *v, size_t n)
+{
+    double sum = 0;
+    for (size_t i = 0; i < n; i++) {
+        sum += v[i];
+    }
+    return n ? sum / n : 0;
+}
+
+static bool check(const expect_t *e, const result_t *results, int count)
+{
+    for (int i = 0; i < count; i++) {
+        if (strcmp(results[i].key, e->key)) {
+            continue;
+        }
+        double v = results[i].value;
+        bool pass = !strcmp(e->op, "<") ? v < e->value
+                    : !strcmp(e->op, "<=") ? v <= e->value
+                    : !strcmp(e->op, ">") ? v > e->value
+                    : !strcmp(e->op, ">=") ? v >= e->value
+                    : v == e->value;
+        if (!pass) {
+            printf("FAIL %s %g, expected %s %g\n", e->key, v, e->op, e->value);
+        }
+        return pass;
+    }
+    printf("FAIL no result %s\n", e->key);
+    return false;
+}
+
+int main(int argc, char **argv)
+{
+    static const struct option long_options[] = {
+        { "frames", required_argument, NULL, 'n' },
+        { "fps", required_argument, NULL, 'f' },
+        { "pclk", required_argument, NULL, 'p' },
+        { "pad", required_argument, NULL, 'P' },
+        { "fb-count", required_argument, NULL, 'b' },
+        { "consumers", required_argument, NULL, 'c' },
+        { "acquire", no_argument, NULL, 'a' },
+        { "latest", no_argument, NULL, 'l' },
+        { "newer", no_argument, NULL, 'N' },
+        { "consumer-ms", required_argument, NULL, 'm' },
+        { "filter-us", required_argument, NULL, 'u' },
+        { "expect", required_argument, NULL, 'e' },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+    int c;
+    while ((c = getopt_long(argc, argv, "vh", long_options, NULL)) != -1) {
+        switch (c) {
+        case 'n': s_opt.frames = strtoul(optarg, NULL, 0); break;
+        case 'f': s_opt.fps = strtod(optarg, NULL); break;
+        case 'p': s_opt.pclk_hz = strtoul(optarg, NULL, 0); break;
+        case 'P': s_opt.pad = strtoul(optarg, NULL, 0); break;
+        case 'b': s_opt.fb_count = strtoul(optarg, NULL, 0); break;
+        case 'c': s_opt.consumers = atoi(optarg); break;
+        case 'a': s_opt.api = API_ACQUIRE; break;
+        case 'l': s_opt.api = API_LATEST; break;
+        case 'N': s_opt.api = API_NEWER; break;
+        case 'm':
+            if (!parse_hold(optarg, s_opt.consumer_ms)) {
+                fprintf(stderr, "bad --consumer-ms %s\n", optarg);
+                return 2;
+            }
+            break;
+        case 'u': s_opt.filter_us = strtoul(optarg, NULL, 0); break;
+        case 'e':
+            if (s_opt.expect_count == MAX_EXPECT || !parse_expect(optarg, &s_opt.expect[s_opt.expect_count++])) {
+                fprintf(stderr, "bad --expect %s\n", optarg);
+                return 2;
+            }
+            break;
+        case 'v': sim_log_level++; break;
+        default: usage(); return 2;
+        }
+    }
+    if (optind == argc || !s_opt.frames || s_opt.consumers < 1 || s_opt.consumers > MAX_CONSUMERS) {
+        usage();
+        return 2;
+    }
+
+    static const uint8_t *frames[MAX_FRAMES];
+    static size_t lens[MAX_FRAMES];
+    size_t count = load_frames(argv + optind, argc - optind, frames, lens);
+    if (!count) {
+        fprintf(stderr, "no frames\n");
+        return 2;
+    }
+
+    s_seen = (uint8_t *)calloc(s_opt.frames, 1);
+    s_max_samples = (size_t)s_opt.frames * (s_opt.consumers + 1) + 64;
+    s_latency = (int64_t *)malloc(s_max_samples * sizeof(int64_t));
+    s_age = (int64_t *)malloc(s_max_samples * sizeof(int64_t));
+
+    sim_sensor_config_t sensor = {
+        .frames = frames,
+        .lens = lens,
+        .count = count,
+        .fps = s_opt.fps,
+        .pclk_hz = s_opt.pclk_hz,
+        .vsync_us = 200,
+        .pad = s_opt.pad,
+        .pin_vsync = camera_config.pin_vsync,
+    };
+    sim_task_set_work("dma_filter", s_opt.filter_us);
+    if (!sim_sensor_start(&sensor)) {
+        fprintf(stderr, "sensor start failed\n");
+        return 1;
+    }
+
+    // like the app: the largest frame size for the buffers, then the one it streams
+    camera_config.fb_count = s_opt.fb_count;
+    esp_err_t err = esp_camera_init(&camera_config);
+    if (err != ESP_OK) {
+        fprintf(stderr, "esp_camera_init failed: 0x%x\n", err);
+        sim_sensor_stop();
+        return 1;
+    }
+    sensor_t *s = esp_camera_sensor_get();
+    s->set_framesize(s, FRAMESIZE_VGA);
+
+    pthread_t consumers[MAX_CONSUMERS];
+    for (int i = 0; i < s_opt.consumers; i++) {
+        pthread_create(&consumers[i], NULL, consumer_main, (void *)(intptr_t)i);
+    }
+    // frames after the measured ones keep consumers from waiting out the driver's timeout
+    while (sim_sensor_sent() < s_opt.frames) {
+        sim_sleep_until(esp_timer_get_time() + 10000);
+    }
+    s_stop = true;
+    for (int i = 0; i < s_opt.consumers; i++) {
+        pthread_join(consumers[i], NULL);
+    }
+    sim_sensor_stop();
+    esp_camera_deinit();
+
+    uint32_t window = 0, unique = 0, shared = 0;
+    if (s_first_seq != UINT32_MAX) {
+        window = s_last_seq - s_first_seq + 1;
+        for (uint32_t i = s_first_seq; i <= s_last_seq; i++) {
+            unique += s_seen[i] != 0;
+            shared += s_seen[i] > 1;
+        }
+    }
+    double secs = (s_last_us - s_first_us) / 1e6;
+    double latency_mean = mean(s_latency, s_samples), age_mean = mean(s_age, s_samples);
+    qsort(s_latency, s_samples, sizeof(int64_t), cmp_i64);
+    qsort(s_age, s_samples, sizeof(int64_t), cmp_i64);
+
+    result_t results[] = {
+        { "sent", s_opt.frames },
+        { "hw_frames", HwFrameCnt },
+        { "i2s_frames", I2sFrameCnt },
+        { "got", s_got },
+        { "delivered", unique },
+        { "dropped", window - unique },
+        { "drop_pct", window ? 100.0 * (window - unique) / window : 100 },
+        { "corrupt", s_corrupt },
+        { "overwritten", s_overwritten },
+        { "dup", s_dup },
+        { "shared", shared },
+        { "missed", s_missed },
+        { "skipped", s_skipped },
+        { "missed_error", s_missed_error },
+        { "timeouts", s_timeouts },
+        { "dma_errors", DMAerrors },
+        { "jpg_errors", JPGerrors },
+        { "fps", secs > 0 ? (unique - 1) / secs : 0 },
+        { "latency_mean_us", latency_mean },
+        { "latency_p50_us", percentile(s_latency, s_samples, 50) },
+        { "latency_p99_us", percentile(s_latency, s_samples, 99) },
+        { "latency_max_us", percentile(s_latency, s_samples, 100) },
+        { "age_mean_us", age_mean },
+        { "age_max_us", percentile(s_age, s_samples, 100) },
+        { "sensor_slip_us", (double)sim_sensor_slip_us() },
+    };
+    int result_count = sizeof(results) / sizeof(results[0]);
+    for (int i = 0; i < result_count; i++) {
+        printf("%-16s %.6g\n", results[i].key, results[i].value);
+    }
+
+    int failed = 0;
+    for (int i = 0; i < s_opt.expect_count; i++) {
+        failed += !check(&s_opt.expect[i], results, result_count);
+    }
+    return failed ? 1 : 0;
+}
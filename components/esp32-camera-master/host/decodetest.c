@@ -0,0 +1,318 @@
+// decodetest: checks jpg2rgb888() (jpgd behind esp_jpg_decode()) against the system libjpeg.
+//
+// The JPEGs in docu/ and libjpeg encodes of a generated image, grayscale and YCbCr with H1V1, H2V1 and H2V2
+// sampling, at a size with partial MCUs, with and without restart markers, are decoded at full size and at 1/2,
+// 1/4 and 1/8. At full size libjpeg, with the accurate integer IDCT and chroma repeated rather than
+// interpolated as jpgd does it, has to give the same pixels up to IDCT rounding.
+//
+// The scaled decodes are box filters: every output sample of a plane is the mean of the square of full size
+// samples it covers, and chroma planes are scaled before they are repeated. libjpeg scales differently (and
+// keeps more chroma for H2V2), so it only gives the size to expect. The reference for the pixels is the full
+// size libjpeg decode in YCbCr, each plane averaged over those squares and converted to RGB. Squares that reach
+// past the image edge average the encoder's padding in jpgd and are left out.
+//
+// esp_jpg_decode() has to hand out the lines in order, in bands that add up to the height, and a JPEG cut off
+// in its headers is refused.
+//
+// With a number of seconds as argument it then measures both decoders at each scale, in Mpixels/s of source.
+#include <stdio.h>
+#include <string.h>
+#include <jpeglib.h>
+#include "esp_log.h"
+#include "img_converters.h"
+#include "esp_jpg_decode.h"
+#include "test.h"
+
+#define IMAGE_WIDTH     203
+#define IMAGE_HEIGHT    141
+#define MAX_DIFF        2       // per channel, at full size
+#define MAX_MEAN_DIFF   0.1
+#define MAX_BOX_DIFF    3       // scaled, the reference averages samples that were rounded to 8 bits
+#define MAX_BOX_MEAN_DIFF 0.5
+
+static const char *const s_scale_names[] = { "1/1", "1/2", "1/4", "1/8" };
+
+typedef struct {
+    char name[64];
+    uint8_t *jpg;
+    size_t len;
+    int width, height;
+    int h_shift, v_shift;       // chroma subsampling, log2
+    bool gray;
+} frame_t;
+
+// Encodes an RGB image with libjpeg, with the luma sampling factors h x v, 0 for grayscale
+static void libjpeg_encode(frame_t *f, const uint8_t *rgb, int width, int height, int h, int v, int quality, int restart_rows)
+{
+    struct jpeg_compress_struct cinfo;
+    struct jpeg_error_mgr jerr;
+    unsigned long len = 0;
+    f->jpg = NULL;
+    cinfo.err = jpeg_std_error(&jerr);
+    jpeg_create_compress(&cinfo);
+    jpeg_mem_dest(&cinfo, &f->jpg, &len);
+    cinfo.image_width = width;
+    cinfo.image_height = height;
+    cinfo.input_components = 3;
+    cinfo.in_color_space = JCS_RGB;
+    jpeg_set_defaults(&cinfo);
+    if (!h) {
+        jpeg_set_colorspace(&cinfo, JCS_GRAYSCALE);
+    } else {
+        cinfo.comp_info[0].h_samp_factor = h;
+        cinfo.comp_info[0].v_samp_factor = v;
+    }
+    jpeg_set_quality(&cinfo, quality, TRUE);
+    cinfo.restart_in_rows = restart_rows;
+    jpeg_start_compress(&cinfo, TRUE);
+    for (int y = 0; y < height; y++) {
+        JSAMPROW row = (JSAMPROW)(rgb + (size_t)y * width * 3);
+        jpeg_write_scanlines(&cinfo, &row, 1);
+    }
+    jpeg_finish_compress(&cinfo);
+    jpeg_destroy_compress(&cinfo);
+    f->len = len;
+    if (h) {
+        snprintf(f->name, sizeof(f->name), "libjpeg %dx%d H%dV%d q%d%s", width, height, h, v, quality, restart_rows ? " restarts" : "");
+    } else {
+        snprintf(f->name, sizeof(f->name), "libjpeg %dx%d gray q%d%s", width, height, quality, restart_rows ? " restarts" : "");
+    }
+}
+
+// Decodes with libjpeg at 1 / (1 << scale) into space (3 components, JCS_RGB comes out as B, G, R)
+static uint8_t *libjpeg_decode(const frame_t *f, int scale, J_COLOR_SPACE space, int *width, int *height)
+{
+    struct jpeg_decompress_struct cinfo;
+    struct jpeg_error_mgr jerr;
+    cinfo.err = jpeg_std_error(&jerr);
+    jpeg_create_decompress(&cinfo);
+    jpeg_mem_src(&cinfo, f->jpg, f->len);
+    jpeg_read_header(&cinfo, TRUE);
+    cinfo.out_color_space = (space == JCS_YCbCr && f->gray) ? JCS_RGB : space;
+    cinfo.scale_num = 1;
+    cinfo.scale_denom = 1 << scale;
+    cinfo.dct_method = JDCT_ISLOW;
+    cinfo.do_fancy_upsampling = FALSE;
+    jpeg_start_decompress(&cinfo);
+    *width = cinfo.output_width;
+    *height = cinfo.output_height;
+    uint8_t *out = (uint8_t *)malloc((size_t)*width * *height * 3);
+    while (cinfo.output_scanline < cinfo.output_height) {
+        JSAMPROW row = (JSAMPROW)(out + (size_t)cinfo.output_scanline * *width * 3);
+        jpeg_read_scanlines(&cinfo, &row, 1);
+    }
+    jpeg_finish_decompress(&cinfo);
+    jpeg_destroy_decompress(&cinfo);
+    for (size_t i = 0; i < (size_t)*width * *height; i++) {
+        if (space == JCS_YCbCr && f->gray) {
+            out[i * 3 + 1] = out[i * 3 + 2] = 128;
+        } else if (space == JCS_RGB) {
+            uint8_t r = out[i * 3];
+            out[i * 3] = out[i * 3 + 2];
+            out[i * 3 + 2] = r;
+        }
+    }
+    return out;
+}
+
+static int clamp(double v)
+{
+    return v < 0 ? 0 : v > 255 ? 255 : (int)(v + 0.5);
+}
+
+// Mean of component c of ycc over the square of side n at (x, y), -1 if it reaches past the edge
+static double box_mean(const uint8_t *ycc, int width, int height, int c, int x, int y, int nx, int ny)
+{
+    if (x + nx > width || y + ny > height) {
+        return -1;
+    }
+    int sum = 0;
+    for (int j = y; j < y + ny; j++) {
+        for (int i = x; i < x + nx; i++) {
+            sum += ycc[((size_t)j * width + i) * 3 + c];
+        }
+    }
+    return (double)sum / (nx * ny);
+}
+
+// The scaled decode as box filters over the full size YCbCr one, as B, G, R; pixels left out get mask 0
+static void box_reference(const frame_t *f, const uint8_t *ycc, int scale, int out_w, int out_h, uint8_t *bgr, uint8_t *mask)
+{
+    const int n = 1 << scale;
+    for (int y = 0; y < out_h; y++) {
+        for (int x = 0; x < out_w; x++) {
+            size_t i = (size_t)y * out_w + x;
+            double yy = box_mean(ycc, f->width, f->height, 0, x * n, y * n, n, n);
+            // the scaled chroma sample this pixel repeats, in full size luma pixels
+            int cx = (x >> f->h_shift) * (n << f->h_shift), cy = (y >> f->v_shift) * (n << f->v_shift);
+            double cb = box_mean(ycc, f->width, f->height, 1, cx, cy, n << f->h_shift, n << f->v_shift);
+            double cr = box_mean(ycc, f->width, f->height, 2, cx, cy, n << f->h_shift, n << f->v_shift);
+            mask[i] = yy >= 0 && cb >= 0 && cr >= 0;
+            bgr[i * 3] = clamp(yy + 1.772 * (cb - 128));
+            bgr[i * 3 + 1] = clamp(yy - 0.344136 * (cb - 128) - 0.714136 * (cr - 128));
+            bgr[i * 3 + 2] = clamp(yy + 1.402 * (cr - 128));
+        }
+    }
+}
+
+// The lines as esp_jpg_decode() hands them out
+typedef struct {
+    uint8_t *rgb;
+    uint16_t width, height;
+    uint16_t next_y;
+    bool out_of_order;
+} lines_t;
+
+static bool lines_cb(void *arg, uint16_t y, uint16_t width, uint16_t lines, const uint8_t *data)
+{
+    lines_t *l = (lines_t *)arg;
+    if (y != l->next_y || width != l->width || y + lines > l->height) {
+        l->out_of_order = true;
+        return false;
+    }
+    memcpy(l->rgb + (size_t)y * width * 3, data, (size_t)lines * width * 3);
+    l->next_y = y + lines;
+    return true;
+}
+
+static void check_frame(const frame_t *f)
+{
+    char what[128];
+    int w0, h0;
+    uint8_t *ycc = libjpeg_decode(f, 0, JCS_YCbCr, &w0, &h0);
+    for (int scale = 0; scale <= JPG_SCALE_MAX; scale++) {
+        snprintf(what, sizeof(what), "%.63s, %s", f->name, s_scale_names[scale]);
+        int ref_w, ref_h;
+        uint8_t *ref = libjpeg_decode(f, scale, JCS_RGB, &ref_w, &ref_h), *mask = NULL;
+        uint16_t w, h;
+        bool ok = esp_jpg_get_size(f->jpg, f->len, (jpg_scale_t)scale, &w, &h);
+        CHECK(ok && w == ref_w && h == ref_h, "%s: esp_jpg_get_size() gives %ux%u, libjpeg %dx%d", what, w, h, ref_w, ref_h);
+        if (!ok || w != ref_w || h != ref_h) {
+            free(ref);
+            continue;
+        }
+        if (scale) {
+            mask = (uint8_t *)malloc((size_t)w * h);
+            box_reference(f, ycc, scale, w, h, ref, mask);
+        }
+
+        uint8_t *rgb = (uint8_t *)malloc((size_t)w * h * 3);
+        CHECK(jpg2rgb888(f->jpg, f->len, rgb, (jpg_scale_t)scale), "%s: jpg2rgb888() failed", what);
+        int max_diff = 0;
+        size_t compared = 0;
+        double sum = 0;
+        for (size_t i = 0; i < (size_t)w * h; i++) {
+            for (int c = 0; (!mask || mask[i]) && c < 3; c++) {
+                int d = abs(rgb[i * 3 + c] - ref[i * 3 + c]);
+                max_diff = d > max_diff ? d : max_diff;
+                sum += d;
+                compared++;
+            }
+        }
+        double mean = compared ? sum / compared : 0;
+        CHECK(scale ? (max_diff <= MAX_BOX_DIFF && mean <= MAX_BOX_MEAN_DIFF) : (max_diff <= MAX_DIFF && mean <= MAX_MEAN_DIFF), "%s: differs from the reference by up to %d, %.3f on average", what, max_diff, mean);
+
+        lines_t l = { (uint8_t *)malloc((size_t)w * h * 3), w, h, 0, false };
+        CHECK(esp_jpg_decode(f->jpg, f->len, (jpg_scale_t)scale, lines_cb, &l), "%s: esp_jpg_decode() failed", what);
+        CHECK(!l.out_of_order && l.next_y == h, "%s: esp_jpg_decode() lines out of order or %u of %u", what, l.next_y, h);
+        CHECK(!memcmp(l.rgb, rgb, (size_t)w * h * 3), "%s: esp_jpg_decode() lines differ from jpg2rgb888()", what);
+        free(l.rgb);
+        free(rgb);
+        free(mask);
+        free(ref);
+    }
+    free(ycc);
+
+    // cut off before the scan
+    esp_log_level_t level = sim_log_level;
+    sim_log_level = ESP_LOG_NONE;
+    uint8_t *rgb = (uint8_t *)malloc((size_t)f->width * f->height * 3);
+    uint16_t w, h;
+    CHECK(!esp_jpg_get_size(f->jpg, 100, JPG_SCALE_NONE, &w, &h), "%s: the size of the first 100 bytes", f->name);
+    CHECK(!jpg2rgb888(f->jpg, 100, rgb, JPG_SCALE_NONE), "%s: the first 100 bytes decode", f->name);
+    free(rgb);
+    sim_log_level = level;
+}
+
+// Mpixels/s of source through jpg2rgb888(), or through libjpeg with reference set
+static double bench(const frame_t *f, int scale, bool reference, double seconds)
+{
+    uint8_t *rgb = (uint8_t *)malloc((size_t)f->width * f->height * 3);
+    size_t pixels = 0;
+    double start = test_now(), t;
+    do {
+        if (reference) {
+            int w, h;
+            free(libjpeg_decode(f, scale, JCS_RGB, &w, &h));
+        } else {
+            jpg2rgb888(f->jpg, f->len, rgb, (jpg_scale_t)scale);
+        }
+        pixels += (size_t)f->width * f->height;
+    } while ((t = test_now() - start) < seconds);
+    free(rgb);
+    return pixels / t / 1e6;
+}
+
+// Smooth shapes, hard edges and some noise, as R, G, B
+static void make_image(uint8_t *rgb, int width, int height, uint32_t seed)
+{
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            uint8_t *p = rgb + (y * width + x) * 3;
+            int noise = (int)(test_rand(&seed) % 9) - 4;
+            int dx = x - width / 3, dy = y - height / 2;
+            bool disc = dx * dx + dy * dy < width * height / 12;
+            p[0] = (disc ? 200 : x * 240 / width) + noise + 4;
+            p[1] = (disc ? 30 : y * 200 / height) + noise + 4;
+            p[2] = ((x ^ y) & 16 ? 180 : 60) + noise;
+        }
+    }
+}
+
+// Size and sampling from the headers
+static void read_headers(frame_t *f)
+{
+    jpg_index_t index;
+    jpg_index(f->jpg, f->len, &index);
+    f->width = index.width;
+    f->height = index.height;
+    f->gray = index.components == 1;
+    f->h_shift = (index.sampling >> 4) - 1;
+    f->v_shift = (index.sampling & 15) - 1;
+}
+
+int main(int argc, char *argv[])
+{
+    double seconds = argc > 1 ? atof(argv[1]) : 0;
+    const char *paths[] = TEST_FRAMES;
+    static const int sampling[][2] = { { 0, 0 }, { 1, 1 }, { 2, 1 }, { 2, 2 } };
+    frame_t frames[TEST_FRAME_COUNT + 8];
+    int count = 0;
+
+    for (int i = 0; i < TEST_FRAME_COUNT; i++) {
+        snprintf(frames[count].name, sizeof(frames[count].name), "%s", paths[i]);
+        frames[count++].jpg = test_load(paths[i], &frames[i].len);
+    }
+    uint8_t *rgb = (uint8_t *)malloc(IMAGE_WIDTH * IMAGE_HEIGHT * 3);
+    make_image(rgb, IMAGE_WIDTH, IMAGE_HEIGHT, 1);
+    for (int s = 0; s < 4; s++) {
+        libjpeg_encode(&frames[count++], rgb, IMAGE_WIDTH, IMAGE_HEIGHT, sampling[s][0], sampling[s][1], 90, 0);
+        libjpeg_encode(&frames[count++], rgb, IMAGE_WIDTH, IMAGE_HEIGHT, sampling[s][0], sampling[s][1], 50, 1);
+    }
+    free(rgb);
+
+    for (int i = 0; i < count; i++) {
+        read_headers(&frames[i]);
+        check_frame(&frames[i]);
+    }
+    for (int i = 0; seconds > 0 && i < TEST_FRAME_COUNT; i++) {
+        for (int scale = 0; scale <= JPG_SCALE_MAX; scale++) {
+            printf("%-28s %s  jpgd %7.1f Mpixels/s  libjpeg %7.1f Mpixels/s\n", frames[i].name, s_scale_names[scale],
+                   bench(&frames[i], scale, false, seconds), bench(&frames[i], scale, true, seconds));
+        }
+    }
+    for (int i = 0; i < count; i++) {
+        free(frames[i].jpg);
+    }
+    return test_done("decodetest");
+}
@@ -0,0 +1,870 @@
+// enctest: checks the JPEG encoder output against known good hashes.
+//
+// A fixed corpus of generated images (gradients, hard edges and noise, at a size with whole MCUs and one with
+// partial MCUs on both edges) is encoded as grayscale, YUYV and RGB at low, medium and high quality, with
+// the default parameters, with two pass Huffman tables and with three threads coding MCU rows in parallel.
+// The hashes were taken from the encoder before its entropy coder was rewritten around a 64 bit bit buffer,
+// any change to the output fails the test. fmt2jpg() is checked the same way for each camera pixel format.
+// process_frame() has to give the same bytes as process_scanline(), and jpg_index() has to find a complete
+// JPEG of the right size in every output. The system libjpeg has to decode the two pass and threaded output
+// without a warning to the same pixels as the default one, so a broken restart interval or DC reset cannot
+// hide behind a new hash. jpeg_encoder::get_header_size() has to give where the coded data starts.
+//
+// malloc(), calloc() and realloc() are wrapped at link time to count allocations. Once an encoder context has
+// converted its first frame, fmt2jpg_ctx() and fmt2jpg_cb_ctx() must not allocate anything for further frames
+// of any format, size or quality, and must give the bytes fmt2jpg() gives. The same goes for a jpeg_encoder
+// on an arena with worker threads and two pass Huffman tables.
+//
+// Two encoders with different quality, subsampling and Huffman tables run on two threads at once, frame after
+// frame, and each has to give the bytes it gives alone. process_lines() refuses more rows than the image has left.
+//
+// Encodes scaled by 2 and 4 in the encoder have to be the size of the source divided and rounded up, and where
+// that is exact the same bytes as encoding the image box filtered by fmt2resized() first.
+//
+// fmt2jpg_rc() has to take the header length of each frame from the encoder. It codes a slowly panning, noisy
+// sequence in each format at budgets from low to high quality: from the third frame on the output has to be
+// within 30% of the budget, from the fourth on within 10%, unless the quality is at its limit.
+//
+// jpeg_encoder takes 1 (Y), 2 (YUYV) or 3 (RGB) channels, anything else is refused.
+//
+// With a number of seconds as argument it then measures the encoder, in MB/s of input and of output, and YUYV
+// also converted to RGB a row at a time before encoding, the way it went before the encoder took YUYV. Encodes
+// at 1/2 and 1/4 size are timed against the full size encode, done by the encoder and by resizing first, with
+// the encoder's working memory and the size of the result.
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <jpeglib.h>
+#include "esp_log.h"
+#include "jpge.h"
+#include "img_converters.h"
+#include "yuv.h"
+#include "test.h"
+
+#define MAX_WIDTH       800
+#define MAX_HEIGHT      600
+#define CTX_FRAMES      20
+#define CONCURRENT_FRAMES 20000
+#define RC_FRAMES       8
+#define RC_SETTLED      3
+#define RC_EARLY_TOLERANCE 0.3f
+#define RC_TOLERANCE    0.1f
+
+// Allocation counter, the link wraps the allocator with these
+static int s_allocs;
+
+extern "C" {
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *p, size_t size);
+
+void *__wrap_malloc(size_t size)
+{
+    __atomic_add_fetch(&s_allocs, 1, __ATOMIC_RELAXED);
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t n, size_t size)
+{
+    __atomic_add_fetch(&s_allocs, 1, __ATOMIC_RELAXED);
+    return __real_calloc(n, size);
+}
+
+void *__wrap_realloc(void *p, size_t size)
+{
+    __atomic_add_fetch(&s_allocs, 1, __ATOMIC_RELAXED);
+    return __real_realloc(p, size);
+}
+}
+
+// Appends to a buffer that grows as needed
+class grow_stream : public jpge::output_stream {
+public:
+    uint8_t *data;
+    size_t len, size;
+
+    grow_stream() : data(NULL), len(0), size(0) { }
+    virtual ~grow_stream() { free(data); }
+
+    virtual bool put_buf(const void *buf, int n)
+    {
+        if (!buf) {
+            return true;
+        }
+        if (len + n > size) {
+            size = (len + n) * 2;
+            data = (uint8_t *)realloc(data, size);
+        }
+        memcpy(data + len, buf, n);
+        len += n;
+        return true;
+    }
+
+    virtual jpge::uint get_size() const
+    {
+        return len;
+    }
+};
+
+// A camera-like test image: a diagonal gradient per channel, a few hard edged shapes and some noise
+static void make_image(uint8_t *rgb, int width, int height, uint32_t seed)
+{
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            uint8_t *p = rgb + (y * width + x) * 3;
+            int noise = (int)(test_rand(&seed) % 17) - 8;
+            int r = x * 255 / width, g = y * 255 / height, b = (x + y) * 127 / (width + height) + 64;
+            int dx = x - width / 3, dy = y - height / 2;
+            if (dx * dx + dy * dy < width * height / 16) {
+                r = 255 - r; g = 40; b = 220;
+            }
+            if (x > width * 2 / 3 && ((y / 4) & 1)) {
+                r = g = b = (x & 8) ? 250 : 5;
+            }
+            r += noise; g += noise; b -= noise;
+            p[0] = r < 0 ? 0 : r > 255 ? 255 : r;
+            p[1] = g < 0 ? 0 : g > 255 ? 255 : g;
+            p[2] = b < 0 ? 0 : b > 255 ? 255 : b;
+        }
+    }
+}
+
+// The image as 1 (Y), 2 (YUYV, the sensor's YUV422) or 3 (RGB) channel source for jpeg_encoder
+static void make_source(uint8_t *dst, const uint8_t *rgb, int width, int height, int channels)
+{
+    for (int i = 0; i < width * height; i++) {
+        const uint8_t *p = rgb + i * 3;
+        int yv = (p[0] * 77 + p[1] * 150 + p[2] * 29 + 128) >> 8;
+        if (channels == 1) {
+            dst[i] = yv;
+        } else if (channels == 3) {
+            memcpy(dst + i * 3, p, 3);
+        } else if (i & 1) {
+            dst[i * 2] = yv;
+            dst[i * 2 + 1] = 128 + ((p[0] - yv) * 91 >> 7);
+        } else {
+            dst[i * 2] = yv;
+            dst[i * 2 + 1] = 128 + ((p[2] - yv) * 72 >> 7);
+        }
+    }
+}
+
+// The image in a camera pixel format, as fmt2jpg() takes it
+static size_t make_frame(uint8_t *dst, const uint8_t *rgb, int width, int height, pixformat_t format)
+{
+    int n = width * height;
+    switch (format) {
+    case PIXFORMAT_GRAYSCALE:
+        make_source(dst, rgb, width, height, 1);
+        return n;
+    case PIXFORMAT_YUV422:
+        make_source(dst, rgb, width, height, 2);
+        return n * 2;
+    case PIXFORMAT_RGB888:
+        for (int i = 0; i < n; i++) {
+            dst[i * 3] = rgb[i * 3 + 2];
+            dst[i * 3 + 1] = rgb[i * 3 + 1];
+            dst[i * 3 + 2] = rgb[i * 3];
+        }
+        return n * 3;
+    default:
+        for (int i = 0; i < n; i++) {
+            const uint8_t *p = rgb + i * 3;
+            uint16_t v = ((p[0] & 0xF8) << 8) | ((p[1] & 0xFC) << 3) | (p[2] >> 3);
+            dst[i * 2] = v >> 8;
+            dst[i * 2 + 1] = v & 0xFF;
+        }
+        return n * 2;
+    }
+}
+
+enum { VARIANT_DEFAULT, VARIANT_TWO_PASS, VARIANT_THREADS, VARIANT_COUNT };
+static const char *const s_variant_names[VARIANT_COUNT] = { "default", "two pass", "3 threads" };
+
+static const int s_sizes[][2] = { { 320, 240 }, { 37, 21 } };
+static const int s_qualities[] = { 10, 75, 98 };
+static const pixformat_t s_formats[] = { PIXFORMAT_GRAYSCALE, PIXFORMAT_YUV422, PIXFORMAT_RGB565, PIXFORMAT_RGB888 };
+static const char *const s_format_names[] = { "GRAYSCALE", "YUV422", "RGB565", "RGB888" };
+
+#define SIZE_COUNT      (int)(sizeof(s_sizes) / sizeof(s_sizes[0]))
+#define QUALITY_COUNT   (int)(sizeof(s_qualities) / sizeof(s_qualities[0]))
+#define FORMAT_COUNT    (int)(sizeof(s_formats) / sizeof(s_formats[0]))
+
+// jpeg_encoder output for [size][channels - 1][variant][quality]
+static const uint64_t s_encoder_hashes[SIZE_COUNT][3][VARIANT_COUNT][QUALITY_COUNT] = {
+    { // 320x240
+        { // Y
+            { 0x64cb10da5ea11c18ULL, 0x0306c989c14f1e7eULL, 0x616f0f86034e93c9ULL }, // default
+            { 0xcde4d3c2316a6718ULL, 0x56d46e6894cfeae1ULL, 0xa6d31ba2984b6b8eULL }, // two pass
+            { 0xd14aa2524d8f493fULL, 0x48e1fb7a36896302ULL, 0xdf607021177c0e96ULL }, // 3 threads
+        },
+        { // YUYV
+            { 0x39846c11ea8bad44ULL, 0x0df6565b341ea75aULL, 0x4463025e57393234ULL }, // default
+            { 0x78be93cfdb7a3b55ULL, 0x2aeb8d065f5a0aadULL, 0xac037a6e492f8e03ULL }, // two pass
+            { 0x96240d8245e64837ULL, 0x51b626b39eec3ddeULL, 0x8a769d3ee5cfbac5ULL }, // 3 threads
+        },
+        { // RGB
+            { 0x79dc5fe56a9be2c6ULL, 0x86af931a53533d9fULL, 0x6dc11c0cc4f63d9aULL }, // default
+            { 0x9276d14d714cf4eaULL, 0x8899eca929280363ULL, 0xa4d312da5d9ba7d5ULL }, // two pass
+            { 0xa08c7df0885b63bfULL, 0xa61abb5429520805ULL, 0x01a04078c4e98ccaULL }, // 3 threads
+        },
+    },
+    { // 37x21
+        { // Y
+            { 0xbdb349924a2272d3ULL, 0x9f17a3f10c72877dULL, 0xdd7bc8dc59ca7616ULL }, // default
+            { 0x8d37d27349afba70ULL, 0x0d14626c998b44fcULL, 0xe32fa81c55a0194fULL }, // two pass
+            { 0x574855234efdd59eULL, 0xa3bc3428429c8c84ULL, 0xe3310244eee3808bULL }, // 3 threads
+        },
+        { // YUYV
+            { 0xaced0a4873dcdd41ULL, 0x96d7e7a8546a26eeULL, 0x6328ef9bdb48c7e2ULL }, // default
+            { 0xfde881a0fd96430fULL, 0xf8cca73e5da6cbfdULL, 0x91772afe2a9fb112ULL }, // two pass
+            { 0x2be2f3ef23448f94ULL, 0xe5f93d3e03c8f44bULL, 0x5588b5c7dab74910ULL }, // 3 threads
+        },
+        { // RGB
+            { 0x5f713a7c72440d08ULL, 0x5b1099e1277189afULL, 0x3fb02368baf1405dULL }, // default
+            { 0xab4c5bb5e900d5f0ULL, 0xec00c32c86ccf373ULL, 0x7d12966c38286debULL }, // two pass
+            { 0x48846bd6b76b9e7eULL, 0x8f266edc6fbd4b33ULL, 0x29332b87adc5122aULL }, // 3 threads
+        },
+    },
+};
+
+// fmt2jpg() output for [size][format] at quality 75
+static const uint64_t s_fmt2jpg_hashes[SIZE_COUNT][FORMAT_COUNT] = {
+    { 0x9c4417384213379cULL, 0xa861df26e6081cfdULL, 0xe554b3837ca8fe70ULL, 0x61069d621d655b69ULL }, // 320x240
+    { 0x47c664d23d92f756ULL, 0xe28cbbed32548bb8ULL, 0x5fba60fb5241964fULL, 0x4b9df555310cf6c1ULL }, // 37x21
+};
+
+static void encoder_params(jpge::params *params, int channels, int variant, int quality)
+{
+    *params = jpge::params();
+    params->m_quality = quality;
+    params->m_subsampling = channels == 1 ? jpge::Y_ONLY : channels == 2 ? jpge::H2V1 : jpge::H2V2;
+    params->m_two_pass_flag = variant == VARIANT_TWO_PASS;
+    params->m_num_threads = variant == VARIANT_THREADS ? 3 : 1;
+}
+
+static bool encode_scanlines(grow_stream *out, const uint8_t *src, int width, int height, int channels, const jpge::params &params)
+{
+    jpge::jpeg_encoder enc;
+    if (!enc.init(out, width, height, channels, params)) {
+        return false;
+    }
+    for (jpge::uint pass = 0; pass < enc.get_total_passes(); pass++) {
+        for (int y = 0; y < height; y++) {
+            if (!enc.process_scanline(src + y * width * channels)) {
+                return false;
+            }
+        }
+        if (!enc.process_scanline(NULL)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool encode_frame(grow_stream *out, const uint8_t *src, int width, int height, int channels, const jpge::params &params)
+{
+    jpge::jpeg_encoder enc;
+    if (!enc.init(out, width, height, channels, params)) {
+        return false;
+    }
+    for (jpge::uint pass = 0; pass < enc.get_total_passes(); pass++) {
+        if (!enc.process_frame(src, width * channels)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void check_jpeg(const char *what, const uint8_t *data, size_t len, int width, int height)
+{
+    jpg_index_t index;
+    CHECK(jpg_index(data, len, &index), "%s: not a complete JPEG, flags 0x%x", what, index.flags);
+    CHECK(index.length == len, "%s: EOI at %u of %u bytes", what, (unsigned)index.length, (unsigned)len);
+    CHECK(index.width == width && index.height == height, "%s: %ux%u in the SOF, %dx%d encoded", what, index.width, index.height, width, height);
+}
+
+// Decodes with libjpeg, as in decodetest; NULL if libjpeg warned about the data, e.g. a restart marker out of place
+static uint8_t *libjpeg_decode(const uint8_t *jpg, size_t len, int *width, int *height)
+{
+    struct jpeg_decompress_struct cinfo;
+    struct jpeg_error_mgr jerr;
+    cinfo.err = jpeg_std_error(&jerr);
+    jpeg_create_decompress(&cinfo);
+    jpeg_mem_src(&cinfo, (unsigned char *)jpg, len);
+    jpeg_read_header(&cinfo, TRUE);
+    cinfo.dct_method = JDCT_ISLOW;
+    jpeg_start_decompress(&cinfo);
+    *width = cinfo.output_width;
+    *height = cinfo.output_height;
+    const int row_len = cinfo.output_width * cinfo.output_components;
+    uint8_t *out = (uint8_t *)malloc((size_t)row_len * *height);
+    while (cinfo.output_scanline < cinfo.output_height) {
+        JSAMPROW row = (JSAMPROW)(out + (size_t)cinfo.output_scanline * row_len);
+        jpeg_read_scanlines(&cinfo, &row, 1);
+    }
+    jpeg_finish_decompress(&cinfo);
+    jpeg_destroy_decompress(&cinfo);
+    if (jerr.num_warnings) {
+        free(out);
+        return NULL;
+    }
+    return out;
+}
+
+// Two pass tables and threads only change how the same coefficients are coded: libjpeg has to decode the
+// output to the same pixels as the default encode, without a warning
+static void check_same_decode(const char *what, const grow_stream &variant, const uint8_t *src, int width, int height, int channels, int quality)
+{
+    jpge::params params;
+    encoder_params(&params, channels, VARIANT_DEFAULT, quality);
+    grow_stream reference;
+    encode_frame(&reference, src, width, height, channels, params);
+    int rw, rh, vw, vh;
+    uint8_t *ref = libjpeg_decode(reference.data, reference.len, &rw, &rh);
+    uint8_t *dec = libjpeg_decode(variant.data, variant.len, &vw, &vh);
+    CHECK(ref, "%s: libjpeg warns about the default encode", what);
+    CHECK(dec, "%s: libjpeg warns about the output", what);
+    if (ref && dec) {
+        CHECK(vw == rw && vh == rh && !memcmp(dec, ref, (size_t)rw * rh * (channels == 1 ? 1 : 3)),
+              "%s: libjpeg decodes it to other pixels than the default encode", what);
+    }
+    free(ref);
+    free(dec);
+}
+
+// get_header_size() has to be where jpg_index() finds the coded data start, whatever the tables
+static void check_header_size(const char *what, const grow_stream &out, const uint8_t *src, int width, int height, int channels, const jpge::params &params)
+{
+    jpge::jpeg_encoder enc;
+    grow_stream again;
+    jpg_index_t index;
+    bool ok = enc.init(&again, width, height, channels, params);
+    for (jpge::uint pass = 0; ok && pass < enc.get_total_passes(); pass++) {
+        ok = enc.process_frame(src, width * channels);
+    }
+    CHECK(ok && jpg_index(out.data, out.len, &index) && enc.get_header_size() == index.scan_offset,
+          "%s: get_header_size() is %u, the scan starts at %u", what, enc.get_header_size(), (unsigned)index.scan_offset);
+}
+
+static void check_encoder(uint8_t *src)
+{
+    static uint8_t rgb[MAX_WIDTH * MAX_HEIGHT * 3];
+    char what[96];
+
+    for (int s = 0; s < SIZE_COUNT; s++) {
+        int width = s_sizes[s][0], height = s_sizes[s][1];
+        make_image(rgb, width, height, 1);
+        for (int channels = 1; channels <= 3; channels++) {
+            make_source(src, rgb, width, height, channels);
+            for (int v = 0; v < VARIANT_COUNT; v++) {
+                for (int q = 0; q < QUALITY_COUNT; q++) {
+                    snprintf(what, sizeof(what), "%dx%d, %d channels, %s, quality %d", width, height, channels, s_variant_names[v], s_qualities[q]);
+                    jpge::params params;
+                    encoder_params(&params, channels, v, s_qualities[q]);
+                    grow_stream lines, frame;
+                    CHECK(encode_scanlines(&lines, src, width, height, channels, params), "%s: process_scanline() failed", what);
+                    CHECK(encode_frame(&frame, src, width, height, channels, params), "%s: process_frame() failed", what);
+                    check_jpeg(what, lines.data, lines.len, width, height);
+                    CHECK(lines.len == frame.len && !memcmp(lines.data, frame.data, lines.len), "%s: process_frame() output differs", what);
+                    uint64_t hash = test_hash(lines.data, lines.len);
+                    CHECK(hash == s_encoder_hashes[s][channels - 1][v][q], "%s: hash 0x%016llxULL, %u bytes", what, (unsigned long long)hash, (unsigned)lines.len);
+                    if (v != VARIANT_DEFAULT) {
+                        check_same_decode(what, lines, src, width, height, channels, s_qualities[q]);
+                    }
+                    check_header_size(what, lines, src, width, height, channels, params);
+                }
+            }
+        }
+    }
+
+    // 2 is YUYV, there is nothing with more channels
+    for (int channels = 0; channels <= 4; channels += 4) {
+        jpge::jpeg_encoder enc;
+        grow_stream out;
+        CHECK(!enc.init(&out, s_sizes[0][0], s_sizes[0][1], channels, jpge::params()), "%d channels accepted", channels);
+    }
+}
+
+static void check_fmt2jpg(uint8_t *src)
+{
+    static uint8_t rgb[MAX_WIDTH * MAX_HEIGHT * 3];
+    char what[96];
+
+    for (int s = 0; s < SIZE_COUNT; s++) {
+        int width = s_sizes[s][0], height = s_sizes[s][1];
+        make_image(rgb, width, height, 2);
+        for (int f = 0; f < FORMAT_COUNT; f++) {
+            snprintf(what, sizeof(what), "fmt2jpg() %dx%d %s", width, height, s_format_names[f]);
+            size_t src_len = make_frame(src, rgb, width, height, s_formats[f]);
+            uint8_t *out = NULL;
+            size_t out_len = 0;
+            CHECK(fmt2jpg(src, src_len, width, height, s_formats[f], 75, &out, &out_len), "%s failed", what);
+            if (!out) {
+                continue;
+            }
+            check_jpeg(what, out, out_len, width, height);
+            uint64_t hash = test_hash(out, out_len);
+            CHECK(hash == s_fmt2jpg_hashes[s][f], "%s: hash 0x%016llxULL, %u bytes", what, (unsigned long long)hash, (unsigned)out_len);
+            free(out);
+        }
+    }
+}
+
+// Callback output into a buffer allocated up front
+typedef struct {
+    uint8_t *data;
+    size_t len, size;
+} cb_buf_t;
+
+static size_t buf_cb(void *arg, size_t index, const void *data, size_t len)
+{
+    cb_buf_t *out = (cb_buf_t *)arg;
+    if (!data || index + len > out->size) {
+        return 0;
+    }
+    memcpy(out->data + index, data, len);
+    out->len = index + len;
+    return len;
+}
+
+// Frames of every format, size and quality through one context: nothing is allocated after the first frame
+static void check_ctx_allocations(uint8_t *src)
+{
+    static uint8_t rgb[MAX_WIDTH * MAX_HEIGHT * 3];
+    static const int sizes[][2] = { { 640, 480 }, { 37, 21 }, { 320, 240 }, { 800, 600 } };
+    char what[96];
+
+    jpg_encoder_ctx_t *ctx = jpg_encoder_ctx_create(MAX_WIDTH, MAX_HEIGHT, 512 * 1024);
+    CHECK(ctx, "jpg_encoder_ctx_create() failed");
+    cb_buf_t cb_out = { (uint8_t *)malloc(512 * 1024), 0, 512 * 1024 };
+    uint8_t **refs = (uint8_t **)malloc(CTX_FRAMES * sizeof(uint8_t *));
+    size_t *ref_lens = (size_t *)malloc(CTX_FRAMES * sizeof(size_t));
+    if (!ctx) {
+        return;
+    }
+
+    // what fmt2jpg() makes of each frame, and a first frame through the context
+    make_image(rgb, MAX_WIDTH, MAX_HEIGHT, 4);
+    for (int n = 0; n < CTX_FRAMES; n++) {
+        int f = n % FORMAT_COUNT, w = sizes[n % 4][0], h = sizes[n % 4][1];
+        size_t src_len = make_frame(src, rgb, w, h, s_formats[f]);
+        fmt2jpg(src, src_len, w, h, s_formats[f], 30 + n * 3, &refs[n], &ref_lens[n]);
+    }
+    uint8_t *out;
+    size_t out_len;
+    size_t src_len = make_frame(src, rgb, MAX_WIDTH, MAX_HEIGHT, PIXFORMAT_RGB565);
+    CHECK(fmt2jpg_ctx(ctx, src, src_len, MAX_WIDTH, MAX_HEIGHT, PIXFORMAT_RGB565, 80, &out, &out_len), "first fmt2jpg_ctx() failed");
+
+    for (int n = 0; n < CTX_FRAMES; n++) {
+        int f = n % FORMAT_COUNT, w = sizes[n % 4][0], h = sizes[n % 4][1];
+        src_len = make_frame(src, rgb, w, h, s_formats[f]);
+        snprintf(what, sizeof(what), "frame %d, %dx%d %s", n, w, h, s_format_names[f]);
+
+        int allocs = s_allocs;
+        bool ok = fmt2jpg_ctx(ctx, src, src_len, w, h, s_formats[f], 30 + n * 3, &out, &out_len);
+        allocs = s_allocs - allocs;
+        CHECK(ok, "%s: fmt2jpg_ctx() failed", what);
+        CHECK(!allocs, "%s: fmt2jpg_ctx() made %d allocations", what, allocs);
+        CHECK(ok && out_len == ref_lens[n] && !memcmp(out, refs[n], out_len), "%s: fmt2jpg_ctx() output differs from fmt2jpg()", what);
+
+        cb_out.len = 0;
+        allocs = s_allocs;
+        ok = fmt2jpg_cb_ctx(ctx, src, src_len, w, h, s_formats[f], 30 + n * 3, buf_cb, &cb_out);
+        allocs = s_allocs - allocs;
+        CHECK(ok, "%s: fmt2jpg_cb_ctx() failed", what);
+        CHECK(!allocs, "%s: fmt2jpg_cb_ctx() made %d allocations", what, allocs);
+        CHECK(ok && cb_out.len == ref_lens[n] && !memcmp(cb_out.data, refs[n], cb_out.len), "%s: fmt2jpg_cb_ctx() output differs from fmt2jpg()", what);
+    }
+
+    // too large a frame is refused, still without allocating
+    esp_log_level_t level = sim_log_level;
+    sim_log_level = ESP_LOG_NONE;
+    int allocs = s_allocs;
+    CHECK(!fmt2jpg_ctx(ctx, src, src_len, MAX_WIDTH + 1, 8, PIXFORMAT_GRAYSCALE, 80, &out, &out_len), "frame wider than the context accepted");
+    CHECK(s_allocs == allocs, "refusing a frame allocated");
+    sim_log_level = level;
+
+    for (int n = 0; n < CTX_FRAMES; n++) {
+        free(refs[n]);
+    }
+    free(refs);
+    free(ref_lens);
+    free(cb_out.data);
+    jpg_encoder_ctx_free(ctx);
+}
+
+// Output into a buffer allocated up front
+class fixed_stream : public jpge::output_stream {
+public:
+    uint8_t *data;
+    size_t len, size;
+
+    fixed_stream(uint8_t *buf, size_t buf_size) : data(buf), len(0), size(buf_size) { }
+
+    virtual bool put_buf(const void *buf, int n)
+    {
+        if (!buf) {
+            return true;
+        }
+        if (len + n > size) {
+            return false;
+        }
+        memcpy(data + len, buf, n);
+        len += n;
+        return true;
+    }
+
+    virtual jpge::uint get_size() const
+    {
+        return len;
+    }
+};
+
+// jpeg_encoder on an arena, with worker threads and two passes: the threads are kept, nothing is allocated
+static void check_arena_allocations(uint8_t *src)
+{
+    static uint8_t rgb[MAX_WIDTH * MAX_HEIGHT * 3];
+    jpge::params params;
+    encoder_params(&params, 3, VARIANT_THREADS, 75);
+    params.m_two_pass_flag = true;
+    jpge::uint arena_len = jpge::jpeg_encoder::get_arena_size(MAX_WIDTH, MAX_HEIGHT, 3, params);
+    void *arena = malloc(arena_len);
+    uint8_t *out = (uint8_t *)malloc(512 * 1024);
+    jpge::jpeg_encoder *enc = new jpge::jpeg_encoder;
+    enc->set_arena(arena, arena_len);
+
+    make_image(rgb, MAX_WIDTH, MAX_HEIGHT, 5);
+    make_source(src, rgb, MAX_WIDTH, MAX_HEIGHT, 3);
+    for (int n = 0; n < CTX_FRAMES; n++) {
+        int allocs = s_allocs;
+        fixed_stream stream(out, 512 * 1024);
+        bool ok = enc->init(&stream, MAX_WIDTH - (n & 7) * 8, MAX_HEIGHT - n, 3, params);
+        for (jpge::uint pass = 0; ok && pass < enc->get_total_passes(); pass++) {
+            ok = enc->process_frame(src, MAX_WIDTH * 3);
+        }
+        allocs = s_allocs - allocs;
+        CHECK(ok, "arena frame %d failed", n);
+        // the first frame starts the worker threads
+        CHECK(!n || !allocs, "arena frame %d made %d allocations", n, allocs);
+    }
+    delete enc;
+    free(out);
+    free(arena);
+}
+
+// Frame n of a slow pan, 4 pixels a frame, across a scene twice as wide as the frame, with fresh sensor noise
+// in every frame
+static size_t make_pan_frame(uint8_t *dst, const uint8_t *scene, int width, int height, int n, pixformat_t format)
+{
+    static uint8_t rgb[MAX_WIDTH * MAX_HEIGHT * 3];
+    uint32_t seed = 100 + n;
+    for (int y = 0; y < height; y++) {
+        const uint8_t *row = scene + (y * width * 2 + n * 4) * 3;
+        for (int i = 0; i < width * 3; i++) {
+            int v = row[i] + (int)(test_rand(&seed) % 9) - 4;
+            rgb[y * width * 3 + i] = v < 0 ? 0 : v > 255 ? 255 : v;
+        }
+    }
+    return make_frame(dst, rgb, width, height, format);
+}
+
+// One of the encoders of check_concurrent(), with the output it has to give
+typedef struct {
+    const char *name;
+    int channels;
+    jpge::subsampling_t subsampling;
+    int quality;
+    bool two_pass;
+    uint8_t *src;
+    grow_stream alone;
+    int failed, differed;
+} concurrent_enc_t;
+
+static void concurrent_params(const concurrent_enc_t *e, jpge::params *params)
+{
+    *params = jpge::params();
+    params->m_quality = e->quality;
+    params->m_subsampling = e->subsampling;
+    params->m_two_pass_flag = e->two_pass;
+}
+
+static void *concurrent_main(void *arg)
+{
+    concurrent_enc_t *e = (concurrent_enc_t *)arg;
+    jpge::params params;
+    concurrent_params(e, &params);
+    for (int n = 0; n < CONCURRENT_FRAMES; n++) {
+        grow_stream out;
+        if (!encode_frame(&out, e->src, s_sizes[1][0], s_sizes[1][1], e->channels, params)) {
+            e->failed++;
+        } else if (out.len != e->alone.len || memcmp(out.data, e->alone.data, out.len)) {
+            e->differed++;
+        }
+    }
+    return NULL;
+}
+
+// Two jpeg_encoders with different quality, subsampling and Huffman tables on their own threads at the same
+// time: every frame has to be what the same encode gives alone
+static void check_concurrent(void)
+{
+    static uint8_t rgb[MAX_WIDTH * MAX_HEIGHT * 3];
+    // small frames, so that the threads often set up an encoder at the same time
+    const int width = s_sizes[1][0], height = s_sizes[1][1];
+    concurrent_enc_t encs[2] = {
+        { "RGB H2V2, quality 90, two pass", 3, jpge::H2V2, 90, true, NULL, grow_stream(), 0, 0 },
+        { "YUYV H1V1, quality 20", 2, jpge::H1V1, 20, false, NULL, grow_stream(), 0, 0 },
+    };
+    pthread_t threads[2];
+    for (int i = 0; i < 2; i++) {
+        concurrent_enc_t *e = &encs[i];
+        jpge::params params;
+        make_image(rgb, width, height, 13 + i);
+        e->src = (uint8_t *)malloc(width * height * 3);
+        make_source(e->src, rgb, width, height, e->channels);
+        concurrent_params(e, &params);
+        CHECK(encode_frame(&e->alone, e->src, width, height, e->channels, params), "%s: encode failed", e->name);
+    }
+    for (int i = 0; i < 2; i++) {
+        pthread_create(&threads[i], NULL, concurrent_main, &encs[i]);
+    }
+    for (int i = 0; i < 2; i++) {
+        concurrent_enc_t *e = &encs[i];
+        pthread_join(threads[i], NULL);
+        CHECK(!e->failed && !e->differed, "%s: next to the other encoder %d of %d frames failed, %d differ from the encode alone",
+              e->name, e->failed, CONCURRENT_FRAMES, e->differed);
+        free(e->src);
+    }
+}
+
+// process_lines() with more rows than the image has left is refused, before or after the image is complete,
+// instead of coding MCU rows past its end
+static void check_extra_rows(uint8_t *src)
+{
+    static uint8_t out[512 * 1024];
+    for (int channels = 1; channels <= 3; channels++) {
+        jpge::params params;
+        encoder_params(&params, channels, VARIANT_DEFAULT, 75);
+        const int mcu_h = params.m_subsampling == jpge::H2V2 ? 16 : 8;
+        for (int done = 0; done <= 64; done += 64) {
+            jpge::jpeg_encoder enc;
+            fixed_stream stream(out, sizeof(out));
+            CHECK(enc.init(&stream, 64, 64, channels, params), "%d channels: init failed", channels);
+            if (done) {
+                CHECK(enc.process_lines(src, 64 * channels, done), "%d channels: the 64 rows of the image refused", channels);
+            }
+            CHECK(!enc.process_lines(src + done * 64 * channels, 64 * channels, 64 - done + mcu_h),
+                  "%d channels, %d rows done: %d more rows than the image has accepted", channels, done, mcu_h);
+            // the header and the 64x64 image at most, not MCU rows past it
+            CHECK(stream.len < 64 * 64 * 3, "%d channels, %d rows done: %u bytes coded", channels, done, (unsigned)stream.len);
+        }
+    }
+}
+
+// m_scale: the JPEG is the source size divided and rounded up; where the scale divides it, the result is the
+// same as encoding the fmt2resized() box filtered image
+static void check_scaled(uint8_t *src)
+{
+    static const pixformat_t formats[] = { PIXFORMAT_GRAYSCALE, PIXFORMAT_YUV422, PIXFORMAT_RGB888 };
+    static uint8_t rgb[MAX_WIDTH * MAX_HEIGHT * 3], resized[MAX_WIDTH * MAX_HEIGHT * 3];
+    char what[96];
+    for (int s = 0; s < SIZE_COUNT; s++) {
+        int width = s_sizes[s][0], height = s_sizes[s][1];
+        make_image(rgb, width, height, 11);
+        for (int channels = 1; channels <= 3; channels++) {
+            make_source(src, rgb, width, height, channels);
+            for (int scale = 2; scale <= 4; scale *= 2) {
+                int out_w = (width + scale - 1) / scale, out_h = (height + scale - 1) / scale;
+                snprintf(what, sizeof(what), "%dx%d, %d channels, 1/%d", width, height, channels, scale);
+                jpge::params params;
+                encoder_params(&params, channels, VARIANT_DEFAULT, 75);
+                grow_stream direct, reference;
+                params.m_scale = scale;
+                CHECK(encode_frame(&direct, src, width, height, channels, params), "%s: encode failed", what);
+                check_jpeg(what, direct.data, direct.len, out_w, out_h);
+                if (width % scale || height % scale) {
+                    continue;
+                }
+                params.m_scale = 1;
+                CHECK(fmt2resized(src, width * height * channels, width, height, formats[channels - 1], NULL, out_w, out_h, IMG_RESIZE_BOX, resized),
+                      "%s: fmt2resized() failed", what);
+                CHECK(encode_frame(&reference, resized, out_w, out_h, channels, params), "%s: encode of the resized image failed", what);
+                CHECK(direct.len == reference.len && !memcmp(direct.data, reference.data, direct.len), "%s: differs from encoding the resized image", what);
+            }
+        }
+    }
+}
+
+// fmt2jpg_rc() over a pan at several budgets: the third frame is within RC_EARLY_TOLERANCE of the budget, the
+// ones after it within RC_TOLERANCE
+static void check_rate_control(uint8_t *src)
+{
+    static const int sizes[][2] = { { 320, 240 }, { 640, 480 } };
+    static const size_t budgets[] = { 4000, 8000, 16000, 32000, 64000 };
+    static uint8_t scene[MAX_WIDTH * 2 * MAX_HEIGHT * 3];
+    for (int s = 0; s < 2; s++) {
+        int w = sizes[s][0], h = sizes[s][1];
+        make_image(scene, w * 2, h, 9);
+        for (int f = 0; f < FORMAT_COUNT; f++) {
+            for (size_t b = 0; b < sizeof(budgets) / sizeof(budgets[0]); b++) {
+                jpg_rate_ctrl_t rc;
+                jpg_rate_ctrl_init(&rc, budgets[b] * w * h / (320 * 240));
+                for (int n = 0; n < RC_FRAMES; n++) {
+                    uint8_t *out;
+                    size_t out_len;
+                    size_t src_len = make_pan_frame(src, scene, w, h, n, s_formats[f]);
+                    bool ok = fmt2jpg_rc(src, src_len, w, h, s_formats[f], &rc, &out, &out_len);
+                    CHECK(ok, "%dx%d %s, budget %u: frame %d failed", w, h, s_format_names[f], (unsigned)rc.target_len, n);
+                    if (!ok) {
+                        break;
+                    }
+                    jpg_index_t index;
+                    CHECK(jpg_index(out, out_len, &index) && rc.header_len == index.scan_offset, "%dx%d %s, budget %u: frame %d has a %u byte header, rate control took %u",
+                          w, h, s_format_names[f], (unsigned)rc.target_len, n, (unsigned)index.scan_offset, (unsigned)rc.header_len);
+                    free(out);
+                    // past the quality limits the budget cannot be met, only the direction is checked
+                    float err = ((float)out_len - rc.target_len) / rc.target_len;
+                    float tol = (n < RC_SETTLED) ? RC_EARLY_TOLERANCE : RC_TOLERANCE;
+                    if (rc.quality == rc.max_quality && err < 0) {
+                        err = 0;
+                    } else if (rc.quality == rc.min_quality && err > 0) {
+                        err = 0;
+                    }
+                    CHECK(n < 2 || fabsf(err) <= tol, "%dx%d %s, budget %u: frame %d is %u bytes at quality %d", w, h, s_format_names[f],
+                          (unsigned)rc.target_len, n, (unsigned)out_len, rc.quality);
+                }
+            }
+        }
+    }
+}
+
+// Encodes an SVGA frame over and over, returns the input MB/s and the output MB/s in *out_mbs
+static double bench_encoder(const uint8_t *src, int channels, int variant, double seconds, double *out_mbs)
+{
+    jpge::params params;
+    encoder_params(&params, channels, variant, 75);
+    size_t in = 0, out = 0;
+    double start = test_now(), t;
+    do {
+        grow_stream stream;
+        encode_frame(&stream, src, MAX_WIDTH, MAX_HEIGHT, channels, params);
+        in += MAX_WIDTH * MAX_HEIGHT * channels;
+        out += stream.len;
+    } while ((t = test_now() - start) < seconds);
+    *out_mbs = out / t / 1e6;
+    return in / t / 1e6;
+}
+
+// The same for a YUYV frame taken through RGB first, a row at a time, as fmt2jpg() did before the encoder took YUYV
+static double bench_yuyv_via_rgb(const uint8_t *src, int variant, double seconds, double *out_mbs)
+{
+    static uint8_t line[MAX_WIDTH * 3];
+    jpge::params params;
+    encoder_params(&params, 2, variant, 75);
+    size_t in = 0, out = 0;
+    double start = test_now(), t;
+    do {
+        grow_stream stream;
+        jpge::jpeg_encoder enc;
+        enc.init(&stream, MAX_WIDTH, MAX_HEIGHT, 3, params);
+        for (jpge::uint pass = 0; pass < enc.get_total_passes(); pass++) {
+            for (int y = 0; y < MAX_HEIGHT; y++) {
+                yuv422_to_rgb888_row(src + y * MAX_WIDTH * 2, line, MAX_WIDTH);
+                enc.process_scanline(line);
+            }
+            enc.process_scanline(NULL);
+        }
+        in += MAX_WIDTH * MAX_HEIGHT * 2;
+        out += stream.len;
+    } while ((t = test_now() - start) < seconds);
+    *out_mbs = out / t / 1e6;
+    return in / t / 1e6;
+}
+
+// ms per SVGA frame encoded 1 / scale in each direction, by the encoder (m_scale) or resized with fmt2resized()
+// first and encoded at that size. *memory gets the encoder's working memory plus any resized copy, *out_len the
+// size of the JPEG.
+static double bench_scaled(const uint8_t *src, int channels, int scale, bool resize_first, double seconds, size_t *memory, size_t *out_len)
+{
+    static const pixformat_t formats[] = { PIXFORMAT_GRAYSCALE, PIXFORMAT_YUV422, PIXFORMAT_RGB888 };
+    static uint8_t resized[MAX_WIDTH * MAX_HEIGHT * 3];
+    const int out_w = (MAX_WIDTH + scale - 1) / scale, out_h = (MAX_HEIGHT + scale - 1) / scale;
+    jpge::params params;
+    encoder_params(&params, channels, VARIANT_DEFAULT, 75);
+    if (resize_first) {
+        *memory = jpge::jpeg_encoder::get_arena_size(out_w, out_h, channels, params) + out_w * out_h * channels;
+    } else {
+        params.m_scale = scale;
+        *memory = jpge::jpeg_encoder::get_arena_size(MAX_WIDTH, MAX_HEIGHT, channels, params);
+    }
+    int frames = 0;
+    double start = test_now(), t;
+    do {
+        grow_stream stream;
+        if (resize_first) {
+            fmt2resized(src, MAX_WIDTH * MAX_HEIGHT * channels, MAX_WIDTH, MAX_HEIGHT, formats[channels - 1], NULL,
+                        out_w, out_h, IMG_RESIZE_BOX, resized);
+            encode_frame(&stream, resized, out_w, out_h, channels, params);
+        } else {
+            encode_frame(&stream, src, MAX_WIDTH, MAX_HEIGHT, channels, params);
+        }
+        *out_len = stream.len;
+        frames++;
+    } while ((t = test_now() - start) < seconds);
+    return t * 1e3 / frames;
+}
+
+int main(int argc, char *argv[])
+{
+    double seconds = argc > 1 ? atof(argv[1]) : 0;
+    uint8_t *src = (uint8_t *)malloc(MAX_WIDTH * MAX_HEIGHT * 3);
+
+    check_encoder(src);
+    check_fmt2jpg(src);
+    check_ctx_allocations(src);
+    check_arena_allocations(src);
+    check_concurrent();
+    check_extra_rows(src);
+    check_scaled(src);
+    check_rate_control(src);
+
+    if (seconds > 0) {
+        static uint8_t rgb[MAX_WIDTH * MAX_HEIGHT * 3];
+        make_image(rgb, MAX_WIDTH, MAX_HEIGHT, 3);
+        for (int channels = 1; channels <= 3; channels++) {
+            make_source(src, rgb, MAX_WIDTH, MAX_HEIGHT, channels);
+            for (int v = 0; v < VARIANT_COUNT; v++) {
+                double out_mbs, in_mbs = bench_encoder(src, channels, v, seconds, &out_mbs);
+                printf("%dx%d %-5s %-10s %8.1f MB/s in %8.1f MB/s out\n", MAX_WIDTH, MAX_HEIGHT,
+                       channels == 1 ? "Y" : channels == 2 ? "YUYV" : "RGB", s_variant_names[v], in_mbs, out_mbs);
+            }
+        }
+        make_source(src, rgb, MAX_WIDTH, MAX_HEIGHT, 2);
+        for (int v = 0; v < VARIANT_COUNT; v++) {
+            double out_mbs, in_mbs = bench_yuyv_via_rgb(src, v, seconds, &out_mbs);
+            printf("%dx%d %-5s %-10s %8.1f MB/s in %8.1f MB/s out, through RGB\n", MAX_WIDTH, MAX_HEIGHT, "YUYV",
+                   s_variant_names[v], in_mbs, out_mbs);
+        }
+
+        for (int channels = 1; channels <= 3; channels++) {
+            make_source(src, rgb, MAX_WIDTH, MAX_HEIGHT, channels);
+            size_t memory, out_len;
+            double full_ms = 0;
+            for (int scale = 1; scale <= 4; scale *= 2) {
+                for (int resize_first = 0; resize_first <= (scale > 1); resize_first++) {
+                    double ms = bench_scaled(src, channels, scale, resize_first, seconds, &memory, &out_len);
+                    if (scale == 1) {
+                        full_ms = ms;
+                    }
+                    printf("%dx%d %-5s 1/%d %-22s %7.2f ms %5.2fx %7u bytes memory %7u bytes out\n", MAX_WIDTH, MAX_HEIGHT,
+                           channels == 1 ? "Y" : channels == 2 ? "YUYV" : "RGB", scale, resize_first ? "fmt2resized() first" : "in the encoder",
+                           ms, full_ms / ms, (unsigned)memory, (unsigned)out_len);
+                }
+            }
+        }
+    }
+    free(src);
+    return test_done("enctest");
+}
@@ -0,0 +1,251 @@
+// The ESP32 peripherals and IDF services the camera driver uses, for the host build.
+// GPIO and I2S interrupts run on the thread that raises them, which is the sensor thread.
+#include <errno.h>
+#include <stdlib.h>
+#include <time.h>
+#include "driver/gpio.h"
+#include "driver/ledc.h"
+#include "esp_intr_alloc.h"
+#include "esp_log.h"
+#include "esp_system.h"
+#include "nvs.h"
+#include "soc/i2s_struct.h"
+#include "sim.h"
+
+struct intr_handle_data_t {
+    int source;
+    intr_handler_t handler;
+    void *arg;
+    volatile bool enabled;
+};
+
+i2s_dev_t I2S0;
+gpio_dev_t GPIO;
+esp_log_level_t sim_log_level = ESP_LOG_WARN;
+
+static struct timespec s_boot;
+static intr_handle_t s_i2s_intr;
+static bool s_gpio_isr_service;
+static volatile gpio_int_type_t s_gpio_intr_type[GPIO_PIN_COUNT];
+static volatile gpio_isr_t s_gpio_isr[GPIO_PIN_COUNT];
+static void * volatile s_gpio_isr_arg[GPIO_PIN_COUNT];
+
+__attribute__((constructor)) static void boot(void)
+{
+    clock_gettime(CLOCK_MONOTONIC, &s_boot);
+}
+
+int64_t esp_timer_get_time(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)(ts.tv_sec - s_boot.tv_sec) * 1000000 + (ts.tv_nsec - s_boot.tv_nsec) / 1000;
+}
+
+void sim_spin_us(uint32_t us)
+{
+    int64_t end = esp_timer_get_time() + us;
+    while (esp_timer_get_time() < end) {
+        ;
+    }
+}
+
+void sim_sleep_until(int64_t us)
+{
+    struct timespec ts;
+    int64_t ns = (int64_t)s_boot.tv_nsec + (us % 1000000) * 1000;
+    ts.tv_sec = s_boot.tv_sec + us / 1000000 + ns / 1000000000;
+    ts.tv_nsec = ns % 1000000000;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+        ;
+    }
+}
+
+esp_err_t esp_intr_alloc(int source, int flags, intr_handler_t handler, void *arg, intr_handle_t *ret_handle)
+{
+    if (source != ETS_I2S0_INTR_SOURCE || s_i2s_intr) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    intr_handle_t h = (intr_handle_t)calloc(1, sizeof(*h));
+    if (!h) {
+        return ESP_ERR_NO_MEM;
+    }
+    h->source = source;
+    h->handler = handler;
+    h->arg = arg;
+    h->enabled = !(flags & ESP_INTR_FLAG_INTRDISABLED);
+    s_i2s_intr = h;
+    if (ret_handle) {
+        *ret_handle = h;
+    }
+    return ESP_OK;
+}
+
+esp_err_t esp_intr_free(intr_handle_t handle)
+{
+    if (handle == s_i2s_intr) {
+        s_i2s_intr = NULL;
+    }
+    free(handle);
+    return ESP_OK;
+}
+
+esp_err_t esp_intr_enable(intr_handle_t handle)
+{
+    handle->enabled = true;
+    return ESP_OK;
+}
+
+esp_err_t esp_intr_disable(intr_handle_t handle)
+{
+    handle->enabled = false;
+    return ESP_OK;
+}
+
+void sim_i2s_poll(void)
+{
+    // int_clr is write-1-to-clear, apply whatever the driver wrote since the last look
+    uint32_t clr = I2S0.int_clr.val;
+    if (clr) {
+        I2S0.int_clr.val = 0;
+        I2S0.int_raw.val &= ~clr;
+    }
+    intr_handle_t h = s_i2s_intr;
+    if (h && h->enabled && (I2S0.int_raw.val & I2S0.int_ena.val)) {
+        h->handler(h->arg);
+        clr = I2S0.int_clr.val;
+        I2S0.int_clr.val = 0;
+        I2S0.int_raw.val &= ~clr;
+    }
+}
+
+void sim_i2s_in_done(void)
+{
+    I2S0.int_raw.in_done = 1;
+    sim_i2s_poll();
+}
+
+esp_err_t gpio_config(const gpio_config_t *config)
+{
+    for (int i = 0; i < GPIO_PIN_COUNT; i++) {
+        if (config->pin_bit_mask & (1ULL << i)) {
+            s_gpio_intr_type[i] = config->intr_type;
+        }
+    }
+    return ESP_OK;
+}
+
+esp_err_t gpio_set_level(gpio_num_t gpio_num, uint32_t level)
+{
+    return (gpio_num >= 0 && gpio_num < GPIO_PIN_COUNT) ? ESP_OK : ESP_ERR_INVALID_ARG;
+}
+
+esp_err_t gpio_set_intr_type(gpio_num_t gpio_num, gpio_int_type_t intr_type)
+{
+    if (gpio_num < 0 || gpio_num >= GPIO_PIN_COUNT) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    s_gpio_intr_type[gpio_num] = intr_type;
+    return ESP_OK;
+}
+
+esp_err_t gpio_install_isr_service(int intr_alloc_flags)
+{
+    if (s_gpio_isr_service) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    s_gpio_isr_service = true;
+    return ESP_OK;
+}
+
+esp_err_t gpio_isr_handler_add(gpio_num_t gpio_num, gpio_isr_t isr_handler, void *args)
+{
+    if (!s_gpio_isr_service) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (gpio_num < 0 || gpio_num >= GPIO_PIN_COUNT) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    s_gpio_isr_arg[gpio_num] = args;
+    s_gpio_isr[gpio_num] = isr_handler;
+    return ESP_OK;
+}
+
+esp_err_t gpio_isr_handler_remove(gpio_num_t gpio_num)
+{
+    if (gpio_num < 0 || gpio_num >= GPIO_PIN_COUNT) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    s_gpio_isr[gpio_num] = NULL;
+    return ESP_OK;
+}
+
+void gpio_matrix_in(uint32_t gpio, uint32_t signal_idx, int inv)
+{
+}
+
+void sim_gpio_input(gpio_num_t gpio_num, int level)
+{
+    uint32_t bit = 1U << (gpio_num & 31);
+    volatile uint32_t *in = (gpio_num < 32) ? &GPIO.in : &GPIO.in1.val;
+    int old = (*in & bit) != 0;
+    if (level) {
+        *in |= bit;
+    } else {
+        *in &= ~bit;
+    }
+
+    gpio_int_type_t type = s_gpio_intr_type[gpio_num];
+    gpio_isr_t isr = s_gpio_isr[gpio_num];
+    bool edge = (type == GPIO_INTR_ANYEDGE && old != level)
+                || (type == GPIO_INTR_POSEDGE && !old && level)
+                || (type == GPIO_INTR_NEGEDGE && old && !level);
+    if (!edge || !isr) {
+        return;
+    }
+    volatile uint32_t *status = (gpio_num < 32) ? &GPIO.status : &GPIO.status1.val;
+    volatile uint32_t *status_w1tc = (gpio_num < 32) ? &GPIO.status_w1tc : &GPIO.status1_w1tc.val;
+    *status |= bit;
+    isr(s_gpio_isr_arg[gpio_num]);
+    *status &= ~*status_w1tc;
+    *status_w1tc = 0;
+}
+
+esp_err_t ledc_timer_config(const ledc_timer_config_t *timer_conf)
+{
+    return ESP_OK;
+}
+
+esp_err_t ledc_channel_config(const ledc_channel_config_t *ledc_conf)
+{
+    return ESP_OK;
+}
+
+esp_err_t nvs_open(const char *name, nvs_open_mode_t open_mode, nvs_handle_t *out_handle)
+{
+    return ESP_ERR_NVS_NOT_FOUND;
+}
+
+void nvs_close(nvs_handle_t handle)
+{
+}
+
+esp_err_t nvs_set_blob(nvs_handle_t handle, const char *key, const void *value, size_t length)
+{
+    return ESP_ERR_NVS_NOT_FOUND;
+}
+
+esp_err_t nvs_get_blob(nvs_handle_t handle, const char *key, void *out_value, size_t *length)
+{
+    return ESP_ERR_NVS_NOT_FOUND;
+}
+
+esp_err_t nvs_set_u8(nvs_handle_t handle, const char *key, uint8_t value)
+{
+    return ESP_ERR_NVS_NOT_FOUND;
+}
+
+esp_err_t nvs_get_u8(nvs_handle_t handle, const char *key, uint8_t *out_value)
+{
+    return ESP_ERR_NVS_NOT_FOUND;
+}
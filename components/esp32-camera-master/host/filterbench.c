@@ -0,0 +1,334 @@
+// filterbench: checks the driver's DMA filters against the byte by byte filters they replaced and measures them.
+//
+// Every filter runs on random DMA words, unused bytes included, for buffer lengths that hit each loop tail and
+// for all four alignments of the frame buffer. Its output and the bytes around it have to match the reference.
+// Then each filter copies a UXGA JPEG sized descriptor over and over, reported as DMA bytes per second.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "esp_system.h"
+#include "dma_filter.h"
+
+#define BUF_SIZE    3200        // DMA buffer of a UXGA line quarter in JPEG mode
+#define OUT_SIZE    (BUF_SIZE * 3 / 4 + 64)
+#define GUARD       16
+
+/*
+ * The filters as camera.c had them
+ * */
+
+static void ref_jpeg(const dma_elem_t* src, lldesc_t* dma_desc, uint8_t* dst)
+{
+    size_t end = dma_desc->length / sizeof(dma_elem_t) / 4;
+    // manually unrolling 4 iterations of the loop here
+    for (size_t i = 0; i < end; ++i)
+    {
+        dst[0] = src[0].sample1;
+        dst[1] = src[1].sample1;
+        dst[2] = src[2].sample1;
+        dst[3] = src[3].sample1;
+        src += 4;
+        dst += 4;
+    }
+}
+
+static void ref_grayscale(const dma_elem_t* src, lldesc_t* dma_desc, uint8_t* dst)
+{
+    size_t end = dma_desc->length / sizeof(dma_elem_t) / 4;
+    for (size_t i = 0; i < end; ++i)
+    {
+        // manually unrolling 4 iterations of the loop here
+        dst[0] = src[0].sample1;
+        dst[1] = src[1].sample1;
+        dst[2] = src[2].sample1;
+        dst[3] = src[3].sample1;
+        src += 4;
+        dst += 4;
+    }
+}
+
+static void ref_grayscale_highspeed(const dma_elem_t* src, lldesc_t* dma_desc, uint8_t* dst)
+{
+    size_t end = dma_desc->length / sizeof(dma_elem_t) / 8;
+    for (size_t i = 0; i < end; ++i)
+    {
+        // manually unrolling 4 iterations of the loop here
+        dst[0] = src[0].sample1;
+        dst[1] = src[2].sample1;
+        dst[2] = src[4].sample1;
+        dst[3] = src[6].sample1;
+        src += 8;
+        dst += 4;
+    }
+    // the final sample of a line in SM_0A0B_0B0C sampling mode needs special handling
+    if ((dma_desc->length & 0x7) != 0)
+    {
+        dst[0] = src[0].sample1;
+        dst[1] = src[2].sample1;
+    }
+}
+
+static void ref_yuyv(const dma_elem_t* src, lldesc_t* dma_desc, uint8_t* dst)
+{
+    size_t end = dma_desc->length / sizeof(dma_elem_t) / 4;
+    for (size_t i = 0; i < end; ++i)
+    {
+        dst[0] = src[0].sample1;//y0
+        dst[1] = src[0].sample2;//u
+        dst[2] = src[1].sample1;//y1
+        dst[3] = src[1].sample2;//v
+
+        dst[4] = src[2].sample1;//y0
+        dst[5] = src[2].sample2;//u
+        dst[6] = src[3].sample1;//y1
+        dst[7] = src[3].sample2;//v
+        src += 4;
+        dst += 8;
+    }
+}
+
+static void ref_yuyv_highspeed(const dma_elem_t* src, lldesc_t* dma_desc, uint8_t* dst)
+{
+    size_t end = dma_desc->length / sizeof(dma_elem_t) / 8;
+    for (size_t i = 0; i < end; ++i)
+    {
+        dst[0] = src[0].sample1;//y0
+        dst[1] = src[1].sample1;//u
+        dst[2] = src[2].sample1;//y1
+        dst[3] = src[3].sample1;//v
+
+        dst[4] = src[4].sample1;//y0
+        dst[5] = src[5].sample1;//u
+        dst[6] = src[6].sample1;//y1
+        dst[7] = src[7].sample1;//v
+        src += 8;
+        dst += 8;
+    }
+    if ((dma_desc->length & 0x7) != 0)
+    {
+        dst[0] = src[0].sample1;//y0
+        dst[1] = src[1].sample1;//u
+        dst[2] = src[2].sample1;//y1
+        dst[3] = src[2].sample2;//v
+    }
+}
+
+static void ref_rgb888(const dma_elem_t* src, lldesc_t* dma_desc, uint8_t* dst)
+{
+    size_t end = dma_desc->length / sizeof(dma_elem_t) / 4;
+    uint8_t lb, hb;
+    for (size_t i = 0; i < end; ++i)
+    {
+        hb = src[0].sample1;
+        lb = src[0].sample2;
+        dst[0] = (lb & 0x1F) << 3;
+        dst[1] = (hb & 0x07) << 5 | (lb & 0xE0) >> 3;
+        dst[2] = hb & 0xF8;
+
+        hb = src[1].sample1;
+        lb = src[1].sample2;
+        dst[3] = (lb & 0x1F) << 3;
+        dst[4] = (hb & 0x07) << 5 | (lb & 0xE0) >> 3;
+        dst[5] = hb & 0xF8;
+
+        hb = src[2].sample1;
+        lb = src[2].sample2;
+        dst[6] = (lb & 0x1F) << 3;
+        dst[7] = (hb & 0x07) << 5 | (lb & 0xE0) >> 3;
+        dst[8] = hb & 0xF8;
+
+        hb = src[3].sample1;
+        lb = src[3].sample2;
+        dst[9] = (lb & 0x1F) << 3;
+        dst[10] = (hb & 0x07) << 5 | (lb & 0xE0) >> 3;
+        dst[11] = hb & 0xF8;
+        src += 4;
+        dst += 12;
+    }
+}
+
+static void ref_rgb888_highspeed(const dma_elem_t* src, lldesc_t* dma_desc, uint8_t* dst)
+{
+    size_t end = dma_desc->length / sizeof(dma_elem_t) / 8;
+    uint8_t lb, hb;
+    for (size_t i = 0; i < end; ++i)
+    {
+        hb = src[0].sample1;
+        lb = src[1].sample1;
+        dst[0] = (lb & 0x1F) << 3;
+        dst[1] = (hb & 0x07) << 5 | (lb & 0xE0) >> 3;
+        dst[2] = hb & 0xF8;
+
+        hb = src[2].sample1;
+        lb = src[3].sample1;
+        dst[3] = (lb & 0x1F) << 3;
+        dst[4] = (hb & 0x07) << 5 | (lb & 0xE0) >> 3;
+        dst[5] = hb & 0xF8;
+
+        hb = src[4].sample1;
+        lb = src[5].sample1;
+        dst[6] = (lb & 0x1F) << 3;
+        dst[7] = (hb & 0x07) << 5 | (lb & 0xE0) >> 3;
+        dst[8] = hb & 0xF8;
+
+        hb = src[6].sample1;
+        lb = src[7].sample1;
+        dst[9] = (lb & 0x1F) << 3;
+        dst[10] = (hb & 0x07) << 5 | (lb & 0xE0) >> 3;
+        dst[11] = hb & 0xF8;
+
+        src += 8;
+        dst += 12;
+    }
+    if ((dma_desc->length & 0x7) != 0)
+    {
+        hb = src[0].sample1;
+        lb = src[1].sample1;
+        dst[0] = (lb & 0x1F) << 3;
+        dst[1] = (hb & 0x07) << 5 | (lb & 0xE0) >> 3;
+        dst[2] = hb & 0xF8;
+
+        hb = src[2].sample1;
+        lb = src[2].sample2;
+        dst[3] = (lb & 0x1F) << 3;
+        dst[4] = (hb & 0x07) << 5 | (lb & 0xE0) >> 3;
+        dst[5] = hb & 0xF8;
+    }
+}
+
+typedef struct {
+    const char *name;
+    i2s_sampling_mode_t mode;
+    pixformat_t format;
+    size_t in_bytes_per_pixel;
+    dma_filter_t ref;
+} filter_case_t;
+
+static const filter_case_t s_cases[] = {
+    { "jpeg",                SM_0A00_0B00, PIXFORMAT_JPEG,      2, ref_jpeg },
+    { "grayscale",           SM_0A0B_0C0D, PIXFORMAT_GRAYSCALE, 2, ref_grayscale },
+    { "grayscale_highspeed", SM_0A00_0B00, PIXFORMAT_GRAYSCALE, 2, ref_grayscale_highspeed },
+    { "yuyv",                SM_0A0B_0C0D, PIXFORMAT_YUV422,    2, ref_yuyv },
+    { "yuyv_highspeed",      SM_0A00_0B00, PIXFORMAT_YUV422,    2, ref_yuyv_highspeed },
+    { "rgb888",              SM_0A0B_0C0D, PIXFORMAT_RGB888,    2, ref_rgb888 },
+    { "rgb888_highspeed",    SM_0A00_0B00, PIXFORMAT_RGB888,    2, ref_rgb888_highspeed },
+};
+
+static const char *mode_name(i2s_sampling_mode_t mode)
+{
+    switch (mode)
+    {
+    case SM_0A0B_0B0C: return "SM_0A0B_0B0C";
+    case SM_0A0B_0C0D: return "SM_0A0B_0C0D";
+    case SM_0A00_0B00: return "SM_0A00_0B00";
+    default: return "?";
+    }
+}
+
+static uint32_t s_rand = 1;
+
+static uint32_t rnd(void)
+{
+    s_rand = s_rand * 1664525 + 1013904223;
+    return s_rand;
+}
+
+static dma_elem_t s_src[BUF_SIZE / sizeof(dma_elem_t) + 8];
+static uint8_t s_ref[OUT_SIZE + 2 * GUARD];
+static uint8_t s_out[OUT_SIZE + 2 * GUARD];
+
+// one length at one frame buffer alignment, the bytes around the output have to stay untouched as well
+static bool verify_one(const filter_case_t *c, dma_filter_t filter, size_t length, size_t offset)
+{
+    lldesc_t desc = { .length = length, .size = length };
+    for (size_t i = 0; i < sizeof(s_src) / sizeof(s_src[0]); ++i)
+    {
+        s_src[i].val = rnd();
+    }
+    memset(s_ref, 0xA5, sizeof(s_ref));
+    memset(s_out, 0xA5, sizeof(s_out));
+    c->ref(s_src, &desc, s_ref + GUARD + offset);
+    filter(s_src, &desc, s_out + GUARD + offset);
+    if (memcmp(s_ref, s_out, sizeof(s_ref)) == 0)
+    {
+        return true;
+    }
+    size_t i = 0;
+    while (s_ref[i] == s_out[i])
+    {
+        i++;
+    }
+    printf("FAIL %s length %u offset %u: byte %d is %02x, expected %02x\n", c->name, (unsigned) length,
+           (unsigned) offset, (int) i - GUARD - (int) offset, s_out[i], s_ref[i]);
+    return false;
+}
+
+static bool verify(const filter_case_t *c, dma_filter_t filter)
+{
+    bool ok = true;
+    for (size_t length = 4; length <= 512 && ok; length += 4)
+    {
+        for (size_t offset = 0; offset < 4 && ok; ++offset)
+        {
+            ok = verify_one(c, filter, length, offset);
+        }
+    }
+    for (size_t offset = 0; offset < 4 && ok; ++offset)
+    {
+        // a full descriptor, and one 4 bytes short like the last of a line in SM_0A0B_0B0C
+        ok = verify_one(c, filter, BUF_SIZE, offset) && verify_one(c, filter, BUF_SIZE - 4, offset);
+    }
+    return ok;
+}
+
+// DMA bytes per second the filter gets through, from the fastest of many short runs so other load on the host drops out
+static double measure(dma_filter_t filter, double seconds)
+{
+    lldesc_t desc = { .length = BUF_SIZE, .size = BUF_SIZE };
+    int64_t start = esp_timer_get_time(), best = INT64_MAX;
+    do
+    {
+        int64_t t = esp_timer_get_time();
+        for (int i = 0; i < 256; ++i)
+        {
+            filter(s_src, &desc, s_out + GUARD);
+            __asm__ volatile("" ::: "memory");
+        }
+        t = esp_timer_get_time() - t;
+        if (t < best)
+        {
+            best = t;
+        }
+    } while (esp_timer_get_time() - start < seconds * 1e6);
+    return 256.0 * BUF_SIZE / (best > 0 ? best / 1e6 : 1e-6);
+}
+
+int main(int argc, char *argv[])
+{
+    double seconds = argc > 1 ? atof(argv[1]) : 0.2;
+    bool ok = true;
+
+    printf("%-20s %-13s %10s %10s %8s\n", "filter", "mode", "ref MB/s", "MB/s", "speedup");
+    for (size_t i = 0; i < sizeof(s_cases) / sizeof(s_cases[0]); ++i)
+    {
+        const filter_case_t *c = &s_cases[i];
+        dma_filter_t filter = dma_filter_get(c->format, c->in_bytes_per_pixel, c->mode);
+        if (!filter || !verify(c, filter))
+        {
+            if (!filter)
+            {
+                printf("FAIL %s: no filter for %s\n", c->name, mode_name(c->mode));
+            }
+            ok = false;
+            continue;
+        }
+        if (seconds <= 0)
+        {
+            continue;
+        }
+        double ref = measure(c->ref, seconds);
+        double rate = measure(filter, seconds);
+        printf("%-20s %-13s %10.0f %10.0f %7.1fx\n", c->name, mode_name(c->mode), ref / 1e6, rate / 1e6, rate / ref);
+    }
+    return ok ? 0 : 1;
+}
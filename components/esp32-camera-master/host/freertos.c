@@ -0,0 +1,399 @@
+// FreeRTOS queues, semaphores, event groups and tasks on POSIX threads for the host build.
+// Blocking calls wait on a condition variable with the tick timeout converted to CLOCK_MONOTONIC.
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/event_groups.h"
+#include "freertos/queue.h"
+#include "freertos/task.h"
+#include "esp_system.h"
+#include "sim.h"
+
+struct QueueDefinition {
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    uint8_t *items;
+    UBaseType_t length;
+    UBaseType_t item_size;
+    UBaseType_t count;
+    UBaseType_t head;
+};
+
+struct EventGroupDef_t {
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    EventBits_t bits;
+    EventBits_t set_bits;       // value right after the latest xEventGroupSetBits()
+    uint64_t sets;              // number of xEventGroupSetBits() calls
+};
+
+struct tskTaskControlBlock {
+    pthread_t thread;
+    TaskFunction_t code;
+    void *arg;
+    char name[16];
+    uint32_t work_us;
+};
+
+static __thread struct tskTaskControlBlock *s_current_task;
+
+// sim_task_set_work() before the task exists
+static char s_work_name[16];
+static uint32_t s_work_us;
+
+static void deadline(TickType_t ticks, struct timespec *ts)
+{
+    uint64_t ns = (uint64_t)ticks * portTICK_PERIOD_MS * 1000000ULL;
+    clock_gettime(CLOCK_MONOTONIC, ts);
+    ts->tv_sec += ns / 1000000000ULL;
+    ts->tv_nsec += ns % 1000000000ULL;
+    if (ts->tv_nsec >= 1000000000L) {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000L;
+    }
+}
+
+static void unlock_queue(void *arg)
+{
+    pthread_mutex_unlock(&((QueueHandle_t)arg)->lock);
+}
+
+static void unlock_mutex(void *arg)
+{
+    pthread_mutex_unlock((pthread_mutex_t *)arg);
+}
+
+static void init_cond(pthread_cond_t *cond)
+{
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(cond, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+// Wait until ready() holds for the locked queue or the ticks ran out. Tasks deleted while waiting release the lock.
+static bool wait_for(QueueHandle_t q, bool (*ready)(QueueHandle_t), TickType_t ticks)
+{
+    struct timespec ts;
+    bool ok = true;
+    if (!ticks) {
+        return ready(q);
+    }
+    if (ticks != portMAX_DELAY) {
+        deadline(ticks, &ts);
+    }
+    pthread_cleanup_push(unlock_queue, q);
+    while (!ready(q)) {
+        if (ticks == portMAX_DELAY) {
+            pthread_cond_wait(&q->changed, &q->lock);
+        } else if (pthread_cond_timedwait(&q->changed, &q->lock, &ts) == ETIMEDOUT) {
+            ok = ready(q);
+            break;
+        }
+    }
+    pthread_cleanup_pop(0);
+    return ok;
+}
+
+static bool has_room(QueueHandle_t q)
+{
+    return q->count < q->length;
+}
+
+static bool has_item(QueueHandle_t q)
+{
+    return q->count > 0;
+}
+
+static void push(QueueHandle_t q, const void *item)
+{
+    if (q->item_size) {
+        memcpy(q->items + ((q->head + q->count) % q->length) * q->item_size, item, q->item_size);
+    }
+    q->count++;
+    pthread_cond_broadcast(&q->changed);
+}
+
+static void pop(QueueHandle_t q, void *buffer)
+{
+    if (q->item_size) {
+        memcpy(buffer, q->items + q->head * q->item_size, q->item_size);
+    }
+    q->head = (q->head + 1) % q->length;
+    q->count--;
+    pthread_cond_broadcast(&q->changed);
+}
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t item_size)
+{
+    QueueHandle_t q = (QueueHandle_t)calloc(1, sizeof(*q));
+    if (!q) {
+        return NULL;
+    }
+    q->items = (uint8_t *)calloc(length, item_size ? item_size : 1);
+    if (!q->items) {
+        free(q);
+        return NULL;
+    }
+    init_cond(&q->changed);
+    pthread_mutex_init(&q->lock, NULL);
+    q->length = length;
+    q->item_size = item_size;
+    return q;
+}
+
+QueueHandle_t xQueueCreateMutex(uint8_t type)
+{
+    QueueHandle_t q = xQueueCreate(1, 0);
+    if (q) {
+        q->count = 1;
+    }
+    return q;
+}
+
+void vQueueDelete(QueueHandle_t queue)
+{
+    pthread_cond_destroy(&queue->changed);
+    pthread_mutex_destroy(&queue->lock);
+    free(queue->items);
+    free(queue);
+}
+
+BaseType_t xQueueSend(QueueHandle_t queue, const void *item, TickType_t ticks_to_wait)
+{
+    pthread_mutex_lock(&queue->lock);
+    bool ok = wait_for(queue, has_room, ticks_to_wait);
+    if (ok) {
+        push(queue, item);
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return ok ? pdTRUE : pdFALSE;
+}
+
+BaseType_t xQueueReceive(QueueHandle_t queue, void *buffer, TickType_t ticks_to_wait)
+{
+    pthread_mutex_lock(&queue->lock);
+    bool ok = wait_for(queue, has_item, ticks_to_wait);
+    if (ok) {
+        pop(queue, buffer);
+    }
+    pthread_mutex_unlock(&queue->lock);
+    // only data counts as work, not taking a semaphore
+    if (ok && queue->item_size && s_current_task && s_current_task->work_us) {
+        sim_spin_us(s_current_task->work_us);
+    }
+    return ok ? pdTRUE : pdFALSE;
+}
+
+BaseType_t xQueueReset(QueueHandle_t queue)
+{
+    pthread_mutex_lock(&queue->lock);
+    queue->count = 0;
+    queue->head = 0;
+    pthread_cond_broadcast(&queue->changed);
+    pthread_mutex_unlock(&queue->lock);
+    return pdPASS;
+}
+
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t queue)
+{
+    pthread_mutex_lock(&queue->lock);
+    UBaseType_t count = queue->count;
+    pthread_mutex_unlock(&queue->lock);
+    return count;
+}
+
+BaseType_t xQueueSendFromISR(QueueHandle_t queue, const void *item, BaseType_t *higher_priority_task_woken)
+{
+    if (higher_priority_task_woken) {
+        *higher_priority_task_woken = pdFALSE;
+    }
+    return xQueueSend(queue, item, 0);
+}
+
+BaseType_t xQueueReceiveFromISR(QueueHandle_t queue, void *buffer, BaseType_t *higher_priority_task_woken)
+{
+    if (higher_priority_task_woken) {
+        *higher_priority_task_woken = pdFALSE;
+    }
+    pthread_mutex_lock(&queue->lock);
+    bool ok = has_item(queue);
+    if (ok) {
+        pop(queue, buffer);
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return ok ? pdTRUE : pdFALSE;
+}
+
+BaseType_t xQueueIsQueueFullFromISR(QueueHandle_t queue)
+{
+    return uxQueueMessagesWaiting(queue) == queue->length ? pdTRUE : pdFALSE;
+}
+
+BaseType_t xQueueIsQueueEmptyFromISR(QueueHandle_t queue)
+{
+    return uxQueueMessagesWaiting(queue) == 0 ? pdTRUE : pdFALSE;
+}
+
+EventGroupHandle_t xEventGroupCreate(void)
+{
+    EventGroupHandle_t group = (EventGroupHandle_t)calloc(1, sizeof(*group));
+    if (!group) {
+        return NULL;
+    }
+    init_cond(&group->changed);
+    pthread_mutex_init(&group->lock, NULL);
+    return group;
+}
+
+void vEventGroupDelete(EventGroupHandle_t group)
+{
+    pthread_cond_destroy(&group->changed);
+    pthread_mutex_destroy(&group->lock);
+    free(group);
+}
+
+EventBits_t xEventGroupSetBits(EventGroupHandle_t group, const EventBits_t bits)
+{
+    pthread_mutex_lock(&group->lock);
+    group->bits |= bits;
+    group->set_bits = group->bits;
+    group->sets++;
+    EventBits_t value = group->bits;
+    pthread_cond_broadcast(&group->changed);
+    pthread_mutex_unlock(&group->lock);
+    return value;
+}
+
+EventBits_t xEventGroupClearBits(EventGroupHandle_t group, const EventBits_t bits)
+{
+    pthread_mutex_lock(&group->lock);
+    EventBits_t value = group->bits;
+    group->bits &= ~bits;
+    pthread_mutex_unlock(&group->lock);
+    return value;
+}
+
+EventBits_t xEventGroupGetBits(EventGroupHandle_t group)
+{
+    pthread_mutex_lock(&group->lock);
+    EventBits_t value = group->bits;
+    pthread_mutex_unlock(&group->lock);
+    return value;
+}
+
+static bool bits_match(EventBits_t value, EventBits_t bits, BaseType_t wait_for_all)
+{
+    return wait_for_all ? (value & bits) == bits : (value & bits) != 0;
+}
+
+// A waiter checks the bits now, and after that the value each set left, even if another waiter cleared them since
+EventBits_t xEventGroupWaitBits(EventGroupHandle_t group, const EventBits_t bits, const BaseType_t clear_on_exit,
+                                const BaseType_t wait_for_all, TickType_t ticks_to_wait)
+{
+    struct timespec ts;
+    pthread_mutex_lock(&group->lock);
+    EventBits_t value = group->bits;
+    bool ok = bits_match(value, bits, wait_for_all);
+    if (!ok && ticks_to_wait) {
+        uint64_t sets = group->sets;
+        if (ticks_to_wait != portMAX_DELAY) {
+            deadline(ticks_to_wait, &ts);
+        }
+        pthread_cleanup_push(unlock_mutex, &group->lock);
+        while (!ok) {
+            if (ticks_to_wait == portMAX_DELAY) {
+                pthread_cond_wait(&group->changed, &group->lock);
+            } else if (pthread_cond_timedwait(&group->changed, &group->lock, &ts) == ETIMEDOUT) {
+                break;
+            }
+            if (group->sets != sets) {
+                value = group->set_bits;
+                ok = bits_match(value, bits, wait_for_all);
+                sets = group->sets;
+            }
+        }
+        pthread_cleanup_pop(0);
+        if (!ok) {
+            value = group->bits;
+        }
+    }
+    if (ok && clear_on_exit) {
+        group->bits &= ~bits;
+    }
+    pthread_mutex_unlock(&group->lock);
+    return value;
+}
+
+static void *task_main(void *arg)
+{
+    struct tskTaskControlBlock *task = (struct tskTaskControlBlock *)arg;
+    s_current_task = task;
+    task->code(task->arg);
+    return NULL;
+}
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t code, const char *name, uint32_t stack_depth, void *arg,
+                                   UBaseType_t priority, TaskHandle_t *created_task, BaseType_t core_id)
+{
+    TaskHandle_t task = (TaskHandle_t)calloc(1, sizeof(*task));
+    if (!task) {
+        return pdFAIL;
+    }
+    task->code = code;
+    task->arg = arg;
+    strncpy(task->name, name, sizeof(task->name) - 1);
+    if (!strcmp(task->name, s_work_name)) {
+        task->work_us = s_work_us;
+    }
+    if (pthread_create(&task->thread, NULL, task_main, task)) {
+        free(task);
+        return pdFAIL;
+    }
+    if (created_task) {
+        *created_task = task;
+    }
+    return pdPASS;
+}
+
+void vTaskDelete(TaskHandle_t task)
+{
+    if (!task || task == s_current_task) {
+        task = s_current_task;
+        pthread_detach(task->thread);
+        free(task);
+        pthread_exit(NULL);
+    }
+    pthread_cancel(task->thread);
+    pthread_join(task->thread, NULL);
+    free(task);
+}
+
+void vTaskDelay(TickType_t ticks)
+{
+    if (!ticks) {
+        sched_yield();
+        return;
+    }
+    struct timespec ts;
+    deadline(ticks, &ts);
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+        ;
+    }
+}
+
+TickType_t xTaskGetTickCount(void)
+{
+    return esp_timer_get_time() / 1000 / portTICK_PERIOD_MS;
+}
+
+void sim_task_set_work(const char *name, uint32_t us)
+{
+    strncpy(s_work_name, name, sizeof(s_work_name) - 1);
+    s_work_us = us;
+}
@@ -0,0 +1,9 @@
+#pragma once
+
+typedef enum {
+    PERIPH_LEDC_MODULE,
+    PERIPH_I2S0_MODULE,
+} periph_module_t;
+
+#define periph_module_enable(periph)
+#define periph_module_disable(periph)
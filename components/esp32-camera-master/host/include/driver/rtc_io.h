@@ -0,0 +1,8 @@
+#pragma once
+
+#include <stdbool.h>
+#include "driver/gpio.h"
+
+// None of the camera pins is an RTC pin on the host
+#define rtc_gpio_is_valid_gpio(gpio_num)    false
+#define rtc_gpio_deinit(gpio_num)           ((void)(gpio_num))
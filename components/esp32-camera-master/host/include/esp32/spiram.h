@@ -0,0 +1,3 @@
+#pragma once
+
+// to_jpg.cpp includes it, PSRAM is plain heap on the host
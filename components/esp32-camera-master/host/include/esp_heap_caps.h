@@ -0,0 +1,14 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdlib.h>
+#include "esp_err.h"
+
+#define MALLOC_CAP_8BIT     (1 << 2)
+#define MALLOC_CAP_DMA      (1 << 3)
+#define MALLOC_CAP_SPIRAM   (1 << 10)
+
+// There is only one kind of memory on the host
+#define heap_caps_malloc(size, caps)        malloc(size)
+#define heap_caps_calloc(n, size, caps)     calloc(n, size)
+#define heap_caps_realloc(p, size, caps)    realloc(p, size)
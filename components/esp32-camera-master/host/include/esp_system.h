@@ -0,0 +1,20 @@
+#pragma once
+
+#include <stdint.h>
+#include "sdkconfig.h"
+#include "esp_err.h"
+
+#define ESP_IDF_VERSION_MAJOR   4
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Microseconds since the simulation started
+int64_t esp_timer_get_time(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#define ets_printf printf
@@ -0,0 +1,31 @@
+// FreeRTOS on POSIX threads, as much of it as the camera driver uses.
+// Tasks are threads, queues and semaphores are a mutex and a condition variable each.
+#pragma once
+
+#include <stdint.h>
+#include <assert.h>
+#include "sdkconfig.h"
+#include "esp_attr.h"
+#include "esp_heap_caps.h"
+
+typedef long BaseType_t;
+typedef unsigned long UBaseType_t;
+typedef uint32_t TickType_t;
+
+#define pdFALSE                 ((BaseType_t)0)
+#define pdTRUE                  ((BaseType_t)1)
+#define pdPASS                  pdTRUE
+#define pdFAIL                  pdFALSE
+
+#define portMAX_DELAY           ((TickType_t)0xffffffffUL)
+#define portTICK_PERIOD_MS      ((TickType_t)1000 / CONFIG_FREERTOS_HZ)
+#define portTICK_RATE_MS        portTICK_PERIOD_MS
+#define pdMS_TO_TICKS(ms)       ((TickType_t)((ms) * CONFIG_FREERTOS_HZ / 1000))
+
+// Waking a task from an "ISR" is immediate on the host, there is nothing to yield to
+#define portYIELD_FROM_ISR()
+#define configASSERT(x)         assert(x)
+
+#define xPortGetCoreID()        0
+
+#include "freertos/queue.h"
@@ -0,0 +1,13 @@
+#pragma once
+
+#include "freertos/queue.h"
+
+typedef QueueHandle_t SemaphoreHandle_t;
+
+// Like FreeRTOS, a semaphore is a queue of items without data
+#define xSemaphoreCreateBinary()                xQueueCreate(1, 0)
+#define xSemaphoreCreateMutex()                 xQueueCreateMutex(1)
+#define xSemaphoreGive(sem)                     xQueueSend(sem, NULL, 0)
+#define xSemaphoreTake(sem, ticks)              xQueueReceive(sem, NULL, ticks)
+#define xSemaphoreGiveFromISR(sem, woken)       xQueueSendFromISR(sem, NULL, woken)
+#define vSemaphoreDelete(sem)                   vQueueDelete(sem)
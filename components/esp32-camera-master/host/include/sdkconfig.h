@@ -0,0 +1,9 @@
+// Settings of the host build, in place of the sdkconfig.h menuconfig generates.
+// They follow the project's sdkconfig where the driver reads them.
+#pragma once
+
+#define CONFIG_IDF_TARGET_ESP32     1
+#define CONFIG_FREERTOS_HZ          100
+#define CONFIG_LOG_DEFAULT_LEVEL    3
+#define CONFIG_OV2640_SUPPORT       1
+#define CONFIG_CAMERA_CORE0         1
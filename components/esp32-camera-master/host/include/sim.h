@@ -0,0 +1,92 @@
+// Emulated hardware of the host build: the parts camsim and the sensor thread drive directly.
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "driver/gpio.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Drive the level of an input pin, calling its GPIO ISR on a matching edge like the GPIO matrix does
+ */
+void sim_gpio_input(gpio_num_t gpio_num, int level);
+
+/**
+ * @brief Raise the I2S in_done interrupt, the handler runs now if enabled or later from sim_i2s_poll()
+ */
+void sim_i2s_in_done(void);
+
+/**
+ * @brief Apply the interrupt clears the driver wrote and deliver a pending interrupt that got enabled
+ */
+void sim_i2s_poll(void);
+
+/**
+ * @brief Let the named task spend us microseconds on every item it receives from a queue, like a slower CPU would
+ *
+ * Set it before the task is created.
+ */
+void sim_task_set_work(const char *name, uint32_t us);
+
+/**
+ * @brief Busy wait, sleeping is too coarse for the microseconds a DMA buffer takes
+ */
+void sim_spin_us(uint32_t us);
+
+/**
+ * @brief Sleep until esp_timer_get_time() reaches us
+ */
+void sim_sleep_until(int64_t us);
+
+/**
+ * @brief The camera as the sensor thread plays it
+ */
+typedef struct {
+    const uint8_t **frames;     /*!< JPEG frames to send, in turn */
+    const size_t *lens;         /*!< Their lengths up to and including EOI */
+    size_t count;               /*!< Number of frames */
+    double fps;                 /*!< Frames per second, VSYNC to VSYNC */
+    uint32_t pclk_hz;           /*!< Bytes per second while HREF is high */
+    uint32_t vsync_us;          /*!< Length of the VSYNC pulse */
+    uint32_t pad;               /*!< Zero bytes sent after each EOI */
+    gpio_num_t pin_vsync;       /*!< Pin the driver reads VSYNC from */
+} sim_sensor_config_t;
+
+/**
+ * @brief Start the sensor thread. It sends frames until sim_sensor_stop(), each tagged with its sequence number.
+ */
+bool sim_sensor_start(const sim_sensor_config_t *config);
+
+/**
+ * @brief Stop the sensor thread
+ */
+void sim_sensor_stop(void);
+
+/**
+ * @brief Number of frames the sensor has sent completely
+ */
+uint32_t sim_sensor_sent(void);
+
+/**
+ * @brief Time the sensor thread fell behind the pixel clock because the host did not run it, in microseconds
+ */
+int64_t sim_sensor_slip_us(void);
+
+/**
+ * @brief Check a frame buffer against what the sensor sent
+ *
+ * @param buf           Frame data
+ * @param len           Frame length as the driver reports it
+ * @param seq           Set to the sequence number the frame carries, UINT32_MAX if it has none
+ *
+ * @return true if the data is the frame with that number, up to the driver's one or two extra bytes at the end
+ */
+bool sim_sensor_check(const uint8_t *buf, size_t len, uint32_t *seq);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,3 @@
+#pragma once
+
+// to_jpg.cpp includes it, nothing in it is used on the host
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <stdint.h>
+
+// Input levels and interrupt status of the GPIO matrix, the sensor thread drives VSYNC in them
+typedef volatile struct {
+    uint32_t in;
+    union {
+        struct {
+            uint32_t data:            8;
+        };
+        uint32_t val;
+    } in1;
+    uint32_t status;
+    uint32_t status_w1tc;
+    union {
+        struct {
+            uint32_t intr_st:         8;
+        };
+        uint32_t val;
+    } status1, status1_w1tc;
+} gpio_dev_t;
+
+extern gpio_dev_t GPIO;
@@ -0,0 +1,100 @@
+// The I2S0 registers the camera driver touches. Field names follow the IDF, the layout does not:
+// the emulated peripheral only ever reads them by name.
+#pragma once
+
+#include <stdint.h>
+
+typedef volatile struct {
+    union {
+        struct {
+            uint32_t tx_reset:        1;
+            uint32_t rx_reset:        1;
+            uint32_t tx_fifo_reset:   1;
+            uint32_t rx_fifo_reset:   1;
+            uint32_t tx_start:        1;
+            uint32_t rx_start:        1;
+            uint32_t tx_slave_mod:    1;
+            uint32_t rx_slave_mod:    1;
+            uint32_t tx_right_first:  1;
+            uint32_t rx_right_first:  1;
+            uint32_t tx_msb_shift:    1;
+            uint32_t rx_msb_shift:    1;
+            uint32_t tx_short_sync:   1;
+            uint32_t rx_short_sync:   1;
+            uint32_t tx_mono:         1;
+            uint32_t rx_mono:         1;
+            uint32_t tx_msb_right:    1;
+            uint32_t rx_msb_right:    1;
+        };
+        uint32_t val;
+    } conf;
+    union {
+        struct {
+            uint32_t rx_take_data:    1;
+            uint32_t reserved_1:      8;
+            uint32_t in_done:         1;
+            uint32_t in_suc_eof:      1;
+        };
+        uint32_t val;
+    } int_raw, int_ena, int_clr;
+    union {
+        struct {
+            uint32_t rx_dsync_sw:     1;
+        };
+        uint32_t val;
+    } timing;
+    union {
+        struct {
+            uint32_t rx_fifo_mod:           3;
+            uint32_t rx_fifo_mod_force_en:  1;
+            uint32_t dscr_en:               1;
+        };
+        uint32_t val;
+    } fifo_conf;
+    uint32_t rx_eof_num;
+    union {
+        struct {
+            uint32_t rx_chan_mod:     3;
+        };
+        uint32_t val;
+    } conf_chan;
+    struct {
+        uint32_t addr;              // the whole descriptor address, the chip keeps 20 bits of it
+        uint32_t stop:            1;
+        uint32_t start:           1;
+        uint32_t restart:         1;
+        uint32_t park:            1;
+    } in_link;
+    union {
+        uint32_t val;
+    } lc_conf;
+    union {
+        struct {
+            uint32_t camera_en:       1;
+            uint32_t lcd_en:          1;
+        };
+        uint32_t val;
+    } conf2;
+    union {
+        struct {
+            uint32_t clkm_div_num:    8;
+            uint32_t clkm_div_b:      6;
+            uint32_t clkm_div_a:      6;
+        };
+        uint32_t val;
+    } clkm_conf;
+    union {
+        struct {
+            uint32_t rx_bits_mod:     6;
+        };
+        uint32_t val;
+    } sample_rate_conf;
+    union {
+        struct {
+            uint32_t rx_fifo_reset_back:  1;
+        };
+        uint32_t val;
+    } state;
+} i2s_dev_t;
+
+extern i2s_dev_t I2S0;
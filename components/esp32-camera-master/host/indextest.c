@@ -0,0 +1,378 @@
+// indextest: checks jpg_index() and jpg_eoi_scan(), the end marker search the DMA filter task runs on every chunk
+// of a frame.
+//
+// jpg_index() has to describe the frames in docu/ correctly, report every prefix of them as truncated, and every
+// broken segment length, missing SOF or SOS and misplaced marker as corrupt. Its quality estimate is checked on
+// the frames with their luma table replaced by the standard one scaled to each quality from 1 to 100.
+//
+// For jpg_eoi_scan() each frame is fed in chunks the way DMA buffers arrive: every fixed size from 1 to MAX_CHUNK
+// bytes, random sizes, and chunks cut right after every 0xFF so that each marker straddles two chunks. The length
+// the scan reports has to be the one jpg_index() finds in the whole frame, 0 when the frame has no EOI.
+//
+// With a number of seconds as argument it then measures both on the frames, in GB/s.
+#include <string.h>
+#include "img_converters.h"
+#include "test.h"
+
+#define MAX_CHUNK       64
+#define MAX_FRAME       (64 * 1024)
+#define DMA_CHUNK       3200        // bytes the DMA filter hands the scan at once for a UXGA JPEG
+
+#define BE16(p)         (((p)[0] << 8) | (p)[1])
+
+// standard luma quantization table (ITU-T T.81 K.1) in zigzag order
+static const uint8_t s_std_lum_quant[64] = { 16,11,12,14,12,10,16,14,13,14,18,17,16,19,24,40,26,24,22,22,24,49,35,37,29,40,58,51,61,60,57,51,56,55,64,72,92,78,64,68,87,69,55,56,80,109,81,87,95,98,103,104,103,62,77,113,121,112,100,120,92,101,103,99 };
+
+typedef struct {
+    const char *name;
+    uint8_t *data;
+    size_t len;
+} frame_t;
+
+static size_t scan_fixed(const uint8_t *data, size_t len, size_t chunk)
+{
+    jpg_eoi_scan_t scan;
+    memset(&scan, 0, sizeof(scan));
+    size_t eoi = 0;
+    for (size_t pos = 0; pos < len; pos += chunk) {
+        eoi = jpg_eoi_scan(&scan, data + pos, (len - pos < chunk) ? len - pos : chunk);
+    }
+    return eoi;
+}
+
+static size_t scan_after_ff(const uint8_t *data, size_t len)
+{
+    jpg_eoi_scan_t scan;
+    memset(&scan, 0, sizeof(scan));
+    size_t eoi = 0, start = 0;
+    for (size_t i = 0; i < len; i++) {
+        if (data[i] == 0xFF || i == len - 1) {
+            eoi = jpg_eoi_scan(&scan, data + start, i + 1 - start);
+            start = i + 1;
+        }
+    }
+    return eoi;
+}
+
+static size_t scan_random(const uint8_t *data, size_t len, uint32_t *seed)
+{
+    jpg_eoi_scan_t scan;
+    memset(&scan, 0, sizeof(scan));
+    size_t eoi = 0;
+    for (size_t pos = 0; pos < len;) {
+        size_t n = 1 + test_rand(seed) % 4096;
+        if (n > len - pos) {
+            n = len - pos;
+        }
+        eoi = jpg_eoi_scan(&scan, data + pos, n);
+        pos += n;
+    }
+    return eoi;
+}
+
+// The frame fed every way must end where jpg_index() says, or not at all without EOI. expect is the length
+// the frame was built with, 0 for none, to catch jpg_index() and the scan agreeing on a wrong answer
+static void check_frame(const char *name, const uint8_t *data, size_t len, size_t expect, uint32_t *seed)
+{
+    jpg_index_t index;
+    jpg_index(data, len, &index);
+    const size_t want = index.eoi_offset ? index.length : 0;
+    CHECK(want == expect, "%s: jpg_index found %u, built with %u", name, (unsigned)want, (unsigned)expect);
+
+    for (size_t chunk = 1; chunk <= MAX_CHUNK; chunk++) {
+        size_t got = scan_fixed(data, len, chunk);
+        CHECK(got == want, "%s: %u byte chunks found %u, jpg_index %u", name, (unsigned)chunk, (unsigned)got, (unsigned)want);
+    }
+    size_t got = scan_fixed(data, len, len);
+    CHECK(got == want, "%s: one chunk found %u, jpg_index %u", name, (unsigned)got, (unsigned)want);
+    got = scan_after_ff(data, len);
+    CHECK(got == want, "%s: chunks cut after FF found %u, jpg_index %u", name, (unsigned)got, (unsigned)want);
+    for (int i = 0; i < 8; i++) {
+        got = scan_random(data, len, seed);
+        CHECK(got == want, "%s: random chunks found %u, jpg_index %u", name, (unsigned)got, (unsigned)want);
+    }
+}
+
+// Insert a marker segment with the given payload right after SOI
+static size_t insert_segment(uint8_t *out, const frame_t *src, uint8_t marker, const uint8_t *payload, size_t n)
+{
+    uint8_t *p = out;
+    memcpy(p, src->data, 2);
+    p += 2;
+    *p++ = 0xFF;
+    *p++ = marker;
+    *p++ = (n + 2) >> 8;
+    *p++ = (n + 2) & 0xFF;
+    memcpy(p, payload, n);
+    p += n;
+    memcpy(p, src->data + 2, src->len - 2);
+    return p - out + src->len - 2;
+}
+
+// Offset of the FF of the first header segment with this marker, 0 if there is none before SOS
+static size_t find_segment(const uint8_t *data, size_t len, uint8_t marker)
+{
+    size_t p = 2;
+    while (p + 4 <= len && data[p] == 0xFF) {
+        if (data[p + 1] == marker) {
+            return p;
+        }
+        if (data[p + 1] == 0xDA) {
+            break;
+        }
+        p += 2 + BE16(data + p + 2);
+    }
+    return 0;
+}
+
+// Copy the frame without the segment at ofs
+static size_t remove_segment(uint8_t *out, const frame_t *src, size_t ofs)
+{
+    size_t seg = 2 + BE16(src->data + ofs + 2);
+    memcpy(out, src->data, ofs);
+    memcpy(out + ofs, src->data + ofs + seg, src->len - ofs - seg);
+    return src->len - seg;
+}
+
+static void check_flags(const char *name, const uint8_t *data, size_t len, uint8_t flags)
+{
+    jpg_index_t index;
+    bool ok = jpg_index(data, len, &index);
+    CHECK(ok == !flags && index.flags == flags, "%s: flags 0x%x, expected 0x%x", name, index.flags, flags);
+    CHECK(index.length <= len, "%s: length %u past the data", name, (unsigned)index.length);
+}
+
+// What jpg_index() finds in a frame as captured, checked against the segments themselves
+static void check_index(const frame_t *src, uint16_t width, uint16_t height)
+{
+    jpg_index_t index;
+    const uint8_t *d = src->data;
+    CHECK(jpg_index(d, src->len, &index), "%s: flags 0x%x", src->name, index.flags);
+    CHECK(index.width == width && index.height == height, "%s: %ux%u", src->name, index.width, index.height);
+    CHECK(index.sof_marker == 0xC0 && index.components == 3 && index.sampling == 0x22,
+          "%s: SOF %02x, %u components, sampling %02x", src->name, index.sof_marker, index.components, index.sampling);
+    CHECK(index.eoi_offset == src->len - 2 && d[index.eoi_offset] == 0xFF && d[index.eoi_offset + 1] == 0xD9,
+          "%s: EOI at %u", src->name, (unsigned)index.eoi_offset);
+    size_t sos = find_segment(d, src->len, 0xDA);
+    CHECK(sos && index.scan_offset == sos + 2 + BE16(d + sos + 2), "%s: scan at %u", src->name, (unsigned)index.scan_offset);
+    size_t dqt = find_segment(d, src->len, 0xDB);
+    CHECK(dqt && index.quant_offset[d[dqt + 4] & 3] == dqt + 5, "%s: table at %u", src->name, (unsigned)index.quant_offset[0]);
+    CHECK(index.quality > 0 && index.restart_interval == 0 && !index.quant_16bit,
+          "%s: quality %u, restart %u, 16 bit tables %x", src->name, index.quality, index.restart_interval, index.quant_16bit);
+}
+
+static void check_truncated(const frame_t *src)
+{
+    jpg_index_t index;
+    int bad = 0;
+    for (size_t cut = 0; cut < src->len; cut++) {
+        bool ok = jpg_index(src->data, cut, &index);
+        if (ok || index.flags != JPG_INDEX_TRUNCATED || index.length > cut) {
+            if (bad++ < 5) {
+                CHECK(false, "%s cut at %u: flags 0x%x, length %u", src->name, (unsigned)cut, index.flags, (unsigned)index.length);
+            }
+        }
+    }
+}
+
+static void check_corrupt(const frame_t *src, uint8_t *buf)
+{
+    const uint8_t *d = src->data;
+    char name[96];
+    size_t len, ofs;
+
+    // segment lengths: below 2, too short for a DQT or SOF, past the end of the data
+    static const struct { uint8_t marker; uint16_t len; uint8_t flags; } lengths[] = {
+        { 0xDB, 0, JPG_INDEX_CORRUPT }, { 0xDB, 1, JPG_INDEX_CORRUPT }, { 0xDB, 66, JPG_INDEX_CORRUPT },
+        { 0xC0, 2, JPG_INDEX_CORRUPT }, { 0xC0, 10, JPG_INDEX_CORRUPT }, { 0xDA, 3, JPG_INDEX_CORRUPT },
+        { 0xE0, 0xFFFF, JPG_INDEX_TRUNCATED }, { 0xC4, 0xFFFF, JPG_INDEX_TRUNCATED },
+    };
+    for (size_t i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i++) {
+        ofs = find_segment(d, src->len, lengths[i].marker);
+        CHECK(ofs, "%s: no segment %02x", src->name, lengths[i].marker);
+        if (!ofs) {
+            continue;
+        }
+        memcpy(buf, d, src->len);
+        buf[ofs + 2] = lengths[i].len >> 8;
+        buf[ofs + 3] = lengths[i].len & 0xFF;
+        snprintf(name, sizeof(name), "%s, segment %02x of length %u", src->name, lengths[i].marker, lengths[i].len);
+        check_flags(name, buf, src->len, lengths[i].flags);
+    }
+
+    // no SOF before SOS
+    len = remove_segment(buf, src, find_segment(d, src->len, 0xC0));
+    snprintf(name, sizeof(name), "%s without SOF", src->name);
+    check_flags(name, buf, len, JPG_INDEX_CORRUPT);
+
+    // no SOS before EOI: the headers, then EOI
+    ofs = find_segment(d, src->len, 0xDA);
+    memcpy(buf, d, ofs);
+    buf[ofs] = 0xFF;
+    buf[ofs + 1] = 0xD9;
+    snprintf(name, sizeof(name), "%s without SOS", src->name);
+    check_flags(name, buf, ofs + 2, JPG_INDEX_CORRUPT);
+
+    // a second SOF
+    ofs = find_segment(d, src->len, 0xC0);
+    frame_t twice = { src->name, buf + MAX_FRAME, 0 };
+    memcpy(twice.data, d, src->len);
+    twice.len = src->len;
+    len = insert_segment(buf, &twice, 0xC0, d + ofs + 4, BE16(d + ofs + 2) - 2);
+    snprintf(name, sizeof(name), "%s with two SOF", src->name);
+    check_flags(name, buf, len, JPG_INDEX_CORRUPT);
+
+    // no SOI, SOI again, RSTn and a bare byte among the headers
+    memcpy(buf, d, src->len);
+    buf[1] = 0xD9;
+    snprintf(name, sizeof(name), "%s without SOI", src->name);
+    check_flags(name, buf, src->len, JPG_INDEX_CORRUPT);
+    static const uint8_t misplaced[] = { 0xD8, 0xD0, 0xD7, 0x00 };
+    ofs = find_segment(d, src->len, 0xC4);
+    for (size_t i = 0; i < sizeof(misplaced); i++) {
+        memcpy(buf, d, src->len);
+        buf[ofs + 1] = misplaced[i];
+        snprintf(name, sizeof(name), "%s, marker %02x among the headers", src->name, misplaced[i]);
+        check_flags(name, buf, src->len, JPG_INDEX_CORRUPT);
+    }
+    memcpy(buf, d, src->len);
+    buf[ofs] = 0x12;
+    snprintf(name, sizeof(name), "%s, no FF before a marker", src->name);
+    check_flags(name, buf, src->len, JPG_INDEX_CORRUPT);
+}
+
+// The luma table replaced by the standard one scaled to each quality the way libjpeg and jpge do
+static void check_quality(const frame_t *src, uint8_t *buf)
+{
+    jpg_index_t index;
+    jpg_index(src->data, src->len, &index);
+    const size_t table = index.quant_offset[0];
+    int worst = 0, worst_q = 0;
+    for (int q = 1; q <= 100; q++) {
+        int scale = q < 50 ? 5000 / q : 200 - q * 2;
+        memcpy(buf, src->data, src->len);
+        for (int k = 0; k < 64; k++) {
+            int v = (s_std_lum_quant[k] * scale + 50) / 100;
+            buf[table + k] = v < 1 ? 1 : (v > 255 ? 255 : v);
+        }
+        jpg_index(buf, src->len, &index);
+        // below 10 most entries clip at 255 and above 95 they round to 1 or 2, allow one off there
+        int err = abs((int)index.quality - q) - (q < 10 || q > 95);
+        if (err > worst) {
+            worst = err;
+            worst_q = q;
+        }
+    }
+    CHECK(worst <= 0, "%s: quality off by %d more than allowed at %d", src->name, worst, worst_q);
+}
+
+static double bench_index(const frame_t *frames, double seconds)
+{
+    jpg_index_t index;
+    size_t bytes = 0;
+    double start = test_now(), t;
+    do {
+        for (int f = 0; f < TEST_FRAME_COUNT; f++) {
+            jpg_index(frames[f].data, frames[f].len, &index);
+            bytes += frames[f].len;
+        }
+    } while ((t = test_now() - start) < seconds);
+    return bytes / t / 1e9;
+}
+
+static double bench_scan(const frame_t *frames, double seconds)
+{
+    size_t bytes = 0;
+    double start = test_now(), t;
+    do {
+        for (int f = 0; f < TEST_FRAME_COUNT; f++) {
+            scan_fixed(frames[f].data, frames[f].len, DMA_CHUNK);
+            bytes += frames[f].len;
+        }
+    } while ((t = test_now() - start) < seconds);
+    return bytes / t / 1e9;
+}
+
+int main(int argc, char *argv[])
+{
+    double seconds = argc > 1 ? atof(argv[1]) : 0;
+    const char *paths[] = TEST_FRAMES;
+    frame_t frames[TEST_FRAME_COUNT];
+    uint8_t *buf = (uint8_t *)malloc(MAX_FRAME * 2);
+    uint32_t seed = 1;
+    char name[96];
+
+    for (int f = 0; f < TEST_FRAME_COUNT; f++) {
+        frames[f].name = paths[f];
+        frames[f].data = test_load(paths[f], &frames[f].len);
+        jpg_index_t index;
+        CHECK(jpg_index(frames[f].data, frames[f].len, &index), "%s: not a complete JPEG, flags 0x%x", paths[f], index.flags);
+        frames[f].len = index.length;
+    }
+
+    // jpg_index()
+    check_index(&frames[0], 300, 300);
+    check_index(&frames[1], 304, 414);
+    for (int f = 0; f < TEST_FRAME_COUNT; f++) {
+        check_truncated(&frames[f]);
+        check_corrupt(&frames[f], buf);
+        check_quality(&frames[f], buf);
+    }
+
+    // jpg_eoi_scan()
+    for (int f = 0; f < TEST_FRAME_COUNT; f++) {
+        const frame_t *src = &frames[f];
+        size_t len;
+
+        // as captured
+        check_frame(src->name, src->data, src->len, src->len, &seed);
+
+        // FF D9 inside an APP1 segment, also FF FF D9 and a segment ending in FF
+        static const uint8_t app[] = { 'E', 'x', 'i', 'f', 0, 0, 0xFF, 0xD9, 0x12, 0xFF, 0xFF, 0xD9, 0xFF, 0xD8, 0xFF };
+        len = insert_segment(buf, src, 0xE1, app, sizeof(app));
+        snprintf(name, sizeof(name), "%s + APP1 with FF D9", src->name);
+        check_frame(name, buf, len, len, &seed);
+
+        // FF D9 inside a DQT segment: table 3 with entries 255, 217, the frame does not use it
+        uint8_t dqt[65];
+        dqt[0] = 3;
+        for (int i = 1; i < 65; i++) {
+            dqt[i] = (i & 1) ? 0xFF : 0xD9;
+        }
+        len = insert_segment(buf, src, 0xDB, dqt, sizeof(dqt));
+        snprintf(name, sizeof(name), "%s + DQT with FF D9", src->name);
+        check_frame(name, buf, len, len, &seed);
+
+        // both, so the DQT comes after a segment the scan skipped
+        uint8_t *both = (uint8_t *)malloc(MAX_FRAME);
+        frame_t with_dqt = { src->name, both, insert_segment(both, src, 0xDB, dqt, sizeof(dqt)) };
+        len = insert_segment(buf, &with_dqt, 0xE1, app, sizeof(app));
+        free(both);
+        snprintf(name, sizeof(name), "%s + APP1 and DQT with FF D9", src->name);
+        check_frame(name, buf, len, len, &seed);
+
+        // DMA leftovers after EOI that hold FF D9 again
+        static const uint8_t junk[] = { 0x00, 0xFF, 0xD9, 0xFF, 0x00, 0xFF, 0xFF, 0xD9, 0x55 };
+        memcpy(buf, src->data, src->len);
+        for (size_t i = 0; i < 512; i++) {
+            buf[src->len + i] = junk[i % sizeof(junk)];
+        }
+        snprintf(name, sizeof(name), "%s + junk with FF D9 after EOI", src->name);
+        check_frame(name, buf, src->len + 512, src->len, &seed);
+
+        // truncated anywhere, the headers holding FF D9 included: no EOI may be found
+        len = insert_segment(buf, src, 0xE1, app, sizeof(app));
+        for (size_t cut = 1; cut < len; cut += (cut < 256) ? 1 : 997) {
+            snprintf(name, sizeof(name), "%s + APP1 cut at %u", src->name, (unsigned)cut);
+            check_frame(name, buf, cut, 0, &seed);
+        }
+        snprintf(name, sizeof(name), "%s without its EOI", src->name);
+        check_frame(name, buf, len - 2, 0, &seed);
+    }
+
+    if (seconds > 0) {
+        printf("%-14s %8.2f GB/s\n", "jpg_index", bench_index(frames, seconds));
+        printf("%-14s %8.2f GB/s  (%u byte chunks)\n", "jpg_eoi_scan", bench_scan(frames, seconds), DMA_CHUNK);
+    }
+    return test_done("indextest");
+}
@@ -0,0 +1,397 @@
+// jpgetest: checks the kernels of the JPEG encoder against its scalar code, bit for bit.
+//
+// jpge.cpp is included whole so its static kernels can be called directly. Every forward DCT the CPU runs
+// (DCT2D_sse2, DCT2D_avx2 and whatever select_dct2d() dispatches to) has to give exactly the output of the
+// scalar DCT2D for random blocks, smooth gradients and blocks at the extremes of the 8 bit sample range:
+// constant -128 or 127, checkerboards, stripes, single spikes and the patterns that drive one coefficient to
+// its maximum. The scalar DCT2D itself has to stay within one of a double precision DCT. Built a second time
+// with JPGE_NO_SIMD as jpgetest-scalar, where dispatch has to fall back to DCT2D.
+//
+// Quantization by reciprocal has to be the rounded division (|x| + q / 2) / q for every quantizer q from 1 to
+// 255 and every |x| below 2^15. quantize(), quantize_avx2() and what select_quantize() picks have to give that,
+// with the sign of x, in zigzag order and with the right nonzero mask, for all those x of either sign and for
+// DCT output of random blocks under the standard tables at several qualities.
+//
+// With a number of seconds as argument it then measures each kernel, in blocks/s.
+#include <math.h>
+#include "../conversions/jpge.cpp"
+#include "test.h"
+
+using namespace jpge;
+
+#define RANDOM_BLOCKS   200000
+#define QUANT_BLOCKS    20000
+
+typedef struct {
+    const char *name;
+    dct2d_func_t fn;
+} dct_kernel_t;
+
+static const dct_kernel_t s_dct_kernels[] = {
+    { "DCT2D", DCT2D },
+#if JPGE_USE_SSE2
+    { "DCT2D_sse2", DCT2D_sse2 },
+#endif
+#if JPGE_USE_AVX2
+    { "DCT2D_avx2", DCT2D_avx2 },
+#endif
+};
+#define DCT_KERNEL_COUNT (int)(sizeof(s_dct_kernels) / sizeof(s_dct_kernels[0]))
+
+static bool kernel_runs(const dct_kernel_t *k)
+{
+#if JPGE_USE_AVX2
+    if (k->fn == DCT2D_avx2) {
+        return __builtin_cpu_supports("avx2");
+    }
+#endif
+    return true;
+}
+
+// Double precision DCT-II with the JPEG scaling, rounded: what DCT2D approximates
+static void dct_exact(const int32 *in, int32 *out)
+{
+    for (int v = 0; v < 8; v++) {
+        for (int u = 0; u < 8; u++) {
+            double sum = 0;
+            for (int y = 0; y < 8; y++) {
+                for (int x = 0; x < 8; x++) {
+                    sum += in[y * 8 + x] * cos((2 * x + 1) * u * M_PI / 16) * cos((2 * y + 1) * v * M_PI / 16);
+                }
+            }
+            sum *= (u ? 1 : M_SQRT1_2) * (v ? 1 : M_SQRT1_2) / 4;
+            out[v * 8 + u] = (int32)lround(sum);
+        }
+    }
+}
+
+// Run every kernel on one block and compare with the scalar DCT2D
+static void check_block(const int32 *block, const char *what, int n)
+{
+    int32 ref[64], exact[64], out[64];
+    memcpy(ref, block, sizeof(ref));
+    DCT2D(ref);
+
+    for (int k = 1; k < DCT_KERNEL_COUNT; k++) {
+        if (!kernel_runs(&s_dct_kernels[k])) {
+            continue;
+        }
+        memcpy(out, block, sizeof(out));
+        s_dct_kernels[k].fn(out);
+        for (int i = 0; i < 64; i++) {
+            if (out[i] != ref[i]) {
+                CHECK(0, "%s: %s block %d, coefficient %d is %d, DCT2D gives %d", s_dct_kernels[k].name, what, n, i, out[i], ref[i]);
+                break;
+            }
+        }
+    }
+    memcpy(out, block, sizeof(out));
+    select_dct2d()(out);
+    CHECK(!memcmp(out, ref, sizeof(out)), "select_dct2d(): %s block %d differs from DCT2D", what, n);
+
+    // the exact DCT is slow, check the scalar code against it on a sample only
+    if (n % 64 == 0) {
+        dct_exact(block, exact);
+        for (int i = 0; i < 64; i++) {
+            if (abs(ref[i] - exact[i]) > 1) {
+                CHECK(0, "DCT2D: %s block %d, coefficient %d is %d, exact DCT gives %d", what, n, i, ref[i], exact[i]);
+                break;
+            }
+        }
+    }
+}
+
+static void check_extremes(void)
+{
+    int32 block[64];
+    int n = 0;
+
+    // constant, every value of the range
+    for (int v = -128; v <= 127; v++) {
+        for (int i = 0; i < 64; i++) {
+            block[i] = v;
+        }
+        check_block(block, "constant", n++);
+    }
+
+    // every 64 bit pattern of -128 and 127 would be too many: take each row and column pattern, which
+    // covers the checkerboards, stripes and cosine sign patterns that maximize single coefficients
+    for (int rows = 0; rows < 256; rows++) {
+        for (int cols = 0; cols < 256; cols++) {
+            for (int i = 0; i < 64; i++) {
+                block[i] = (((rows >> (i / 8)) ^ (cols >> (i % 8))) & 1) ? 127 : -128;
+            }
+            check_block(block, "extreme pattern", n++);
+        }
+    }
+
+    // one spike of either extreme on a background of the other
+    for (int bg = 0; bg < 2; bg++) {
+        for (int p = 0; p < 64; p++) {
+            for (int i = 0; i < 64; i++) {
+                block[i] = (i == p) == bg ? -128 : 127;
+            }
+            check_block(block, "spike", n++);
+        }
+    }
+
+    // the sign pattern of each basis function, scaled to the full range
+    for (int v = 0; v < 8; v++) {
+        for (int u = 0; u < 8; u++) {
+            for (int i = 0; i < 64; i++) {
+                double c = cos((2 * (i % 8) + 1) * u * M_PI / 16) * cos((2 * (i / 8) + 1) * v * M_PI / 16);
+                block[i] = c >= 0 ? 127 : -128;
+            }
+            check_block(block, "basis sign", n++);
+        }
+    }
+}
+
+static void check_random(uint32_t *seed)
+{
+    int32 block[64];
+    for (int n = 0; n < RANDOM_BLOCKS; n++) {
+        if (n & 1) {
+            // noise anywhere in the range
+            for (int i = 0; i < 64; i++) {
+                block[i] = (int32)(test_rand(seed) & 0xFF) - 128;
+            }
+        } else {
+            // a gradient with some noise on it, like camera content
+            int base = (int)(test_rand(seed) & 0xFF), dx = (int)(test_rand(seed) % 33) - 16, dy = (int)(test_rand(seed) % 33) - 16;
+            for (int i = 0; i < 64; i++) {
+                int v = base + dx * (i % 8) + dy * (i / 8) + (int)(test_rand(seed) % 9) - 4;
+                block[i] = (v < 0 ? 0 : v > 255 ? 255 : v) - 128;
+            }
+        }
+        check_block(block, "random", n);
+    }
+}
+
+typedef struct {
+    const char *name;
+    quantize_func_t fn;
+} quant_kernel_t;
+
+static const quant_kernel_t s_quant_kernels[] = {
+    { "quantize", quantize },
+#if JPGE_USE_AVX2
+    { "quantize_avx2", quantize_avx2 },
+#endif
+};
+#define QUANT_KERNEL_COUNT (int)(sizeof(s_quant_kernels) / sizeof(s_quant_kernels[0]))
+
+static bool quant_kernel_runs(const quant_kernel_t *k)
+{
+#if JPGE_USE_AVX2
+    if (k->fn == quantize_avx2) {
+        return __builtin_cpu_supports("avx2");
+    }
+#endif
+    return true;
+}
+
+typedef struct {
+    uint16 recip[64], bias[64];
+    uint8 shift[64];
+    int32 q[64];
+} quant_table_t;
+
+static void make_quant_table(quant_table_t *t, const int32 *q)
+{
+    for (int i = 0; i < 64; i++) {
+        t->q[i] = q[i];
+        compute_quant_reciprocal(q[i], &t->recip[i], &t->bias[i], &t->shift[i]);
+    }
+}
+
+// The standard table scaled to a quality the way the encoder does it, in zigzag order like the reciprocals
+static void std_quant_table(quant_table_t *t, const int16 *std, int quality)
+{
+    int32 q[64];
+    int scale = quality < 50 ? 5000 / quality : 200 - quality * 2;
+    for (int i = 0; i < 64; i++) {
+        int32 j = (std[i] * scale + 50) / 100;
+        q[i] = j < 1 ? 1 : j > 255 ? 255 : j;
+    }
+    make_quant_table(t, q);
+}
+
+// Every q and |x|: the reciprocal multiply is the rounded division
+static void check_quant_reciprocal(void)
+{
+    for (int32 q = 1; q <= 255; q++) {
+        uint16 recip, bias;
+        uint8 shift;
+        compute_quant_reciprocal(q, &recip, &bias, &shift);
+        for (uint32 x = 0; x < 32768; x++) {
+            uint32 r = ((x + bias) * recip) >> shift, expect = (x + q / 2) / q;
+            if (r != expect) {
+                CHECK(0, "q %d: |x| %u quantizes to %u, (|x| + q / 2) / q is %u", q, x, r, expect);
+                break;
+            }
+        }
+    }
+}
+
+// Quantize one block with every kernel and compare with the division
+static void check_quant_block(const int32 *block, const quant_table_t *t, const char *what, int n)
+{
+    int16 expect[64], out[64];
+    uint64 expect_nonzero = 0;
+    for (int i = 0; i < 64; i++) {
+        int32 x = block[s_zag[i]], a = (x < 0 ? -x : x);
+        int32 r = (a + t->q[i] / 2) / t->q[i];
+        expect[i] = static_cast<int16>(x < 0 ? -r : r);
+        expect_nonzero |= static_cast<uint64>(r != 0) << i;
+    }
+    for (int k = 0; k < QUANT_KERNEL_COUNT + 1; k++) {
+        const char *name = k < QUANT_KERNEL_COUNT ? s_quant_kernels[k].name : "select_quantize()";
+        quantize_func_t fn = k < QUANT_KERNEL_COUNT ? s_quant_kernels[k].fn : select_quantize();
+        if (k < QUANT_KERNEL_COUNT && !quant_kernel_runs(&s_quant_kernels[k])) {
+            continue;
+        }
+        memset(out, 0x55, sizeof(out));
+        uint64 nonzero = fn(block, t->recip, t->bias, t->shift, out);
+        CHECK(!memcmp(out, expect, sizeof(out)), "%s: %s block %d differs from the division", name, what, n);
+        CHECK(nonzero == expect_nonzero, "%s: %s block %d nonzero mask 0x%016llx, expected 0x%016llx", name, what, n,
+              (unsigned long long)nonzero, (unsigned long long)expect_nonzero);
+    }
+}
+
+static void check_quantize(uint32_t *seed)
+{
+    quant_table_t t;
+    int32 q[64], block[64];
+    int n = 0;
+
+    // one q for the whole block, every x of either sign
+    for (int32 qv = 1; qv <= 255; qv++) {
+        for (int i = 0; i < 64; i++) {
+            q[i] = qv;
+        }
+        make_quant_table(&t, q);
+        for (int32 x = 0; x < 32768; x += 64) {
+            for (int i = 0; i < 64; i++) {
+                block[i] = x + i;
+            }
+            check_quant_block(block, &t, "positive", n++);
+            for (int i = 0; i < 64; i++) {
+                block[i] = -(x + i);
+            }
+            check_quant_block(block, &t, "negative", n++);
+        }
+    }
+
+    // DCT output of random blocks under the standard tables
+    static const int qualities[] = { 1, 10, 50, 75, 90, 100 };
+    for (int qi = 0; qi < (int)(sizeof(qualities) / sizeof(qualities[0])); qi++) {
+        for (int c = 0; c < 2; c++) {
+            std_quant_table(&t, c ? s_std_croma_quant : s_std_lum_quant, qualities[qi]);
+            for (int b = 0; b < QUANT_BLOCKS; b++) {
+                for (int i = 0; i < 64; i++) {
+                    block[i] = (int32)(test_rand(seed) % ((b & 3) ? 32 : 256)) - ((b & 3) ? 16 : 128);
+                }
+                DCT2D(block);
+                check_quant_block(block, &t, "random", n++);
+            }
+        }
+    }
+}
+
+// keeps the benchmarked results alive
+static volatile uint64 s_sink;
+
+static double bench_quantize(quantize_func_t fn, double seconds)
+{
+    enum { BLOCKS = 256 };
+    static int32 src[BLOCKS][64];
+    int16 out[64];
+    quant_table_t t;
+    uint32_t seed = 7;
+    std_quant_table(&t, s_std_lum_quant, 75);
+    for (int b = 0; b < BLOCKS; b++) {
+        for (int i = 0; i < 64; i++) {
+            src[b][i] = (int32)(test_rand(&seed) % 64) - 32;
+        }
+        DCT2D(src[b]);
+    }
+    size_t blocks = 0;
+    uint64 sink = 0;
+    double start = test_now(), t0;
+    do {
+        for (int b = 0; b < BLOCKS; b++) {
+            sink += fn(src[b], t.recip, t.bias, t.shift, out);
+        }
+        blocks += BLOCKS;
+    } while ((t0 = test_now() - start) < seconds);
+    s_sink = sink;
+    return blocks / t0;
+}
+
+static double bench_dct(dct2d_func_t fn, double seconds)
+{
+    enum { BLOCKS = 256 };
+    static int32 src[BLOCKS][64], work[BLOCKS][64];
+    uint32_t seed = 7;
+    for (int b = 0; b < BLOCKS; b++) {
+        for (int i = 0; i < 64; i++) {
+            src[b][i] = (int32)(test_rand(&seed) & 0xFF) - 128;
+        }
+    }
+    size_t blocks = 0;
+    double start = test_now(), t;
+    do {
+        memcpy(work, src, sizeof(work));
+        for (int b = 0; b < BLOCKS; b++) {
+            fn(work[b]);
+        }
+        blocks += BLOCKS;
+    } while ((t = test_now() - start) < seconds);
+    return blocks / t;
+}
+
+int main(int argc, char *argv[])
+{
+    double seconds = argc > 1 ? atof(argv[1]) : 0;
+    uint32_t seed = 1;
+
+#if JPGE_USE_SSE2
+    CHECK(select_dct2d() != DCT2D, "select_dct2d() picks the scalar DCT on an SSE2 host");
+#else
+    CHECK(select_dct2d() == DCT2D, "select_dct2d() without SIMD does not pick DCT2D");
+#endif
+    for (int k = 0; k < DCT_KERNEL_COUNT; k++) {
+        printf("%-14s %s\n", s_dct_kernels[k].name, kernel_runs(&s_dct_kernels[k]) ? "checked" : "not supported by this CPU");
+    }
+    check_extremes();
+    check_random(&seed);
+#if JPGE_USE_AVX2
+    CHECK(select_quantize() == (__builtin_cpu_supports("avx2") ? quantize_avx2 : quantize), "select_quantize() does not pick the fastest kernel");
+#else
+    CHECK(select_quantize() == quantize, "select_quantize() without SIMD does not pick quantize");
+#endif
+    for (int k = 0; k < QUANT_KERNEL_COUNT; k++) {
+        printf("%-14s %s\n", s_quant_kernels[k].name, quant_kernel_runs(&s_quant_kernels[k]) ? "checked" : "not supported by this CPU");
+    }
+    check_quant_reciprocal();
+    check_quantize(&seed);
+
+    if (seconds > 0) {
+        for (int k = 0; k < DCT_KERNEL_COUNT; k++) {
+            if (kernel_runs(&s_dct_kernels[k])) {
+                printf("%-14s %8.1f M blocks/s\n", s_dct_kernels[k].name, bench_dct(s_dct_kernels[k].fn, seconds) / 1e6);
+            }
+        }
+        for (int k = 0; k < QUANT_KERNEL_COUNT; k++) {
+            if (quant_kernel_runs(&s_quant_kernels[k])) {
+                printf("%-14s %8.1f M blocks/s\n", s_quant_kernels[k].name, bench_quantize(s_quant_kernels[k].fn, seconds) / 1e6);
+            }
+        }
+    }
+#ifdef JPGE_NO_SIMD
+    return test_done("jpgetest-scalar");
+#else
+    return test_done("jpgetest");
+#endif
+}
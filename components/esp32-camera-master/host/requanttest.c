@@ -0,0 +1,249 @@
+// requanttest: checks jpg_requantize() on the JPEGs in docu/ and on an SVGA fmt2jpg() encode.
+//
+// At quality 100 the tables of the source are kept, so the result has to have the same quantization tables and
+// decode to the same pixels. Going down in quality the result has to decode to an image of the same size that
+// gets smaller and further from the source, measured in PSNR against the decoded source. jpg_requantize_cb() has
+// to give the same bytes, and a quality outside of 1..100 is refused.
+//
+// With a number of seconds as argument it then measures jpg_requantize() in MB/s of source JPEG, next to
+// decoding and encoding again with fmt2jpg(), and reports bytes against PSNR for both at each quality.
+#include <math.h>
+#include <string.h>
+#include "esp_log.h"
+#include "img_converters.h"
+#include "test.h"
+
+#define SVGA_WIDTH      800
+#define SVGA_HEIGHT     600
+
+static const int s_qualities[] = { 100, 90, 75, 50, 30, 10 };
+#define QUALITY_COUNT   (int)(sizeof(s_qualities) / sizeof(s_qualities[0]))
+
+typedef struct {
+    const char *name;
+    uint8_t *jpg;
+    size_t len;
+    int width, height;
+    uint8_t *rgb;       // decoded
+} frame_t;
+
+typedef struct {
+    uint8_t *data;
+    size_t len, size;
+} cb_out_t;
+
+static size_t collect_cb(void *arg, size_t index, const void *data, size_t len)
+{
+    cb_out_t *out = (cb_out_t *)arg;
+    if (!data) {
+        return 0;
+    }
+    if (index + len > out->size) {
+        out->size = (index + len) * 2;
+        out->data = (uint8_t *)realloc(out->data, out->size);
+    }
+    memcpy(out->data + index, data, len);
+    out->len = index + len;
+    return len;
+}
+
+static uint8_t *decode(const uint8_t *jpg, size_t len, int *width, int *height)
+{
+    jpg_index_t index;
+    if (!jpg_index(jpg, len, &index)) {
+        return NULL;
+    }
+    uint8_t *rgb = (uint8_t *)malloc((size_t)index.width * index.height * 3);
+    if (!jpg2rgb888(jpg, len, rgb, JPG_SCALE_NONE)) {
+        free(rgb);
+        return NULL;
+    }
+    *width = index.width;
+    *height = index.height;
+    return rgb;
+}
+
+static double psnr(const uint8_t *a, const uint8_t *b, size_t len)
+{
+    double sum = 0;
+    for (size_t i = 0; i < len; i++) {
+        int d = a[i] - b[i];
+        sum += d * d;
+    }
+    return sum ? 10 * log10(255.0 * 255.0 * len / sum) : INFINITY;
+}
+
+// Decodes a result and gives its PSNR against the frame, 0 if it does not decode to the frame size
+static double result_psnr(const frame_t *f, const uint8_t *jpg, size_t len)
+{
+    int width, height;
+    uint8_t *rgb = decode(jpg, len, &width, &height);
+    double p = 0;
+    if (rgb && width == f->width && height == f->height) {
+        p = psnr(rgb, f->rgb, (size_t)width * height * 3);
+    }
+    free(rgb);
+    return p;
+}
+
+// Whether two JPEGs have the same quantization tables
+static bool same_tables(const uint8_t *a, size_t a_len, const uint8_t *b, size_t b_len)
+{
+    jpg_index_t ia, ib;
+    if (!jpg_index(a, a_len, &ia) || !jpg_index(b, b_len, &ib)) {
+        return false;
+    }
+    for (int t = 0; t < 4; t++) {
+        if (!ia.quant_offset[t] != !ib.quant_offset[t]) {
+            return false;
+        }
+        for (int k = 0; ia.quant_offset[t] && k < 64; k++) {
+            int qa = (ia.quant_16bit >> t & 1) ? a[ia.quant_offset[t] + k * 2] << 8 | a[ia.quant_offset[t] + k * 2 + 1] : a[ia.quant_offset[t] + k];
+            int qb = (ib.quant_16bit >> t & 1) ? b[ib.quant_offset[t] + k * 2] << 8 | b[ib.quant_offset[t] + k * 2 + 1] : b[ib.quant_offset[t] + k];
+            if (qa != qb) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+static void check_frame(const frame_t *f)
+{
+    size_t last_len = (size_t)-1;
+    double last_psnr = INFINITY;
+    for (int q = 0; q < QUALITY_COUNT; q++) {
+        uint8_t *out = NULL;
+        size_t out_len;
+        bool ok = jpg_requantize(f->jpg, f->len, s_qualities[q], &out, &out_len);
+        CHECK(ok, "%s, quality %d: jpg_requantize() failed", f->name, s_qualities[q]);
+        if (!ok) {
+            continue;
+        }
+        cb_out_t cb_out = { NULL, 0, 0 };
+        CHECK(jpg_requantize_cb(f->jpg, f->len, s_qualities[q], collect_cb, &cb_out), "%s, quality %d: jpg_requantize_cb() failed", f->name, s_qualities[q]);
+        CHECK(cb_out.len == out_len && !memcmp(cb_out.data, out, out_len), "%s, quality %d: jpg_requantize_cb() output differs", f->name, s_qualities[q]);
+        free(cb_out.data);
+
+        double p = result_psnr(f, out, out_len);
+        CHECK(p > 0, "%s, quality %d: result does not decode to %dx%d", f->name, s_qualities[q], f->width, f->height);
+        if (s_qualities[q] == 100) {
+            CHECK(isinf(p), "%s: quality 100 changes the pixels, PSNR %.2f dB", f->name, p);
+            CHECK(same_tables(f->jpg, f->len, out, out_len), "%s: quality 100 changes the quantization tables", f->name);
+        }
+        CHECK(out_len <= last_len && p <= last_psnr, "%s, quality %d: %u bytes at %.2f dB, more than at the quality before",
+              f->name, s_qualities[q], (unsigned)out_len, p);
+        last_len = out_len;
+        last_psnr = p;
+        free(out);
+    }
+
+    esp_log_level_t level = sim_log_level;
+    sim_log_level = ESP_LOG_NONE;
+    uint8_t *out = NULL;
+    size_t out_len;
+    CHECK(!jpg_requantize(f->jpg, f->len, 0, &out, &out_len), "%s: quality 0 accepted", f->name);
+    CHECK(!jpg_requantize(f->jpg, f->len, 101, &out, &out_len), "%s: quality 101 accepted", f->name);
+    sim_log_level = level;
+}
+
+// MB/s of source JPEG through jpg_requantize(), or through jpg2rgb888() and fmt2jpg() with reencode set
+static double bench(const frame_t *f, int quality, bool reencode, double seconds)
+{
+    uint8_t *rgb = (uint8_t *)malloc((size_t)f->width * f->height * 3);
+    size_t in = 0;
+    double start = test_now(), t;
+    do {
+        uint8_t *out = NULL;
+        size_t out_len;
+        if (reencode) {
+            jpg2rgb888(f->jpg, f->len, rgb, JPG_SCALE_NONE);
+            fmt2jpg(rgb, (size_t)f->width * f->height * 3, f->width, f->height, PIXFORMAT_RGB888, quality, &out, &out_len);
+        } else {
+            jpg_requantize(f->jpg, f->len, quality, &out, &out_len);
+        }
+        free(out);
+        in += f->len;
+    } while ((t = test_now() - start) < seconds);
+    free(rgb);
+    return in / t / 1e6;
+}
+
+// Bytes and PSNR against the decoded source of requantizing and of encoding the decoded source again
+static void report(const frame_t *f, double seconds)
+{
+    printf("%s, %dx%d, %u bytes\n", f->name, f->width, f->height, (unsigned)f->len);
+    printf("%7s  %-37s %s\n", "quality", "requantize", "decode + fmt2jpg");
+    for (int q = 1; q < QUALITY_COUNT; q++) {
+        uint8_t *out = NULL, *rgb = (uint8_t *)malloc((size_t)f->width * f->height * 3);
+        size_t req_len = 0, enc_len = 0;
+        double req_psnr = 0, enc_psnr = 0;
+        if (jpg_requantize(f->jpg, f->len, s_qualities[q], &out, &req_len)) {
+            req_psnr = result_psnr(f, out, req_len);
+            free(out);
+        }
+        out = NULL;
+        if (jpg2rgb888(f->jpg, f->len, rgb, JPG_SCALE_NONE)
+                && fmt2jpg(rgb, (size_t)f->width * f->height * 3, f->width, f->height, PIXFORMAT_RGB888, s_qualities[q], &out, &enc_len)) {
+            enc_psnr = result_psnr(f, out, enc_len);
+            free(out);
+        }
+        free(rgb);
+        printf("%7d %8u bytes %6.2f dB %7.1f MB/s %8u bytes %6.2f dB %7.1f MB/s\n", s_qualities[q],
+               (unsigned)req_len, req_psnr, bench(f, s_qualities[q], false, seconds),
+               (unsigned)enc_len, enc_psnr, bench(f, s_qualities[q], true, seconds));
+    }
+}
+
+// Smooth shapes, hard edges and some noise, as B, G, R
+static void make_image(uint8_t *bgr, int width, int height, uint32_t seed)
+{
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            uint8_t *p = bgr + (y * width + x) * 3;
+            int noise = (int)(test_rand(&seed) % 9) - 4;
+            int dx = x - width / 3, dy = y - height / 2;
+            bool disc = dx * dx + dy * dy < width * height / 12;
+            p[0] = (disc ? 200 : x * 240 / width) + noise + 4;
+            p[1] = (disc ? 30 : y * 200 / height) + noise + 4;
+            p[2] = ((x ^ y) & 16 ? 180 : 60) + noise;
+        }
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    double seconds = argc > 1 ? atof(argv[1]) : 0;
+    const char *paths[] = TEST_FRAMES;
+    frame_t frames[TEST_FRAME_COUNT + 1];
+    for (int f = 0; f < TEST_FRAME_COUNT; f++) {
+        frames[f].name = paths[f];
+        frames[f].jpg = test_load(paths[f], &frames[f].len);
+    }
+    uint8_t *bgr = (uint8_t *)malloc(SVGA_WIDTH * SVGA_HEIGHT * 3);
+    make_image(bgr, SVGA_WIDTH, SVGA_HEIGHT, 1);
+    frames[TEST_FRAME_COUNT].name = "fmt2jpg() RGB888, quality 90";
+    frames[TEST_FRAME_COUNT].jpg = NULL;
+    CHECK(fmt2jpg(bgr, SVGA_WIDTH * SVGA_HEIGHT * 3, SVGA_WIDTH, SVGA_HEIGHT, PIXFORMAT_RGB888, 90,
+                  &frames[TEST_FRAME_COUNT].jpg, &frames[TEST_FRAME_COUNT].len), "fmt2jpg() failed");
+    free(bgr);
+
+    for (int f = 0; f <= TEST_FRAME_COUNT; f++) {
+        frames[f].rgb = frames[f].jpg ? decode(frames[f].jpg, frames[f].len, &frames[f].width, &frames[f].height) : NULL;
+        CHECK(frames[f].rgb, "%s: does not decode", frames[f].name);
+        if (frames[f].rgb) {
+            check_frame(&frames[f]);
+        }
+    }
+
+    for (int f = 0; seconds > 0 && f <= TEST_FRAME_COUNT; f++) {
+        if (frames[f].rgb) {
+            report(&frames[f], seconds / QUALITY_COUNT);
+        }
+    }
+    for (int f = 0; f <= TEST_FRAME_COUNT; f++) {
+        free(frames[f].jpg);
+        free(frames[f].rgb);
+    }
+    return test_done("requanttest");
+}
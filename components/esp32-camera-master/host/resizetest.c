@@ -0,0 +1,327 @@
+// resizetest: checks fmt2resized() and fmt2resized_cb() for GRAYSCALE, RGB565, RGB888 and YUV422.
+//
+// Random images are resized with both filters: to their own size and to the size of a crop, which has to copy
+// the pixels; by integer ratios; and to sizes that are neither. The result has to match a floating point
+// reference of the filters as img_converters.h describes them, per channel (RGB565 as 8 bit channels rounded
+// back to 5 and 6 bits, YUYV as a Y plane and U, V planes of pixel pairs): copies and halving exactly, with
+// halves rounded up, the rest within 1 and 0.3 on average. A constant image stays constant. Nothing is
+// written past the output, and the callback gets the rows of the buffer in order, then NULL once.
+//
+// Crops that touch the edges are taken, crops past them refused, as are empty sizes, odd YUYV widths, unknown
+// filters and short source buffers.
+#include <math.h>
+#include <string.h>
+#include "esp_log.h"
+#include "img_converters.h"
+#include "test.h"
+
+#define SRC_WIDTH       96
+#define SRC_HEIGHT      72
+#define MAX_OUT         (2 * SRC_WIDTH * 2 * SRC_HEIGHT * 3)
+#define MAX_TAPS        (2 * SRC_WIDTH + 2)
+#define GUARD           16
+#define GUARD_BYTE      0xA5
+#define MAX_MEAN_DIFF   0.3
+
+static const pixformat_t s_formats[] = { PIXFORMAT_GRAYSCALE, PIXFORMAT_RGB565, PIXFORMAT_RGB888, PIXFORMAT_YUV422 };
+static const char *const s_format_names[] = { "GRAYSCALE", "RGB565", "RGB888", "YUV422" };
+static const int s_bpp[] = { 1, 2, 3, 2 };
+#define FORMAT_COUNT    (int)(sizeof(s_formats) / sizeof(s_formats[0]))
+
+static const char *const s_filter_names[] = { "box", "bilinear" };
+
+enum { EXACT, CLOSE };
+
+typedef struct {
+    img_rect_t crop;            // width 0 for none
+    uint16_t out_width, out_height;
+    int expect;                 // how close to the reference
+} resize_case_t;
+
+static const resize_case_t s_cases[] = {
+    { { 0, 0, 0, 0 }, SRC_WIDTH, SRC_HEIGHT, EXACT },                   // identity
+    { { 6, 4, 30, 20 }, 30, 20, EXACT },                                // crop only
+    { { 0, 0, SRC_WIDTH, 1 }, SRC_WIDTH, 1, EXACT },                    // top row
+    { { 0, SRC_HEIGHT - 1, SRC_WIDTH, 1 }, SRC_WIDTH, 1, EXACT },       // bottom row
+    { { SRC_WIDTH - 2, 0, 2, SRC_HEIGHT }, 2, SRC_HEIGHT, EXACT },      // right columns
+    { { 0, 0, 0, 0 }, SRC_WIDTH / 2, SRC_HEIGHT / 2, EXACT },           // halves
+    { { 0, 0, 0, 0 }, SRC_WIDTH / 3, SRC_HEIGHT / 3, CLOSE },           // thirds
+    { { 0, 0, 0, 0 }, SRC_WIDTH / 4, SRC_HEIGHT / 2, CLOSE },           // a quarter by a half
+    { { 10, 8, 48, 36 }, 12, 9, CLOSE },                                // quarters of a crop
+    { { 0, 0, 0, 0 }, SRC_WIDTH * 2, SRC_HEIGHT * 2, CLOSE },           // doubled
+    { { 0, 0, 0, 0 }, 70, 50, CLOSE },                                  // a bit smaller
+    { { 0, 0, 0, 0 }, 58, 29, CLOSE },
+    { { 0, 0, 0, 0 }, 130, 101, CLOSE },                                // a bit larger
+    { { 7, 5, 33, 21 }, 50, 40, CLOSE },                                // odd crop, enlarged
+    { { 3, 1, 80, 61 }, 40, 30, CLOSE },                                // odd crop, about halved
+};
+#define CASE_COUNT      (int)(sizeof(s_cases) / sizeof(s_cases[0]))
+
+// Source samples one output sample reads, with their weights
+typedef struct {
+    int n;
+    int k[MAX_TAPS];
+    double w[MAX_TAPS];
+} taps_t;
+
+static int clampi(int v, int lo, int hi)
+{
+    return v < lo ? lo : v > hi ? hi : v;
+}
+
+// Output sample j of out over the source span [start, start + len), reading samples lo..hi only
+static void ref_taps(taps_t *t, img_resize_filter_t filter, double start, double len, int out, int j, int lo, int hi)
+{
+    double step = len / out;
+    t->n = 0;
+    if (filter == IMG_RESIZE_BILINEAR) {
+        // between the two source centers around the output center
+        double c = start + (j + 0.5) * step - 0.5;
+        int k = c <= lo ? lo : (int)floor(c);
+        double f = c <= lo ? 0 : c - k;
+        if (k >= hi) {
+            k = hi;
+            f = 0;
+        }
+        t->k[t->n] = k;
+        t->w[t->n++] = 1 - f;
+        if (f > 0) {
+            t->k[t->n] = k + 1;
+            t->w[t->n++] = f;
+        }
+        return;
+    }
+    // every source sample with the part of it the output sample covers
+    double a = start + j * step, b = a + step;
+    for (int k = (int)floor(a); k < b; k++) {
+        double overlap = fmin(k + 1, b) - fmax(k, a);
+        if (overlap > 1e-9) {
+            t->k[t->n] = clampi(k, lo, hi);
+            t->w[t->n++] = overlap / step;
+        }
+    }
+}
+
+// Planes of an image: 1 for GRAYSCALE, R, G, B (8 bit) for RGB565 and RGB888, Y and U, V of pairs for YUYV
+static int plane_count(pixformat_t format)
+{
+    return format == PIXFORMAT_GRAYSCALE ? 1 : 3;
+}
+
+static bool half_plane(pixformat_t format, int plane)
+{
+    return format == PIXFORMAT_YUV422 && plane > 0;
+}
+
+static int sample(pixformat_t format, const uint8_t *img, int width, int plane, int x, int y)
+{
+    const uint8_t *row = img + (size_t)y * width * (format == PIXFORMAT_GRAYSCALE ? 1 : format == PIXFORMAT_RGB888 ? 3 : 2);
+    if (format == PIXFORMAT_GRAYSCALE) {
+        return row[x];
+    }
+    if (format == PIXFORMAT_RGB888) {
+        return row[x * 3 + plane];
+    }
+    if (format == PIXFORMAT_YUV422) {
+        return plane ? row[x * 4 + 2 * plane - 1] : row[x * 2];
+    }
+    uint16_t v = row[x * 2] << 8 | row[x * 2 + 1];
+    int c = plane == 0 ? (v >> 11) << 3 : plane == 1 ? ((v >> 5) & 63) << 2 : (v & 31) << 3;
+    return plane == 1 ? (c | c >> 6) : (c | c >> 5);
+}
+
+// Sample as the output stores it: RGB565 channels as 5 or 6 bit values
+static int packed(pixformat_t format, int plane, int v8)
+{
+    if (format != PIXFORMAT_RGB565) {
+        return v8;
+    }
+    int max = plane == 1 ? 63 : 31;
+    return (int)floor(v8 * max / 255.0 + 0.5);
+}
+
+static int out_sample(pixformat_t format, const uint8_t *img, int width, int plane, int x, int y)
+{
+    if (format != PIXFORMAT_RGB565) {
+        return sample(format, img, width, plane, x, y);
+    }
+    const uint8_t *p = img + ((size_t)y * width + x) * 2;
+    uint16_t v = p[0] << 8 | p[1];
+    return plane == 0 ? v >> 11 : plane == 1 ? (v >> 5) & 63 : v & 31;
+}
+
+static void random_image(uint8_t *img, size_t len, uint32_t *seed)
+{
+    for (size_t i = 0; i < len; i++) {
+        img[i] = test_rand(seed);
+    }
+}
+
+typedef struct {
+    uint8_t *data;
+    size_t len, size;
+    int end_calls;
+    bool out_of_order;
+} cb_out_t;
+
+static size_t collect_cb(void *arg, size_t index, const void *data, size_t len)
+{
+    cb_out_t *out = (cb_out_t *)arg;
+    if (index != out->len || out->end_calls) {
+        out->out_of_order = true;
+    }
+    if (!data) {
+        out->end_calls++;
+        return 0;
+    }
+    if (out->len + len > out->size) {
+        out->size = (out->len + len) * 2;
+        out->data = (uint8_t *)realloc(out->data, out->size);
+    }
+    memcpy(out->data + out->len, data, len);
+    out->len += len;
+    return len;
+}
+
+static void check_case(int f, img_resize_filter_t filter, const resize_case_t *rc, const uint8_t *src, uint8_t *buf)
+{
+    static taps_t htaps, vtaps;
+    const pixformat_t format = s_formats[f];
+    const img_rect_t *crop = rc->crop.width ? &rc->crop : NULL;
+    const img_rect_t c = crop ? rc->crop : (img_rect_t) { 0, 0, SRC_WIDTH, SRC_HEIGHT };
+    const int ow = rc->out_width, oh = rc->out_height;
+    const size_t out_len = (size_t)ow * oh * s_bpp[f];
+    char what[128];
+    snprintf(what, sizeof(what), "%s %s, crop %ux%u at %u,%u to %dx%d", s_format_names[f], s_filter_names[filter],
+             c.width, c.height, c.x, c.y, ow, oh);
+
+    memset(buf, GUARD_BYTE, out_len + 2 * GUARD);
+    uint8_t *out = buf + GUARD;
+    bool ok = fmt2resized(src, (size_t)SRC_WIDTH * SRC_HEIGHT * s_bpp[f], SRC_WIDTH, SRC_HEIGHT, format, crop, ow, oh, filter, out);
+    CHECK(ok, "%s: fmt2resized() failed", what);
+    if (!ok) {
+        return;
+    }
+    bool guarded = true;
+    for (int i = 0; i < GUARD; i++) {
+        guarded = guarded && buf[i] == GUARD_BYTE && out[out_len + i] == GUARD_BYTE;
+    }
+    CHECK(guarded, "%s: writes outside the output", what);
+
+    cb_out_t cb_out = { NULL, 0, 0, 0, false };
+    CHECK(fmt2resized_cb(src, (size_t)SRC_WIDTH * SRC_HEIGHT * s_bpp[f], SRC_WIDTH, SRC_HEIGHT, format, crop, ow, oh, filter, collect_cb, &cb_out),
+          "%s: fmt2resized_cb() failed", what);
+    CHECK(!cb_out.out_of_order && cb_out.end_calls == 1, "%s: callback out of order or not ended once", what);
+    CHECK(cb_out.len == out_len && !memcmp(cb_out.data, out, out_len), "%s: callback output differs", what);
+    free(cb_out.data);
+
+    int max_diff = 0, count = 0;
+    double sum = 0;
+    for (int p = 0; p < plane_count(format); p++) {
+        // a plane of pixel pairs starts at the crop's x in half pairs and reads the pairs the crop touches
+        const bool half = half_plane(format, p);
+        const int pw = half ? ow / 2 : ow;
+        const double x0 = half ? c.x / 2.0 : c.x, xlen = half ? c.width / 2.0 : c.width;
+        const int xlo = half ? c.x / 2 : c.x, xhi = half ? (c.x + c.width - 1) / 2 : c.x + c.width - 1;
+        for (int y = 0; y < oh; y++) {
+            ref_taps(&vtaps, filter, c.y, c.height, oh, y, c.y, c.y + c.height - 1);
+            for (int x = 0; x < pw; x++) {
+                ref_taps(&htaps, filter, x0, xlen, pw, x, xlo, xhi);
+                double v = 0;
+                for (int j = 0; j < vtaps.n; j++) {
+                    for (int i = 0; i < htaps.n; i++) {
+                        v += vtaps.w[j] * htaps.w[i] * sample(format, src, SRC_WIDTH, p, htaps.k[i], vtaps.k[j]);
+                    }
+                }
+                int expect = packed(format, p, (int)floor(v + 0.5));
+                int got = out_sample(format, out, ow, p, x, y);
+                int d = abs(got - expect);
+                max_diff = d > max_diff ? d : max_diff;
+                sum += d;
+                count++;
+            }
+        }
+    }
+    double mean = sum / count;
+    if (rc->expect == CLOSE) {
+        CHECK(max_diff <= 1 && mean <= MAX_MEAN_DIFF, "%s: differs from the reference by up to %d, %.3f on average", what, max_diff, mean);
+    } else {
+        CHECK(!max_diff, "%s: differs from the reference by up to %d, %.3f on average", what, max_diff, mean);
+    }
+}
+
+static void check_constant(int f, img_resize_filter_t filter, uint8_t *src, uint8_t *buf)
+{
+    const pixformat_t format = s_formats[f];
+    // a mid gray that RGB565 holds exactly
+    static const uint8_t pixel[][4] = { { 0x5A }, { 0x8C, 0x51 }, { 0x21, 0x84, 0xC6 }, { 0x80, 0x40, 0x80, 0xC0 } };
+    for (int i = 0; i < SRC_WIDTH * SRC_HEIGHT; i++) {
+        if (format == PIXFORMAT_YUV422) {
+            memcpy(src + i * 2, pixel[f] + (i & 1) * 2, 2);
+        } else {
+            memcpy(src + i * s_bpp[f], pixel[f], s_bpp[f]);
+        }
+    }
+    for (int n = 0; n < CASE_COUNT; n++) {
+        const resize_case_t *rc = &s_cases[n];
+        const img_rect_t *crop = rc->crop.width ? &rc->crop : NULL;
+        bool ok = fmt2resized(src, (size_t)SRC_WIDTH * SRC_HEIGHT * s_bpp[f], SRC_WIDTH, SRC_HEIGHT, format, crop,
+                              rc->out_width, rc->out_height, filter, buf);
+        bool constant = ok;
+        for (int i = 0; ok && i < rc->out_width * rc->out_height; i++) {
+            const uint8_t *expect = format == PIXFORMAT_YUV422 ? pixel[f] + (i & 1) * 2 : pixel[f];
+            constant = constant && !memcmp(buf + i * s_bpp[f], expect, s_bpp[f]);
+        }
+        CHECK(constant, "%s %s: constant image to %dx%d is not constant", s_format_names[f], s_filter_names[filter], rc->out_width, rc->out_height);
+    }
+}
+
+static void check_refused(uint8_t *src, uint8_t *buf)
+{
+    const size_t len = SRC_WIDTH * SRC_HEIGHT * 3;
+    const img_rect_t edge = { SRC_WIDTH - 10, SRC_HEIGHT - 10, 10, 10 };
+    const img_rect_t past_x = { SRC_WIDTH - 10, 0, 11, 10 }, past_y = { 0, SRC_HEIGHT - 10, 10, 11 };
+    const img_rect_t empty_w = { 0, 0, 0, 10 }, empty_h = { 0, 0, 10, 0 };
+    const img_rect_t far = { 65535, 0, 2, 2 };
+
+    CHECK(fmt2resized(src, len, SRC_WIDTH, SRC_HEIGHT, PIXFORMAT_RGB888, &edge, 5, 5, IMG_RESIZE_BOX, buf), "crop at the bottom right corner refused");
+
+    esp_log_level_t level = sim_log_level;
+    sim_log_level = ESP_LOG_NONE;
+    CHECK(!fmt2resized(src, len, SRC_WIDTH, SRC_HEIGHT, PIXFORMAT_RGB888, &past_x, 5, 5, IMG_RESIZE_BOX, buf), "crop past the right edge taken");
+    CHECK(!fmt2resized(src, len, SRC_WIDTH, SRC_HEIGHT, PIXFORMAT_RGB888, &past_y, 5, 5, IMG_RESIZE_BOX, buf), "crop past the bottom edge taken");
+    CHECK(!fmt2resized(src, len, SRC_WIDTH, SRC_HEIGHT, PIXFORMAT_RGB888, &empty_w, 5, 5, IMG_RESIZE_BOX, buf), "crop of no width taken");
+    CHECK(!fmt2resized(src, len, SRC_WIDTH, SRC_HEIGHT, PIXFORMAT_RGB888, &empty_h, 5, 5, IMG_RESIZE_BOX, buf), "crop of no height taken");
+    CHECK(!fmt2resized(src, len, SRC_WIDTH, SRC_HEIGHT, PIXFORMAT_RGB888, &far, 5, 5, IMG_RESIZE_BOX, buf), "crop far outside taken");
+    CHECK(!fmt2resized(src, len, SRC_WIDTH, SRC_HEIGHT, PIXFORMAT_RGB888, NULL, 0, 5, IMG_RESIZE_BOX, buf), "output of no width taken");
+    CHECK(!fmt2resized(src, len, SRC_WIDTH, SRC_HEIGHT, PIXFORMAT_RGB888, NULL, 5, 0, IMG_RESIZE_BOX, buf), "output of no height taken");
+    CHECK(!fmt2resized(src, len, SRC_WIDTH, SRC_HEIGHT, PIXFORMAT_RGB888, NULL, 5, 5, (img_resize_filter_t)2, buf), "unknown filter taken");
+    CHECK(!fmt2resized(src, len - 1, SRC_WIDTH, SRC_HEIGHT, PIXFORMAT_RGB888, NULL, 5, 5, IMG_RESIZE_BOX, buf), "short source taken");
+    CHECK(!fmt2resized(src, len, SRC_WIDTH, SRC_HEIGHT, PIXFORMAT_JPEG, NULL, 5, 5, IMG_RESIZE_BOX, buf), "JPEG source taken");
+    CHECK(!fmt2resized(src, len, SRC_WIDTH, SRC_HEIGHT, PIXFORMAT_YUV422, NULL, 5, 6, IMG_RESIZE_BOX, buf), "odd YUYV output width taken");
+    CHECK(!fmt2resized(src, len, SRC_WIDTH - 1, SRC_HEIGHT, PIXFORMAT_YUV422, NULL, 6, 6, IMG_RESIZE_BOX, buf), "odd YUYV source width taken");
+    sim_log_level = level;
+}
+
+int main(void)
+{
+    uint32_t seed = 1;
+    uint8_t *src = (uint8_t *)malloc(SRC_WIDTH * SRC_HEIGHT * 3);
+    uint8_t *buf = (uint8_t *)malloc(MAX_OUT + 2 * GUARD);
+
+    for (int f = 0; f < FORMAT_COUNT; f++) {
+        random_image(src, SRC_WIDTH * SRC_HEIGHT * 3, &seed);
+        for (int filter = IMG_RESIZE_BOX; filter <= IMG_RESIZE_BILINEAR; filter++) {
+            for (int n = 0; n < CASE_COUNT; n++) {
+                check_case(f, (img_resize_filter_t)filter, &s_cases[n], src, buf);
+            }
+        }
+        for (int filter = IMG_RESIZE_BOX; filter <= IMG_RESIZE_BILINEAR; filter++) {
+            check_constant(f, (img_resize_filter_t)filter, src, buf);
+        }
+    }
+    check_refused(src, buf);
+    free(src);
+    free(buf);
+    return test_done("resizetest");
+}
@@ -0,0 +1,65 @@
+// SCCB of the host build: an OV2640 at 0x30 with its two register banks, in place of driver/sccb.c
+#include <stdint.h>
+#include <string.h>
+#include "esp_log.h"
+#include "sccb.h"
+
+#define OV2640_ADDR     0x30
+#define BANK_SEL        0xFF
+#define BANK_SENSOR     1
+#define COM7            0x12
+#define COM7_SRST       0x80
+
+static const char* TAG = "sccb";
+
+static uint8_t s_regs[2][256];
+
+static void ov2640_reset(void)
+{
+    memset(s_regs, 0, sizeof(s_regs));
+    s_regs[BANK_SENSOR][0x0A] = 0x26;   // PID
+    s_regs[BANK_SENSOR][0x0B] = 0x42;   // VER
+    s_regs[BANK_SENSOR][0x1C] = 0x7F;   // MIDH
+    s_regs[BANK_SENSOR][0x1D] = 0xA2;   // MIDL
+}
+
+int SCCB_Init(int pin_sda, int pin_scl)
+{
+    ESP_LOGI(TAG, "pin_sda %d pin_scl %d", pin_sda, pin_scl);
+    ov2640_reset();
+    return 0;
+}
+
+uint8_t SCCB_Probe()
+{
+    return OV2640_ADDR;
+}
+
+uint8_t SCCB_Read(uint8_t slv_addr, uint8_t reg)
+{
+    if (slv_addr != OV2640_ADDR) {
+        ESP_LOGE(TAG, "SCCB_Read Failed addr:0x%02x, reg:0x%02x", slv_addr, reg);
+        return -1;
+    }
+    uint8_t bank = s_regs[0][BANK_SEL] & 1;
+    return reg == BANK_SEL ? s_regs[0][BANK_SEL] : s_regs[bank][reg];
+}
+
+uint8_t SCCB_Write(uint8_t slv_addr, uint8_t reg, uint8_t data)
+{
+    if (slv_addr != OV2640_ADDR) {
+        ESP_LOGE(TAG, "SCCB_Write Failed addr:0x%02x, reg:0x%02x, data:0x%02x", slv_addr, reg, data);
+        return -1;
+    }
+    uint8_t bank = s_regs[0][BANK_SEL] & 1;
+    if (reg == BANK_SEL) {
+        s_regs[0][BANK_SEL] = data;
+    } else if (bank == BANK_SENSOR && reg == COM7 && (data & COM7_SRST)) {
+        uint8_t sel = s_regs[0][BANK_SEL];
+        ov2640_reset();
+        s_regs[0][BANK_SEL] = sel;
+    } else {
+        s_regs[bank][reg] = data;
+    }
+    return 0;
+}
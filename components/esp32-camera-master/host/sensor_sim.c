@@ -0,0 +1,218 @@
+// The OV2640 and the I2S DMA of the host build, played by one thread.
+//
+// Every frame period the thread pulses VSYNC, its falling edge ending the previous frame like on the camera,
+// then sends the JPEG at the pixel clock. Bytes go into the DMA descriptor I2S0.in_link points at, one per
+// 32 bit sample as in SM_0A00_0B00, and a full descriptor raises in_done before the next one in the chain is
+// used. While rx_start is clear the bytes are lost. Each frame carries a COM segment with its sequence number
+// right after SOI, so consumers can tell dropped and damaged frames apart.
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include "esp_log.h"
+#include "esp_system.h"
+#include "soc/i2s_struct.h"
+#include "esp32/rom/lldesc.h"
+#include "sim.h"
+
+#define SIM_MODE_JPEG       3   // SM_0A00_0B00
+#define SEQ_HEADER_LEN      14  // SOI, then COM: FF FE, length, "csim", 32 bit sequence number
+#define IDLE_CHUNK          256 // bytes sent at once while no descriptor takes them
+#define MAX_LATE_US         100
+
+static const char* TAG = "sensor_sim";
+
+static sim_sensor_config_t s_config;
+static pthread_t s_thread;
+static volatile bool s_running;
+static volatile uint32_t s_sent;
+static volatile int64_t s_slip_us;
+static lldesc_t *s_desc;
+static size_t s_desc_pos;
+
+static const char s_tag[4] = { 'c', 's', 'i', 'm' };
+
+static size_t build_frame(uint32_t seq, uint8_t *out)
+{
+    const uint8_t *src = s_config.frames[seq % s_config.count];
+    size_t len = s_config.lens[seq % s_config.count];
+    uint8_t *p = out;
+    *p++ = 0xFF;
+    *p++ = 0xD8;
+    *p++ = 0xFF;
+    *p++ = 0xFE;
+    *p++ = 0;
+    *p++ = SEQ_HEADER_LEN - 4;
+    memcpy(p, s_tag, sizeof(s_tag));
+    p += sizeof(s_tag);
+    *p++ = seq >> 24;
+    *p++ = seq >> 16;
+    *p++ = seq >> 8;
+    *p++ = seq;
+    memcpy(p, src + 2, len - 2);
+    p += len - 2;
+    memset(p, 0, s_config.pad);
+    return p + s_config.pad - out;
+}
+
+// Room left in the current descriptor, after taking a new link the driver started
+static size_t dma_room(void)
+{
+    sim_i2s_poll();
+    if (I2S0.in_link.start) {
+        I2S0.in_link.start = 0;
+        s_desc = (lldesc_t *)(uintptr_t)I2S0.in_link.addr;
+        s_desc_pos = 0;
+    }
+    if (!I2S0.conf.rx_start || !s_desc) {
+        return 0;
+    }
+    if (I2S0.fifo_conf.rx_fifo_mod != SIM_MODE_JPEG) {
+        static bool logged;
+        if (!logged) {
+            ESP_LOGE(TAG, "Only SM_0A00_0B00 is emulated, not %u", I2S0.fifo_conf.rx_fifo_mod);
+            logged = true;
+        }
+        return 0;
+    }
+    return (s_desc->size - s_desc_pos) / sizeof(uint32_t);
+}
+
+// DMA up to len bytes, returns how many the bus took, lost ones included
+static size_t dma_push(const uint8_t *data, size_t len)
+{
+    size_t n = dma_room();
+    if (!n) {
+        return len;
+    }
+    if (n > len) {
+        n = len;
+    }
+    volatile uint32_t *dst = (volatile uint32_t *)(s_desc->buf + s_desc_pos);
+    for (size_t i = 0; i < n; i++) {
+        dst[i] = (uint32_t)data[i] << 16;
+    }
+    s_desc_pos += n * sizeof(uint32_t);
+    if (s_desc_pos == s_desc->size) {
+        s_desc = s_desc->qe.stqe_next;
+        s_desc_pos = 0;
+        sim_i2s_in_done();
+    }
+    return n;
+}
+
+static void *sensor_main(void *arg)
+{
+    size_t max_len = 0;
+    for (size_t i = 0; i < s_config.count; i++) {
+        if (s_config.lens[i] > max_len) {
+            max_len = s_config.lens[i];
+        }
+    }
+    uint8_t *frame = (uint8_t *)malloc(max_len + SEQ_HEADER_LEN + s_config.pad);
+    if (!frame) {
+        ESP_LOGE(TAG, "Frame buffer malloc failed");
+        return NULL;
+    }
+
+    int64_t period = 1000000 / s_config.fps;
+    int64_t t_frame = esp_timer_get_time();
+    for (uint32_t seq = 0; s_running; seq++) {
+        size_t len = build_frame(seq, frame);
+
+        sim_gpio_input(s_config.pin_vsync, 1);
+        sim_sleep_until(t_frame + s_config.vsync_us);
+        sim_gpio_input(s_config.pin_vsync, 0);
+        if (seq) {
+            // the driver has seen the end of the previous frame
+            s_sent = seq;
+        }
+
+        int64_t t_data = t_frame + s_config.vsync_us;
+        for (size_t pos = 0; pos < len && s_running; ) {
+            size_t n = dma_room();
+            if (!n) {
+                n = IDLE_CHUNK;
+            }
+            if (n > len - pos) {
+                n = len - pos;
+            }
+            // hand over the bytes once the last of them has arrived. When the host kept the thread from running,
+            // the rest of the frame comes late rather than in a burst the pixel clock could never produce.
+            int64_t due = t_data + (int64_t)(pos + n) * 1000000 / s_config.pclk_hz;
+            int64_t late = esp_timer_get_time() - due;
+            if (late > MAX_LATE_US) {
+                t_data += late;
+                due += late;
+                s_slip_us += late;
+            }
+            sim_sleep_until(due);
+            pos += dma_push(frame + pos, n);
+        }
+        t_frame += period;
+        sim_sleep_until(t_frame);
+    }
+    free(frame);
+    return NULL;
+}
+
+bool sim_sensor_start(const sim_sensor_config_t *config)
+{
+    void *probe = malloc(64);
+    bool low = (uintptr_t)probe <= UINT32_MAX;
+    free(probe);
+    if (!low) {
+        // I2S0.in_link.addr is 32 bit like on the chip, the driver's descriptors have to be below 4 GB
+        ESP_LOGE(TAG, "Heap above 4 GB, link with -no-pie");
+        return false;
+    }
+    if (!config->count || config->fps <= 0 || !config->pclk_hz) {
+        return false;
+    }
+    s_config = *config;
+    s_sent = 0;
+    s_slip_us = 0;
+    s_desc = NULL;
+    s_running = true;
+    sim_gpio_input(s_config.pin_vsync, 0);
+    if (pthread_create(&s_thread, NULL, sensor_main, NULL)) {
+        s_running = false;
+        return false;
+    }
+    return true;
+}
+
+void sim_sensor_stop(void)
+{
+    if (s_running) {
+        s_running = false;
+        pthread_join(s_thread, NULL);
+    }
+}
+
+uint32_t sim_sensor_sent(void)
+{
+    return s_sent;
+}
+
+int64_t sim_sensor_slip_us(void)
+{
+    return s_slip_us;
+}
+
+bool sim_sensor_check(const uint8_t *buf, size_t len, uint32_t *seq)
+{
+    *seq = UINT32_MAX;
+    if (len < SEQ_HEADER_LEN || buf[0] != 0xFF || buf[1] != 0xD8 || buf[2] != 0xFF || buf[3] != 0xFE
+            || memcmp(buf + 6, s_tag, sizeof(s_tag))) {
+        return false;
+    }
+    *seq = (uint32_t)buf[10] << 24 | buf[11] << 16 | buf[12] << 8 | buf[13];
+    const uint8_t *src = s_config.frames[*seq % s_config.count];
+    size_t src_len = s_config.lens[*seq % s_config.count];
+    size_t n = src_len - 2 + SEQ_HEADER_LEN;
+    // dma_finish_frame() adds a byte at lengths divisible by 512 or 100
+    if (len < n || len > n + 2) {
+        return false;
+    }
+    return !memcmp(buf + SEQ_HEADER_LEN, src + 2, src_len - 2);
+}
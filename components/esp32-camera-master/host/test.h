@@ -0,0 +1,85 @@
+// What the host tests share: checks that count failures instead of stopping, file loading, a reproducible
+// random source, a hash to pin down outputs and a timer for the benchmarks. Each test is one program, so
+// everything is static here.
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "esp_system.h"
+
+// docu/ as seen from host/, the JPEGs the tests use as camera frames
+#define TEST_FRAMES { "../../../docu/esp32-cam.jpg", "../../../docu/menue.jpg" }
+#define TEST_FRAME_COUNT 2
+
+static int test_failures;
+
+// Report and count a failed condition, then go on with the next check
+#define CHECK(cond, ...) do {                                           \
+        if (!(cond)) {                                                  \
+            if (test_failures++ < 50) {                                 \
+                printf("FAIL %s:%d: ", __FILE__, __LINE__);             \
+                printf(__VA_ARGS__);                                    \
+                printf("\n");                                           \
+            }                                                           \
+        }                                                               \
+    } while (0)
+
+// Print the summary line and give the exit code of the test
+static inline int test_done(const char *name)
+{
+    if (test_failures) {
+        printf("%s: %d checks failed\n", name, test_failures);
+        return 1;
+    }
+    printf("%s: ok\n", name);
+    return 0;
+}
+
+static inline uint8_t *test_load(const char *path, size_t *len)
+{
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        perror(path);
+        exit(2);
+    }
+    fseek(f, 0, SEEK_END);
+    *len = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    uint8_t *buf = (uint8_t *)malloc(*len);
+    if (!buf || fread(buf, 1, *len, f) != *len) {
+        fprintf(stderr, "%s: read failed\n", path);
+        exit(2);
+    }
+    fclose(f);
+    return buf;
+}
+
+// xorshift32, the same sequence on every run and host
+static inline uint32_t test_rand(uint32_t *state)
+{
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
+
+// FNV-1a, 64 bit
+static inline uint64_t test_hash(const void *data, size_t len)
+{
+    const uint8_t *p = (const uint8_t *)data;
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ p[i]) * 0x100000001b3ULL;
+    }
+    return h;
+}
+
+// Seconds since the program started
+static inline double test_now(void)
+{
+    return esp_timer_get_time() / 1e6;
+}
@@ -0,0 +1,333 @@
+// tojpgtest: checks the line converters fmt2jpg() runs RGB888 and RGB565 frames through and the output streams
+// the conversions write to, and measures the converters.
+//
+// to_jpg.cpp is included whole so its static converters and streams can be used directly. convert_line_format() has to
+// give R, G, B as the plain per pixel conversion does, for every width from 1 to a few hundred and for lines
+// deeper in the frame, and must not write past width * 3 bytes. Built a second time with JPGE_NO_SIMD as
+// tojpgtest-scalar, where only the scalar loops run.
+//
+// memory_stream (fmt2jpg_buf()): writes that do not fit return false and leave the buffer alone, a JPEG that
+// fits exactly is written whole, one byte less fails without writing past the buffer. callback_stream
+// (fmt2jpg_cb()): a callback that takes fewer bytes than it was given, at the start, around a flush or in the
+// last write, fails the conversion, and is not called again after that. chain_stream (fmt2jpg()): detach()
+// gives everything written, through put_buf() and through the write buffer, in order and in one piece,
+// whether it fit the first chunk or took several; with nothing written, or a second time, it gives NULL, and
+// the stream can be written again after it.
+//
+// With a number of seconds as argument it then measures, in Mpixels/s per pixel format, the line converters
+// and fmt2jpg() as a whole. GRAYSCALE and YUV422 are read by the encoder in place and have no converter.
+#include "../conversions/to_jpg.cpp"
+#include "test.h"
+#include "esp_log.h"
+
+#define MAX_LINE        300
+#define LINES           3
+#define GUARD           16
+#define GUARD_BYTE      0xA5
+#define BENCH_WIDTH     800
+#define BENCH_HEIGHT    600
+#define STREAM_WIDTH    160
+#define STREAM_HEIGHT   120
+
+static const pixformat_t s_formats[] = { PIXFORMAT_GRAYSCALE, PIXFORMAT_YUV422, PIXFORMAT_RGB565, PIXFORMAT_RGB888 };
+static const char *const s_format_names[] = { "GRAYSCALE", "YUV422", "RGB565", "RGB888" };
+static const int s_bpp[] = { 1, 2, 2, 3 };
+#define FORMAT_COUNT    (int)(sizeof(s_formats) / sizeof(s_formats[0]))
+
+// One pixel as the encoder takes it
+static void reference_pixel(const uint8_t *src, pixformat_t format, uint8_t *rgb)
+{
+    if (format == PIXFORMAT_RGB888) {
+        rgb[0] = src[2];
+        rgb[1] = src[1];
+        rgb[2] = src[0];
+    } else {
+        uint16_t v = src[0] << 8 | src[1];
+        rgb[0] = (v >> 11) << 3;
+        rgb[1] = ((v >> 5) & 0x3F) << 2;
+        rgb[2] = (v & 0x1F) << 3;
+    }
+}
+
+static void check_converter(pixformat_t format, const char *name, int bpp)
+{
+    static uint8_t src[MAX_LINE * LINES * 3];
+    uint8_t out[MAX_LINE * 3 + GUARD];
+    uint32_t seed = 1;
+    for (size_t i = 0; i < sizeof(src); i++) {
+        src[i] = test_rand(&seed);
+    }
+    for (int width = 1; width <= MAX_LINE; width++) {
+        for (int line = 0; line < LINES; line++) {
+            memset(out, GUARD_BYTE, sizeof(out));
+            convert_line_format(src, format, out, width, line);
+            int bad = -1;
+            for (int x = 0; x < width && bad < 0; x++) {
+                uint8_t rgb[3];
+                reference_pixel(src + ((size_t)line * width + x) * bpp, format, rgb);
+                if (memcmp(out + x * 3, rgb, 3)) {
+                    bad = x;
+                }
+            }
+            CHECK(bad < 0, "%s, width %d, line %d: pixel %d differs", name, width, line, bad);
+            bool guard = true;
+            for (int i = 0; i < GUARD; i++) {
+                guard &= out[width * 3 + i] == GUARD_BYTE;
+            }
+            CHECK(guard, "%s, width %d, line %d: written past the line", name, width, line);
+        }
+    }
+}
+
+// Random bytes, different for each seed
+static void fill(uint8_t *buf, size_t len, uint32_t seed)
+{
+    for (size_t i = 0; i < len; i++) {
+        buf[i] = test_rand(&seed);
+    }
+}
+
+// A frame that codes to some kilobytes at quality 90, a few flushes of callback_stream
+static uint8_t *make_stream_frame(size_t *len)
+{
+    uint8_t *src = (uint8_t *)malloc(STREAM_WIDTH * STREAM_HEIGHT * 3);
+    fill(src, STREAM_WIDTH * STREAM_HEIGHT * 3, 7);
+    *len = STREAM_WIDTH * STREAM_HEIGHT * 3;
+    return src;
+}
+
+static void check_memory_stream(const uint8_t *src, size_t src_len, const uint8_t *jpg, size_t jpg_len)
+{
+    uint8_t buf[64 + GUARD], data[64];
+    fill(data, sizeof(data), 3);
+
+    // the stream alone: what fits is written, what does not is refused without touching the buffer
+    memset(buf, GUARD_BYTE, sizeof(buf));
+    memory_stream stream(buf, 64);
+    esp_log_level_t level = sim_log_level;
+    sim_log_level = ESP_LOG_NONE;
+    CHECK(stream.put_buf(data, 40), "memory_stream: 40 of 64 bytes refused");
+    CHECK(!stream.put_buf(data + 40, 25), "memory_stream: 25 bytes accepted with 24 left");
+    CHECK(stream.get_size() == 40 && buf[40] == GUARD_BYTE, "memory_stream: refused write changed the buffer");
+    jpge::uint room = 0;
+    CHECK(!stream.get_write_buf(25, &room), "memory_stream: write buffer of 25 bytes with 24 left");
+    jpge::uint8 *w = stream.get_write_buf(24, &room);
+    CHECK(w == buf + 40 && room == 24, "memory_stream: write buffer at %d, %u bytes, expected 40, 24", w ? (int)(w - buf) : -1, room);
+    if (w) {
+        memcpy(w, data + 40, 24);
+        stream.commit_write_buf(24);
+    }
+    CHECK(!stream.put_buf(data, 1), "memory_stream: a byte accepted when full");
+    CHECK(stream.put_buf(NULL, 0), "memory_stream: end of image refused when full");
+    CHECK(stream.get_size() == 64 && !memcmp(buf, data, 64), "memory_stream: content differs");
+    sim_log_level = level;
+
+    // a whole conversion: the exact size is enough, a byte less fails and stays inside the buffer
+    uint8_t *out = (uint8_t *)malloc(jpg_len + GUARD);
+    for (int less = 0; less <= 1; less++) {
+        size_t out_len = 0;
+        memset(out, GUARD_BYTE, jpg_len + GUARD);
+        sim_log_level = ESP_LOG_NONE;
+        bool ok = fmt2jpg_buf((uint8_t *)src, src_len, STREAM_WIDTH, STREAM_HEIGHT, PIXFORMAT_RGB888, 90, out, jpg_len - less, &out_len);
+        sim_log_level = level;
+        if (less) {
+            CHECK(!ok, "fmt2jpg_buf(): %u bytes into %u accepted", (unsigned)jpg_len, (unsigned)(jpg_len - 1));
+        } else {
+            CHECK(ok && out_len == jpg_len && !memcmp(out, jpg, jpg_len), "fmt2jpg_buf(): exact size failed or differs");
+        }
+        bool guard = true;
+        for (size_t i = jpg_len - less; i < jpg_len + GUARD; i++) {
+            guard &= out[i] == GUARD_BYTE;
+        }
+        CHECK(guard, "fmt2jpg_buf(), %u bytes less: written past the buffer", (unsigned)less);
+    }
+    free(out);
+}
+
+typedef struct {
+    size_t limit;       // bytes taken in all before a write comes up short
+    size_t taken;
+    int calls, calls_after_short;
+    bool short_write, ended;
+} short_cb_t;
+
+static size_t short_cb(void *arg, size_t index, const void *data, size_t len)
+{
+    short_cb_t *s = (short_cb_t *)arg;
+    if (s->short_write) {
+        s->calls_after_short++;
+    }
+    s->calls++;
+    if (!data) {
+        s->ended = true;
+        return 0;
+    }
+    if (s->taken + len > s->limit) {
+        len = s->limit - s->taken;
+        s->short_write = true;
+    }
+    s->taken += len;
+    return len;
+}
+
+static void check_callback_stream(const uint8_t *src, size_t src_len, size_t jpg_len)
+{
+    // the stream alone: a short write is an error, and nothing reaches the callback after it, not even the end
+    uint8_t flush_buf[CONFIG_JPEG_ENCODER_CB_FLUSH_SIZE], data[16];
+    fill(data, sizeof(data), 9);
+    short_cb_t alone = { 10, 0, 0, 0, false, false };
+    callback_stream stream(short_cb, &alone, flush_buf);
+    CHECK(!stream.put_buf(data, 16), "callback_stream: 10 of 16 bytes taken, write not refused");
+    CHECK(!stream.put_buf(data, 4), "callback_stream: write after a short one not refused");
+    CHECK(!stream.put_buf(NULL, 0), "callback_stream: end after a short write not refused");
+    CHECK(!alone.calls_after_short && !alone.ended, "callback_stream: %d calls after a short write", alone.calls_after_short);
+
+    const size_t flush = CONFIG_JPEG_ENCODER_CB_FLUSH_SIZE;
+    const size_t limits[] = { 0, 1, flush - 1, flush, flush + 1, jpg_len - 1, jpg_len };
+    esp_log_level_t level = sim_log_level;
+    for (size_t i = 0; i < sizeof(limits) / sizeof(limits[0]); i++) {
+        short_cb_t s = { limits[i], 0, 0, 0, false, false };
+        sim_log_level = ESP_LOG_NONE;
+        bool ok = fmt2jpg_cb((uint8_t *)src, src_len, STREAM_WIDTH, STREAM_HEIGHT, PIXFORMAT_RGB888, 90, short_cb, &s);
+        sim_log_level = level;
+        if (limits[i] < jpg_len) {
+            CHECK(!ok, "fmt2jpg_cb(): short write after %u of %u bytes not reported", (unsigned)limits[i], (unsigned)jpg_len);
+            CHECK(!s.calls_after_short, "fmt2jpg_cb(): %d calls after a short write after %u bytes", s.calls_after_short, (unsigned)limits[i]);
+        } else {
+            CHECK(ok && s.taken == jpg_len && s.ended, "fmt2jpg_cb(): %u of %u bytes taken, end %s", (unsigned)s.taken, (unsigned)jpg_len, s.ended ? "called" : "missing");
+        }
+    }
+}
+
+// Writes count bytes of data into a chain_stream in pieces, alternating put_buf() and the write buffer
+static bool write_chain(chain_stream *stream, const uint8_t *data, size_t count, uint32_t seed)
+{
+    size_t o = 0;
+    while (o < count) {
+        size_t n = 1 + test_rand(&seed) % 700;
+        n = n < count - o ? n : count - o;
+        if (test_rand(&seed) & 1) {
+            if (!stream->put_buf(data + o, n)) {
+                return false;
+            }
+        } else {
+            jpge::uint room = 0;
+            jpge::uint8 *w = stream->get_write_buf(n, &room);
+            if (!w || room < n) {
+                return false;
+            }
+            memcpy(w, data + o, n);
+            stream->commit_write_buf(n);
+        }
+        o += n;
+    }
+    return stream->put_buf(NULL, 0);
+}
+
+static void check_chain_stream(const uint8_t *src, size_t src_len, const uint8_t *jpg, size_t jpg_len)
+{
+    static uint8_t data[20000];
+    fill(data, sizeof(data), 5);
+    // fits the first chunk, just does not, takes many
+    const size_t counts[][2] = { { 1000, 4096 }, { 4097, 4096 }, { sizeof(data), 16 } };
+    for (size_t i = 0; i < sizeof(counts) / sizeof(counts[0]); i++) {
+        chain_stream stream(counts[i][1]);
+        CHECK(write_chain(&stream, data, counts[i][0], i + 1), "chain_stream: %u bytes from %u refused", (unsigned)counts[i][0], (unsigned)counts[i][1]);
+        CHECK(stream.get_size() == counts[i][0], "chain_stream: size %u, %u written", stream.get_size(), (unsigned)counts[i][0]);
+        uint8_t *out = stream.detach();
+        CHECK(out && !memcmp(out, data, counts[i][0]), "chain_stream: %u bytes from %u detached differ", (unsigned)counts[i][0], (unsigned)counts[i][1]);
+        CHECK(!stream.get_size() && !stream.detach(), "chain_stream: something left after detach()");
+        free(out);
+        // and it starts over
+        CHECK(write_chain(&stream, data + 1, 100, i + 1), "chain_stream: write after detach() refused");
+        out = stream.detach();
+        CHECK(out && !memcmp(out, data + 1, 100), "chain_stream: write after detach() differs");
+        free(out);
+    }
+    chain_stream empty(4096);
+    CHECK(!empty.detach(), "chain_stream: detach() of nothing is not NULL");
+
+    // fmt2jpg() starts the chain at an estimate noise goes far past
+    uint8_t *out = NULL;
+    size_t out_len = 0;
+    CHECK(fmt2jpg((uint8_t *)src, src_len, STREAM_WIDTH, STREAM_HEIGHT, PIXFORMAT_RGB888, 90, &out, &out_len)
+          && out_len == jpg_len && !memcmp(out, jpg, jpg_len), "fmt2jpg(): differs from fmt2jpg_buf()");
+    free(out);
+}
+
+// Mpixels/s through convert_line_format(), a frame at a time
+static double bench_converter(const uint8_t *src, pixformat_t format, double seconds)
+{
+    static uint8_t line[BENCH_WIDTH * 3];
+    size_t pixels = 0;
+    double start = test_now(), t;
+    do {
+        for (int y = 0; y < BENCH_HEIGHT; y++) {
+            convert_line_format((uint8_t *)src, format, line, BENCH_WIDTH, y);
+        }
+        pixels += BENCH_WIDTH * BENCH_HEIGHT;
+    } while ((t = test_now() - start) < seconds);
+    return pixels / t / 1e6;
+}
+
+// Mpixels/s through fmt2jpg() at quality 75
+static double bench_fmt2jpg(const uint8_t *src, pixformat_t format, int bpp, double seconds)
+{
+    size_t pixels = 0;
+    double start = test_now(), t;
+    do {
+        uint8_t *out = NULL;
+        size_t out_len;
+        fmt2jpg((uint8_t *)src, (size_t)BENCH_WIDTH * BENCH_HEIGHT * bpp, BENCH_WIDTH, BENCH_HEIGHT, format, 75, &out, &out_len);
+        free(out);
+        pixels += BENCH_WIDTH * BENCH_HEIGHT;
+    } while ((t = test_now() - start) < seconds);
+    return pixels / t / 1e6;
+}
+
+int main(int argc, char *argv[])
+{
+    double seconds = argc > 1 ? atof(argv[1]) : 0;
+
+    check_converter(PIXFORMAT_RGB888, "RGB888", 3);
+    check_converter(PIXFORMAT_RGB565, "RGB565", 2);
+
+    size_t src_len, jpg_len = 0;
+    uint8_t *src = make_stream_frame(&src_len);
+    uint8_t *jpg = (uint8_t *)malloc(src_len * 2);
+    CHECK(fmt2jpg_buf(src, src_len, STREAM_WIDTH, STREAM_HEIGHT, PIXFORMAT_RGB888, 90, jpg, src_len * 2, &jpg_len), "fmt2jpg_buf() failed");
+    CHECK(jpg_len > STREAM_WIDTH * STREAM_HEIGHT / 4 + 1024 && jpg_len > 2 * CONFIG_JPEG_ENCODER_CB_FLUSH_SIZE,
+          "%u bytes of JPEG, too few for the stream checks", (unsigned)jpg_len);
+    if (jpg_len) {
+        check_memory_stream(src, src_len, jpg, jpg_len);
+        check_callback_stream(src, src_len, jpg_len);
+        check_chain_stream(src, src_len, jpg, jpg_len);
+    }
+    free(jpg);
+    free(src);
+
+    if (seconds > 0) {
+        // smooth rows with some noise, so the encoder sees something like a picture
+        uint8_t *src = (uint8_t *)malloc(BENCH_WIDTH * BENCH_HEIGHT * 3);
+        uint32_t seed = 1;
+        for (int i = 0; i < BENCH_WIDTH * BENCH_HEIGHT * 3; i++) {
+            src[i] = (i / 3 % BENCH_WIDTH) * 200 / BENCH_WIDTH + test_rand(&seed) % 16;
+        }
+        for (int f = 0; f < FORMAT_COUNT; f++) {
+            bool converted = s_formats[f] == PIXFORMAT_RGB888 || s_formats[f] == PIXFORMAT_RGB565;
+            printf("%dx%d %-9s", BENCH_WIDTH, BENCH_HEIGHT, s_format_names[f]);
+            if (converted) {
+                printf(" %8.1f Mpixels/s line converter", bench_converter(src, s_formats[f], seconds));
+            } else {
+                printf(" %8s %-24s", "", "read in place");
+            }
+            printf(" %8.1f Mpixels/s fmt2jpg()\n", bench_fmt2jpg(src, s_formats[f], s_bpp[f], seconds));
+        }
+        free(src);
+    }
+#ifdef JPGE_NO_SIMD
+    return test_done("tojpgtest-scalar");
+#else
+    return test_done("tojpgtest");
+#endif
+}
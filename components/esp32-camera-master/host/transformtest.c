@@ -0,0 +1,224 @@
+// transformtest: checks jpg_transform() against the same rotation, mirror and crop done on decoded pixels.
+//
+// The JPEGs in docu/ and fmt2jpg() encodes of a generated image as GRAYSCALE (8x8 MCUs), YUV422 (16x8) and
+// RGB888 (16x16), at a size with partial MCUs on both edges, go through every transform uncropped, with crops
+// on the MCU grid and with a crop that is not. The result is decoded with jpg2rgb888() and has to match the
+// decoded source, cropped and widened to the MCU grid the way img_converters.h describes it and then rotated or
+// mirrored pixel by pixel. Only the coefficients move, so cropped alone the pixels are the same, and rotated or
+// mirrored they differ at most by the rounding of the IDCT, which does not commute exactly with those. jpg_transform_cb() has to give the same
+// bytes as jpg_transform().
+#include <string.h>
+#include "esp_log.h"
+#include "img_converters.h"
+#include "test.h"
+
+#define IMAGE_WIDTH     100
+#define IMAGE_HEIGHT    75
+#define MAX_DIFF        4       // per channel
+#define MAX_MEAN_DIFF   0.25
+
+static const char *const s_transform_names[] = { "none", "flip h", "flip v", "transpose", "transverse", "rot 90", "rot 180", "rot 270" };
+#define TRANSFORM_COUNT (int)(sizeof(s_transform_names) / sizeof(s_transform_names[0]))
+
+// Output pixel (ox, oy) is source pixel (a, b), or (b, a) if transposed, each mirrored within the region if set:
+// { transposed, source columns mirrored, source rows mirrored }
+static const uint8_t s_geometry[TRANSFORM_COUNT][3] = {
+    { 0, 0, 0 },    // none
+    { 0, 1, 0 },    // flip h
+    { 0, 0, 1 },    // flip v
+    { 1, 0, 0 },    // transpose
+    { 1, 1, 1 },    // transverse
+    { 1, 0, 1 },    // rot 90, the left column becomes the top row
+    { 0, 1, 1 },    // rot 180
+    { 1, 1, 0 },    // rot 270, the right column becomes the top row
+};
+
+typedef struct {
+    uint8_t *data;
+    size_t len, size;
+} cb_out_t;
+
+static size_t collect_cb(void *arg, size_t index, const void *data, size_t len)
+{
+    cb_out_t *out = (cb_out_t *)arg;
+    if (!data) {
+        return 0;
+    }
+    if (index + len > out->size) {
+        out->size = (index + len) * 2;
+        out->data = (uint8_t *)realloc(out->data, out->size);
+    }
+    memcpy(out->data + index, data, len);
+    out->len = index + len;
+    return len;
+}
+
+static uint8_t *decode(const uint8_t *jpg, size_t len, jpg_index_t *index)
+{
+    if (!jpg_index(jpg, len, index)) {
+        return NULL;
+    }
+    uint8_t *rgb = (uint8_t *)malloc((size_t)index->width * index->height * 3);
+    if (!jpg2rgb888(jpg, len, rgb, JPG_SCALE_NONE)) {
+        free(rgb);
+        return NULL;
+    }
+    return rgb;
+}
+
+// One transform of one crop, compared with the pixel domain reference
+static void check_transform(const char *name, const uint8_t *jpg, size_t len, const jpg_index_t *src_index, const uint8_t *src_rgb,
+                            int t, const img_rect_t *crop)
+{
+    const int mcu_w = 8 * (src_index->sampling >> 4), mcu_h = 8 * (src_index->sampling & 15);
+    const bool transposed = s_geometry[t][0], mirror_x = s_geometry[t][1], mirror_y = s_geometry[t][2];
+    img_rect_t c = { 0, 0, src_index->width, src_index->height };
+    char what[128];
+    if (crop) {
+        c = *crop;
+    }
+    snprintf(what, sizeof(what), "%s, %s, crop %ux%u at %u,%u", name, s_transform_names[t], c.width, c.height, c.x, c.y);
+
+    // the crop widened to the MCU grid at its top left, partial MCUs that would move to the top or left dropped
+    int x0 = c.x - c.x % mcu_w, y0 = c.y - c.y % mcu_h;
+    int w = c.x + c.width - x0, h = c.y + c.height - y0;
+    if (mirror_x) {
+        w -= w % mcu_w;
+    }
+    if (mirror_y) {
+        h -= h % mcu_h;
+    }
+    int out_w = transposed ? h : w, out_h = transposed ? w : h;
+
+    uint8_t *out = NULL;
+    size_t out_len = 0;
+    bool ok = jpg_transform(jpg, len, (jpg_transform_t)t, crop, &out, &out_len);
+    CHECK(ok, "%s: jpg_transform() failed", what);
+    if (!ok) {
+        return;
+    }
+    cb_out_t cb_out = { NULL, 0, 0 };
+    CHECK(jpg_transform_cb(jpg, len, (jpg_transform_t)t, crop, collect_cb, &cb_out), "%s: jpg_transform_cb() failed", what);
+    CHECK(cb_out.len == out_len && !memcmp(cb_out.data, out, out_len), "%s: jpg_transform_cb() output differs", what);
+    free(cb_out.data);
+
+    jpg_index_t index;
+    uint8_t *rgb = decode(out, out_len, &index);
+    CHECK(rgb, "%s: result does not decode", what);
+    if (rgb) {
+        CHECK(index.width == out_w && index.height == out_h, "%s: result is %ux%u, expected %dx%d", what, index.width, index.height, out_w, out_h);
+    }
+    if (rgb && index.width == out_w && index.height == out_h) {
+        int max_diff = 0;
+        double sum = 0;
+        for (int oy = 0; oy < out_h; oy++) {
+            for (int ox = 0; ox < out_w; ox++) {
+                int a = transposed ? oy : ox, b = transposed ? ox : oy;
+                int sx = x0 + (mirror_x ? w - 1 - a : a), sy = y0 + (mirror_y ? h - 1 - b : b);
+                const uint8_t *p = rgb + ((size_t)oy * out_w + ox) * 3;
+                const uint8_t *e = src_rgb + ((size_t)sy * src_index->width + sx) * 3;
+                for (int i = 0; i < 3; i++) {
+                    int d = abs(p[i] - e[i]);
+                    max_diff = d > max_diff ? d : max_diff;
+                    sum += d;
+                }
+            }
+        }
+        double mean = sum / ((double)out_w * out_h * 3);
+        // without a transform the blocks are the same ones
+        int limit = t == JPG_TRANSFORM_NONE ? 0 : MAX_DIFF;
+        CHECK(max_diff <= limit && mean <= MAX_MEAN_DIFF, "%s: pixels differ by up to %d, %.3f on average", what, max_diff, mean);
+    }
+    free(rgb);
+    free(out);
+}
+
+// Every transform of a JPEG, uncropped, cropped on the MCU grid and cropped off it
+static void check_jpeg(const char *name, const uint8_t *jpg, size_t len)
+{
+    jpg_index_t index;
+    uint8_t *rgb = decode(jpg, len, &index);
+    CHECK(rgb, "%s: does not decode", name);
+    if (!rgb) {
+        return;
+    }
+    const int mcu_w = 8 * (index.sampling >> 4), mcu_h = 8 * (index.sampling & 15);
+    const int mw = index.width / mcu_w, mh = index.height / mcu_h;
+    const img_rect_t crops[] = {
+        // one MCU in from the top left, whole MCUs up to one before the edges
+        { (uint16_t)mcu_w, (uint16_t)mcu_h, (uint16_t)((mw - 2) * mcu_w), (uint16_t)((mh - 2) * mcu_h) },
+        // a single MCU at the top left
+        { 0, 0, (uint16_t)mcu_w, (uint16_t)mcu_h },
+        // the bottom right corner, partial MCUs included
+        { (uint16_t)((mw - 1) * mcu_w), (uint16_t)((mh - 1) * mcu_h), (uint16_t)(index.width - (mw - 1) * mcu_w), (uint16_t)(index.height - (mh - 1) * mcu_h) },
+        // off the grid, widened to it
+        { 5, 3, (uint16_t)(3 * mcu_w + 7), (uint16_t)(2 * mcu_h + 5) },
+    };
+    for (int t = 0; t < TRANSFORM_COUNT; t++) {
+        check_transform(name, jpg, len, &index, rgb, t, NULL);
+        for (size_t i = 0; i < sizeof(crops) / sizeof(crops[0]); i++) {
+            check_transform(name, jpg, len, &index, rgb, t, &crops[i]);
+        }
+    }
+    free(rgb);
+}
+
+// Smooth shapes with some noise, as B, G, R
+static void make_image(uint8_t *bgr, int width, int height, uint32_t seed)
+{
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            uint8_t *p = bgr + (y * width + x) * 3;
+            int noise = (int)(test_rand(&seed) % 9) - 4;
+            int dx = x - width / 3, dy = y - height / 2;
+            bool disc = dx * dx + dy * dy < width * height / 12;
+            p[0] = (disc ? 200 : x * 255 / width) + noise + 4;
+            p[1] = (disc ? 30 : y * 200 / height) + noise + 4;
+            p[2] = ((x ^ y) & 16 ? 180 : 60) + noise;
+        }
+    }
+}
+
+int main(void)
+{
+    const char *paths[] = TEST_FRAMES;
+    for (int f = 0; f < TEST_FRAME_COUNT; f++) {
+        size_t len;
+        uint8_t *jpg = test_load(paths[f], &len);
+        check_jpeg(paths[f], jpg, len);
+        free(jpg);
+    }
+
+    static const pixformat_t formats[] = { PIXFORMAT_GRAYSCALE, PIXFORMAT_YUV422, PIXFORMAT_RGB888 };
+    static const char *const format_names[] = { "GRAYSCALE", "YUV422", "RGB888" };
+    uint8_t *bgr = (uint8_t *)malloc(IMAGE_WIDTH * IMAGE_HEIGHT * 3), *src = (uint8_t *)malloc(IMAGE_WIDTH * IMAGE_HEIGHT * 3);
+    make_image(bgr, IMAGE_WIDTH, IMAGE_HEIGHT, 1);
+    for (int f = 0; f < 3; f++) {
+        size_t src_len = IMAGE_WIDTH * IMAGE_HEIGHT * 3, len;
+        uint8_t *jpg = NULL;
+        char name[64];
+        if (formats[f] == PIXFORMAT_GRAYSCALE) {
+            src_len = IMAGE_WIDTH * IMAGE_HEIGHT;
+            for (size_t i = 0; i < src_len; i++) {
+                src[i] = bgr[i * 3 + 1];
+            }
+        } else if (formats[f] == PIXFORMAT_YUV422) {
+            src_len = IMAGE_WIDTH * IMAGE_HEIGHT * 2;
+            for (size_t i = 0; i < src_len / 2; i++) {
+                src[i * 2] = bgr[i * 3 + 1];
+                src[i * 2 + 1] = (i & 1) ? bgr[i * 3 + 2] : bgr[i * 3];
+            }
+        } else {
+            memcpy(src, bgr, src_len);
+        }
+        snprintf(name, sizeof(name), "%s %dx%d", format_names[f], IMAGE_WIDTH, IMAGE_HEIGHT);
+        CHECK(fmt2jpg(src, src_len, IMAGE_WIDTH, IMAGE_HEIGHT, formats[f], 90, &jpg, &len), "%s: fmt2jpg() failed", name);
+        if (jpg) {
+            check_jpeg(name, jpg, len);
+        }
+        free(jpg);
+    }
+    free(bgr);
+    free(src);
+    return test_done("transformtest");
+}
@@ -0,0 +1,205 @@
+// yuvtest: checks the YUV422 row converters against yuv2rgb(), and yuv2rgb() against the conversion formula.
+//
+// yuv.c is included whole, and the test is built four times: with and without SIMD (JPGE_NO_SIMD), each for
+// BT.601 limited range and for full range (YUV_FULL_RANGE).
+//
+// yuv2rgb() has to match the formula for every (y, u, v), and give a green value worked out by hand for one of
+// them, which pins down the U and V green terms the table used to have the wrong way round. Then every (y, u, v)
+// goes through yuv422_to_rgb888_row(), yuv422_to_rgb565_row() and yuv422_to_gray_row() as pixels of 256 pixel
+// rows, which have to give what yuv2rgb() gives for each pixel. Last, random rows of every width up to MAX_WIDTH, at every
+// source and destination alignment, are converted between guard bytes: the output has to match the per pixel
+// conversion, an odd last pixel taking V = 128, and nothing outside the row may be written.
+//
+// With a number of seconds as argument it then measures each row converter, in Mpixels/s.
+#include <string.h>
+#include "../conversions/yuv.c"
+#include "test.h"
+
+#define MAX_WIDTH       100
+#define GUARD           32
+#define GUARD_BYTE      0xA5
+#define FUZZ_ROUNDS     20
+#define BENCH_WIDTH     1600
+
+#if YUV_USE_SSE2
+#define SIMD_NAME       "SSE2"
+#else
+#define SIMD_NAME       "scalar"
+#endif
+// BT.601 in thousandths, written out again rather than taken from yuv.c: y offset, y, v to r, u to g, v to g, u to b
+#ifdef YUV_FULL_RANGE
+#define RANGE_NAME      "full range"
+static const int s_matrix[6] = { 0, 1000, 1402, -344, -714, 1772 };
+#define PINNED_G        87
+#else
+#define RANGE_NAME      "limited range"
+static const int s_matrix[6] = { 16, 1164, 1596, -391, -813, 2018 };
+#define PINNED_G        82
+#endif
+
+typedef void (*row_func_t)(const uint8_t *src, uint8_t *dst, size_t width);
+
+typedef struct {
+    const char *name;
+    row_func_t fn;
+    int bytes;          // per output pixel
+} row_kernel_t;
+
+static const row_kernel_t s_kernels[] = {
+    { "yuv422_to_rgb888_row", yuv422_to_rgb888_row, 3 },
+    { "yuv422_to_rgb565_row", yuv422_to_rgb565_row, 2 },
+    { "yuv422_to_gray_row", yuv422_to_gray_row, 1 },
+};
+#define KERNEL_COUNT    (int)(sizeof(s_kernels) / sizeof(s_kernels[0]))
+
+static int clamp(int v)
+{
+    return v < 0 ? 0 : v > 255 ? 255 : v;
+}
+
+// The conversion as the header describes it, each term truncated toward zero
+static void formula(int y, int u, int v, int *r, int *g, int *b)
+{
+    int yt = s_matrix[1] * (y - s_matrix[0]) / 1000;
+    *r = clamp(yt + s_matrix[2] * (v - 128) / 1000);
+    *g = clamp(yt + s_matrix[3] * (u - 128) / 1000 + s_matrix[4] * (v - 128) / 1000);
+    *b = clamp(yt + s_matrix[5] * (u - 128) / 1000);
+}
+
+// What a row converter has to write for one pixel
+static void expect_pixel(int kernel, uint8_t y, uint8_t u, uint8_t v, uint8_t *dst)
+{
+    uint8_t r, g, b;
+    yuv2rgb(y, u, v, &r, &g, &b);
+    if (kernel == 0) {
+        dst[0] = b;
+        dst[1] = g;
+        dst[2] = r;
+    } else if (kernel == 1) {
+        put_rgb565(dst, r, g, b);
+    } else {
+        yuv2rgb(y, 128, 128, &r, &g, &b);
+        dst[0] = r;
+    }
+}
+
+static void check_yuv2rgb(void)
+{
+    // Worked out by hand, not by formula(): G takes 0.391 (0.344) of U - 128 and 0.813 (0.714) of V - 128. The
+    // hand written limited range table yuv.c had before swapped the two and gave 178 here.
+    uint8_t r, g, b;
+    yuv2rgb(128, 16, 240, &r, &g, &b);
+    CHECK(g == PINNED_G, "yuv2rgb(128, 16, 240): G is %d, expected %d", g, PINNED_G);
+
+    for (int y = 0; y < 256; y++) {
+        for (int u = 0; u < 256; u++) {
+            for (int v = 0; v < 256; v++) {
+                uint8_t r, g, b;
+                int er, eg, eb;
+                yuv2rgb(y, u, v, &r, &g, &b);
+                formula(y, u, v, &er, &eg, &eb);
+                CHECK(r == er && g == eg && b == eb, "yuv2rgb(%d, %d, %d) is %d %d %d, expected %d %d %d", y, u, v, r, g, b, er, eg, eb);
+            }
+        }
+    }
+}
+
+// Rows of 256 pixels in 128 pairs y = 2k, 2k + 1, one row per (u, v): every (y, u, v) is converted once
+static void check_exhaustive(void)
+{
+    uint8_t src[256 * 2], out[256 * 3], expect[3];
+    for (int u = 0; u < 256; u++) {
+        for (int v = 0; v < 256; v++) {
+            for (int i = 0; i < 256; i += 2) {
+                src[i * 2] = i;
+                src[i * 2 + 1] = u;
+                src[i * 2 + 2] = i + 1;
+                src[i * 2 + 3] = v;
+            }
+            for (int k = 0; k < KERNEL_COUNT; k++) {
+                s_kernels[k].fn(src, out, 256);
+                for (int i = 0; i < 256; i++) {
+                    expect_pixel(k, i, u, v, expect);
+                    if (memcmp(out + i * s_kernels[k].bytes, expect, s_kernels[k].bytes)) {
+                        CHECK(0, "%s: y %d, u %d, v %d differs from yuv2rgb()", s_kernels[k].name, i, u, v);
+                        break;
+                    }
+                }
+            }
+        }
+    }
+}
+
+// Random rows between guard bytes, every width and alignment
+static void check_fuzz(uint32_t *seed)
+{
+    uint8_t src[MAX_WIDTH * 2 + 16], buf[MAX_WIDTH * 3 + 2 * GUARD + 16], expect[MAX_WIDTH * 3];
+    for (int round = 0; round < FUZZ_ROUNDS; round++) {
+        for (size_t width = 0; width <= MAX_WIDTH; width++) {
+            for (int align = 0; align < 16; align++) {
+                const uint8_t *row = src + align;
+                for (size_t i = 0; i < sizeof(src); i++) {
+                    src[i] = test_rand(seed);
+                }
+                for (int k = 0; k < KERNEL_COUNT; k++) {
+                    int bytes = s_kernels[k].bytes;
+                    uint8_t *dst = buf + GUARD + (15 - align);
+                    size_t len = width * bytes;
+                    memset(buf, GUARD_BYTE, sizeof(buf));
+                    s_kernels[k].fn(row, dst, width);
+
+                    for (size_t i = 0; i < width; i++) {
+                        // an odd last pixel has no V
+                        uint8_t v = (i | 1) < width ? row[(i | 1) * 2 + 1] : 128;
+                        expect_pixel(k, row[i * 2], row[(i & ~(size_t)1) * 2 + 1], v, expect + i * bytes);
+                    }
+                    CHECK(!memcmp(dst, expect, len), "%s: random row of %u pixels, alignment %d differs", s_kernels[k].name, (unsigned)width, align);
+                    bool guarded = true;
+                    for (uint8_t *p = buf; p < buf + sizeof(buf); p++) {
+                        if ((p < dst || p >= dst + len) && *p != GUARD_BYTE) {
+                            guarded = false;
+                        }
+                    }
+                    CHECK(guarded, "%s: row of %u pixels, alignment %d writes outside the row", s_kernels[k].name, (unsigned)width, align);
+                }
+            }
+        }
+    }
+}
+
+static double bench_row(row_func_t fn, double seconds)
+{
+    static uint8_t src[BENCH_WIDTH * 2], dst[BENCH_WIDTH * 3];
+    uint32_t seed = 5;
+    for (size_t i = 0; i < sizeof(src); i++) {
+        src[i] = test_rand(&seed);
+    }
+    size_t pixels = 0;
+    double start = test_now(), t;
+    do {
+        for (int i = 0; i < 100; i++) {
+            fn(src, dst, BENCH_WIDTH);
+        }
+        pixels += 100 * BENCH_WIDTH;
+    } while ((t = test_now() - start) < seconds);
+    return pixels / t / 1e6;
+}
+
+int main(int argc, char *argv[])
+{
+    double seconds = argc > 1 ? atof(argv[1]) : 0;
+    uint32_t seed = 1;
+    char name[64];
+
+    check_yuv2rgb();
+    check_exhaustive();
+    check_fuzz(&seed);
+
+    if (seconds > 0) {
+        for (int k = 0; k < KERNEL_COUNT; k++) {
+            printf("%-22s %-6s %8.1f Mpixels/s\n", s_kernels[k].name, SIMD_NAME, bench_row(s_kernels[k].fn, seconds));
+        }
+    }
+    snprintf(name, sizeof(name), "yuvtest, %s, %s", SIMD_NAME, RANGE_NAME);
+    return test_done(name);
+}
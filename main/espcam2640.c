@@ -55,7 +55,7 @@ static camera_config_t camera_config =
     .frame_size = FRAMESIZE_UXGA,//first init with largest framesize to get biggest framebuffers in camera driver
 
     .jpeg_quality = 10, //0-63 lower number means higher quality
-    .fb_count = 2 //number of framebuffers to use for capturing, if > 1, i2s runs in continuous mode.
+    .fb_count = 3 //number of framebuffers to use for capturing, if > 1, i2s runs in continuous mode. 3: the stream and a snapshot can each hold one while the driver keeps the newest
 };
 
 
@@ -33,6 +33,7 @@ september 2020, Thomas Krueger, Hofgeismar Germany (all rights reserved)
 #include <lwip/netdb.h>
 #include "driver/gpio.h"
 #include "esp_camera.h"
+#include "img_converters.h"
 #include "esp_log.h"
 
 
@@ -41,7 +42,7 @@ void streamtask(void *param);
 int tcpserver(int port);
 int http_response(int port, char *req, int connection);
 int http_stream(int connection);
-int get_frame(uint8_t **buf, size_t *len);
+int get_frame(camera_fb_t **fb, int next, uint8_t **buf, size_t *len);
 static uint16_t set_register(char *uri);
 static int set_control(char *uri);
 static int get_camstatus(void);
@@ -50,7 +51,6 @@ void stream_speed(int full);
 void night_mode(int on);
 
 //globals:
-camera_fb_t *fb=NULL;					 
 char iobuf[1024]; // for control processing
 int flashlight, streamlight, streamspeed, nightmode, IsStreaming;
 
@@ -220,6 +220,7 @@ int http_response(int port, char *req, int connection)
     uint8_t *pb;
     size_t len;
     char response[1024];
+    camera_fb_t *fb=NULL; // frame sent with the response, shared with a running stream
 
     char request[10], uri[100];
     int ret,keepalive=1;
@@ -303,44 +304,35 @@ int http_response(int port, char *req, int connection)
         // download raw image!! usually yuv422 like on ov7670, but jpg on ov2640.
         if (!strcmp(uri,"/download"))
         {
-            if (!IsStreaming) //if currently streaming 0 Bytes will be downloaded!
+            ESP_LOGI(TAG,"Downloading full cam-img as frame.jpg");
+            if (flashlight)
             {
-                ESP_LOGI(TAG,"Downloading full cam-img as frame.jpg");
-                if (flashlight)
-                {
-                    gpio_set_level(4, 1); // turn led on
-                    vTaskDelay(400/portTICK_PERIOD_MS);  // wait a little to get camera exposure settle to new light conditions
-                }
-				get_frame(&pb,&len); // skip previous frame, it contains old light settings
-                if (!get_frame(&pb,&len)) len=0; // get raw image
-                gpio_set_level(4, 0); // turn led off
+                gpio_set_level(4, 1); // turn led on
+                vTaskDelay(400/portTICK_PERIOD_MS);  // wait a little to get camera exposure settle to new light conditions
             }
-            else
-                len = 0;
+			get_frame(&fb,1,&pb,&len); // skip previous frame, it contains old light settings
+            if (!get_frame(&fb,1,&pb,&len)) len=0; // get raw image
+            gpio_set_level(4, 0); // turn led off
             sprintf(response,resp_attach,len);
             goto sendmore;
 
         }
 
-        // capture image!! only if not streaming, as the camera driver gets confused when calling get_frame in 2 tasks at the same time!
+        // capture image!! works while streaming, the driver shares the frame with the stream task.
         if (!strncmp(uri,"/capture",8))
         {
-            if (!IsStreaming)
+            ESP_LOGI(TAG,"Get Still");
+
+            if (flashlight)
             {
-                ESP_LOGI(TAG,"Get Still");
-
-                if (flashlight)
-                {
-                    gpio_set_level(4, 1); // turn led on
-                    vTaskDelay(400/portTICK_PERIOD_MS);  // wait a little to get camera exposure settle to new light conditions
-                }
-				get_frame(&pb,&len); // skip previous frame, it contains old light settings
-                ret=get_frame(&pb,&len);
-
-                gpio_set_level(4, 0); // turn led off
-                if (!ret) len=0;
+                gpio_set_level(4, 1); // turn led on
+                vTaskDelay(400/portTICK_PERIOD_MS);  // wait a little to get camera exposure settle to new light conditions
             }
-            else len=0;
+			get_frame(&fb,1,&pb,&len); // skip previous frame, it contains old light settings
+            ret=get_frame(&fb,1,&pb,&len);
+
+            gpio_set_level(4, 0); // turn led off
+            if (!ret) len=0;
             // printf("--pbuf:0x%08x len:%d\n",(uint32_t)pb,len);
             sprintf(response,resp_capture,len);
 
@@ -382,12 +374,16 @@ sendresponse:
     // send the response text
     ret=send(connection, response, strlen(response),ret);// this blocks until data is sent. ret contains optional MSG_MORE flag to delay sending
     if (ret <= 0)
+    {
+        esp_camera_fb_release(fb);
         return 0; // connection closed. broken connection
+    }
     if (ret != strlen(response)) ESP_LOGE(TAG,"send1, not all bytes sent:%d",ret);
     if (more)
     {
         //printf("sending data...\n");
         ret = send(connection, pb, len, 0);// this blocks until data is sent
+        esp_camera_fb_release(fb); // NULL if no frame was taken
         if (ret <= 0) // connection closed. broken connection
             return 0;
         if (ret != len) ESP_LOGE(TAG,"send2, not all bytes sent:%d",ret);
@@ -417,6 +413,7 @@ int http_stream(int connection)
     uint8_t *pb;
     size_t len;
     char response[512];
+    camera_fb_t *fb=NULL;
 
     int ret;
 
@@ -433,7 +430,7 @@ int http_stream(int connection)
         if (streamlight) gpio_set_level(4, 1); // turn led on
         else gpio_set_level(4, 0); // turn led off
 
-        ret=get_frame(&pb,&len);
+        ret=get_frame(&fb,0,&pb,&len);
         if (!ret) // error message is printed in driver if fails
         {
             // something went wrong in the camera/driver, just reset the thing trying to resolve it.
@@ -456,6 +453,7 @@ int http_stream(int connection)
         else if (ret != len) ESP_LOGE(TAG,"sendjpg, not all bytes sent:%d errno:%d",ret,errno);
     }
 
+    esp_camera_fb_release(fb);
     IsStreaming=0;
     gpio_set_level(4, 0); // turn led off
     ESP_LOGI(TAG,"....Stream Stop");
@@ -466,21 +464,34 @@ int http_stream(int connection)
 
 /*
 get a frame from the camera
-uses global pointer to  fb_struct (camera framebuffer)
 entry:
+- address of the caller's framebuffer pointer. A frame it still holds is released first, NULL if none.
+- next: 1=wait for a frame captured after this call and share it with other tasks (snapshots),
+  0=the newest frame the stream has not sent yet.
 - address of pointer to receive the resulting framebuffer address.
 - address of len variable receiving the length of framebuffer data.
 exit:
 1=OK, 0=capture  failed.
 The buffer with data and the length is returned to caller using pointers!!
+The caller releases the frame with esp_camera_fb_release() when done sending it, the driver doesn't refill
+it before. Several tasks can hold frames at once, so use at least 3 framebuffers.
+Jpeg frames that are cut short or broken are skipped, motion and browsers choke on them. After 3 bad ones in a row
+the last one is returned anyway.
 */
-int get_frame(uint8_t **buf, size_t *len)
+int get_frame(camera_fb_t **fb, int next, uint8_t **buf, size_t *len)
 {
-    esp_camera_fb_return(fb); //release a possible last used framebuffer. we should work with at least 2 framebuffers!
+    jpg_index_t index;
+    int tries = 3;
 
-											   
-    fb = esp_camera_fb_get(); // get a new framebuffer with current picture data
-    if (!fb)
+    esp_camera_fb_release(*fb); //release a possible last used framebuffer.
+    *fb = next ? esp_camera_fb_acquire() : esp_camera_fb_get(); // get a new framebuffer with current picture data
+    while (*fb && (*fb)->format == PIXFORMAT_JPEG && !jpg_index((*fb)->buf, (*fb)->len, &index) && --tries)
+    {
+        ESP_LOGW(TAG,"Skipping bad jpeg frame, flags:%d len:%u", index.flags, (*fb)->len);
+        esp_camera_fb_release(*fb);
+        *fb = next ? esp_camera_fb_acquire() : esp_camera_fb_get();
+    }
+    if (!*fb)
     {
         ESP_LOGE(TAG,"CamCapture failed");
         return 0;
@@ -488,8 +499,8 @@ int get_frame(uint8_t **buf, size_t *len)
     else
     {
         // save data from the framebuffer
-        *buf=fb->buf;
-        *len=fb->len;
+        *buf=(*fb)->buf;
+        *len=(*fb)->len;
     }
 
     return 1;